@@ -419,6 +419,10 @@ message_handler(coap_session_t *session COAP_UNUSED,
       append_to_output(databuf, len);
       if ((len + offset == total) && add_nl)
         append_to_output((const uint8_t*)"\n", 1);
+      if ((block_mode & COAP_BLOCK_STREAM_BODY) && len + offset < total) {
+        /* More of the body to come */
+        return COAP_RESPONSE_OK;
+      }
     }
 
     /* Check if Block2 option is set */
@@ -536,7 +540,8 @@ usage(const char *program, const char *version) {
      "\t-K interval\tSend a ping after interval seconds of inactivity\n"
      "\t-L value\tSum of one or more COAP_BLOCK_* flag valuess for block\n"
      "\t       \t\thandling methods. Default is 1 (COAP_BLOCK_USE_LIBCOAP)\n"
-     "\t       \t\t(Sum of one or more of 1,2 and 16)\n"
+     "\t       \t\t(Sum of one or more of 1,2,4,16 and 32). 32\n"
+     "\t       \t\t(COAP_BLOCK_STREAM_BODY) is added if -o is given\n"
      "\t-N     \t\tSend NON-confirmable message\n"
      "\t-O num,text\tAdd option num with contents text to request. If the\n"
      "\t       \t\ttext begins with 0x, then the hex text (two [0-9a-f] per\n"
@@ -644,6 +649,8 @@ cmdline_content_type(char *arg, uint16_t key) {
     { 50, "application/json" },
     { 60, "cbor" },
     { 60, "application/cbor" },
+    { 64, "link-format+cbor" },
+    { 64, "application/link-format+cbor" },
     { 255, NULL }
   };
   coap_optlist_t *node;
@@ -1812,30 +1819,37 @@ main(int argc, char **argv) {
       scheme = COAP_URI_SCHEME_COAPS_TCP;
   }
 
-  /* resolve destination address where data should be sent */
-  info_list = coap_resolve_address_info(&server, port, port,
-                                        0,
-                                        1 << scheme);
+  ctx = coap_new_context( NULL );
+  if ( !ctx ) {
+    coap_log_emerg("cannot create context\n" );
+    goto finish;
+  }
+
+  /*
+   * resolve destination address where data should be sent, holding all
+   * the addresses in ctx so that a TCP session can race connections to them
+   */
+  info_list = coap_context_resolve_address_info(ctx, &server, port, port,
+                                                0,
+                                                1 << scheme);
 
   if (info_list == NULL) {
     coap_log_err("failed to resolve address\n");
-    exit(1);
+    goto finish;
   }
   memcpy(&dst, &info_list->addr, sizeof(dst));
   coap_free_address_info(info_list);
 
-  ctx = coap_new_context( NULL );
-  if ( !ctx ) {
-    coap_log_emerg("cannot create context\n" );
-    goto finish;
-  }
-
   if (doing_oscore) {
     if (get_oscore_conf() == NULL)
       goto finish;
   }
 
   coap_context_set_keepalive(ctx, ping_seconds);
+  if (output_file.s) {
+    /* Write the data out as it arrives rather than holding it all */
+    block_mode |= COAP_BLOCK_STREAM_BODY;
+  }
   coap_context_set_block_mode(ctx, block_mode);
   if (csm_max_message_size)
     coap_context_set_csm_max_message_size(ctx, csm_max_message_size);
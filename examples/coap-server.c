@@ -252,6 +252,29 @@ hnd_get_index(coap_resource_t *resource,
                                (const uint8_t *)INDEX, NULL, NULL);
 }
 
+/*
+ * The index never changes, so it is sent from a template without calling
+ * hnd_get_index() (which is still used for block-wise requests).
+ */
+static void
+set_index_template(coap_resource_t *resource) {
+  coap_pdu_t *pdu;
+  uint8_t buf[4];
+
+  pdu = coap_pdu_init(COAP_MESSAGE_ACK, COAP_RESPONSE_CODE_CONTENT, 0,
+                      sizeof(INDEX) + 16);
+  if (!pdu)
+    return;
+  coap_add_option(pdu, COAP_OPTION_CONTENT_FORMAT,
+                  coap_encode_var_safe(buf, sizeof(buf),
+                                       COAP_MEDIATYPE_TEXT_PLAIN), buf);
+  coap_add_option(pdu, COAP_OPTION_MAXAGE,
+                  coap_encode_var_safe(buf, sizeof(buf), 0x2ffff), buf);
+  coap_add_data(pdu, strlen(INDEX), (const uint8_t *)INDEX);
+  coap_resource_set_response_template(resource, COAP_REQUEST_GET, pdu);
+  coap_delete_pdu(pdu);
+}
+
 static void
 hnd_get_fetch_time(coap_resource_t *resource,
                    coap_session_t *session,
@@ -618,122 +641,8 @@ static coap_uri_t proxy = { {0, NULL}, 0, {0, NULL}, {0, NULL}, 0 };
 static size_t proxy_host_name_count = 0;
 static const char **proxy_host_name_list = NULL;
 
-typedef struct proxy_list_t {
-  coap_session_t *ongoing;  /* Ongoing session */
-  coap_session_t *incoming; /* Incoming session */
-  coap_binary_t *token;     /* Incoming token */
-  coap_string_t *query;     /* Incoming query */
-  coap_pdu_code_t req_code; /* Incoming request code */
-  coap_pdu_type_t req_type; /* Incoming request type */
-} proxy_list_t;
-
-static proxy_list_t *proxy_list = NULL;
-static size_t proxy_list_count = 0;
-static coap_resource_t *proxy_resource = NULL;
-
-static int
-get_uri_proxy_scheme_info(const coap_pdu_t *request,
-                          coap_opt_t *opt,
-                          coap_uri_t *uri,
-                          coap_string_t **uri_path,
-                          coap_string_t **uri_query) {
-
-  const char *opt_val = (const char*)coap_opt_value(opt);
-  int opt_len = coap_opt_length(opt);
-  coap_opt_iterator_t opt_iter;
-
-  if (opt_len == 9 &&
-      strncasecmp(opt_val, "coaps+tcp", 9) == 0) {
-    uri->scheme = COAP_URI_SCHEME_COAPS_TCP;
-    uri->port = COAPS_DEFAULT_PORT;
-  }
-  else if (opt_len == 8 &&
-      strncasecmp(opt_val, "coap+tcp", 8) == 0) {
-    uri->scheme = COAP_URI_SCHEME_COAP_TCP;
-    uri->port = COAP_DEFAULT_PORT;
-  }
-  else if (opt_len == 5 &&
-      strncasecmp(opt_val, "coaps", 5) == 0) {
-    uri->scheme = COAP_URI_SCHEME_COAPS;
-    uri->port = COAPS_DEFAULT_PORT;
-  }
-  else if (opt_len == 4 &&
-      strncasecmp(opt_val, "coap", 4) == 0) {
-    uri->scheme = COAP_URI_SCHEME_COAP;
-    uri->port = COAP_DEFAULT_PORT;
-  } else {
-    coap_log_warn("Unsupported Proxy Scheme '%*.*s'\n",
-             opt_len, opt_len, opt_val);
-    return 0;
-  }
-
-  opt = coap_check_option(request, COAP_OPTION_URI_HOST, &opt_iter);
-  if (opt) {
-    uri->host.length = coap_opt_length(opt);
-    uri->host.s = coap_opt_value(opt);
-  } else {
-    coap_log_warn("Proxy Scheme requires Uri-Host\n");
-    return 0;
-  }
-  opt = coap_check_option(request, COAP_OPTION_URI_PORT, &opt_iter);
-  if (opt) {
-    uri->port =
-          coap_decode_var_bytes (coap_opt_value (opt),
-                                 coap_opt_length (opt));
-  }
-  *uri_path = coap_get_uri_path(request);
-  if (*uri_path) {
-    uri->path.s = (*uri_path)->s;
-    uri->path.length = (*uri_path)->length;
-  }
-  *uri_query = coap_get_query(request);
-  if (*uri_query) {
-    uri->query.s = (*uri_query)->s;
-    uri->query.length = (*uri_query)->length;
-  }
-  return 1;
-}
-
-static int
-verify_proxy_scheme_supported(coap_uri_scheme_t scheme) {
-
-  /* Sanity check that the connection can be forwarded on */
-  switch (scheme) {
-  case COAP_URI_SCHEME_HTTP:
-  case COAP_URI_SCHEME_HTTPS:
-  coap_log_warn("Proxy URI http or https not supported\n");
-    return 0;
-  case COAP_URI_SCHEME_COAP:
-    break;
-  case COAP_URI_SCHEME_COAPS:
-    if (!coap_dtls_is_supported()) {
-      coap_log_warn(
-        "coaps URI scheme not supported for proxy\n");
-      return 0;
-    }
-    break;
-  case COAP_URI_SCHEME_COAP_TCP:
-    if (!coap_tcp_is_supported()) {
-      coap_log_warn(
-        "coap+tcp URI scheme not supported for proxy\n");
-      return 0;
-    }
-    break;
-  case COAP_URI_SCHEME_COAPS_TCP:
-    if (!coap_tls_is_supported()) {
-      coap_log_warn(
-        "coaps+tcp URI scheme not supported for proxy\n");
-      return 0;
-    }
-    break;
-  case COAP_URI_SCHEME_LAST:
-  default:
-      coap_log_warn(
-        "%d URI scheme not supported\n", scheme);
-    break;
-  }
-  return 1;
-}
+static coap_proxy_server_t proxy_next_hop;
+static coap_proxy_server_list_t proxy_server_list;
 
 static coap_dtls_cpsk_t *
 setup_cpsk(char *client_sni) {
@@ -749,413 +658,41 @@ setup_cpsk(char *client_sni) {
   return &dtls_cpsk;
 }
 
-static proxy_list_t *
-get_proxy_session(coap_session_t *session, coap_pdu_t *response,
-                  const coap_bin_const_t *token, const coap_string_t *query,
-                  coap_pdu_code_t req_code, coap_pdu_type_t req_type) {
-
-  size_t i;
-  proxy_list_t *new_proxy_list;
-
-  /* Locate existing forwarding relationship */
-  for (i = 0; i < proxy_list_count; i++) {
-    if (proxy_list[i].incoming == session) {
-      return &proxy_list[i];
-    }
-  }
-
-  /* Need to create a new forwarding mapping */
-  new_proxy_list = realloc(proxy_list, (i+1)*sizeof(proxy_list[0]));
-
-  if (new_proxy_list == NULL) {
-    coap_pdu_set_code(response, COAP_RESPONSE_CODE_INTERNAL_ERROR);
-    return NULL;
-  }
-  proxy_list = new_proxy_list;
-  proxy_list[i].incoming = session;
-  if (token) {
-    proxy_list[i].token = coap_new_binary(token->length);
-    if (!proxy_list[i].token) {
-      coap_pdu_set_code(response, COAP_RESPONSE_CODE_INTERNAL_ERROR);
-      return NULL;
-    }
-    memcpy(proxy_list[i].token->s, token->s, token->length);
-  }
-  else
-    proxy_list[i].token = NULL;
-
-  if (query) {
-    proxy_list[i].query = coap_new_string(query->length);
-    if (!proxy_list[i].query) {
-      coap_pdu_set_code(response, COAP_RESPONSE_CODE_INTERNAL_ERROR);
-      return NULL;
-    }
-    memcpy(proxy_list[i].query->s, query->s, query->length);
-  }
-  else
-    proxy_list[i].query = NULL;
-
-  proxy_list[i].ongoing = NULL;
-  proxy_list[i].req_code = req_code;
-  proxy_list[i].req_type = req_type;
-  proxy_list_count++;
-  return &proxy_list[i];
-}
-
 static void
-remove_proxy_association(coap_session_t *session, int send_failure) {
-
-  size_t i;
-
-  for (i = 0; i < proxy_list_count; i++) {
-    if (proxy_list[i].incoming == session) {
-      coap_session_release(proxy_list[i].ongoing);
-      break;
-    }
-    if (proxy_list[i].ongoing == session && send_failure) {
-      coap_pdu_t *response;
-
-      coap_session_release(proxy_list[i].ongoing);
-
-      /* Need to send back a gateway failure */
-      response = coap_pdu_init(proxy_list[i].req_type,
-                               COAP_RESPONSE_CODE_BAD_GATEWAY,
-                               coap_new_message_id(proxy_list[i].incoming),
-                          coap_session_max_pdu_size(proxy_list[i].incoming));
-      if (!response) {
-        coap_log_info("PDU creation issue\n");
-        return;
-      }
-
-      if (proxy_list[i].token &&
-          !coap_add_token(response, proxy_list[i].token->length,
-                          proxy_list[i].token->s)) {
-        coap_log_debug(
-                       "Cannot add token to incoming proxy response PDU\n");
-      }
-
-      if (coap_send(proxy_list[i].incoming, response) ==
-                                                          COAP_INVALID_MID) {
-        coap_log_info("Failed to send PDU with 5.02 gateway issue\n");
-      }
-      break;
-    }
-  }
-  if (i != proxy_list_count) {
-    coap_delete_binary(proxy_list[i].token);
-    coap_delete_string(proxy_list[i].query);
-    if (proxy_list_count-i > 1) {
-       memmove (&proxy_list[i],
-                &proxy_list[i+1],
-               (proxy_list_count-i-1) * sizeof (proxy_list[0]));
-    }
-    proxy_list_count--;
-  }
-}
-
-
-static coap_session_t *
-get_ongoing_proxy_session(coap_session_t *session,
-                          coap_pdu_t *response, const coap_bin_const_t *token,
-                          const coap_string_t *query, coap_pdu_code_t req_code,
-                          coap_pdu_type_t req_type, const coap_uri_t *uri) {
-
-  coap_address_t dst;
-  coap_uri_scheme_t scheme;
-  static char client_sni[256];
-  coap_str_const_t server;
-  uint16_t port;
-  coap_addr_info_t *info_list = NULL;
-  proxy_list_t *new_proxy_list;
-  coap_context_t *context = coap_session_get_context(session);
-
-  new_proxy_list = get_proxy_session(session, response, token, query, req_code,
-                                     req_type);
-  if (!new_proxy_list)
-    return NULL;
-
-  if (new_proxy_list->ongoing)
-    return new_proxy_list->ongoing;
-
-  if (proxy.host.length) {
-    server = proxy.host;
-    port = proxy.port;
-    scheme = proxy.scheme;
-  } else {
-    server = uri->host;
-    port = uri->port;
-    scheme = uri->scheme;
-  }
-
-  /* resolve destination address where data should be sent */
-  info_list = coap_resolve_address_info(&server, port, port,
-                                        0,
-                                        1 << scheme);
-
-  if (info_list == NULL) {
-    coap_pdu_set_code(response, COAP_RESPONSE_CODE_BAD_GATEWAY);
-    remove_proxy_association(session, 0);
-    return NULL;
-  }
-  memcpy(&dst, &info_list->addr, sizeof(dst));
-  coap_free_address_info(info_list);
-
-  switch (scheme) {
-  case COAP_URI_SCHEME_COAP:
-  case COAP_URI_SCHEME_COAP_TCP:
-    new_proxy_list->ongoing =
-       coap_new_client_session(context, NULL, &dst,
-                               scheme == COAP_URI_SCHEME_COAP ?
-                                COAP_PROTO_UDP : COAP_PROTO_TCP);
-    break;
-  case COAP_URI_SCHEME_COAPS:
-  case COAP_URI_SCHEME_COAPS_TCP:
-    memset(client_sni, 0, sizeof(client_sni));
-    if ((server.length == 3 && memcmp(server.s, "::1", 3) != 0) ||
-        (server.length == 9 && memcmp(server.s, "127.0.0.1", 9) != 0))
-      memcpy(client_sni, server.s, min(server.length, sizeof(client_sni)-1));
-    else
-      memcpy(client_sni, "localhost", 9);
-
-    if (!key_defined) {
-      /* Use our defined PKI certs (or NULL)  */
-      coap_dtls_pki_t *dtls_pki = setup_pki(context, COAP_DTLS_ROLE_CLIENT,
-                                            client_sni);
-      new_proxy_list->ongoing =
-           coap_new_client_session_pki(context, NULL, &dst,
-                 scheme == COAP_URI_SCHEME_COAPS ?
-                  COAP_PROTO_DTLS : COAP_PROTO_TLS,
-                 dtls_pki);
-    } else {
-      /* Use our defined PSK */
-      coap_dtls_cpsk_t *dtls_cpsk = setup_cpsk(client_sni);
-
-      new_proxy_list->ongoing =
-           coap_new_client_session_psk2(context, NULL, &dst,
-                 scheme == COAP_URI_SCHEME_COAPS ?
-                  COAP_PROTO_DTLS : COAP_PROTO_TLS,
-                 dtls_cpsk);
-    }
-    break;
-  case COAP_URI_SCHEME_HTTP:
-  case COAP_URI_SCHEME_HTTPS:
-  case COAP_URI_SCHEME_LAST:
-  default:
-    assert(0);
-    break;
-  }
-  if (new_proxy_list->ongoing == NULL) {
-    coap_pdu_set_code(response, COAP_RESPONSE_CODE_PROXYING_NOT_SUPPORTED);
-    remove_proxy_association(session, 0);
-    return NULL;
-  }
-  return new_proxy_list->ongoing;
-}
-
-static void
-release_proxy_body_data(coap_session_t *session COAP_UNUSED,
-                        void *app_ptr) {
-  coap_delete_binary(app_ptr);
-}
-
-static void
-hnd_proxy_uri(coap_resource_t *resource COAP_UNUSED,
-                coap_session_t *session,
-                const coap_pdu_t *request,
-                const coap_string_t *query,
-                coap_pdu_t *response) {
-  coap_opt_iterator_t opt_iter;
-  coap_opt_t *opt;
-  coap_opt_t *proxy_uri;
-  int proxy_scheme_option = 0;
-  coap_uri_t uri;
-  coap_string_t *uri_path = NULL;
-  coap_string_t *uri_query = NULL;
-  coap_session_t *ongoing = NULL;
-  size_t size;
-  size_t offset;
-  size_t total;
-  coap_binary_t *body_data = NULL;
-  const uint8_t *data;
-  coap_pdu_t *pdu;
-  coap_optlist_t *optlist = NULL;
-  coap_opt_t *option;
-#define BUFSIZE 100
-  unsigned char _buf[BUFSIZE];
-  unsigned char *buf = _buf;
-  coap_bin_const_t token = coap_pdu_get_token(request);
-
-  memset(&uri, 0, sizeof(uri));
-  /*
-   * See if Proxy-Scheme
-   */
-  opt = coap_check_option(request, COAP_OPTION_PROXY_SCHEME, &opt_iter);
-  if (opt) {
-    if (!get_uri_proxy_scheme_info(request, opt, &uri, &uri_path,
-                                   &uri_query)) {
-      coap_pdu_set_code(response,
-                             COAP_RESPONSE_CODE_PROXYING_NOT_SUPPORTED);
-      goto cleanup;
-    }
-    proxy_scheme_option = 1;
-  }
+hnd_proxy_uri(coap_resource_t *resource,
+              coap_session_t *session,
+              const coap_pdu_t *request,
+              const coap_string_t *query COAP_UNUSED,
+              coap_pdu_t *response) {
   /*
-   * See if Proxy-Uri
+   * libcoap sends the request on (to the next proxy if one is defined) and
+   * relays the upstream response back as a separate response
    */
-  proxy_uri = coap_check_option(request, COAP_OPTION_PROXY_URI, &opt_iter);
-  if (proxy_uri) {
-    coap_log_info("Proxy URI '%.*s'\n",
-             coap_opt_length(proxy_uri),
-             (const char*)coap_opt_value(proxy_uri));
-    if (coap_split_proxy_uri(coap_opt_value(proxy_uri),
-                             coap_opt_length(proxy_uri),
-                             &uri) < 0) {
-      /* Need to return a 5.05 RFC7252 Section 5.7.2 */
-      coap_log_warn("Proxy URI not decodable\n");
-      coap_pdu_set_code(response,
-                             COAP_RESPONSE_CODE_PROXYING_NOT_SUPPORTED);
-      goto cleanup;
-    }
-  }
-
-  if (!(proxy_scheme_option || proxy_uri)) {
-    coap_pdu_set_code(response, COAP_RESPONSE_CODE_NOT_FOUND);
-    goto cleanup;
-  }
+  coap_proxy_forward_request(session, request, response, resource,
+                             &proxy_server_list);
+}
 
-  if (uri.host.length == 0) {
-    /* Ongoing connection not well formed */
-    coap_pdu_set_code(response, COAP_RESPONSE_CODE_PROXYING_NOT_SUPPORTED);
-    goto cleanup;
-  }
+static void
+init_proxy_server_list(coap_context_t *ctx) {
+  static coap_dtls_pki_t dtls_pki;
 
-  if (!verify_proxy_scheme_supported(uri.scheme)) {
-    coap_pdu_set_code(response, COAP_RESPONSE_CODE_PROXYING_NOT_SUPPORTED);
-    goto cleanup;
+  if (proxy.host.length) {
+    proxy_next_hop.uri = proxy;
+    proxy_server_list.entry = &proxy_next_hop;
+    proxy_server_list.entry_count = 1;
   }
 
-  /* Handle the CoAP forwarding mapping */
-  if (uri.scheme == COAP_URI_SCHEME_COAP ||
-      uri.scheme == COAP_URI_SCHEME_COAPS ||
-      uri.scheme == COAP_URI_SCHEME_COAP_TCP ||
-      uri.scheme == COAP_URI_SCHEME_COAPS_TCP) {
-    coap_pdu_code_t req_code = coap_pdu_get_code(request);
-    coap_pdu_type_t req_type = coap_pdu_get_type(request);
-
-    if (!get_proxy_session(session, response, &token, query, req_code, req_type))
-      goto cleanup;
-
-    if (coap_get_data_large(request, &size, &data, &offset, &total)) {
-      /* COAP_BLOCK_SINGLE_BODY is set, so single body should be given */
-      assert(size == total);
-      body_data = coap_new_binary(total);
-      if (!body_data) {
-        coap_log_debug("body build memory error\n");
-        goto cleanup;
-      }
-      memcpy(body_data->s, data, size);
-      data = body_data->s;
-    }
-
-    /* Send data on (opening session if appropriate) */
-
-    ongoing = get_ongoing_proxy_session(session, response, &token,
-                                        query, req_code, req_type, &uri);
-    if (!ongoing)
-      goto cleanup;
-    /*
-     * Build up the ongoing PDU that we are going to send
-     */
-    pdu = coap_pdu_init(req_type, req_code,
-                        coap_new_message_id(ongoing),
-                        coap_session_max_pdu_size(ongoing));
-    if (!pdu) {
-      coap_pdu_set_code(response, COAP_RESPONSE_CODE_INTERNAL_ERROR);
-      goto cleanup;
-    }
-
-    if (!coap_add_token(pdu, token.length, token.s)) {
-      coap_log_debug("cannot add token to proxy request\n");
-      coap_pdu_set_code(response, COAP_RESPONSE_CODE_INTERNAL_ERROR);
-      coap_delete_pdu(pdu);
-      goto cleanup;
-    }
-
-    if (proxy.host.length == 0) {
-      /* Use  Uri-Path and Uri-Query - direct session */
-      proxy_uri = NULL;
-      proxy_scheme_option = 0;
-
-      if (coap_uri_into_options(&uri, &optlist, 1,
-                                buf, sizeof(buf)) < 0) {
-        coap_log_err("Failed to create options for URI\n");
-        goto cleanup;
-      }
-    }
-
-    /* Copy the remaining options across */
-    coap_option_iterator_init(request, &opt_iter, COAP_OPT_ALL);
-    while ((option = coap_option_next(&opt_iter))) {
-      switch (opt_iter.number) {
-      case COAP_OPTION_PROXY_URI:
-        if (proxy_uri) {
-          /* Need to add back in */
-          goto add_in;
-        }
-        break;
-      case COAP_OPTION_PROXY_SCHEME:
-      case COAP_OPTION_URI_PATH:
-      case COAP_OPTION_URI_PORT:
-      case COAP_OPTION_URI_QUERY:
-        if (proxy_scheme_option) {
-          /* Need to add back in */
-          goto add_in;
-        }
-        break;
-      case COAP_OPTION_BLOCK1:
-      case COAP_OPTION_BLOCK2:
-        /* These are not passed on */
-        break;
-      default:
-add_in:
-        coap_insert_optlist(&optlist,
-                    coap_new_optlist(opt_iter.number,
-                    coap_opt_length(option),
-                    coap_opt_value(option)));
-        break;
-      }
-    }
-
-    /* Update pdu with options */
-    coap_add_optlist_pdu(pdu, &optlist);
-    coap_delete_optlist(optlist);
-
-    if (size) {
-      if (!coap_add_data_large_request(ongoing, pdu, size, data,
-                                       release_proxy_body_data, body_data)) {
-        coap_log_debug("cannot add data to proxy request\n");
-      } else {
-        body_data = NULL;
-      }
-    }
-
-    if (coap_get_log_level() < COAP_LOG_DEBUG)
-      coap_show_pdu(COAP_LOG_INFO, pdu);
-
-    coap_send(ongoing, pdu);
-    /*
-     * Do not update with response code (hence empty ACK) as will be sending
-     * separate response when response comes back from upstream server
-     */
-    goto cleanup;
+  /* With no client_sni, each upstream server is sent its own host as SNI */
+  if (!key_defined) {
+    /* Use our defined PKI certs (or NULL) */
+    dtls_pki = *setup_pki(ctx, COAP_DTLS_ROLE_CLIENT, NULL);
+    proxy_server_list.dtls_pki = &dtls_pki;
   } else {
-    /* TODO http & https */
-    coap_log_err("Proxy-Uri scheme %d unknown\n", uri.scheme);
+    /* Use our defined PSK */
+    proxy_server_list.dtls_cpsk = setup_cpsk(NULL);
   }
-cleanup:
-  coap_delete_string(uri_path);
-  coap_delete_string(uri_query);
-  coap_delete_binary(body_data);
+  /* Close upstream sessions that have not been used for 5 minutes */
+  proxy_server_list.idle_timeout_secs = 300;
 }
 
 #endif /* SERVER_CAN_PROXY */
@@ -1531,188 +1068,6 @@ hnd_put_post_unknown(coap_resource_t *resource COAP_UNUSED,
   hnd_put_post(r, session, request, query, response);
 }
 
-#if SERVER_CAN_PROXY
-static int
-proxy_event_handler(coap_session_t *session,
-              coap_event_t event) {
-
-  switch(event) {
-  case COAP_EVENT_DTLS_CLOSED:
-  case COAP_EVENT_TCP_CLOSED:
-  case COAP_EVENT_SESSION_CLOSED:
-  case COAP_EVENT_OSCORE_DECRYPTION_FAILURE:
-  case COAP_EVENT_OSCORE_NOT_ENABLED:
-  case COAP_EVENT_OSCORE_NO_PROTECTED_PAYLOAD:
-  case COAP_EVENT_OSCORE_NO_SECURITY:
-  case COAP_EVENT_OSCORE_INTERNAL_ERROR:
-  case COAP_EVENT_OSCORE_DECODE_ERROR:
-    /* Need to remove any proxy associations */
-    remove_proxy_association(session, 0);
-    break;
-  case COAP_EVENT_DTLS_CONNECTED:
-  case COAP_EVENT_DTLS_RENEGOTIATE:
-  case COAP_EVENT_DTLS_ERROR:
-  case COAP_EVENT_TCP_CONNECTED:
-  case COAP_EVENT_TCP_FAILED:
-  case COAP_EVENT_SESSION_CONNECTED:
-  case COAP_EVENT_SESSION_FAILED:
-  case COAP_EVENT_PARTIAL_BLOCK:
-  case COAP_EVENT_XMIT_BLOCK_FAIL:
-  case COAP_EVENT_SERVER_SESSION_NEW:
-  case COAP_EVENT_SERVER_SESSION_DEL:
-  case COAP_EVENT_BAD_PACKET:
-  case COAP_EVENT_MSG_RETRANSMITTED:
-  default:
-    break;
-  }
-  return 0;
-}
-
-static coap_response_t
-proxy_response_handler(coap_session_t *session,
-                const coap_pdu_t *sent COAP_UNUSED,
-                const coap_pdu_t *received,
-                const coap_mid_t id COAP_UNUSED) {
-
-  coap_pdu_t *pdu = NULL;
-  coap_session_t *incoming = NULL;
-  size_t i;
-  size_t size;
-  const uint8_t *data;
-  coap_optlist_t *optlist = NULL;
-  coap_opt_t *option;
-  coap_opt_iterator_t opt_iter;
-  size_t offset;
-  size_t total;
-  proxy_list_t *proxy_entry = NULL;
-  uint16_t media_type = COAP_MEDIATYPE_TEXT_PLAIN;
-  int maxage = -1;
-  uint64_t etag = 0;
-  coap_pdu_code_t rcv_code = coap_pdu_get_code(received);
-  coap_bin_const_t rcv_token = coap_pdu_get_token(received);
-  coap_binary_t *body_data = NULL;
-
-  for (i = 0; i < proxy_list_count; i++) {
-    if (proxy_list[i].ongoing == session) {
-      proxy_entry = &proxy_list[i];
-      incoming = proxy_entry->incoming;
-      break;
-    }
-  }
-  if (i == proxy_list_count) {
-    coap_log_debug("Unknown proxy ongoing session response received\n");
-    return COAP_RESPONSE_OK;
-  }
-
-  coap_log_debug("** process upstream incoming %d.%02d response:\n",
-           COAP_RESPONSE_CLASS(rcv_code), rcv_code & 0x1F);
-  if (coap_get_log_level() < COAP_LOG_DEBUG)
-    coap_show_pdu(COAP_LOG_INFO, received);
-
-  if (coap_get_data_large(received, &size, &data, &offset, &total)) {
-    /* COAP_BLOCK_SINGLE_BODY is set, so single body should be given */
-    assert(size == total);
-    body_data = coap_new_binary(total);
-    if (!body_data) {
-      coap_log_debug("body build memory error\n");
-      return COAP_RESPONSE_OK;
-    }
-    memcpy(body_data->s, data, size);
-    data = body_data->s;
-  }
-
-  /*
-   * Build up the ongoing PDU that we are going to send to proxy originator
-   * as separate response
-   */
-  pdu = coap_pdu_init(proxy_entry->req_type, rcv_code,
-                      coap_new_message_id(incoming),
-                      coap_session_max_pdu_size(incoming));
-  if (!pdu) {
-    coap_log_debug("Failed to create ongoing proxy response PDU\n");
-    return COAP_RESPONSE_OK;
-  }
-
-  if (!coap_add_token(pdu, rcv_token.length, rcv_token.s)) {
-    coap_log_debug("cannot add token to ongoing proxy response PDU\n");
-  }
-
-  /*
-   * Copy the options across, skipping those needed for
-   * coap_add_data_response_large()
-   */
-  coap_option_iterator_init(received, &opt_iter, COAP_OPT_ALL);
-  while ((option = coap_option_next(&opt_iter))) {
-    switch (opt_iter.number) {
-    case COAP_OPTION_CONTENT_FORMAT:
-      media_type = coap_decode_var_bytes(coap_opt_value (option),
-                                         coap_opt_length (option));
-      break;
-    case COAP_OPTION_MAXAGE:
-      maxage = coap_decode_var_bytes(coap_opt_value (option),
-                                     coap_opt_length (option));
-      break;
-    case COAP_OPTION_ETAG:
-      etag = coap_decode_var_bytes8(coap_opt_value (option),
-                                    coap_opt_length (option));
-      break;
-    case COAP_OPTION_BLOCK2:
-    case COAP_OPTION_SIZE2:
-      break;
-    default:
-      coap_insert_optlist(&optlist,
-                  coap_new_optlist(opt_iter.number,
-                  coap_opt_length(option),
-                  coap_opt_value(option)));
-      break;
-    }
-  }
-  coap_add_optlist_pdu(pdu, &optlist);
-  coap_delete_optlist(optlist);
-
-  if (size > 0) {
-    coap_pdu_t *dummy_pdu = coap_pdu_init(proxy_entry->req_type,
-                                          proxy_entry->req_code, 0,
-                                          coap_session_max_pdu_size(incoming));
-
-    coap_add_data_large_response(proxy_resource, incoming, dummy_pdu, pdu,
-                                 proxy_entry->query,
-                                 media_type, maxage, etag, size, data,
-                                 release_proxy_body_data,
-                                 body_data);
-    coap_delete_pdu(dummy_pdu);
-  }
-
-  if (coap_get_log_level() < COAP_LOG_DEBUG)
-    coap_show_pdu(COAP_LOG_INFO, pdu);
-
-  coap_send(incoming, pdu);
-  return COAP_RESPONSE_OK;
-}
-
-static void
-proxy_nack_handler(coap_session_t *session,
-             const coap_pdu_t *sent COAP_UNUSED,
-             const coap_nack_reason_t reason,
-             const coap_mid_t id COAP_UNUSED) {
-
-  switch(reason) {
-  case COAP_NACK_TOO_MANY_RETRIES:
-  case COAP_NACK_NOT_DELIVERABLE:
-  case COAP_NACK_RST:
-  case COAP_NACK_TLS_FAILED:
-    /* Need to remove any proxy associations */
-    remove_proxy_association(session, 1);
-    break;
-  case COAP_NACK_ICMP_ISSUE:
-  case COAP_NACK_BAD_RESPONSE:
-  default:
-    break;
-  }
-  return;
-}
-
-#endif /* SERVER_CAN_PROXY */
 
 static void
 init_resources(coap_context_t *ctx) {
@@ -1720,6 +1075,7 @@ init_resources(coap_context_t *ctx) {
 
   r = coap_resource_init(NULL, COAP_RESOURCE_FLAGS_HAS_MCAST_SUPPORT);
   coap_register_request_handler(r, COAP_REQUEST_GET, hnd_get_index);
+  set_index_template(r);
 
   coap_add_attr(r, coap_make_str_const("ct"), coap_make_str_const("0"), 0);
   coap_add_attr(r, coap_make_str_const("title"), coap_make_str_const("\"General Info\""), 0);
@@ -1762,7 +1118,9 @@ init_resources(coap_context_t *ctx) {
     coap_add_resource(ctx, r);
   }
 
-  r = coap_resource_init(coap_make_str_const("example_data"), resource_flags);
+  r = coap_resource_init(coap_make_str_const("example_data"),
+                         resource_flags |
+                           COAP_RESOURCE_FLAGS_CACHE_REPRESENTATION);
   coap_register_request_handler(r, COAP_REQUEST_GET, hnd_get_example_data);
   coap_register_request_handler(r, COAP_REQUEST_PUT, hnd_put_example_data);
   coap_register_request_handler(r, COAP_REQUEST_FETCH, hnd_get_example_data);
@@ -1774,13 +1132,12 @@ init_resources(coap_context_t *ctx) {
 
 #if SERVER_CAN_PROXY
   if (proxy_host_name_count) {
+    init_proxy_server_list(ctx);
     r = coap_resource_proxy_uri_init2(hnd_proxy_uri, proxy_host_name_count,
                                       proxy_host_name_list, 0);
+    /* Observations are relayed, sharing one upstream per representation */
+    coap_resource_set_get_observable(r, 1);
     coap_add_resource(ctx, r);
-    coap_register_event_handler(ctx, proxy_event_handler);
-    coap_register_response_handler(ctx, proxy_response_handler);
-    coap_register_nack_handler(ctx, proxy_nack_handler);
-    proxy_resource = r;
   }
 #endif /* SERVER_CAN_PROXY */
 }
@@ -3031,13 +2388,6 @@ finish:
   free(dynamic_entry);
   release_resource_data(NULL, example_data_value);
 #if SERVER_CAN_PROXY
-  for (i = 0; i < proxy_list_count; i++) {
-    coap_delete_binary(proxy_list[i].token);
-    coap_delete_string(proxy_list[i].query);
-  }
-  free(proxy_list);
-  proxy_list = NULL;
-  proxy_list_count = 0;
 #ifdef _WIN32
 #pragma warning( disable : 4090 )
 #endif
@@ -60,7 +60,10 @@ typedef struct {
 
 #define COAP_BLOCK_USE_LIBCOAP  0x01 /* Use libcoap to do block requests */
 #define COAP_BLOCK_SINGLE_BODY  0x02 /* Deliver the data as a single body */
+#define COAP_BLOCK_TRY_Q_BLOCK  0x04 /* Try Q-Block method (RFC9177) */
 #define COAP_BLOCK_NO_PREEMPTIVE_RTAG 0x10 /* Don't use pre-emptive Request-Tags */
+#define COAP_BLOCK_STREAM_BODY  0x20 /* Deliver response bodies in order as
+                                        they arrive */
 
 /**
  * Returns the value of the least significant byte of a Block option @p opt.
@@ -390,6 +393,50 @@ coap_add_data_large_response(coap_resource_t *resource,
                              coap_release_large_data_t release_func,
                              void *app_ptr);
 
+/**
+ * Callback handler for a server resource to consume the body of a large
+ * request (Block1 or Q-Block1) as it arrives, instead of libcoap
+ * re-assembling the entire body in memory.
+ *
+ * The body is passed on in order, starting at @p offset 0.  Payloads that
+ * arrive out of order (Q-Block1) are held back in a small window until the
+ * gap has been filled.
+ *
+ * @param resource The resource the request is for.
+ * @param session  The session the request was received on.
+ * @param request  The request PDU that completed this part of the body.
+ * @param offset   The offset of @p data within the body.
+ * @param data     The next part of the body.
+ * @param length   The length of @p data.
+ * @param total    The expected size of the body (Size1) or @c 0 if unknown.
+ *
+ * @return @c 1 to continue with the body, @c 0 (or @c -1) to abort the
+ *         transfer with a 5.00 (Internal Server Error) response.
+ */
+typedef int (*coap_block1_sink_t)(coap_resource_t *resource,
+                                  coap_session_t *session,
+                                  const coap_pdu_t *request,
+                                  size_t offset,
+                                  const uint8_t *data,
+                                  size_t length,
+                                  size_t total);
+
+/**
+ * Registers a @p sink for the body of large requests to @p resource.
+ *
+ * When libcoap would otherwise re-assemble the body of a request before
+ * calling the request handler (COAP_BLOCK_SINGLE_BODY, BERT or Q-Block1),
+ * each part of the body is passed to @p sink as it arrives.  The request
+ * handler is then called without any data once the whole body has been
+ * passed to @p sink.  Bodies that fit into a single PDU are passed to the
+ * request handler as usual.
+ *
+ * @param resource The resource.
+ * @param sink     The sink to use, or @c NULL to re-assemble the body.
+ */
+void coap_resource_set_block1_sink(coap_resource_t *resource,
+                                   coap_block1_sink_t sink);
+
 /**
  * Set the context level CoAP block handling bits for handling RFC7959.
  * These bits flow down to a session when a session is created and if the peer
@@ -405,6 +452,20 @@ coap_add_data_large_response(coap_resource_t *resource,
  * all of this work (the default if coap_context_set_block_mode() is not
  * called).
  *
+ * Note: COAP_BLOCK_TRY_Q_BLOCK enables the RFC9177 Q-Block1 and Q-Block2
+ * options for UDP and DTLS sessions.  The first large transfer to a peer is
+ * sent as CON to find out whether the peer supports Q-Block, falling back to
+ * Block1 and Block2 if the peer responds with 4.02 (Bad Option).  NON
+ * transfers are then sent in bursts of MAX_PAYLOADS blocks, with missing
+ * blocks being requested by the receiver.
+ *
+ * Note: COAP_BLOCK_STREAM_BODY passes each part of a large response body to
+ * the client's response handler in order as it arrives (with the BlockX
+ * option removed), instead of re-assembling the body.  The next block is
+ * not asked for until the response handler has returned.  A transfer whose
+ * body changes part way through is abandoned with a
+ * COAP_EVENT_PARTIAL_BLOCK event.
+ *
  * @param context        The coap_context_t object.
  * @param block_mode     Zero or more COAP_BLOCK_ or'd options
  */
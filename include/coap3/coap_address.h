@@ -177,6 +177,78 @@ coap_addr_info_t *coap_resolve_address_info(const coap_str_const_t *server,
                                             int ai_hints_flags,
                                             int scheme_hint_bits);
 
+/**
+ * Resolve the specified @p server as coap_resolve_address_info() does, and
+ * hold the result in the resolver cache of @p context. This blocks while the
+ * name is looked up, unless it is already held.
+ *
+ * The cache is what a coap+tcp or coaps+tcp client session looks up the
+ * other addresses of the server's host in, so that it can race connections
+ * to them. A session to an address given by coap_resolve_address_info()
+ * connects only to that address.
+ *
+ * @param context  The context to resolve for.
+ * @param server   The Address to resolve.
+ * @param port     The unsecured protocol port to use.
+ * @param secure_port The secured protocol port to use.
+ * @param ai_hints_flags AI_* Hint flags to use for internal getaddrinfo().
+ * @param scheme_hint_bits Which schemes to return information for. One or
+ *                         more of COAP_URI_SCHEME_*_BIT or'd together.
+ *
+ * @return One or more linked sets of coap_addr_info_t or @c NULL if error.
+ */
+coap_addr_info_t *coap_context_resolve_address_info(coap_context_t *context,
+                                                    const coap_str_const_t *server,
+                                                    uint16_t port,
+                                                    uint16_t secure_port,
+                                                    int ai_hints_flags,
+                                                    int scheme_hint_bits);
+
+/**
+ * Callback handler that is given the result of
+ * coap_resolve_address_info_async().
+ *
+ * @param context   The context the resolution was done for.
+ * @param info_list The resolved addresses, or @c NULL if the server could not
+ *                  be resolved. These are to be freed by the handler with
+ *                  coap_free_address_info().
+ * @param app_data  The application data given to
+ *                  coap_resolve_address_info_async().
+ */
+typedef void (*coap_resolve_handler_t)(coap_context_t *context,
+                                       coap_addr_info_t *info_list,
+                                       void *app_data);
+
+/**
+ * Resolve the specified @p server as coap_resolve_address_info() does, but
+ * without blocking. The name is looked up by a worker thread (where threads
+ * are available) and @p handler is called from coap_io_process() when it is
+ * done. Results are held by @p context for a while, so that a server that is
+ * known (or an IP literal) has @p handler called before this returns. Only
+ * COAP_RESOLVE_MAX_PENDING names are looked up at a time for a context,
+ * further ones failing until one of those is done.
+ *
+ * @param context  The context to resolve for.
+ * @param server   The Address to resolve.
+ * @param port     The unsecured protocol port to use.
+ * @param secure_port The secured protocol port to use.
+ * @param ai_hints_flags AI_* Hint flags to use for internal getaddrinfo().
+ * @param scheme_hint_bits Which schemes to return information for. One or
+ *                         more of COAP_URI_SCHEME_*_BIT or'd together.
+ * @param handler  The handler to call with the result.
+ * @param app_data Application data to pass to @p handler.
+ *
+ * @return @c 1 if @p handler has been or will be called, @c 0 on error.
+ */
+int coap_resolve_address_info_async(coap_context_t *context,
+                                    const coap_str_const_t *server,
+                                    uint16_t port,
+                                    uint16_t secure_port,
+                                    int ai_hints_flags,
+                                    int scheme_hint_bits,
+                                    coap_resolve_handler_t handler,
+                                    void *app_data);
+
 /**
  * Free off the one or more linked sets of coap_addr_info_t returned from
  * coap_resolve_address_info().
@@ -21,6 +21,7 @@
 
 #include "coap_internal.h"
 #include "coap_pdu_internal.h"
+#include "coap_uthash_internal.h"
 #include "resource.h"
 
 /**
@@ -30,24 +31,81 @@
  * @{
  */
 
+/* Internal session only block_mode bits for tracking Q-Block support */
+#define COAP_BLOCK_HAS_Q_BLOCK  0x40 /* Peer supports Q-Block */
+#define COAP_BLOCK_NOT_Q_BLOCK  0x80 /* Peer does not support Q-Block */
+
+/* Set if the session is to use Q-Block (RFC9177) for new transfers */
+#define COAP_BLOCK_Q_BLOCK_OK(s) \
+  (((s)->block_mode & (COAP_BLOCK_TRY_Q_BLOCK | COAP_BLOCK_NOT_Q_BLOCK)) == \
+   COAP_BLOCK_TRY_Q_BLOCK && COAP_PROTO_NOT_RELIABLE((s)->proto))
+
+/* Set if Q-Block support by the peer is not yet known */
+#define COAP_BLOCK_Q_BLOCK_PROBE(s) \
+  (COAP_BLOCK_Q_BLOCK_OK(s) && !((s)->block_mode & COAP_BLOCK_HAS_Q_BLOCK))
+
+/*
+ * RFC9177 transmission parameters.
+ *
+ * MAX_PAYLOADS is the number of NON blocks sent back to back (a payload set)
+ * before waiting for a Continue, NON_TIMEOUT (ACK_TIMEOUT) is how long to
+ * wait for that Continue before sending the next payload set anyway,
+ * NON_RECEIVE_TIMEOUT (2 * NON_TIMEOUT) is how long a receiver waits before
+ * asking for missing blocks and NON_MAX_RETRANSMIT (MAX_RETRANSMIT) is how
+ * often that is tried.
+ */
+#define COAP_MAX_PAYLOADS 10
+
+/**
+ * Number of blocks that can be held back when the body of a request is
+ * passed to a resource's block1_sink and the blocks arrive out of order.
+ */
+#ifndef COAP_BLOCK1_SINK_WINDOW
+#define COAP_BLOCK1_SINK_WINDOW (2 * COAP_MAX_PAYLOADS)
+#endif /* COAP_BLOCK1_SINK_WINDOW */
+
+/**
+ * Number of blocks that can be held back when the body of a response is
+ * passed on using COAP_BLOCK_STREAM_BODY and the blocks arrive out of order.
+ */
+#ifndef COAP_BLOCK2_STREAM_WINDOW
+#define COAP_BLOCK2_STREAM_WINDOW (2 * COAP_MAX_PAYLOADS)
+#endif /* COAP_BLOCK2_STREAM_WINDOW */
+#define COAP_NON_TIMEOUT_TICKS(s) \
+  ((s)->ack_timeout.integer_part * COAP_TICKS_PER_SECOND + \
+   (s)->ack_timeout.fractional_part * COAP_TICKS_PER_SECOND / 1000)
+#define COAP_NON_RECEIVE_TIMEOUT_TICKS(s) (2 * COAP_NON_TIMEOUT_TICKS(s))
+#define COAP_NON_MAX_RETRANSMIT(s) ((s)->max_retransmit)
+
+/* Returns 1 if option is a Q-Block option */
+#define COAP_OPTION_IS_Q_BLOCK(o) \
+  ((o) == COAP_OPTION_Q_BLOCK1 || (o) == COAP_OPTION_Q_BLOCK2)
+
+/* No timeout pending for coap_block_check_lg_*_timeouts() */
+#define COAP_TICK_NONE ((coap_tick_t)-1)
+
 typedef enum {
   COAP_RECURSE_OK,
   COAP_RECURSE_NO
 } coap_recurse_t;
 
-struct coap_lg_range {
-  uint32_t begin;
-  uint32_t end;
-};
-
-#define COAP_RBLOCK_CNT 4
+/* Block numbers are at most 20 bits, which bounds the bitmap to 128 KiB */
+#define COAP_RBLOCK_MAX_BLOCKS (1U << 20)
+/* Initial bitmap size in bytes (covers 128 blocks) */
+#define COAP_RBLOCK_MIN_BITMAP 16
 /**
  * Structure to keep track of received blocks
+ *
+ * A bitmap with a bit per block number that is grown (by doubling) as higher
+ * block numbers arrive, so blocks can be received in any order.
  */
 typedef struct coap_rblock_t {
-  uint32_t used;
+  uint32_t used;          /**< Number of different blocks received */
   uint32_t retry;
-  struct coap_lg_range range[COAP_RBLOCK_CNT];
+  uint32_t first_missing; /**< Lowest block number not yet received */
+  uint32_t highest;       /**< Highest block number received (if used) */
+  uint8_t *bitmap;        /**< Bit set for each block received */
+  size_t bitmap_len;      /**< Number of bytes in bitmap */
   coap_tick_t last_seen;
 } coap_rblock_t;
 
@@ -69,6 +127,7 @@ typedef struct coap_l_block1_t {
 typedef struct coap_l_block2_t {
   coap_resource_t *resource; /**< associated resource */
   coap_string_t *query;  /**< Associated query for the resource */
+  uint64_t path_key;     /**< Uri-Path hash if resource is a template */
   uint64_t etag;         /**< ETag value */
   coap_pdu_code_t request_method; /**< Method used to request this data */
   uint8_t rtag_set;      /**< Set if RTag is in receive PDU */
@@ -97,8 +156,16 @@ struct coap_lg_xmit_t {
   coap_tick_t last_sent; /**< Last time any data sent */
   coap_tick_t last_all_sent; /**< Last time all data sent or 0 */
   coap_tick_t last_obs; /**< Last time used (Observe tracking) or 0 */
+  uint8_t non_burst;     /**< Set if sending Q-Block NON payload sets */
+  uint8_t non_retry;     /**< Q-Block1 last block resend count */
   coap_release_large_data_t release_func; /**< large data de-alloc function */
   void *app_ptr;         /**< applicaton provided ptr for de-alloc function */
+  UT_hash_handle hh;     /**< session->lg_xmit_hash (hkey) */
+  UT_hash_handle hh_app; /**< session->lg_xmit_app (hkey_app, requests) */
+  uint64_t hkey;         /**< state token base (request) or response key */
+  uint64_t hkey_app;     /**< app token base (request) */
+  struct coap_lg_xmit_t *dirty_next; /**< next in session->lg_xmit_dirty */
+  uint8_t dirty;         /**< Set if in session->lg_xmit_dirty */
 };
 
 #if COAP_CLIENT_SUPPORT
@@ -121,6 +188,9 @@ struct coap_lg_crcv_t {
   uint16_t retry_counter; /**< Retry counter (part of state token) */
   size_t total_len;      /**< Length as indicated by SIZE2 option */
   coap_binary_t *body_data; /**< Used for re-assembling entire body */
+  size_t stream_offset;  /**< Amount of body passed on (stream) */
+  size_t stream_end;     /**< Length of body (if last block seen) */
+  uint8_t *stream_window; /**< Blocks held back (stream) */
   coap_binary_t *app_token; /**< app requesting PDU token */
   coap_bin_const_t **obs_token; /**< Tokens used in setting up Observe
                                   (to handle large FETCH) */
@@ -129,6 +199,12 @@ struct coap_lg_crcv_t {
   coap_pdu_t pdu;        /**< skeletal PDU */
   coap_rblock_t rec_blocks; /** < list of received blocks */
   coap_tick_t last_used; /**< Last time all data sent or 0 */
+  UT_hash_handle hh;     /**< session->lg_crcv_hash (hkey) */
+  UT_hash_handle hh_app; /**< session->lg_crcv_app (hkey_app) */
+  uint64_t hkey;         /**< state token base */
+  uint64_t hkey_app;     /**< app token base */
+  struct coap_lg_crcv_t *dirty_next; /**< next in session->lg_crcv_dirty */
+  uint8_t dirty;         /**< Set if in session->lg_crcv_dirty */
 };
 #endif /* COAP_CLIENT_SUPPORT */
 
@@ -150,12 +226,22 @@ struct coap_lg_srcv_t {
   size_t total_len;      /**< Length as indicated by SIZE1 option */
   coap_binary_t *body_data; /**< Used for re-assembling entire body */
   size_t amount_so_far;  /**< Amount of data seen so far */
+  size_t sink_offset;    /**< Amount of body passed to the block1_sink */
+  size_t sink_end;       /**< Length of body (if last block seen) */
+  uint8_t *sink_window;  /**< Blocks held back from the block1_sink */
   coap_resource_t *resource; /**< associated resource */
   coap_str_const_t *uri_path; /** set to uri_path if unknown resource */
   coap_rblock_t rec_blocks; /** < list of received blocks */
   coap_mid_t last_mid;   /**< Last received mid for this set of packets */
+  coap_bin_const_t *last_token; /**< Last received token (Q-Block1) */
   coap_tick_t last_used; /**< Last time data sent or 0 */
   uint16_t block_option; /**< Block option in use */
+  UT_hash_handle hh;     /**< session->lg_srcv_hash (hkey) */
+  UT_hash_handle hh_path; /**< session->lg_srcv_path (hkey_path) */
+  uint64_t hkey;         /**< resource + RTag key */
+  uint64_t hkey_path;    /**< uri_path + RTag key (if uri_path) */
+  struct coap_lg_srcv_t *dirty_next; /**< next in session->lg_srcv_dirty */
+  uint8_t dirty;         /**< Set if in session->lg_srcv_dirty */
 };
 #endif /* COAP_SERVER_SUPPORT */
 
@@ -167,19 +253,112 @@ coap_lg_crcv_t * coap_block_new_lg_crcv(coap_session_t *session,
 void coap_block_delete_lg_crcv(coap_session_t *session,
                                coap_lg_crcv_t *lg_crcv);
 
+/**
+ * Add @p lg_crcv to the session's list of large receives and its indexes.
+ *
+ * @param session The session.
+ * @param lg_crcv The large receive information.
+ */
+void coap_block_link_lg_crcv(coap_session_t *session, coap_lg_crcv_t *lg_crcv);
+
+/**
+ * Remove @p lg_crcv from the session's list of large receives and its
+ * indexes.  @p lg_crcv is not freed.
+ *
+ * @param session The session.
+ * @param lg_crcv The large receive information.
+ */
+void coap_block_unlink_lg_crcv(coap_session_t *session,
+                               coap_lg_crcv_t *lg_crcv);
+
+/**
+ * Find the lg_crcv set up by the application request using @p token.
+ *
+ * @param session The session.
+ * @param token   The application's request token.
+ *
+ * @return The lg_crcv or @c NULL if not found.
+ */
+coap_lg_crcv_t *coap_find_lg_crcv_app(coap_session_t *session,
+                                      const coap_bin_const_t *token);
+
+/**
+ * Find the lg_xmit (request) set up by the application request using
+ * @p token.
+ *
+ * @param session The session.
+ * @param token   The application's request token.
+ *
+ * @return The lg_xmit or @c NULL if not found.
+ */
+coap_lg_xmit_t *coap_find_lg_xmit_request_app(coap_session_t *session,
+                                              const coap_bin_const_t *token);
+
+/**
+ * Update the state token of the lg_xmit (request), keeping the session's
+ * index in step.
+ *
+ * @param session     The session.
+ * @param lg_xmit     The large transmit information.
+ * @param state_token The new state token.
+ */
+void coap_block_set_lg_xmit_token(coap_session_t *session,
+                                  coap_lg_xmit_t *lg_xmit,
+                                  uint64_t state_token);
+
 int coap_block_check_lg_crcv_timeouts(coap_session_t *session,
                                       coap_tick_t now,
                                       coap_tick_t *tim_rem);
+
+/**
+ * Send the remainder of the current Q-Block1 payload set (up to
+ * COAP_MAX_PAYLOADS blocks) starting at lg_xmit->offset as NON requests.
+ *
+ * @param session The session.
+ * @param lg_xmit The large transmit information.
+ */
+void coap_block_send_q_block1_set(coap_session_t *session,
+                                  coap_lg_xmit_t *lg_xmit);
 #endif /* COAP_CLIENT_SUPPORT */
 
 #if COAP_SERVER_SUPPORT
 void coap_block_delete_lg_srcv(coap_session_t *session,
                                coap_lg_srcv_t *lg_srcv);
 
+/**
+ * Add @p lg_srcv to the session's list of large receives and its indexes.
+ *
+ * @param session The session.
+ * @param lg_srcv The large receive information.
+ */
+void coap_block_link_lg_srcv(coap_session_t *session, coap_lg_srcv_t *lg_srcv);
+
+/**
+ * Remove @p lg_srcv from the session's list of large receives and its
+ * indexes.  @p lg_srcv is not freed.
+ *
+ * @param session The session.
+ * @param lg_srcv The large receive information.
+ */
+void coap_block_unlink_lg_srcv(coap_session_t *session,
+                               coap_lg_srcv_t *lg_srcv);
+
 int coap_block_check_lg_srcv_timeouts(coap_session_t *session,
                                       coap_tick_t now,
                                       coap_tick_t *tim_rem);
 
+/**
+ * Send the rest of the first Q-Block2 payload set as NON responses once
+ * block 0 has been sent as the response to @p request.
+ *
+ * @param session The session.
+ * @param request The request PDU (for the token to use).
+ * @param lg_xmit The large transmit information.
+ */
+void coap_block_send_q_block2_set(coap_session_t *session,
+                                  const coap_pdu_t *request,
+                                  coap_lg_xmit_t *lg_xmit);
+
 int coap_handle_request_send_block(coap_session_t *session,
                                    coap_pdu_t *pdu,
                                    coap_pdu_t *response,
@@ -220,6 +399,25 @@ coap_retransmit_oscore_pdu(coap_session_t *session,
 void coap_block_delete_lg_xmit(coap_session_t *session,
                                coap_lg_xmit_t *lg_xmit);
 
+/**
+ * Add @p lg_xmit to the session's list of large transmissions and its
+ * indexes.
+ *
+ * @param session The session.
+ * @param lg_xmit The large transmit information.
+ */
+void coap_block_link_lg_xmit(coap_session_t *session, coap_lg_xmit_t *lg_xmit);
+
+/**
+ * Remove @p lg_xmit from the session's list of large transmissions and its
+ * indexes.  @p lg_xmit is not freed.
+ *
+ * @param session The session.
+ * @param lg_xmit The large transmit information.
+ */
+void coap_block_unlink_lg_xmit(coap_session_t *session,
+                               coap_lg_xmit_t *lg_xmit);
+
 int coap_block_check_lg_xmit_timeouts(coap_session_t *session,
                                       coap_tick_t now,
                                       coap_tick_t *tim_rem);
@@ -44,6 +44,45 @@ typedef enum coap_cache_record_pdu_t {
   COAP_CACHE_RECORD_PDU
 } coap_cache_record_pdu_t;
 
+/**
+ * Cache counters, see coap_cache_get_stats().
+ */
+typedef struct coap_cache_stats_t {
+  uint64_t hits;         /**< lookups that found a cache-entry */
+  uint64_t misses;       /**< lookups that did not */
+  uint64_t evictions;    /**< cache-entries deleted to keep within the
+                              size limit */
+  uint64_t expirations;  /**< cache-entries deleted when idle or no longer
+                              fresh */
+  uint64_t coalesced;    /**< requests answered with the response fetched
+                              for an identical request, see
+                              coap_cache_flight_join() */
+  size_t entries;        /**< cache-entries currently held */
+  size_t size;           /**< bytes currently held by cache-entries */
+} coap_cache_stats_t;
+
+/**
+ * Outcome of coap_cache_flight_join().
+ */
+typedef enum coap_cache_flight_status_t {
+  COAP_CACHE_FLIGHT_NONE,    /**< not coalesced, handle the request as
+                                  usual */
+  COAP_CACHE_FLIGHT_LEADER,  /**< the first request: fetch the response,
+                                  then call coap_cache_flight_complete() */
+  COAP_CACHE_FLIGHT_PARKED   /**< parked until the response is fetched:
+                                  leave the response code unset */
+} coap_cache_flight_status_t;
+
+/**
+ * The hash that cache-keys are derived with.
+ */
+typedef enum coap_cache_key_hash_t {
+  COAP_CACHE_KEY_HASH_DIGEST,  /**< SHA-256 digest of the (D)TLS library
+                                    (default) */
+  COAP_CACHE_KEY_HASH_SIPHASH  /**< SipHash-2-4-128 with a random key for
+                                    the context */
+} coap_cache_key_hash_t;
+
 /**
  * Calculates a cache-key for the given CoAP PDU. See
  * https://rfc-editor.org/rfc/rfc7252#section-5.4.2
@@ -111,6 +150,25 @@ coap_cache_key_t *coap_cache_derive_key_w_ignore(const coap_session_t *session,
  */
 void coap_delete_cache_key(coap_cache_key_t *cache_key);
 
+/**
+ * Selects the hash that cache-keys are derived with for @p context.
+ *
+ * COAP_CACHE_KEY_HASH_SIPHASH is much cheaper than the default digest and
+ * needs no memory allocation, while its random key stops peers choosing
+ * requests with colliding cache-keys. Its cache-keys are only meaningful
+ * within @p context, and change when this function is called again.
+ *
+ * This should be called before any cache-entries or observers are set up,
+ * as cache-keys that have already been derived will no longer match.
+ *
+ * @param context The context.
+ * @param hash    The hash to use.
+ *
+ * @return @c 1 if successful, else @c 0.
+ */
+int coap_cache_set_key_hash(coap_context_t *context,
+                            coap_cache_key_hash_t hash);
+
 /**
  * Define the CoAP options that are not to be included when calculating
  * the cache-key. Options that are defined as Non-Cache and the Observe
@@ -155,6 +213,101 @@ coap_cache_entry_t *coap_new_cache_entry(coap_session_t *session,
                                  coap_cache_session_based_t session_based,
                                  unsigned int idle_time);
 
+/**
+ * Create a new cache-entry holding a copy of @p response, keyed by the
+ * cache-key derived from @p request. The cache-entry stays fresh for the
+ * Max-Age of @p response (60 seconds if it has no Max-Age option) and is
+ * then deleted. Any cache-entry already held for the cache-key is replaced.
+ *
+ * @param session The session to use.
+ * @param request The request that @p response is for.
+ * @param response The response to hold.
+ * @param session_based COAP_CACHE_IS_SESSION_BASED if session based
+ *                     cache-key to be used, else COAP_CACHE_NOT_SESSION_BASED.
+ *
+ * @return The cache-entry, or @c NULL if @p response has a Max-Age of 0, is
+ *         larger than the cache size limit, or on error.
+ */
+coap_cache_entry_t *coap_cache_add_response(coap_session_t *session,
+                                            const coap_pdu_t *request,
+                                            const coap_pdu_t *response,
+                                   coap_cache_session_based_t session_based);
+
+/**
+ * Returns how long the response held by a cache-entry created by
+ * coap_cache_add_response() remains fresh. This is the Max-Age to send with
+ * the response when it is served from the cache.
+ *
+ * @param cache_entry The CoAP cache entry.
+ *
+ * @return The remaining seconds, or @c 0 if no longer fresh or
+ *         @p cache_entry was not created by coap_cache_add_response().
+ */
+unsigned int coap_cache_get_max_age(const coap_cache_entry_t *cache_entry);
+
+/**
+ * Limits the total size of the cache-entries held by @p context. When a new
+ * cache-entry takes the total over @p max_size, the least recently used
+ * cache-entries are deleted. The sizes include any copied PDUs, but not any
+ * application data.
+ *
+ * @param context  The context.
+ * @param max_size The limit in bytes, or @c 0 for no limit (the default).
+ */
+void coap_cache_set_max_size(coap_context_t *context, size_t max_size);
+
+/**
+ * Get the cache counters of @p context.
+ *
+ * @param context The context.
+ * @param stats   Updated with the cache counters.
+ */
+void coap_cache_get_stats(const coap_context_t *context,
+                          coap_cache_stats_t *stats);
+
+/**
+ * Coalesces identical requests that arrive while the response to the first
+ * one is still being fetched (for example from an upstream server by a
+ * proxy). The first request with @p cache_key makes the caller the leader of
+ * a "single-flight", which goes on to fetch the response. Later GET or FETCH
+ * requests with the same @p cache_key are parked as asynchronous requests
+ * (see coap_register_async()), and answered by coap_cache_flight_complete().
+ *
+ * This is called from a request handler. When the request is parked, the
+ * handler must return without setting the response code, so that only an
+ * empty ACK is sent.
+ *
+ * @param session   The session the request came in on.
+ * @param request   The request.
+ * @param cache_key The cache-key of @p request, typically derived with
+ *                  COAP_CACHE_NOT_SESSION_BASED.
+ *
+ * @return @c COAP_CACHE_FLIGHT_LEADER, @c COAP_CACHE_FLIGHT_PARKED or
+ *         @c COAP_CACHE_FLIGHT_NONE if the request cannot be coalesced
+ *         (it is not a GET or FETCH, it has an Observe option or it is
+ *         already asynchronous).
+ */
+coap_cache_flight_status_t coap_cache_flight_join(coap_session_t *session,
+                                                  const coap_pdu_t *request,
+                                          const coap_cache_key_t *cache_key);
+
+/**
+ * Completes the single-flight for @p cache_key started by
+ * coap_cache_flight_join(). Each parked request is sent a separate response
+ * with the code, options and body of @p response (using block-wise transfer
+ * if needed). If @p response is @c NULL, as the fetch failed, the parked
+ * requests are instead passed to the request handler again.
+ *
+ * @param resource  The resource the parked requests are for.
+ * @param cache_key The cache-key passed to coap_cache_flight_join().
+ * @param response  The fetched response, or @c NULL.
+ *
+ * @return The number of parked requests.
+ */
+size_t coap_cache_flight_complete(coap_resource_t *resource,
+                                  const coap_cache_key_t *cache_key,
+                                  const coap_pdu_t *response);
+
 /**
  * Remove a cache-entry from the hash list and free off all the appropriate
  * contents apart from app_data.
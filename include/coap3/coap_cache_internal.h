@@ -44,11 +44,35 @@ struct coap_cache_entry_t {
   coap_session_t *session;
   coap_pdu_t *pdu;
   void* app_data;
-  coap_tick_t expire_ticks;
+  coap_tick_t expire_ticks;   /**< when idle, or no longer fresh, or 0 */
   unsigned int idle_timeout;
   coap_cache_app_data_free_callback_t callback;
+  struct coap_cache_entry_t *lru_prev; /**< context cache_lru list, least */
+  struct coap_cache_entry_t *lru_next; /**< recently used first */
+  size_t heap_index;          /**< 1 + index in context cache_expiry, or 0 */
+  size_t size;                /**< bytes held, as counted in cache_size */
 };
 
+/**
+ * A request parked by coap_cache_flight_join(), identified by its session and
+ * token as the application may free its coap_async_t.
+ */
+typedef struct coap_cache_waiter_t {
+  struct coap_cache_waiter_t *next;
+  coap_session_t *session;    /**< referenced session of the request */
+  coap_bin_const_t *token;    /**< token of the request */
+} coap_cache_waiter_t;
+
+/**
+ * A response being fetched for the first request with a cache-key, and the
+ * identical requests waiting for it.
+ */
+typedef struct coap_cache_flight_t {
+  UT_hash_handle hh;
+  coap_cache_key_t cache_key;
+  coap_cache_waiter_t *waiters; /**< parked requests, in arrival order */
+} coap_cache_flight_t;
+
 /**
  * Expire coap_cache_entry_t entries
  *
@@ -58,6 +82,83 @@ struct coap_cache_entry_t {
  */
 void coap_expire_cache_entries(coap_context_t *context);
 
+/**
+ * Frees off all the single-flights of @p context, abandoning any parked
+ * requests.
+ *
+ * Internal function.
+ *
+ * @param context The context holding the single-flights.
+ */
+void coap_delete_cache_flights(coap_context_t *context);
+
+/**
+ * As coap_cache_add_response(), but for a given @p cache_key.
+ *
+ * @param session   The session to use.
+ * @param cache_key The cache-key, which is copied.
+ * @param response  The response to hold.
+ * @param session_based COAP_CACHE_IS_SESSION_BASED if the cache-entry is to
+ *                  be deleted with @p session, else
+ *                  COAP_CACHE_NOT_SESSION_BASED.
+ *
+ * @return The cache-entry, or @c NULL if @p response has a Max-Age of 0, is
+ *         larger than the cache size limit, or on error.
+ */
+coap_cache_entry_t *coap_cache_add_response_by_key(coap_session_t *session,
+                                        const coap_cache_key_t *cache_key,
+                                        const coap_pdu_t *response,
+                             coap_cache_session_based_t session_based);
+
+/**
+ * A response body, shared by the responses that are sending it.
+ */
+typedef struct coap_cache_body_t {
+  unsigned int ref;  /**< the creator plus each response sending it */
+  size_t length;     /**< length of s */
+  uint8_t s[1];      /**< the body */
+} coap_cache_body_t;
+
+/**
+ * Copies the (complete) body of @p response.
+ *
+ * @param response The response.
+ *
+ * @return The body, to be released with coap_cache_body_release(), or
+ *         @c NULL if @p response has no complete body or on error.
+ */
+coap_cache_body_t *coap_cache_body_new(const coap_pdu_t *response);
+
+/**
+ * Releases a reference to a body returned by coap_cache_body_new().
+ * Suitable for use as a coap_release_large_data_t.
+ *
+ * @param session Not used.
+ * @param app_ptr The coap_cache_body_t.
+ */
+void coap_cache_body_release(coap_session_t *session, void *app_ptr);
+
+/**
+ * Sets up @p pdu, the response to @p request, with the code and options of
+ * @p response, and with @p body using coap_add_data_large_response() so that
+ * the Block2 option of @p request is honoured. The Observe, Block2, Q-Block2
+ * and Size2 options of @p response are not copied.
+ *
+ * @param resource The resource @p request is for.
+ * @param session  The session to send @p pdu on.
+ * @param request  The request being answered.
+ * @param pdu      The response to set up, which has its token.
+ * @param response The response to copy.
+ * @param body     The body of @p response, or @c NULL if none.
+ * @param max_age  The Max-Age to send instead of that of @p response, or
+ *                 @c -1.
+ */
+void coap_cache_fill_response(coap_resource_t *resource,
+                              coap_session_t *session,
+                              const coap_pdu_t *request, coap_pdu_t *pdu,
+                              const coap_pdu_t *response,
+                              coap_cache_body_t *body, int max_age);
+
 typedef void coap_digest_ctx_t;
 
 /**
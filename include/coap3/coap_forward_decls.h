@@ -102,6 +102,7 @@ typedef struct coap_resource_t coap_resource_t;
  */
 typedef struct coap_addr_hash_t coap_addr_hash_t;
 typedef struct coap_endpoint_t coap_endpoint_t;
+typedef struct coap_rtt_estimator_t coap_rtt_estimator_t;
 typedef struct coap_session_t coap_session_t;
 
 /* ************* coap_subscribe_internal.h ***************** */
@@ -58,4 +58,43 @@ void coap_hash_impl(const unsigned char *s, size_t len, coap_key_t h);
     coap_hash((Str)->s, (Str)->length, (H)); \
   }
 
+/**
+ * State of an incremental SipHash-2-4 calculation. SipHash is a keyed hash:
+ * without the key, its results cannot be predicted or collisions chosen.
+ */
+typedef struct coap_siphash_t {
+  uint64_t v[4];    /**< internal state */
+  uint64_t tail;    /**< bytes not yet hashed, little endian */
+  size_t length;    /**< total number of bytes so far */
+  uint8_t outlen;   /**< 8 or 16 bytes of result */
+} coap_siphash_t;
+
+/**
+ * Starts a SipHash-2-4 calculation.
+ *
+ * @param state  The state to initialize.
+ * @param key    The 16 byte key.
+ * @param outlen The length of the result, 8 or 16 bytes (SipHash-2-4-128).
+ */
+void coap_siphash_init(coap_siphash_t *state, const uint8_t key[16],
+                       uint8_t outlen);
+
+/**
+ * Adds @p length bytes of @p data to a SipHash-2-4 calculation.
+ *
+ * @param state  The state set up by coap_siphash_init().
+ * @param data   The data.
+ * @param length The length of @p data.
+ */
+void coap_siphash_update(coap_siphash_t *state, const uint8_t *data,
+                         size_t length);
+
+/**
+ * Ends a SipHash-2-4 calculation.
+ *
+ * @param state  The state set up by coap_siphash_init().
+ * @param out    Receives the outlen bytes of the result.
+ */
+void coap_siphash_final(coap_siphash_t *state, uint8_t *out);
+
 #endif /* COAP_HASHKEY_INTERNAL_H_ */
@@ -75,12 +75,14 @@
 /* Specific OSCORE general .h files */
 typedef struct oscore_ctx_t oscore_ctx_t;
 #include "oscore/oscore.h"
-#include "oscore/oscore_cbor.h"
 #include "oscore/oscore_cose.h"
 #include "oscore/oscore_context.h"
 #include "oscore/oscore_crypto.h"
 #endif /* HAVE_OSCORE */
 
+/* Also used for link-format+cbor */
+#include "oscore/oscore_cbor.h"
+
 /* Specifically defined internal .h files */
 #include "coap_asn1_internal.h"
 #include "coap_async_internal.h"
@@ -99,6 +101,7 @@ typedef struct oscore_ctx_t oscore_ctx_t;
 #include "coap_oscore_internal.h"
 #endif /* HAVE_OSCORE */
 #include "coap_pdu_internal.h"
+#include "coap_proxy_internal.h"
 #include "coap_resource_internal.h"
 #include "coap_session_internal.h"
 #include "coap_subscribe_internal.h"
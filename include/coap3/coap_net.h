@@ -363,6 +363,61 @@ coap_context_set_max_handshake_sessions(coap_context_t *context,
 unsigned int
 coap_context_get_max_handshake_sessions(const coap_context_t *context);
 
+/**
+ * Set the size of the per-session output buffer used to coalesce PDUs that
+ * are sent over reliable (TCP or TLS) sessions.  PDUs sent during one
+ * coap_io_process() iteration are collected in this buffer and then written
+ * out as a single send() or TLS record.  PDUs larger than @p size are sent
+ * directly.
+ * 0 (the default) means that PDUs are written out immediately.
+ *
+ * @param context The coap_context_t object.
+ * @param size    The size of the output buffer in bytes.
+ */
+void
+coap_context_set_write_coalesce_size(coap_context_t *context, size_t size);
+
+/**
+ * Get the size of the per-session output buffer used to coalesce PDUs sent
+ * over reliable sessions.
+ *
+ * @param context The coap_context_t object.
+ *
+ * @return The output buffer size, or @c 0 if write coalescing is disabled.
+ */
+size_t
+coap_context_get_write_coalesce_size(const coap_context_t *context);
+
+/**
+ * Set whether, and how, the retransmission timeout (RTO) for confirmable
+ * messages sent over UDP or DTLS is adapted using RTT measurements (based on
+ * CoCoA draft-ietf-core-cocoa).  Exchanges that complete without a
+ * retransmission update the strong estimator, those that need one or two
+ * retransmissions update the weak estimator.  The RTO is aged when it has not
+ * been updated for a while, and the retransmission back-off factor varies
+ * with the RTO.
+ *
+ * Only sessions that are created or send their first confirmable message
+ * after this call are affected.
+ *
+ * @param context The coap_context_t object.
+ * @param mode    The estimation mode. The default is
+ *                COAP_RTT_ESTIMATION_NONE.
+ */
+void
+coap_context_set_rtt_estimation(coap_context_t *context,
+                                coap_rtt_estimation_t mode);
+
+/**
+ * Get the RTT estimation mode.
+ *
+ * @param context The coap_context_t object.
+ *
+ * @return The current RTT estimation mode.
+ */
+coap_rtt_estimation_t
+coap_context_get_rtt_estimation(const coap_context_t *context);
+
 /**
  * Returns a new message id and updates @p session->tx_mid accordingly. The
  * message id is returned in network byte order to make it easier to read in
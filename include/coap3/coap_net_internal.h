@@ -37,6 +37,7 @@ struct coap_queue_t {
                                  *    when zero */
   uint8_t is_mcast;             /**< Set if this is a queued mcast response */
   unsigned int timeout;         /**< the randomized timeout value */
+  coap_tick_t tx_time;          /**< when the PDU was first sent */
   coap_session_t *session;      /**< the CoAP session */
   coap_mid_t id;                /**< CoAP message id */
   coap_pdu_t *pdu;              /**< the CoAP PDU to send */
@@ -50,6 +51,8 @@ struct coap_context_t {
 #if COAP_SERVER_SUPPORT
   coap_resource_t *resources; /**< hash table or list of known
                                    resources */
+  struct coap_uri_node_t *resource_trie; /**< resources by Uri-Path
+                                              segments */
   coap_resource_t *unknown_resource; /**< can be used for handling
                                           unknown resources */
   coap_resource_t *proxy_uri_resource; /**< can be used for handling
@@ -57,6 +60,10 @@ struct coap_context_t {
   coap_resource_release_userdata_handler_t release_userdata;
                                         /**< function to  release user_data
                                              when resource is deleted */
+  struct coap_wkc_cache_t *wkc_cache; /**< unfiltered .well-known/core */
+  struct coap_wkc_cache_t *wkc_cache_cbor; /**< and as link-format+cbor */
+  struct coap_wkc_index_t *wkc_index; /**< resources by link attribute value */
+  uint8_t wkc_index_built;            /**< wkc_index is up to date */
 #endif /* COAP_SERVER_SUPPORT */
 
 #ifndef WITHOUT_ASYNC
@@ -129,7 +136,12 @@ struct coap_context_t {
   unsigned int csm_timeout;           /**< Timeout for waiting for a CSM from
                                            the remote side. 0 means disabled. */
   uint32_t csm_max_message_size;   /**< Value for CSM Max-Message-Size */
+  size_t write_coalesce_size;      /**< Size of reliable session output
+                                        buffer. 0 means disabled. */
   uint64_t etag;                   /**< Next ETag to use */
+  coap_stats_t stats;              /**< Context traffic counters */
+  coap_rtt_estimation_t rtt_estimation; /**< RTT estimation mode */
+  coap_rtt_estimator_t *rtt_estimators; /**< Shared RTT estimators */
 
 #if COAP_SERVER_SUPPORT
   coap_cache_entry_t *cache;       /**< CoAP cache-entry cache */
@@ -137,9 +149,51 @@ struct coap_context_t {
                                         cache-key */
   size_t cache_ignore_count;       /**< The number of CoAP options to ignore
                                         when creating a cache-key */
+  coap_cache_key_hash_t cache_key_hash; /**< How cache-keys are derived */
+  coap_cache_entry_t *cache_lru;   /**< cache-entries, least recently used
+                                        first */
+  coap_cache_entry_t **cache_expiry; /**< heap of the cache-entries that
+                                          expire, soonest first */
+  size_t cache_expiry_count;       /**< entries in cache_expiry */
+  size_t cache_expiry_size;        /**< allocated entries of cache_expiry */
+  size_t cache_size;               /**< bytes held by cache-entries */
+  size_t cache_max_size;           /**< limit of cache_size, or 0 */
+  coap_cache_stats_t cache_stats;  /**< cache counters */
+  struct coap_cache_flight_t *cache_flights; /**< responses being fetched,
+                                                  by cache-key */
+  uint8_t cache_key_secret[16];    /**< SipHash key for cache-keys */
+  struct coap_pdu_template_t *error_templates; /**< error responses without
+                                                    options, by code */
+#if COAP_CLIENT_SUPPORT
+  struct coap_proxy_upstream_t *proxy_upstreams; /**< pooled upstream
+                                                      sessions, by server */
+  struct coap_proxy_req_t *proxy_reqs; /**< forwarded requests, by upstream
+                                            session and token */
+  struct coap_proxy_req_t *proxy_observes; /**< relayed observations, by
+                                                downstream notify key */
+  struct coap_proxy_req_t *proxy_ended_observes; /**< relayed observations
+                                                      that have ended, kept
+                                                      for the last
+                                                      notifications */
+  struct coap_proxy_backend_t *proxy_backends; /**< health of server list
+                                                    entries, by server */
+  uint8_t proxy_token_key[32];     /**< SipHash keys for stateless proxy
+                                        tokens, for the keystream and then
+                                        the MAC */
+  int proxy_token_key_set;         /**< set once proxy_token_key is random */
+  uint64_t proxy_token_nonce;      /**< the last stateless proxy token
+                                        nonce */
+  struct coap_proxy_parked_t *proxy_parked; /**< requests held until the
+                                                 server name resolves */
+#endif /* COAP_CLIENT_SUPPORT */
 #endif /* COAP_SERVER_SUPPORT */
   void *app;                       /**< application-specific data */
   uint32_t max_token_size;         /**< Largest token size supported RFC8974 */
+  struct coap_resolve_entry_t *resolve_cache; /**< hosts resolved, or being
+                                                   resolved, most recent
+                                                   first */
+  int resolve_fd[2];               /**< pipe that resolver threads wake the
+                                        I/O loop with, or -1 */
 #ifdef COAP_EPOLL_SUPPORT
   int epfd;                        /**< External FD for epoll */
   int eptimerfd;                   /**< Internal FD for timeout */
@@ -374,6 +428,20 @@ unsigned int coap_calc_timeout(coap_session_t *session, unsigned char r);
  */
 coap_mid_t coap_send_internal(coap_session_t *session, coap_pdu_t *pdu);
 
+#if COAP_CLIENT_SUPPORT
+/**
+ * Sends the request that checks whether the server of @p session takes
+ * tokens of session->max_token_size (RFC8974 2.2.2), without waiting for
+ * the outcome. session->max_token_checked is COAP_EXT_T_CHECKING until the
+ * response (or RST) comes in.
+ *
+ * @param session The client session.
+ *
+ * @return The message id of the request or @c COAP_INVALID_MID on error.
+ */
+coap_mid_t coap_send_test_extended_token(coap_session_t *session);
+#endif /* COAP_CLIENT_SUPPORT */
+
 /**
  * Delay the sending of the first client request until some other negotiation
  * has completed.
@@ -384,6 +452,172 @@ coap_mid_t coap_send_internal(coap_session_t *session, coap_pdu_t *pdu);
  */
 int coap_client_delay_first(coap_session_t *session);
 
+/**
+ * How long a host resolved by coap_resolve_address_info_cached() is held
+ * for, in seconds. getaddrinfo() does not give the TTL of the DNS records.
+ */
+#ifndef COAP_RESOLVE_CACHE_TTL
+#define COAP_RESOLVE_CACHE_TTL 60
+#endif /* COAP_RESOLVE_CACHE_TTL */
+
+/**
+ * How long a host that could not be resolved is held for, in seconds.
+ */
+#ifndef COAP_RESOLVE_CACHE_FAIL_TTL
+#define COAP_RESOLVE_CACHE_FAIL_TTL 5
+#endif /* COAP_RESOLVE_CACHE_FAIL_TTL */
+
+/**
+ * The most hosts held by the resolver cache of a context.
+ */
+#ifndef COAP_RESOLVE_CACHE_MAX
+#define COAP_RESOLVE_CACHE_MAX 16
+#endif /* COAP_RESOLVE_CACHE_MAX */
+
+/**
+ * The most worker threads looking up hosts at a time, shared by all the
+ * contexts.
+ */
+#ifndef COAP_RESOLVE_WORKERS
+#define COAP_RESOLVE_WORKERS 4
+#endif /* COAP_RESOLVE_WORKERS */
+
+/**
+ * The most hosts that the worker threads are resolving (or have queued) for
+ * a context. Looking up another host fails until one of them is done, so
+ * that names given by peers (such as in Proxy-Uri options) cannot tie up the
+ * workers, or fill the cache, with lookups.
+ */
+#ifndef COAP_RESOLVE_MAX_PENDING
+#define COAP_RESOLVE_MAX_PENDING 4
+#endif /* COAP_RESOLVE_MAX_PENDING */
+
+/**
+ * A handler waiting for a host in the resolver cache to be resolved.
+ */
+typedef struct coap_resolve_waiter_t {
+  struct coap_resolve_waiter_t *next; /**< in the entry's waiters */
+  coap_resolve_handler_t handler;     /**< to call once resolved */
+  void *app_data;                     /**< to pass to handler */
+  coap_addr_info_t *info_list;        /**< the copy of the addresses that
+                                           handler is to be given */
+} coap_resolve_waiter_t;
+
+/**
+ * A host in the resolver cache of a context.
+ */
+typedef struct coap_resolve_entry_t {
+  struct coap_resolve_entry_t *next; /**< in the context's resolve_cache */
+  struct coap_resolve_entry_t *next_queued; /**< in the worker queue */
+  coap_resolve_waiter_t *waiters;    /**< to call once resolved */
+  coap_addr_info_t *info_list;       /**< the addresses, or NULL if it
+                                          failed */
+  coap_tick_t expire;                /**< when to resolve it again */
+  int resolving;                     /**< set while queued for, or being
+                                          resolved by, the worker thread */
+  int prefer_family;                 /**< the address family to list first,
+                                          as it last won a connection race,
+                                          or 0 */
+  /* Set under the resolver mutex */
+  int running;                       /**< set once the worker has taken it
+                                          from the queue */
+  int done;                          /**< set once getaddrinfo() has
+                                          returned */
+  int abandoned;                     /**< set if the context has gone, so the
+                                          worker thread frees the entry */
+  int wake_fd;                       /**< the pipe to wake the I/O loop
+                                          with */
+  int error;                         /**< from getaddrinfo() */
+  struct addrinfo *res;              /**< from getaddrinfo() */
+  uint16_t port;                     /**< the unsecured port asked for */
+  uint16_t secure_port;              /**< the secured port asked for */
+  int ai_hints_flags;                /**< the getaddrinfo() hints asked for */
+  int scheme_hint_bits;              /**< the schemes asked for */
+  size_t host_length;                /**< length of host */
+  char host[1];                      /**< the host, NUL terminated */
+} coap_resolve_entry_t;
+
+/**
+ * Looks @p server up in the resolver cache of @p context, queueing it for
+ * the worker thread if it is not there. Without threads, or for an IP
+ * literal, it is resolved there and then.
+ *
+ * @param context  The context to resolve for.
+ * @param server   The Address to resolve.
+ * @param port     The unsecured protocol port to use.
+ * @param secure_port The secured protocol port to use.
+ * @param ai_hints_flags AI_* Hint flags to use for internal getaddrinfo().
+ * @param scheme_hint_bits Which schemes to return information for.
+ * @param handler  The handler to call when a resolution that is started
+ *                 is done, or @c NULL.
+ * @param app_data Application data to pass to @p handler.
+ * @param info_list Set to a copy of the addresses of a known @p server (to be
+ *                  freed by the caller), or @c NULL.
+ *
+ * @return @c 1 if @p server is known (@p info_list is @c NULL if it could not
+ *         be resolved), @c 0 if it is being resolved, @c -1 on error, or
+ *         @c -2 if COAP_RESOLVE_MAX_PENDING hosts are already being
+ *         resolved.
+ */
+int coap_resolve_address_info_cached(coap_context_t *context,
+                                     const coap_str_const_t *server,
+                                     uint16_t port,
+                                     uint16_t secure_port,
+                                     int ai_hints_flags,
+                                     int scheme_hint_bits,
+                                     coap_resolve_handler_t handler,
+                                     void *app_data,
+                                     coap_addr_info_t **info_list);
+
+/**
+ * Calls the handlers of the resolutions that helper threads have completed.
+ * This is called from the I/O loop when the threads wake it.
+ *
+ * @param context The context to check.
+ */
+void coap_resolve_check(coap_context_t *context);
+
+/**
+ * Frees the resolver cache of @p context. Resolutions that are still in
+ * progress are abandoned, without their handlers being called.
+ *
+ * @param context The context being freed.
+ */
+void coap_resolve_free(coap_context_t *context);
+
+/**
+ * Has the resolver worker thread exit once it has no more hosts to resolve.
+ * This is called by coap_cleanup().
+ */
+void coap_resolve_shutdown(void);
+
+/**
+ * Returns the other addresses that the host that @p server was resolved from
+ * (by coap_resolve_address_info_cached()) has, with the same port, for
+ * connecting to if @p server cannot be. The address families are
+ * interleaved, starting with the family that @p server is not.
+ *
+ * @param context The context holding the resolver cache.
+ * @param server  The address being connected to.
+ * @param count   Updated with the number of addresses returned.
+ *
+ * @return The addresses, to be freed with coap_free_type(COAP_STRING), or
+ *         @c NULL if there are none.
+ */
+coap_address_t *coap_resolve_cache_alternatives(coap_context_t *context,
+                                                const coap_address_t *server,
+                                                size_t *count);
+
+/**
+ * Records that @p connected won a connection race, so that the addresses of
+ * its family are listed first the next time its host is looked up.
+ *
+ * @param context   The context holding the resolver cache.
+ * @param connected The address connected to.
+ */
+void coap_resolve_cache_prefer(coap_context_t *context,
+                               const coap_address_t *connected);
+
 /** @} */
 
 #endif /* COAP_NET_INTERNAL_H_ */
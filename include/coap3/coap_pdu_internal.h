@@ -339,6 +339,54 @@ int coap_update_token(coap_pdu_t *pdu,
  */
 int coap_option_check_repeatable(coap_option_num_t number);
 
+/**
+ * A response whose options and payload are encoded once, so that it can be
+ * sent by copying it into a PDU with the type, MID and token of a request.
+ */
+typedef struct coap_pdu_template_t {
+  struct coap_pdu_template_t *next; /**< next in the list, if any */
+  coap_pdu_code_t code;  /**< response code */
+  uint16_t max_opt;      /**< highest option number in s */
+  size_t data_offset;    /**< offset of the payload in s, or 0 if none */
+  size_t length;         /**< length of s */
+  uint8_t s[1];          /**< the encoded options and payload */
+} coap_pdu_template_t;
+
+/**
+ * Creates a template from the options and payload of @p pdu. The token of
+ * @p pdu is not included.
+ *
+ * @param pdu The PDU to copy.
+ *
+ * @return The template, to be freed with coap_pdu_template_free(), or
+ *         @c NULL on error.
+ */
+coap_pdu_template_t *coap_pdu_template_new(const coap_pdu_t *pdu);
+
+/**
+ * Frees a template returned by coap_pdu_template_new().
+ *
+ * @param tmpl The template, or @c NULL.
+ */
+void coap_pdu_template_free(coap_pdu_template_t *tmpl);
+
+/**
+ * Creates a PDU from @p tmpl.
+ *
+ * @param tmpl     The template.
+ * @param type     The message type.
+ * @param mid      The message id.
+ * @param token    The token.
+ * @param max_size The maximum size of the PDU (as for coap_pdu_init()).
+ *
+ * @return The PDU or @c NULL on error, including if @p tmpl does not fit
+ *         in @p max_size.
+ */
+coap_pdu_t *coap_pdu_from_template(const coap_pdu_template_t *tmpl,
+                                   coap_pdu_type_t type, coap_mid_t mid,
+                                   const coap_bin_const_t *token,
+                                   size_t max_size);
+
 /** @} */
 
 #endif /* COAP_COAP_PDU_INTERNAL_H_ */
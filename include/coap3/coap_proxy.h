@@ -0,0 +1,169 @@
+/*
+ * coap_proxy.h -- helper functions for proxy handling
+ *
+ * Copyright (C) 2023 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_proxy.h
+ * @brief Helper functions for proxy handling
+ */
+
+#ifndef COAP_PROXY_H_
+#define COAP_PROXY_H_
+
+#include "coap_address.h"
+#include "coap_dtls.h"
+#include "coap_uri.h"
+
+/**
+ * @ingroup application_api
+ * @defgroup coap_proxy Proxy Support
+ * API for forwarding requests received by a proxy to upstream servers.
+ * The upstream client sessions are kept in a pool, keyed by scheme, host
+ * and port, and shared by all the requests being forwarded to the same
+ * server.
+ * @{
+ */
+
+/**
+ * An upstream server.
+ */
+typedef struct coap_proxy_server_t {
+  coap_uri_t uri;              /**< scheme, host and port of the server */
+  coap_dtls_pki_t *dtls_pki;   /**< PKI setup for coaps and coaps+tcp, or
+                                    NULL */
+  coap_dtls_cpsk_t *dtls_cpsk; /**< PSK setup for coaps and coaps+tcp, or
+                                    NULL */
+} coap_proxy_server_t;
+
+/**
+ * The kind of proxy.
+ */
+typedef enum coap_proxy_t {
+  COAP_PROXY_FORWARD,    /**< requests name the server with a Proxy-Uri or
+                              Proxy-Scheme option */
+  COAP_PROXY_REVERSE     /**< requests are for the proxy itself, and are
+                              passed on to one of the entries */
+} coap_proxy_t;
+
+/**
+ * How a request is given to one of the entries of a server list.
+ */
+typedef enum coap_proxy_lb_t {
+  COAP_PROXY_LB_ROUND_ROBIN, /**< each entry in turn */
+  COAP_PROXY_LB_HASH_PATH,   /**< by hashing the Uri-Path, so that all the
+                                  requests for a resource go to one entry */
+  COAP_PROXY_LB_HASH_CLIENT  /**< by hashing the client address, so that all
+                                  the requests of a client go to one entry */
+} coap_proxy_lb_t;
+
+/**
+ * The smallest (RFC 8974 extended) token size that a stateless proxy uses
+ * upstream, which coap_context_set_max_token_size() needs to allow. The
+ * downstream Uri-Path, Uri-Query, ETag, Block2 and Request-Tag options are
+ * carried too, so more allows for longer URIs.
+ */
+#define COAP_PROXY_STATELESS_TOKEN_SIZE 68
+
+/**
+ * Where and how coap_proxy_forward_request() forwards requests.
+ *
+ * The list is referenced while requests are being forwarded and its entries
+ * are health checked, so needs to remain valid for the life of the context.
+ */
+typedef struct coap_proxy_server_list_t {
+  coap_proxy_server_t *entry;     /**< next-hop proxies or (for a reverse
+                                       proxy) servers to send all requests
+                                       to, or NULL to send each request to
+                                       the server it names */
+  size_t entry_count;             /**< number of entries */
+  size_t next_entry;              /**< entry to use next, internally updated
+                                       to share requests between entries */
+  coap_proxy_t type;              /**< forward or reverse proxy */
+  coap_proxy_lb_t lb;             /**< how requests are shared between the
+                                       entries */
+  coap_dtls_pki_t *dtls_pki;      /**< PKI setup for coaps and coaps+tcp
+                                       servers named by requests, or NULL */
+  coap_dtls_cpsk_t *dtls_cpsk;    /**< PSK setup for coaps and coaps+tcp
+                                       servers named by requests, or NULL */
+  unsigned int idle_timeout_secs; /**< close upstream sessions with no
+                                       requests outstanding after this long,
+                                       or 0 to keep them */
+  unsigned int health_check_secs; /**< how often to ping each entry, or 0 to
+                                       only mark entries as down when
+                                       requests to them fail */
+  int cache_responses;            /**< if set, responses are held in the
+                                       cache (see coap_cache_add_response())
+                                       for their Max-Age and used to answer
+                                       the same requests */
+  int stateless;                  /**< if set, requests are forwarded over
+                                       UDP and DTLS without keeping any
+                                       state, what is needed to relay the
+                                       response being carried in the
+                                       upstream token */
+} coap_proxy_server_list_t;
+
+/**
+ * Returns @c 1 if libcoap was built with proxy support (which needs both
+ * client and server support), @c 0 otherwise.
+ */
+int coap_proxy_is_supported(void);
+
+/**
+ * Forwards @p request, received on the Proxy-Uri resource @p resource (see
+ * coap_resource_proxy_uri_init2()), to the upstream server named by its
+ * Proxy-Uri or Proxy-Scheme option (or to a next hop in @p server_list).
+ * For a COAP_PROXY_REVERSE @p server_list, @p request is instead received on
+ * any resource (such as the unknown resource) and sent to one of the
+ * entries. The upstream session is taken from the pool, or created.
+ *
+ * Entries that fail to respond, or to health check pings, are marked as down
+ * and are not used until they recover, and idempotent requests that fail are
+ * sent again to another entry.
+ *
+ * Upstream responses are relayed by libcoap as separate responses, and are
+ * not passed to the response handler. Concurrent identical requests are
+ * coalesced into one upstream request (see coap_cache_flight_join()). If
+ * the upstream server does not respond, or the upstream session fails, a
+ * 5.04 (Gateway Timeout) or 5.02 (Bad Gateway) response is sent.
+ *
+ * If @p resource is observable, observations are relayed, with all the
+ * downstream observers of a representation sharing one upstream observation.
+ *
+ * For a stateless @p server_list, requests on the Proxy-Uri or unknown
+ * resource are forwarded with an upstream token that holds the downstream
+ * client address, token and options, encrypted and authenticated by a MAC, so
+ * that the proxy keeps nothing for them. The upstream servers need to take
+ * extended tokens of at least COAP_PROXY_STATELESS_TOKEN_SIZE, which is
+ * checked (RFC 8974 2.2.2) when the upstream session is set up, requests
+ * being forwarded with state until it has been.
+ *
+ * This should be called from the request handler of @p resource, with the
+ * parameters the handler is given.
+ *
+ * @param session     The session @p request was received on.
+ * @param request     The request.
+ * @param response    The response being set up by the request handler. It
+ *                    is left empty if the request is forwarded, else
+ *                    completed (from the cache, or with an error code).
+ * @param resource    The Proxy-Uri (or reverse proxied) resource.
+ * @param server_list Where and how to forward the request.
+ *
+ * @return @c 1 if @p request was forwarded or answered from the cache, or
+ *         @c 0 if @p response has an error code.
+ */
+int coap_proxy_forward_request(coap_session_t *session,
+                               const coap_pdu_t *request,
+                               coap_pdu_t *response,
+                               coap_resource_t *resource,
+                               coap_proxy_server_list_t *server_list);
+
+/** @} */
+
+#endif /* COAP_PROXY_H_ */
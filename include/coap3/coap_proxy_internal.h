@@ -0,0 +1,260 @@
+/*
+ * coap_proxy_internal.h -- Proxy functions for libcoap
+ *
+ * Copyright (C) 2023 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_proxy_internal.h
+ * @brief CoAP Proxy internal information
+ */
+
+#ifndef COAP_PROXY_INTERNAL_H_
+#define COAP_PROXY_INTERNAL_H_
+
+#include "coap_internal.h"
+#include "coap_uthash_internal.h"
+
+#if COAP_SERVER_SUPPORT && COAP_CLIENT_SUPPORT
+
+/**
+ * @ingroup internal_api
+ * @defgroup coap_proxy_internal Proxy Support
+ * Internal API for forwarding requests to upstream servers.
+ * @{
+ */
+
+/**
+ * How long a forwarded request waits for its upstream response before the
+ * downstream client is sent a 5.04 (Gateway Timeout), in seconds. This is
+ * NON_LIFETIME (RFC 7252 4.8.2) with the default transmission parameters,
+ * as CON requests are failed sooner when their retransmissions run out.
+ */
+#ifndef COAP_PROXY_REQ_LIFETIME
+#define COAP_PROXY_REQ_LIFETIME 145
+#endif /* COAP_PROXY_REQ_LIFETIME */
+
+/**
+ * The number of failures in a row (of forwarded requests or health check
+ * pings) after which a server list entry is marked as down.
+ */
+#ifndef COAP_PROXY_BACKEND_MAX_FAILS
+#define COAP_PROXY_BACKEND_MAX_FAILS 1
+#endif /* COAP_PROXY_BACKEND_MAX_FAILS */
+
+/**
+ * How long an entry that is down is avoided when it is not health checked,
+ * in seconds. It is then tried again with the next request.
+ */
+#ifndef COAP_PROXY_BACKEND_RETRY
+#define COAP_PROXY_BACKEND_RETRY 30
+#endif /* COAP_PROXY_BACKEND_RETRY */
+
+/**
+ * A pooled upstream session.
+ */
+typedef struct coap_proxy_upstream_t {
+  UT_hash_handle hh;        /**< in the context's proxy_upstreams */
+  coap_session_t *session;  /**< the referenced client session */
+  coap_tick_t last_used;    /**< when a request was last sent or answered */
+  unsigned int pending;     /**< forwarded requests awaiting a response */
+  unsigned int idle_timeout_secs; /**< close when idle this long, or 0 */
+  char client_sni[256];     /**< SNI sent to the server, if not set by the
+                                 (D)TLS setup */
+  size_t key_length;        /**< length of key */
+  uint8_t key[1];           /**< scheme, port and host */
+} coap_proxy_upstream_t;
+
+/**
+ * The health of a server list entry.
+ */
+typedef struct coap_proxy_backend_t {
+  UT_hash_handle hh;                     /**< in the context's
+                                              proxy_backends */
+  coap_proxy_server_list_t *server_list; /**< the list server is in */
+  coap_proxy_server_t *server;           /**< the entry */
+  unsigned int fails;                    /**< failures in a row */
+  int down;                              /**< set if the entry is not to be
+                                              used */
+  coap_tick_t retry_at;                  /**< when to try a down entry again
+                                              if there are no health checks */
+  coap_tick_t next_check;                /**< when to next health check */
+  coap_tick_t check_sent;                /**< when the outstanding health check
+                                              started, or 0 */
+  int ping_sent;                         /**< set if a ping was sent for the
+                                              outstanding health check */
+  size_t key_length;                     /**< length of key */
+  uint8_t key[1];                        /**< scheme, port and host, as for
+                                              the upstream pool */
+} coap_proxy_backend_t;
+
+/**
+ * Identifies a forwarded request by its upstream session and token.
+ */
+typedef struct coap_proxy_req_key_t {
+  coap_session_t *upstream;  /**< the upstream session */
+  size_t token_length;       /**< length of token */
+  uint8_t token[8];          /**< the token used upstream */
+} coap_proxy_req_key_t;
+
+/**
+ * A request forwarded upstream and awaiting its response. A request that
+ * registers an observation is kept while the observation lasts, relaying
+ * each notification to all the downstream observers of the same
+ * representation.
+ */
+typedef struct coap_proxy_req_t {
+  UT_hash_handle hh;               /**< in the context's proxy_reqs */
+  UT_hash_handle hh_observe;       /**< in the context's proxy_observes
+                                        (or proxy_ended_observes once
+                                        ended), if is_observe is set */
+  coap_proxy_req_key_t key;        /**< upstream session and token */
+  coap_proxy_upstream_t *upstream; /**< the pool entry of key.upstream */
+  coap_session_t *incoming;        /**< the referenced downstream session */
+  coap_pdu_t *request;             /**< the downstream request (without
+                                        any payload) */
+  coap_cache_body_t *body;         /**< the request body, or NULL */
+  coap_proxy_server_list_t *server_list; /**< how the request is forwarded */
+  coap_proxy_server_t *server;     /**< the entry of server_list used, or
+                                        NULL for a server named by the
+                                        request */
+  coap_proxy_backend_t *backend;   /**< the health of server, or NULL */
+  unsigned int retries;            /**< times sent again to another entry */
+  coap_resource_t *resource;       /**< the Proxy-Uri resource */
+  coap_cache_key_t *cache_key;     /**< identifies the request for the
+                                        cache, or NULL */
+  int is_flight;                   /**< set if identical requests are
+                                        waiting on cache_key */
+  int cache_responses;             /**< set if the response is to be held
+                                        in the cache */
+  coap_tick_t expire;              /**< when to give up on the response */
+  int is_observe;                  /**< set if relaying an observation */
+  int observing;                   /**< set once the upstream server has
+                                        taken on the observation */
+  int ended;                       /**< set once the observation has ended
+                                        (and req is not in proxy_reqs) */
+  coap_cache_key_t observe_key;    /**< notify key of the downstream
+                                        observers */
+  coap_pdu_t *latest;              /**< the last upstream notification, or
+                                        NULL */
+  coap_cache_body_t *latest_body;  /**< the body of latest, or NULL */
+} coap_proxy_req_t;
+
+/**
+ * A request held until the name of the server it is going to has been
+ * resolved, when it is forwarded again.
+ */
+typedef struct coap_proxy_parked_t {
+  struct coap_proxy_parked_t *next; /**< in the context's proxy_parked */
+  coap_session_t *incoming;        /**< the referenced downstream session */
+  coap_pdu_t *request;             /**< the downstream request, its body
+                                        (if any) being body */
+  coap_cache_body_t *body;         /**< the request body, or NULL */
+  coap_resource_t *resource;       /**< the Proxy-Uri resource */
+  coap_proxy_server_list_t *server_list; /**< how the request is forwarded */
+} coap_proxy_parked_t;
+
+/**
+ * Relays a response to a request forwarded upstream by
+ * coap_proxy_forward_request() to the downstream client.
+ *
+ * @param session  The upstream session.
+ * @param received The response.
+ *
+ * @return COAP_RESPONSE_OK, or COAP_RESPONSE_FAIL if @p received is not for
+ *         a forwarded request.
+ */
+coap_response_t coap_proxy_forward_response(coap_session_t *session,
+                                            const coap_pdu_t *received);
+
+/**
+ * Authenticates the stateless upstream token of @p pdu, which is a request
+ * forwarded statelessly by coap_proxy_forward_request() or its response, and
+ * recovers the downstream request (code, type, token and the options the
+ * response is built from) and the session it came in on.
+ *
+ * @param context  The context.
+ * @param pdu      The PDU with the token.
+ * @param now      The current time, for the token to not have expired.
+ * @param request  Set to the downstream request, which the caller needs to
+ *                 delete with coap_delete_pdu().
+ * @param resource Set to the resource the request was received on.
+ *
+ * @return The downstream session, or @c NULL if the token is not valid, has
+ *         expired, or the downstream session has gone.
+ */
+coap_session_t *coap_proxy_stateless_decode(coap_context_t *context,
+                                            const coap_pdu_t *pdu,
+                                            coap_tick_t now,
+                                            coap_pdu_t **request,
+                                            coap_resource_t **resource);
+
+/**
+ * Handles a request forwarded upstream that was not acknowledged, or was
+ * rejected with a RST. The server list entry it was sent to is marked as
+ * failing, and the request is sent to another entry if it is idempotent.
+ * Otherwise the downstream client is sent a 5.04 (Gateway Timeout) or 5.02
+ * (Bad Gateway) response.
+ *
+ * @param session The upstream session.
+ * @param sent    The request, with the token it was given by
+ *                coap_proxy_forward_request().
+ * @param reason  Why the request failed.
+ */
+void coap_proxy_upstream_nack(coap_session_t *session,
+                              const coap_pdu_t *sent,
+                              coap_nack_reason_t reason);
+
+/**
+ * Handles the requests forwarded over an upstream session that has failed,
+ * as for coap_proxy_upstream_nack(), sending a 5.02 (Bad Gateway) response
+ * for those that are not sent again. The session is dropped from the pool
+ * the next time it is looked up.
+ *
+ * @param session The upstream session.
+ */
+void coap_proxy_upstream_disconnected(coap_session_t *session);
+
+/**
+ * Health checks the server list entries that have been used, pinging those
+ * whose list has health_check_secs set, and marks them as up or down.
+ *
+ * @param context The context.
+ * @param now     The current time.
+ *
+ * @return The time until the next check is due, or @c 0 if there are none.
+ */
+coap_tick_t coap_proxy_check_backends(coap_context_t *context, coap_tick_t now);
+
+/**
+ * Handles forwarded requests that have waited too long as failures, drops
+ * relayed observations that have ended or have no observers left, and closes
+ * upstream sessions that have failed or been idle for the idle_timeout_secs
+ * of the server list they were last used for.
+ *
+ * @param context The context.
+ * @param now     The current time.
+ *
+ * @return The time until the next check is due, or @c 0 if there are none.
+ */
+coap_tick_t coap_proxy_check_timeouts(coap_context_t *context,
+                                      coap_tick_t now);
+
+/**
+ * Drops the forwarded and held requests, pooled upstream sessions and health
+ * records of @p context.
+ *
+ * @param context The context.
+ */
+void coap_delete_proxy(coap_context_t *context);
+
+/** @} */
+
+#endif /* COAP_SERVER_SUPPORT && COAP_CLIENT_SUPPORT */
+
+#endif /* COAP_PROXY_INTERNAL_H_ */
@@ -36,6 +36,15 @@
 #define COAP_RESOURCE_MAX_SUBSCRIBER 0
 #endif /* COAP_RESOURCE_MAX_SUBSCRIBER */
 
+/**
+ * Limits the number of representations (for different Uri-Query, Accept
+ * etc.) that each resource with COAP_RESOURCE_FLAGS_CACHE_REPRESENTATION
+ * keeps.
+ */
+#ifndef COAP_RESOURCE_MAX_REPRESENTATIONS
+#define COAP_RESOURCE_MAX_REPRESENTATIONS 8
+#endif /* COAP_RESOURCE_MAX_REPRESENTATIONS */
+
 /**
 * Abstraction of attribute associated with a resource.
 */
@@ -46,6 +55,47 @@ struct coap_attr_t {
   int flags;
 };
 
+/**
+ * A node of the trie of Uri-Path segments that incoming requests are routed
+ * through.
+ */
+typedef struct coap_uri_node_t {
+  UT_hash_handle hh;                 /**< in the parent's children */
+  struct coap_uri_node_t *children;  /**< child nodes, by exact segment */
+  struct coap_uri_node_t *param;     /**< child node for any one segment */
+  coap_resource_t *resource;         /**< resource whose path ends here */
+  coap_resource_t *prefix;           /**< resource for this path followed
+                                          by any remaining segments */
+  size_t seg_length;                 /**< length of seg */
+  uint8_t seg[1];                    /**< the (decoded) segment */
+} coap_uri_node_t;
+
+/**
+ * The rendered unfiltered .well-known/core document. It is shared by all
+ * the responses in progress, and kept until a resource or attribute change
+ * invalidates it.
+ */
+typedef struct coap_wkc_cache_t {
+  unsigned int ref;  /**< the context plus each response in progress */
+  uint64_t etag;     /**< ETag for the document */
+  size_t length;     /**< length of s */
+  uint8_t s[1];      /**< the document */
+} coap_wkc_cache_t;
+
+/**
+ * An entry of the index of link attribute values (or the individual values
+ * of the rt, if and rel attributes) to the resources that have them.
+ */
+typedef struct coap_wkc_index_t {
+  UT_hash_handle hh;
+  coap_resource_t **resources; /**< matching resources, in the order of
+                                    coap_context_t resources */
+  size_t count;                /**< used entries of resources */
+  size_t size;                 /**< allocated entries of resources */
+  size_t key_length;           /**< length of key */
+  uint8_t key[1];              /**< attribute name '=' value */
+} coap_wkc_index_t;
+
 /**
 * Abstraction of resource that can be attached to coap_context_t.
 * The key is uri_path.
@@ -58,6 +108,7 @@ struct coap_resource_t {
   unsigned int cacheable:1;      /**< can be cached */
   unsigned int is_unknown:1;     /**< resource created for unknown handler */
   unsigned int is_proxy_uri:1;   /**< resource created for proxy URI handler */
+  unsigned int is_template:1;    /**< uri_path has {name} or * segments */
 
   /**
    * Used to store handlers for the seven coap methods @c GET, @c POST, @c PUT,
@@ -67,11 +118,23 @@ struct coap_resource_t {
    * response if no handler is available.
    */
   coap_method_handler_t handler[7];
+  coap_block1_sink_t block1_sink; /**< consumer of large request bodies */
+  struct coap_file_res_t *file;   /**< file served by
+                                       coap_resource_file_init() */
+  struct coap_rep_t *reps;        /**< kept GET/FETCH responses, see
+                          COAP_RESOURCE_FLAGS_CACHE_REPRESENTATION */
+  /** pre-encoded responses for each method, see
+      coap_resource_set_response_template() */
+  struct coap_pdu_template_t *response_template[7];
 
   UT_hash_handle hh;
 
   coap_attr_t *link_attr; /**< attributes to be included with the link format */
   coap_subscription_t *subscribers;  /**< list of observers for this resource */
+  coap_subscription_t *subscriber_hash; /**< subscribers indexed by session
+                                             and token */
+  struct coap_notify_group_t *notify_groups; /**< subscribers grouped by
+                                                  notify key */
 
   /**
    * Request URI Path for this resource. This field will point into static
@@ -132,6 +195,78 @@ void coap_delete_all_resources(coap_context_t *context);
     HASH_FIND(hh, (r), (k)->s, (k)->length, (res)); \
   }
 
+/**
+ * Finds the resource that the Uri-Path options of @p pdu route to. An exact
+ * path takes priority over a template segment, which takes priority over a
+ * prefix resource.
+ *
+ * @param context The context holding the resources.
+ * @param pdu     The request.
+ *
+ * @return The resource or @c NULL if none matches.
+ */
+coap_resource_t *coap_resource_match(coap_context_t *context,
+                                     const coap_pdu_t *pdu);
+
+/**
+ * A response kept by a resource to be sent again, see
+ * COAP_RESOURCE_FLAGS_CACHE_REPRESENTATION.
+ */
+typedef struct coap_rep_t coap_rep_t;
+
+/**
+ * Builds the response to a GET or FETCH @p request from the representations
+ * kept by @p resource, so that the handler need not be called. If the request
+ * has the ETag of the representation, the response is a 2.03 (Valid).
+ *
+ * @param resource The resource with COAP_RESOURCE_FLAGS_CACHE_REPRESENTATION.
+ * @param session  The session the request came in on.
+ * @param request  The request.
+ * @param response The response set up for the handler, whose token, type and
+ *                 MID are used.
+ *
+ * @return The response to send instead of @p response, or @c NULL if the
+ *         handler needs to be called.
+ */
+coap_pdu_t *coap_resource_rep_respond(coap_resource_t *resource,
+                                      coap_session_t *session,
+                                      const coap_pdu_t *request,
+                                      const coap_pdu_t *response);
+
+/**
+ * Keeps the 2.05 response the handler built for a GET or FETCH @p request,
+ * adding an ETag (a hash of the body) if the handler did not. A successful
+ * response to any other method drops the kept representations, as the
+ * resource may have changed.
+ *
+ * @param resource The resource with COAP_RESOURCE_FLAGS_CACHE_REPRESENTATION.
+ * @param session  The session the request came in on.
+ * @param request  The request.
+ * @param query    The Uri-Query of @p request, or @c NULL.
+ * @param response The response built by the handler.
+ */
+void coap_resource_rep_update(coap_resource_t *resource,
+                              coap_session_t *session,
+                              const coap_pdu_t *request,
+                              const coap_string_t *query,
+                              coap_pdu_t *response);
+
+/**
+ * Drops the representations kept by @p resource.
+ *
+ * @param resource The resource.
+ */
+void coap_resource_rep_invalidate(coap_resource_t *resource);
+
+/**
+ * Stops watching the file served by a coap_resource_file_init() resource
+ * with inotify, so that changes are found by stat() instead.  Used by the
+ * unit tests.
+ *
+ * @param resource The resource.
+ */
+void coap_resource_file_unwatch(coap_resource_t *resource);
+
 /**
  * Deletes an attribute.
  * Note: This is for internal use only, as it is not deleted from its chain.
@@ -141,11 +276,64 @@ void coap_delete_all_resources(coap_context_t *context);
  */
 void coap_delete_attr(coap_attr_t *attr);
 
+/**
+ * Gets the unfiltered .well-known/core document of @p context, rendering it
+ * if it is not already cached. The caller must release the returned
+ * reference with coap_wkc_cache_release().
+ *
+ * @param context    The context holding the resources.
+ * @param media_type COAP_MEDIATYPE_APPLICATION_LINK_FORMAT or
+ *                   COAP_MEDIATYPE_APPLICATION_LINK_FORMAT_CBOR.
+ *
+ * @return The document or @c NULL on error.
+ */
+coap_wkc_cache_t *coap_wkc_cache_get(coap_context_t *context,
+                                     uint16_t media_type);
+
+/**
+ * Releases a reference to a document returned by coap_wkc_cache_get().
+ * Suitable for use as a coap_release_large_data_t.
+ *
+ * @param session Not used.
+ * @param app_ptr The coap_wkc_cache_t.
+ */
+void coap_wkc_cache_release(coap_session_t *session, void *app_ptr);
+
+/**
+ * Drops the cached .well-known/core document and attribute index, as a
+ * resource or its link attributes have changed.
+ *
+ * @param context The context holding the resources.
+ */
+void coap_wkc_invalidate(coap_context_t *context);
+
 coap_print_status_t coap_print_wellknown(coap_context_t *,
                                          unsigned char *,
                                          size_t *, size_t,
                                          const coap_string_t *);
 
+/**
+ * Encodes the links to the resources of @p context that pass
+ * @p query_filter as application/link-format+cbor: an array with a map for
+ * each link, keyed by the integers registered for the common attribute names
+ * and by the text of any other names. If @p buf is too small for all the
+ * links, only the leading links that fit in whole are encoded, so the array
+ * is always well formed.
+ *
+ * @param context      The context holding the resources.
+ * @param buf          The buffer to write to, or @c NULL to only get the
+ *                     length needed.
+ * @param buflen       The size of @p buf, updated with the length of the
+ *                     encoding.
+ * @param query_filter The query filter, or @c NULL.
+ *
+ * @return @c 1 on success, or @c 0 if @p buf cannot even hold an empty
+ *         array.
+ */
+int coap_print_wellknown_cbor(coap_context_t *context, uint8_t *buf,
+                              size_t *buflen,
+                              const coap_string_t *query_filter);
+
 /** @} */
 
 #endif /* COAP_SERVER_SUPPORT */
@@ -605,6 +605,47 @@ void coap_session_set_probing_rate(coap_session_t *session, uint32_t value);
 */
 uint32_t coap_session_get_probing_rate(const coap_session_t *session);
 
+/**
+ * Adaptive retransmission timeout (RTO) modes, based on the CoCoA
+ * (draft-ietf-core-cocoa) strong and weak RTT estimators.
+ *
+ * Configurable using coap_context_set_rtt_estimation()
+ */
+typedef enum coap_rtt_estimation_t {
+  COAP_RTT_ESTIMATION_NONE = 0, /**< RTO is derived from ack_timeout only
+                                     (RFC7252, the default) */
+  COAP_RTT_ESTIMATION_SESSION,  /**< RTO estimated for each session */
+  COAP_RTT_ESTIMATION_SHARED,   /**< RTO estimated for each remote IP address
+                                     and shared by all the sessions to it */
+} coap_rtt_estimation_t;
+
+/**
+ * The current state of the RTT estimator used by a session.  All times are
+ * in coap_tick_t ticks.
+ */
+typedef struct coap_rtt_info_t {
+  coap_tick_t rto;             /**< Current overall RTO */
+  coap_tick_t srtt_strong;     /**< Strong estimator smoothed RTT */
+  coap_tick_t rttvar_strong;   /**< Strong estimator RTT variation */
+  coap_tick_t srtt_weak;       /**< Weak estimator smoothed RTT */
+  coap_tick_t rttvar_weak;     /**< Weak estimator RTT variation */
+  uint32_t strong_samples;     /**< Number of strong RTT samples taken */
+  uint32_t weak_samples;       /**< Number of weak RTT samples taken */
+  uint32_t shared;             /**< Number of sessions using this estimator */
+} coap_rtt_info_t;
+
+/**
+ * Get the current state of the RTT estimator used by the @p session.
+ *
+ * @param session The CoAP session.
+ * @param info    Updated with the RTT estimator information.
+ *
+ * @return @c 1 if the session has an RTT estimator, else @c 0 (and
+ *         coap_session_get_ack_timeout() is used for the RTO).
+ */
+int coap_session_get_rtt_info(const coap_session_t *session,
+                              coap_rtt_info_t *info);
+
       /** @} */
 /**
  * Send a ping message for the session.
@@ -621,4 +662,67 @@ coap_mid_t coap_session_send_ping(coap_session_t *session);
  */
 void coap_session_set_no_observe_cancel(coap_session_t *session);
 
+/**
+ * @ingroup application_api
+ * @defgroup stats Traffic Statistics
+ * API for reading the traffic counters of Sessions, Endpoints and Contexts
+ * @{
+ */
+
+/**
+ * Traffic counters.  The counters are maintained for each session, for each
+ * server endpoint (totals of its sessions) and for each context (totals of
+ * all sessions).  All counters only ever increase.
+ */
+typedef struct coap_stats_t {
+  uint64_t pdus_sent;          /**< PDUs sent, including retransmissions */
+  uint64_t bytes_sent;         /**< CoAP bytes sent (excluding any (D)TLS
+                                    or transport overhead) */
+  uint64_t pdus_received;      /**< PDUs received */
+  uint64_t bytes_received;     /**< CoAP bytes received (excluding any (D)TLS
+                                    or transport overhead) */
+  uint64_t retransmits;        /**< Confirmable PDUs retransmitted */
+  uint64_t retransmit_failed;  /**< Confirmable PDUs given up on after
+                                    MAX_RETRANSMIT retransmissions */
+  uint64_t duplicates;         /**< Duplicate PDUs received (and not
+                                    processed again) */
+  uint64_t bad_pdus;           /**< Received PDUs that were malformed or
+                                    rejected */
+  uint64_t handshake_dropped;  /**< Incoming packets (server) dropped as
+                                    max_handshake_sessions was exceeded */
+} coap_stats_t;
+
+/**
+ * Get the traffic counters for the @p session.
+ *
+ * @param session The CoAP session.
+ * @param stats   Updated with the session traffic counters.
+ */
+void coap_session_get_stats(const coap_session_t *session,
+                            coap_stats_t *stats);
+
+/**
+ * Get the traffic counters for the server @p endpoint. These are the totals
+ * of all the sessions that have used the endpoint, including those since
+ * closed.
+ *
+ * @param endpoint The CoAP endpoint.
+ * @param stats    Updated with the endpoint traffic counters.
+ */
+void coap_endpoint_get_stats(const coap_endpoint_t *endpoint,
+                             coap_stats_t *stats);
+
+/**
+ * Get the traffic counters for the @p context. These are the totals of all
+ * the client and server sessions that have used the context, including those
+ * since closed.
+ *
+ * @param context The CoAP context.
+ * @param stats   Updated with the context traffic counters.
+ */
+void coap_context_get_stats(const coap_context_t *context,
+                            coap_stats_t *stats);
+
+/** @} */
+
 #endif  /* COAP_SESSION_H */
@@ -25,6 +25,32 @@
 #define COAP_PARTIAL_SESSION_TIMEOUT_TICKS (30 * COAP_TICKS_PER_SECOND)
 #define COAP_DEFAULT_MAX_HANDSHAKE_SESSIONS 100
 
+/*
+ * Client TCP sessions race connections to the other addresses of the
+ * server's host (RFC8305), where these are known.
+ */
+#if COAP_CLIENT_SUPPORT && !COAP_DISABLE_TCP && !defined(WITH_LWIP) && \
+    !defined(WITH_CONTIKI)
+#define COAP_CONNECT_RACE 1
+#else /* ! (COAP_CLIENT_SUPPORT && !COAP_DISABLE_TCP && ...) */
+#define COAP_CONNECT_RACE 0
+#endif /* ! (COAP_CLIENT_SUPPORT && !COAP_DISABLE_TCP && ...) */
+
+/**
+ * How long to wait for a connection attempt, in milliseconds, before also
+ * trying the next address (the Connection Attempt Delay of RFC8305 5).
+ */
+#ifndef COAP_CONNECT_ATTEMPT_DELAY
+#define COAP_CONNECT_ATTEMPT_DELAY 250
+#endif /* COAP_CONNECT_ATTEMPT_DELAY */
+
+/**
+ * The most connection attempts raced against that of the session socket.
+ */
+#ifndef COAP_CONNECT_RACE_MAX
+#define COAP_CONNECT_RACE_MAX 3
+#endif /* COAP_CONNECT_RACE_MAX */
+
 /**
  * @ingroup internal_api
  * @defgroup session_internal Sessions
@@ -60,6 +86,25 @@ typedef enum coap_ext_token_check_t {
   COAP_EXT_T_CHECKING,        /**< Token size check request sent */
 } coap_ext_token_check_t;
 
+/**
+ * CoCoA style RTT estimator state.  Held by one session, or shared by all the
+ * sessions to the same remote IP address (COAP_RTT_ESTIMATION_SHARED).
+ * All times are in coap_tick_t ticks.
+ */
+struct coap_rtt_estimator_t {
+  struct coap_rtt_estimator_t *next;
+  coap_address_t remote;          /**< remote address (port ignored) */
+  unsigned int ref;               /**< number of sessions using this */
+  coap_tick_t rto;                /**< overall RTO */
+  coap_tick_t srtt_strong;        /**< strong estimator smoothed RTT */
+  coap_tick_t rttvar_strong;      /**< strong estimator RTT variation */
+  coap_tick_t srtt_weak;          /**< weak estimator smoothed RTT */
+  coap_tick_t rttvar_weak;        /**< weak estimator RTT variation */
+  coap_tick_t last_update;        /**< when rto was last updated or aged */
+  uint32_t strong_samples;        /**< number of strong RTT samples */
+  uint32_t weak_samples;          /**< number of weak RTT samples */
+};
+
 /**
  * Abstraction of virtual session that can be attached to coap_context_t
  * (client) or coap_endpoint_t (server).
@@ -93,15 +138,50 @@ struct coap_session_t {
   coap_queue_t *delayqueue;         /**< list of delayed messages waiting to
                                          be sent */
   coap_lg_xmit_t *lg_xmit;          /**< list of large transmissions */
+  coap_lg_xmit_t *lg_xmit_hash;     /**< lg_xmit indexed by state token
+                                         (requests) or response key */
+  coap_lg_xmit_t *lg_xmit_app;      /**< lg_xmit requests indexed by app
+                                         token */
+  coap_lg_xmit_t *lg_xmit_dirty;    /**< lg_xmit changed since the last
+                                         timeout check */
+  coap_tick_t lg_xmit_due;          /**< Earliest lg_xmit timeout, 0 if
+                                         unknown */
 #if COAP_CLIENT_SUPPORT
   coap_lg_crcv_t *lg_crcv;       /**< Client list of expected large receives */
+  coap_lg_crcv_t *lg_crcv_hash;  /**< lg_crcv indexed by state token */
+  coap_lg_crcv_t *lg_crcv_app;   /**< lg_crcv indexed by app token */
+  coap_lg_crcv_t *lg_crcv_dirty; /**< lg_crcv changed since the last timeout
+                                      check */
+  coap_tick_t lg_crcv_due;       /**< Earliest lg_crcv timeout, 0 if unknown */
+  uint8_t proxy_upstream;        /**< Set if pooled by the proxy, so that
+                                      responses are relayed downstream */
+  struct coap_connect_race_t *connect_race; /**< connection attempts to the
+                                                 other addresses of the
+                                                 server, or NULL */
 #endif /* COAP_CLIENT_SUPPORT */
 #if COAP_SERVER_SUPPORT
   coap_lg_srcv_t *lg_srcv;       /**< Server list of expected large receives */
+  coap_lg_srcv_t *lg_srcv_hash;  /**< lg_srcv indexed by resource + RTag */
+  coap_lg_srcv_t *lg_srcv_path;  /**< lg_srcv indexed by uri_path + RTag */
+  coap_lg_srcv_t *lg_srcv_dirty; /**< lg_srcv changed since the last timeout
+                                      check */
+  coap_tick_t lg_srcv_due;       /**< Earliest lg_srcv timeout, 0 if unknown */
+  coap_subscription_t *subscriptions; /**< Observe subscriptions held by
+                                           this session */
+  coap_subscription_t *subscription_keys; /**< subscriptions indexed by
+                                               cache_key */
 #endif /* COAP_SERVER_SUPPORT */
   size_t partial_write;             /**< if > 0 indicates number of bytes
                                          already written from the pdu at the
                                          head of sendqueue */
+  uint8_t *write_buf;               /**< reliable output buffer for coalescing
+                                         PDUs, allocated on first use */
+  size_t write_buf_used;            /**< number of bytes held in write_buf */
+  size_t write_buf_sent;            /**< number of bytes of write_buf already
+                                         written out */
+  uint8_t write_buf_flushing;       /**< Set if write_buf flush could not
+                                         complete, so no more data must be
+                                         added until it has drained */
   uint8_t read_header[8];           /**< storage space for header of incoming
                                          message header */
   size_t partial_read;              /**< if > 0 indicates number of bytes
@@ -187,8 +267,28 @@ struct coap_session_t {
                                        been processed */
   coap_mid_t last_con_mid;        /**< The last CON mid that has been
                                        been processed */
+  coap_stats_t stats;             /**< Session traffic counters */
+  coap_rtt_estimator_t *rtt_est;  /**< RTT estimator, if any */
 };
 
+#if COAP_CONNECT_RACE
+/**
+ * The connection attempts of a client TCP session, other than the one on
+ * the session socket. The first to connect is moved into the session socket.
+ */
+typedef struct coap_connect_race_t {
+  coap_tick_t next_attempt;       /**< when to start the next attempt */
+  int default_port;               /**< the port if an address has none */
+  int done;                       /**< set once the race is over */
+  size_t next;                    /**< the next of addr to try */
+  size_t count;                   /**< number of addresses in addr */
+  coap_socket_t sock[COAP_CONNECT_RACE_MAX]; /**< the attempts in progress
+                                                  (fd is COAP_INVALID_SOCKET
+                                                  if not in use) */
+  coap_address_t addr[1];         /**< the addresses to try, in order */
+} coap_connect_race_t;
+#endif /* COAP_CONNECT_RACE */
+
 #if COAP_SERVER_SUPPORT
 /**
  * Abstraction of virtual endpoint that can be attached to coap_context_t. The
@@ -203,9 +303,66 @@ struct coap_endpoint_t {
                                        any */
   coap_address_t bind_addr;       /**< local interface address */
   coap_session_t *sessions;       /**< hash table or list of active sessions */
+  coap_stats_t stats;             /**< Endpoint traffic counters */
 };
 #endif /* COAP_SERVER_SUPPORT */
 
+/**
+ * Add @p n to the traffic counter @p field of @p s, as well as to the same
+ * counter of the owning endpoint (if any) and context.
+ *
+ * @param s     The CoAP session.
+ * @param field The coap_stats_t member to update.
+ * @param n     The amount to add.
+ */
+#if COAP_SERVER_SUPPORT
+#define COAP_STATS_ADD(s, field, n) do { \
+    (s)->stats.field += (n); \
+    if ((s)->endpoint) \
+      (s)->endpoint->stats.field += (n); \
+    if ((s)->context) \
+      (s)->context->stats.field += (n); \
+  } while (0)
+#else /* ! COAP_SERVER_SUPPORT */
+#define COAP_STATS_ADD(s, field, n) do { \
+    (s)->stats.field += (n); \
+    if ((s)->context) \
+      (s)->context->stats.field += (n); \
+  } while (0)
+#endif /* ! COAP_SERVER_SUPPORT */
+
+/**
+ * Get the base retransmission timeout for a new confirmable message sent
+ * over @p session.  Creates (or attaches to a shared) RTT estimator if RTT
+ * estimation is enabled for the session's context, and ages the RTO if it has
+ * not been updated recently.
+ *
+ * @param session The CoAP session.
+ * @param rto     Updated with the RTO in ticks if there is an estimator.
+ *
+ * @return @c 1 if @p rto was updated from an estimator, else @c 0 (and
+ *         ack_timeout is to be used).
+ */
+int coap_session_rtt_get_rto(coap_session_t *session, coap_tick_t *rto);
+
+/**
+ * Update the RTT estimator of @p session with the result of the acknowledged
+ * confirmable message @p node.
+ *
+ * @param session The CoAP session.
+ * @param node    The sendqueue entry that has just been acknowledged.
+ * @param now     The current time.
+ */
+void coap_session_rtt_update(coap_session_t *session, const coap_queue_t *node,
+                             coap_tick_t now);
+
+/**
+ * Release the RTT estimator (if any) used by @p session.
+ *
+ * @param session The CoAP session.
+ */
+void coap_session_rtt_release(coap_session_t *session);
+
 /**
  * Notify session transport has just connected and CSM exchange can now start.
  *
@@ -287,6 +444,19 @@ coap_session_t *coap_new_server_session(
  */
 ssize_t coap_session_send_pdu(coap_session_t *session, coap_pdu_t *pdu);
 
+/**
+ * Write out any PDUs that have been coalesced into the session's reliable
+ * output buffer (see coap_context_set_write_coalesce_size()).  Data that
+ * cannot be written out immediately is kept until the socket becomes
+ * writable again.
+ *
+ * @param session          Session to flush.
+ *
+ * @return                 @c 1 if the output buffer is now empty, @c 0 if
+ *                         data is still pending or @c -1 on error.
+ */
+int coap_session_flush_write_buf(coap_session_t *session);
+
 ssize_t
 coap_session_delay_pdu(coap_session_t *session, coap_pdu_t *pdu,
                        coap_queue_t *node);
@@ -330,6 +500,43 @@ coap_session_t *coap_session_new_dtls_session(coap_session_t *session,
 void coap_session_free(coap_session_t *session);
 void coap_session_mfree(coap_session_t *session);
 
+#if COAP_CONNECT_RACE
+/**
+ * Finishes the connection attempt on @p sock, which is the socket of
+ * @p session or one of its other attempts. If it has connected, it is made
+ * the session socket and the other attempts are closed. If it has failed and
+ * there are other attempts, or addresses still to try, the race goes on.
+ *
+ * @param session The connecting client session.
+ * @param sock    The socket that can connect.
+ * @param now     The current time in ticks.
+ *
+ * @return @c 1 if the session socket has connected, @c 0 if the session is
+ *         still connecting, or @c -1 if all the attempts have failed.
+ */
+int coap_session_race_connect(coap_session_t *session, coap_socket_t *sock,
+                              coap_tick_t now);
+
+/**
+ * Starts the next connection attempt of @p session, if it is due, and frees
+ * the race once it is over.
+ *
+ * @param session The client session.
+ * @param now     The current time in ticks.
+ *
+ * @return The ticks until the next attempt is due, or @c 0 if none is.
+ */
+coap_tick_t coap_session_race_check(coap_session_t *session, coap_tick_t now);
+
+/**
+ * Closes the connection attempts of @p session other than that on the
+ * session socket, ending the race.
+ *
+ * @param session The client session.
+ */
+void coap_session_race_end(coap_session_t *session);
+#endif /* COAP_CONNECT_RACE */
+
 #define COAP_SESSION_REF(s) ((s)->ref
 
 /* RFC7252 */
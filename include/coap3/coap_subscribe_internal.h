@@ -19,6 +19,7 @@
 #define COAP_SUBSCRIBE_INTERNAL_H_
 
 #include "coap_internal.h"
+#include "coap_uthash_internal.h"
 
 #if COAP_SERVER_SUPPORT
 
@@ -53,10 +54,29 @@
 #error COAP_OBS_MAX_FAIL is too large
 #endif /* COAP_OBS_MAX_FAIL > 255 */
 
+/**
+ * The subscribers of a resource that share a notify key (see
+ * coap_observer_notify_key()), so that they can be found without walking
+ * every subscriber of the resource.
+ */
+typedef struct coap_notify_group_t {
+  UT_hash_handle hh;         /**< resource's notify_groups handle */
+  coap_cache_key_t key;      /**< the shared notify key */
+  unsigned int count;        /**< number of subscribers in the group */
+  struct coap_subscription_t *subscribers; /**< linked by group_next */
+} coap_notify_group_t;
+
 /** Subscriber information */
 struct coap_subscription_t {
   struct coap_subscription_t *next; /**< next element in linked list */
+  struct coap_subscription_t *prev; /**< previous element in linked list */
   struct coap_session_t *session;   /**< subscriber session */
+  struct coap_resource_t *resource; /**< subscribed resource */
+  struct coap_subscription_t *session_next; /**< next in session's list */
+  struct coap_subscription_t *session_prev; /**< previous in session's list */
+  UT_hash_handle hh;                /**< resource's subscriber_hash handle */
+  uint64_t hkey;                    /**< hash of session and token */
+  UT_hash_handle hh_key;            /**< session's subscription_keys handle */
 
   uint8_t non_cnt;  /**< up to 255 non-confirmable notifies allowed */
   uint8_t fail_cnt; /**< up to 255 confirmable notifies can fail */
@@ -64,6 +84,12 @@ struct coap_subscription_t {
                      *   sent (in that case, the resource's partially
                      *   dirty flag is set too) */
   coap_cache_key_t *cache_key; /** cache_key to identify requester */
+  coap_cache_key_t *notify_key; /**< session independent key of the
+                                     requested representation (set on first
+                                     use) */
+  coap_notify_group_t *group; /**< notify key group, if any */
+  struct coap_subscription_t *group_next; /**< next in group's list */
+  struct coap_subscription_t *group_prev; /**< previous in group's list */
   coap_pdu_t *pdu;         /**< PDU to use for additional requests */
 };
 
@@ -121,6 +147,31 @@ coap_subscription_t *coap_find_observer(coap_resource_t *resource,
                                         coap_session_t *session,
                                         const coap_bin_const_t *token);
 
+/**
+ * Returns the session independent key of the representation that @p obs
+ * asked for, so that observers that get the same notifications share it.
+ *
+ * @param obs The subscription.
+ *
+ * @return The key (owned by @p obs), or @c NULL on error.
+ */
+coap_cache_key_t *coap_observer_notify_key(coap_subscription_t *obs);
+
+/**
+ * Counts the observers of @p resource whose notify key (see
+ * coap_observer_notify_key()) is @p notify_key, and if @p notify is set, has
+ * only them sent a notification.
+ *
+ * @param resource   The observed resource.
+ * @param notify_key The key of the representation that has changed.
+ * @param notify     Set to flag the observers as needing a notification.
+ *
+ * @return The number of observers with @p notify_key.
+ */
+unsigned int coap_resource_observers_by_key(coap_resource_t *resource,
+                                            const coap_cache_key_t *notify_key,
+                                            int notify);
+
 /**
  * Flags that data is ready to be sent to observers.
  *
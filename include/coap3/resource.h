@@ -152,6 +152,34 @@ typedef void (*coap_method_handler_t)
  */
 #define COAP_RESOURCE_FLAGS_OSCORE_ONLY 0x400
 
+/**
+ * Build each Observe notification once for all the observers that asked for
+ * the same representation (same method, Uri-Query, Accept, Block2 size etc.),
+ * rather than calling the GET (or FETCH) handler for every observer.  The
+ * handler output must then not depend on the observer's session.
+ */
+#define COAP_RESOURCE_FLAGS_NOTIFY_ENCODE_ONCE 0x800
+
+/**
+ * Treat the uri_path of this resource as a template. A segment of the form
+ * {name} matches any one Uri-Path segment (see coap_resource_get_uri_param()),
+ * and a final segment of * matches any remaining segments (including none),
+ * so that one resource can handle a whole family of paths.  A request that
+ * matches more than one resource goes to the one with an exact segment
+ * before one with a {name} segment, before one with a * segment.
+ */
+#define COAP_RESOURCE_FLAGS_URI_TEMPLATE 0x1000
+
+/**
+ * Keep the last 2.05 response to each distinct GET or FETCH request (Uri-Query,
+ * Accept etc.), with an ETag added if the handler did not set one. Repeat
+ * requests are answered from it without calling the handler, with a 2.03
+ * (Valid) if the request has its ETag. The kept responses are dropped by
+ * coap_resource_notify_observers() and by a successful PUT, POST, DELETE,
+ * PATCH or iPATCH. The handler output must then not depend on the session.
+ */
+#define COAP_RESOURCE_FLAGS_CACHE_REPRESENTATION 0x2000
+
 /**
  * Creates a new resource object and initializes the link field to the string
  * @p uri_path. This function returns the new coap_resource_t object.
@@ -281,6 +309,55 @@ coap_resource_t *coap_resource_proxy_uri_init2(coap_method_handler_t handler,
                                               const char *host_name_list[],
                                               int flags);
 
+/**
+ * Creates a new resource object that serves the contents of the file @p path
+ * with a GET handler.
+ *
+ * The file is read into memory once, and a strong ETag is computed from its
+ * contents. All the downloads in progress share this one copy and the data
+ * is sent block by block straight out of it. If the file changes, the next
+ * GET picks up the new contents (inotify is used to spot this where
+ * available, else the file is stat()ed), while any downloads in progress
+ * carry on with the old copy.
+ *
+ * A request whose ETag matches the current contents gets a 2.03 (Valid)
+ * response without any data.
+ *
+ * Note: COAP_BLOCK_USE_LIBCOAP must be set by coap_context_set_block_mode()
+ * for files that do not fit into a single PDU.
+ *
+ * @param uri_path   The string URI path of the new resource.
+ * @param path       The file to serve.
+ * @param media_type The Content-Format to send with the data.
+ * @param maxage     The Max-Age to send with the data, or @c -1 for none.
+ * @param flags      As for coap_resource_init().
+ *
+ * @return           A pointer to the new object or @c NULL on error (which
+ *                   includes @p path not being readable).
+ */
+coap_resource_t *coap_resource_file_init(coap_str_const_t *uri_path,
+                                         const char *path,
+                                         uint16_t media_type,
+                                         int maxage,
+                                         int flags);
+
+/**
+ * Gets the Uri-Path segment of @p request that matched the {@p name} segment
+ * of a COAP_RESOURCE_FLAGS_URI_TEMPLATE resource. @p value points into
+ * @p request, so is only valid as long as @p request is.
+ *
+ * @param resource The resource that @p request was routed to.
+ * @param request  The request.
+ * @param name     The name of the template segment, without the braces.
+ * @param value    Updated with the matching segment.
+ *
+ * @return @c 1 if found, else @c 0.
+ */
+int coap_resource_get_uri_param(const coap_resource_t *resource,
+                                const coap_pdu_t *request,
+                                const char *name,
+                                coap_str_const_t *value);
+
 /**
  * Returns the resource identified by the unique string @p uri_path. If no
  * resource was found, this function returns @c NULL.
@@ -395,6 +472,26 @@ void coap_register_request_handler(coap_resource_t *resource,
                            coap_request_t method,
                            coap_method_handler_t handler);
 
+/**
+ * Registers @p response as the response to @p method requests for
+ * @p resource. The options and payload of @p response are encoded once, and
+ * each request is answered with a copy that only has the type, message id
+ * and token changed, without calling the handler. The template is not used
+ * for requests with an Observe, Block2 or Q-Block2 option if there is a
+ * handler for @p method, as the handler is called for those instead. A
+ * template that does not fit in the session's PDU size is not used either.
+ *
+ * @param resource The resource.
+ * @param method   The CoAP request method.
+ * @param response The response to copy (its token, type and message id are
+ *                 ignored), or @c NULL to remove the template.
+ *
+ * @return @c 1 on success, or @c 0 on error.
+ */
+int coap_resource_set_response_template(coap_resource_t *resource,
+                                        coap_request_t method,
+                                        const coap_pdu_t *response);
+
 /**
  * Registers a new attribute with the given @p resource. As the
  * attribute's coap_str_const_ fields will point to @p name and @p value the
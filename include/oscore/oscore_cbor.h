@@ -106,6 +106,12 @@ size_t oscore_cbor_put_tag(uint8_t **buffer, size_t *buf_size, uint64_t value);
 size_t
 oscore_cbor_put_negative(uint8_t **buffer, size_t *buf_size, int64_t value);
 
+/* oscore_cbor_head_size
+ * returns the size of the head of an item with the given argument
+ * (a value, a length or a number of elements)
+ */
+size_t oscore_cbor_head_size(uint64_t value);
+
 uint8_t oscore_cbor_get_next_element(const uint8_t **buffer);
 
 uint64_t oscore_cbor_get_element_size(const uint8_t **buffer);
@@ -365,7 +365,9 @@ coap_context_set_block_mode(coap_context_t *context,
                                   uint8_t block_mode) {
   context->block_mode = block_mode &= (COAP_BLOCK_USE_LIBCOAP |
                                        COAP_BLOCK_SINGLE_BODY |
-                                       COAP_BLOCK_NO_PREEMPTIVE_RTAG);
+                                       COAP_BLOCK_TRY_Q_BLOCK |
+                                       COAP_BLOCK_NO_PREEMPTIVE_RTAG |
+                                       COAP_BLOCK_STREAM_BODY);
   if (!(block_mode & COAP_BLOCK_USE_LIBCOAP))
     context->block_mode = 0;
 }
@@ -376,12 +378,369 @@ full_match(const uint8_t *a, size_t alen,
   return alen == blen && (alen == 0 || memcmp(a, b, alen) == 0);
 }
 
+/*
+ * The lg_xmit, lg_crcv and lg_srcv lists are also indexed by hash tables
+ * so that sessions with many concurrent transfers do not need to scan the
+ * lists for every PDU.  The index keys are not necessarily unique, so any
+ * entry found is checked and the list scanned if it is not the one wanted.
+ */
+#define LG_KEY_INIT 0xcbf29ce484222325ULL
+
+/* FNV-1a hash of data, continuing from key */
+static uint64_t
+lg_key_add(uint64_t key, const void *data, size_t length) {
+  const uint8_t *p = (const uint8_t *)data;
+
+  while (length--) {
+    key ^= *p++;
+    key *= 0x100000001b3ULL;
+  }
+  return key;
+}
+
+static uint64_t
+lg_key_rtag(uint64_t key, int rtag_set, const uint8_t *rtag,
+            size_t rtag_length) {
+  uint8_t set = rtag_set ? 1 : 0;
+
+  key = lg_key_add(key, &set, sizeof(set));
+  return rtag_set ? lg_key_add(key, rtag, rtag_length) : key;
+}
+
+#if COAP_CLIENT_SUPPORT
+static uint64_t
+lg_key_token(const uint8_t *token, size_t length) {
+  return STATE_TOKEN_BASE(coap_decode_var_bytes8(token, length));
+}
+#endif /* COAP_CLIENT_SUPPORT */
+
+#if COAP_SERVER_SUPPORT
+/*
+ * Requests routed to a template resource can have different paths, so these
+ * also have to be told apart by their Uri-Path.
+ */
+static uint64_t
+lg_key_uri_path(const coap_resource_t *resource, const coap_pdu_t *request) {
+  coap_opt_filter_t filter;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *opt;
+  uint64_t key = LG_KEY_INIT;
+
+  if (!resource || !resource->is_template)
+    return 0;
+  coap_option_filter_clear(&filter);
+  coap_option_filter_set(&filter, COAP_OPTION_URI_PATH);
+  coap_option_iterator_init(request, &opt_iter, &filter);
+  while ((opt = coap_option_next(&opt_iter))) {
+    key = lg_key_add(key, coap_opt_value(opt), coap_opt_length(opt));
+    key = lg_key_add(key, "/", 1);
+  }
+  return key;
+}
+
+static uint64_t
+lg_key_response(const coap_resource_t *resource, coap_pdu_code_t method,
+                const coap_string_t *query, uint64_t path_key, int rtag_set,
+                const uint8_t *rtag, size_t rtag_length) {
+  uint64_t key = lg_key_add(LG_KEY_INIT, &resource, sizeof(resource));
+
+  key = lg_key_add(key, &method, sizeof(method));
+  if (path_key)
+    key = lg_key_add(key, &path_key, sizeof(path_key));
+  if (query && query->length)
+    key = lg_key_add(key, query->s, query->length);
+  return lg_key_rtag(key, rtag_set, rtag, rtag_length);
+}
+
+static uint64_t
+lg_key_srcv(const coap_resource_t *resource, int rtag_set,
+            const uint8_t *rtag, size_t rtag_length) {
+  uint64_t key = lg_key_add(LG_KEY_INIT, &resource, sizeof(resource));
+
+  return lg_key_rtag(key, rtag_set, rtag, rtag_length);
+}
+
+static uint64_t
+lg_key_srcv_path(const coap_str_const_t *uri_path, int rtag_set,
+                 const uint8_t *rtag, size_t rtag_length) {
+  uint64_t key = lg_key_add(LG_KEY_INIT, uri_path->s, uri_path->length);
+
+  return lg_key_rtag(key, rtag_set, rtag, rtag_length);
+}
+#endif /* COAP_SERVER_SUPPORT */
+
+/*
+ * Entries that may have had their timeout changed since the last timeout
+ * check are put on a dirty list, so that the check only needs to look at
+ * these until the earliest timeout of the others is reached.
+ */
+static void
+lg_xmit_touch(coap_session_t *session, coap_lg_xmit_t *lg_xmit) {
+  if (!lg_xmit->dirty) {
+    lg_xmit->dirty = 1;
+    LL_PREPEND2(session->lg_xmit_dirty, lg_xmit, dirty_next);
+  }
+}
+
+void
+coap_block_link_lg_xmit(coap_session_t *session, coap_lg_xmit_t *lg_xmit) {
+  LL_PREPEND(session->lg_xmit, lg_xmit);
+  if (COAP_PDU_IS_REQUEST(&lg_xmit->pdu)) {
+#if COAP_CLIENT_SUPPORT
+    lg_xmit->hkey = STATE_TOKEN_BASE(lg_xmit->b.b1.state_token);
+    lg_xmit->hkey_app = lg_key_token(lg_xmit->b.b1.app_token->s,
+                                     lg_xmit->b.b1.app_token->length);
+    HASH_ADD(hh_app, session->lg_xmit_app, hkey_app,
+             sizeof(lg_xmit->hkey_app), lg_xmit);
+#endif /* COAP_CLIENT_SUPPORT */
+  } else {
+#if COAP_SERVER_SUPPORT
+    lg_xmit->hkey = lg_key_response(lg_xmit->b.b2.resource,
+                                    lg_xmit->b.b2.request_method,
+                                    lg_xmit->b.b2.query,
+                                    lg_xmit->b.b2.path_key,
+                                    lg_xmit->b.b2.rtag_set,
+                                    lg_xmit->b.b2.rtag,
+                                    lg_xmit->b.b2.rtag_length);
+#endif /* COAP_SERVER_SUPPORT */
+  }
+  HASH_ADD(hh, session->lg_xmit_hash, hkey, sizeof(lg_xmit->hkey), lg_xmit);
+  lg_xmit_touch(session, lg_xmit);
+}
+
+void
+coap_block_unlink_lg_xmit(coap_session_t *session, coap_lg_xmit_t *lg_xmit) {
+  LL_DELETE(session->lg_xmit, lg_xmit);
+  HASH_DELETE(hh, session->lg_xmit_hash, lg_xmit);
+  if (COAP_PDU_IS_REQUEST(&lg_xmit->pdu))
+    HASH_DELETE(hh_app, session->lg_xmit_app, lg_xmit);
+  if (lg_xmit->dirty) {
+    LL_DELETE2(session->lg_xmit_dirty, lg_xmit, dirty_next);
+    lg_xmit->dirty = 0;
+  }
+}
+
+#if COAP_CLIENT_SUPPORT
+void
+coap_block_set_lg_xmit_token(coap_session_t *session, coap_lg_xmit_t *lg_xmit,
+                             uint64_t state_token) {
+  lg_xmit->b.b1.state_token = state_token;
+  if (lg_xmit->hkey != STATE_TOKEN_BASE(state_token)) {
+    HASH_DELETE(hh, session->lg_xmit_hash, lg_xmit);
+    lg_xmit->hkey = STATE_TOKEN_BASE(state_token);
+    HASH_ADD(hh, session->lg_xmit_hash, hkey, sizeof(lg_xmit->hkey), lg_xmit);
+  }
+}
+
+/*
+ * Find the lg_xmit (request) where the state token or the application's
+ * token matches the received token.
+ */
+static coap_lg_xmit_t *
+find_lg_xmit_request(coap_session_t *session, const coap_bin_const_t *token) {
+  uint64_t token_match = lg_key_token(token->s, token->length);
+  coap_lg_xmit_t *lg_xmit;
+
+  HASH_FIND(hh, session->lg_xmit_hash, &token_match, sizeof(token_match),
+            lg_xmit);
+  if (lg_xmit && COAP_PDU_IS_REQUEST(&lg_xmit->pdu))
+    return lg_xmit;
+  if (!lg_xmit) {
+    HASH_FIND(hh_app, session->lg_xmit_app, &token_match,
+              sizeof(token_match), lg_xmit);
+    return lg_xmit;
+  }
+  /* A response key is the same as the token */
+  LL_FOREACH(session->lg_xmit, lg_xmit) {
+    if (COAP_PDU_IS_REQUEST(&lg_xmit->pdu) &&
+        (token_match == STATE_TOKEN_BASE(lg_xmit->b.b1.state_token) ||
+         token_match == lg_xmit->hkey_app))
+      break;
+  }
+  return lg_xmit;
+}
+
+coap_lg_xmit_t *
+coap_find_lg_xmit_request_app(coap_session_t *session,
+                              const coap_bin_const_t *token) {
+  uint64_t token_match = lg_key_token(token->s, token->length);
+  coap_lg_xmit_t *lg_xmit;
+
+  HASH_FIND(hh_app, session->lg_xmit_app, &token_match, sizeof(token_match),
+            lg_xmit);
+  if (!lg_xmit || coap_binary_equal(token, lg_xmit->b.b1.app_token))
+    return lg_xmit;
+  /* Another token has the same index key */
+  LL_FOREACH(session->lg_xmit, lg_xmit) {
+    if (COAP_PDU_IS_REQUEST(&lg_xmit->pdu) &&
+        coap_binary_equal(token, lg_xmit->b.b1.app_token))
+      break;
+  }
+  return lg_xmit;
+}
+
+static void
+lg_crcv_touch(coap_session_t *session, coap_lg_crcv_t *lg_crcv) {
+  if (!lg_crcv->dirty) {
+    lg_crcv->dirty = 1;
+    LL_PREPEND2(session->lg_crcv_dirty, lg_crcv, dirty_next);
+  }
+}
+
+void
+coap_block_link_lg_crcv(coap_session_t *session, coap_lg_crcv_t *lg_crcv) {
+  LL_PREPEND(session->lg_crcv, lg_crcv);
+  lg_crcv->hkey = STATE_TOKEN_BASE(lg_crcv->state_token);
+  lg_crcv->hkey_app = lg_key_token(lg_crcv->app_token->s,
+                                   lg_crcv->app_token->length);
+  HASH_ADD(hh, session->lg_crcv_hash, hkey, sizeof(lg_crcv->hkey), lg_crcv);
+  HASH_ADD(hh_app, session->lg_crcv_app, hkey_app, sizeof(lg_crcv->hkey_app),
+           lg_crcv);
+  lg_crcv_touch(session, lg_crcv);
+}
+
+void
+coap_block_unlink_lg_crcv(coap_session_t *session, coap_lg_crcv_t *lg_crcv) {
+  LL_DELETE(session->lg_crcv, lg_crcv);
+  HASH_DELETE(hh, session->lg_crcv_hash, lg_crcv);
+  HASH_DELETE(hh_app, session->lg_crcv_app, lg_crcv);
+  if (lg_crcv->dirty) {
+    LL_DELETE2(session->lg_crcv_dirty, lg_crcv, dirty_next);
+    lg_crcv->dirty = 0;
+  }
+}
+
+/*
+ * Find the lg_crcv where the state token matches the received token, or the
+ * application's token is the received token.
+ */
+static coap_lg_crcv_t *
+find_lg_crcv(coap_session_t *session, const coap_bin_const_t *token) {
+  uint64_t token_match = lg_key_token(token->s, token->length);
+  coap_lg_crcv_t *lg_crcv;
+
+  HASH_FIND(hh, session->lg_crcv_hash, &token_match, sizeof(token_match),
+            lg_crcv);
+  if (lg_crcv)
+    return lg_crcv;
+  return coap_find_lg_crcv_app(session, token);
+}
+
+coap_lg_crcv_t *
+coap_find_lg_crcv_app(coap_session_t *session, const coap_bin_const_t *token) {
+  uint64_t token_match = lg_key_token(token->s, token->length);
+  coap_lg_crcv_t *lg_crcv;
+
+  HASH_FIND(hh_app, session->lg_crcv_app, &token_match, sizeof(token_match),
+            lg_crcv);
+  if (!lg_crcv || coap_binary_equal(token, lg_crcv->app_token))
+    return lg_crcv;
+  /* Another token has the same index key */
+  LL_FOREACH(session->lg_crcv, lg_crcv) {
+    if (coap_binary_equal(token, lg_crcv->app_token))
+      break;
+  }
+  return lg_crcv;
+}
+#endif /* COAP_CLIENT_SUPPORT */
+
+#if COAP_SERVER_SUPPORT
+static void
+lg_srcv_touch(coap_session_t *session, coap_lg_srcv_t *lg_srcv) {
+  if (!lg_srcv->dirty) {
+    lg_srcv->dirty = 1;
+    LL_PREPEND2(session->lg_srcv_dirty, lg_srcv, dirty_next);
+  }
+}
+
+void
+coap_block_link_lg_srcv(coap_session_t *session, coap_lg_srcv_t *lg_srcv) {
+  LL_PREPEND(session->lg_srcv, lg_srcv);
+  lg_srcv->hkey = lg_key_srcv(lg_srcv->resource, lg_srcv->rtag_set,
+                              lg_srcv->rtag, lg_srcv->rtag_length);
+  HASH_ADD(hh, session->lg_srcv_hash, hkey, sizeof(lg_srcv->hkey), lg_srcv);
+  if (lg_srcv->uri_path) {
+    lg_srcv->hkey_path = lg_key_srcv_path(lg_srcv->uri_path,
+                                          lg_srcv->rtag_set, lg_srcv->rtag,
+                                          lg_srcv->rtag_length);
+    HASH_ADD(hh_path, session->lg_srcv_path, hkey_path,
+             sizeof(lg_srcv->hkey_path), lg_srcv);
+  }
+  lg_srcv_touch(session, lg_srcv);
+}
+
+void
+coap_block_unlink_lg_srcv(coap_session_t *session, coap_lg_srcv_t *lg_srcv) {
+  LL_DELETE(session->lg_srcv, lg_srcv);
+  HASH_DELETE(hh, session->lg_srcv_hash, lg_srcv);
+  if (lg_srcv->uri_path)
+    HASH_DELETE(hh_path, session->lg_srcv_path, lg_srcv);
+  if (lg_srcv->dirty) {
+    LL_DELETE2(session->lg_srcv_dirty, lg_srcv, dirty_next);
+    lg_srcv->dirty = 0;
+  }
+}
+
+static int
+lg_srcv_match(coap_context_t *context, const coap_lg_srcv_t *lg_srcv,
+              const coap_resource_t *resource, const coap_string_t *uri_path,
+              int rtag_set, const uint8_t *rtag, size_t rtag_length) {
+  if (rtag_set || lg_srcv->rtag_set == 1) {
+    if (!(rtag_set && lg_srcv->rtag_set == 1))
+      return 0;
+    if (lg_srcv->rtag_length != rtag_length ||
+        memcmp(lg_srcv->rtag, rtag, rtag_length) != 0)
+      return 0;
+  }
+  if (resource == lg_srcv->resource && !lg_srcv->uri_path)
+    return 1;
+  if ((resource == lg_srcv->resource ||
+       lg_srcv->resource == context->unknown_resource ||
+       resource == context->proxy_uri_resource) &&
+      uri_path && lg_srcv->uri_path &&
+      coap_string_equal(uri_path, lg_srcv->uri_path))
+    return 1;
+  return 0;
+}
+
+/*
+ * Find the lg_srcv for the resource (or uri_path if the resource was
+ * unknown) and RTag.
+ */
+static coap_lg_srcv_t *
+find_lg_srcv(coap_context_t *context, coap_session_t *session,
+             const coap_resource_t *resource, const coap_string_t *uri_path,
+             int rtag_set, const uint8_t *rtag, size_t rtag_length) {
+  uint64_t key = lg_key_srcv(resource, rtag_set, rtag, rtag_length);
+  coap_lg_srcv_t *lg_srcv;
+
+  HASH_FIND(hh, session->lg_srcv_hash, &key, sizeof(key), lg_srcv);
+  if (!lg_srcv && uri_path) {
+    coap_str_const_t path = { uri_path->length, uri_path->s };
+
+    key = lg_key_srcv_path(&path, rtag_set, rtag, rtag_length);
+    HASH_FIND(hh_path, session->lg_srcv_path, &key, sizeof(key), lg_srcv);
+  }
+  if (!lg_srcv || lg_srcv_match(context, lg_srcv, resource, uri_path,
+                                rtag_set, rtag, rtag_length))
+    return lg_srcv;
+  /* Another entry has the same index key */
+  LL_FOREACH(session->lg_srcv, lg_srcv) {
+    if (lg_srcv_match(context, lg_srcv, resource, uri_path,
+                      rtag_set, rtag, rtag_length))
+      break;
+  }
+  return lg_srcv;
+}
+#endif /* COAP_SERVER_SUPPORT */
+
 #if COAP_CLIENT_SUPPORT
 
 int
 coap_cancel_observe(coap_session_t *session, coap_binary_t *token,
                     coap_pdu_type_t type) {
-  coap_lg_crcv_t *lg_crcv, *q;
+  coap_lg_crcv_t *lg_crcv;
+  coap_bin_const_t empty = { 0, (const uint8_t *)"" };
 
   assert(session);
   if (!session)
@@ -394,51 +753,49 @@ coap_cancel_observe(coap_session_t *session, coap_binary_t *token,
     return 0;
   }
 
-  LL_FOREACH_SAFE(session->lg_crcv, lg_crcv, q) {
-    if (lg_crcv->observe_set) {
-      if ((!token && !lg_crcv->app_token->length) || (token &&
-          coap_binary_equal(token, lg_crcv->app_token))) {
-        uint8_t buf[8];
-        coap_mid_t mid;
-        size_t size;
-        const uint8_t *data;
-        coap_bin_const_t *otoken = lg_crcv->obs_token ?
-                                     lg_crcv->obs_token[0] ?
-                                       lg_crcv->obs_token[0] :
-                                       (coap_bin_const_t *)lg_crcv->app_token :
-                                     (coap_bin_const_t *)lg_crcv->app_token;
-        coap_pdu_t * pdu = coap_pdu_duplicate(&lg_crcv->pdu,
-                                              session,
-                                              otoken->length,
-                                              otoken->s,
-                                              NULL);
-
-        lg_crcv->observe_set = 0;
-        if (pdu == NULL)
-          return 0;
-        /* Need to make sure that this is the correct type */
-        pdu->type = type;
-
-        coap_update_option(pdu, COAP_OPTION_OBSERVE,
-                           coap_encode_var_safe(buf, sizeof(buf),
-                                                COAP_OBSERVE_CANCEL),
-                           buf);
-        if (coap_get_data(&lg_crcv->pdu, &size, &data))
-          coap_add_data_large_request(session, pdu, size, data, NULL, NULL);
+  lg_crcv = coap_find_lg_crcv_app(session, token ?
+                                            (coap_bin_const_t *)token : &empty);
+  if (lg_crcv && lg_crcv->observe_set) {
+    uint8_t buf[8];
+    coap_mid_t mid;
+    size_t size;
+    const uint8_t *data;
+    coap_bin_const_t *otoken = lg_crcv->obs_token ?
+                                 lg_crcv->obs_token[0] ?
+                                   lg_crcv->obs_token[0] :
+                                   (coap_bin_const_t *)lg_crcv->app_token :
+                                 (coap_bin_const_t *)lg_crcv->app_token;
+    coap_pdu_t * pdu = coap_pdu_duplicate(&lg_crcv->pdu,
+                                          session,
+                                          otoken->length,
+                                          otoken->s,
+                                          NULL);
+
+    lg_crcv->observe_set = 0;
+    lg_crcv_touch(session, lg_crcv);
+    if (pdu == NULL)
+      return 0;
+    /* Need to make sure that this is the correct type */
+    pdu->type = type;
 
-        /*
-         * Need to fix lg_xmit stateless token as using tokens from
-           observe setup
-         */
-        if (pdu->lg_xmit)
-          pdu->lg_xmit->b.b1.state_token = lg_crcv->state_token;
+    coap_update_option(pdu, COAP_OPTION_OBSERVE,
+                       coap_encode_var_safe(buf, sizeof(buf),
+                                            COAP_OBSERVE_CANCEL),
+                       buf);
+    if (coap_get_data(&lg_crcv->pdu, &size, &data))
+      coap_add_data_large_request(session, pdu, size, data, NULL, NULL);
 
-        mid = coap_send_internal(session, pdu);
-        if (mid != COAP_INVALID_MID)
-          return 1;
-        break;
-      }
-    }
+    /*
+     * Need to fix lg_xmit stateless token as using tokens from
+       observe setup
+     */
+    if (pdu->lg_xmit)
+      coap_block_set_lg_xmit_token(session, pdu->lg_xmit,
+                                   lg_crcv->state_token);
+
+    mid = coap_send_internal(session, pdu);
+    if (mid != COAP_INVALID_MID)
+      return 1;
   }
   return 0;
 }
@@ -450,9 +807,6 @@ coap_retransmit_oscore_pdu(coap_session_t *session,
                            coap_opt_t* echo)
 {
   coap_lg_crcv_t *lg_crcv;
-  uint64_t token_match =
-      STATE_TOKEN_BASE(coap_decode_var_bytes8(pdu->actual_token.s,
-                                              pdu->actual_token.length));
   uint8_t ltoken[8];
   size_t ltoken_len;
   uint64_t token;
@@ -461,13 +815,8 @@ coap_retransmit_oscore_pdu(coap_session_t *session,
   coap_pdu_t *resend_pdu;
   coap_block_b_t block;
 
-  LL_FOREACH(session->lg_crcv, lg_crcv) {
-    if (token_match != STATE_TOKEN_BASE(lg_crcv->state_token) &&
-      !coap_binary_equal(&pdu->actual_token, lg_crcv->app_token)) {
-      /* try out the next one */
-      continue;
-    }
-
+  lg_crcv = find_lg_crcv(session, &pdu->actual_token);
+  if (lg_crcv) {
     /* lg_crcv found */
 
     /* Re-send request with new token */
@@ -504,6 +853,33 @@ error:
 /*
  * Find the response lg_xmit
  */
+static int
+lg_xmit_response_match(const coap_lg_xmit_t *lg_xmit, const coap_pdu_t *request,
+                       const coap_resource_t *resource,
+                       const coap_string_t *query, uint64_t path_key,
+                       int rtag_set, const uint8_t *rtag, size_t rtag_length) {
+  static coap_string_t empty = { 0, NULL};
+
+  if (COAP_PDU_IS_REQUEST(&lg_xmit->pdu) ||
+      resource != lg_xmit->b.b2.resource ||
+      request->code != lg_xmit->b.b2.request_method ||
+      path_key != lg_xmit->b.b2.path_key ||
+      !coap_string_equal(query ? query : &empty,
+                         lg_xmit->b.b2.query ?
+                                           lg_xmit->b.b2.query : &empty)) {
+    return 0;
+  }
+  /* lg_xmit is a response */
+  if (rtag_set || lg_xmit->b.b2.rtag_set == 1) {
+    if (!(rtag_set && lg_xmit->b.b2.rtag_set == 1))
+      return 0;
+    if (lg_xmit->b.b2.rtag_length != rtag_length ||
+        memcmp(lg_xmit->b.b2.rtag, rtag, rtag_length) != 0)
+      return 0;
+  }
+  return 1;
+}
+
 coap_lg_xmit_t *
 coap_find_lg_xmit_response(const coap_session_t *session,
                            const coap_pdu_t *request,
@@ -517,30 +893,22 @@ coap_find_lg_xmit_response(const coap_session_t *session,
                                            &opt_iter);
   size_t rtag_length = rtag_opt ? coap_opt_length(rtag_opt) : 0;
   const uint8_t *rtag = rtag_opt ? coap_opt_value(rtag_opt) : NULL;
-
-  LL_FOREACH(session->lg_xmit, lg_xmit) {
-    static coap_string_t empty = { 0, NULL};
-
-    if (COAP_PDU_IS_REQUEST(&lg_xmit->pdu) ||
-        resource != lg_xmit->b.b2.resource ||
-        request->code != lg_xmit->b.b2.request_method ||
-        !coap_string_equal(query ? query : &empty,
-                           lg_xmit->b.b2.query ?
-                                             lg_xmit->b.b2.query : &empty)) {
-      /* try out the next one */
-      continue;
-    }
-    /* lg_xmit is a response */
-    if (rtag_opt || lg_xmit->b.b2.rtag_set == 1) {
-      if (!(rtag_opt && lg_xmit->b.b2.rtag_set == 1))
-        continue;
-      if (lg_xmit->b.b2.rtag_length != rtag_length ||
-          memcmp(lg_xmit->b.b2.rtag, rtag, rtag_length) != 0)
-        continue;
-    }
+  uint64_t path_key = lg_key_uri_path(resource, request);
+  uint64_t key = lg_key_response(resource, request->code, query, path_key,
+                                 rtag_opt != NULL, rtag, rtag_length);
+
+  HASH_FIND(hh, session->lg_xmit_hash, &key, sizeof(key), lg_xmit);
+  if (!lg_xmit || lg_xmit_response_match(lg_xmit, request, resource, query,
+                                         path_key, rtag_opt != NULL, rtag,
+                                         rtag_length))
     return lg_xmit;
+  /* Another entry has the same index key */
+  LL_FOREACH(session->lg_xmit, lg_xmit) {
+    if (lg_xmit_response_match(lg_xmit, request, resource, query, path_key,
+                               rtag_opt != NULL, rtag, rtag_length))
+      break;
   }
-  return NULL;
+  return lg_xmit;
 }
 #endif /* COAP_SERVER_SUPPORT */
 
@@ -603,26 +971,29 @@ coap_add_data_large_internal(coap_session_t *session,
   }
 
   if (COAP_PDU_IS_REQUEST(pdu)) {
-    coap_lg_xmit_t *q;
-
     option = COAP_OPTION_BLOCK1;
+    if (COAP_BLOCK_Q_BLOCK_OK(session) &&
+        !coap_check_option(pdu, COAP_OPTION_BLOCK1, &opt_iter))
+      option = COAP_OPTION_Q_BLOCK1;
 
+#if COAP_CLIENT_SUPPORT
     /* See if this token is already in use for large bodies (unlikely) */
-    LL_FOREACH_SAFE(session->lg_xmit, lg_xmit, q) {
-      if (coap_binary_equal(&pdu->actual_token, lg_xmit->b.b1.app_token)) {
-        /* Unfortunately need to free this off as potential size change */
-        LL_DELETE(session->lg_xmit, lg_xmit);
-        coap_block_delete_lg_xmit(session, lg_xmit);
-        lg_xmit = NULL;
-        coap_handle_event(session->context, COAP_EVENT_XMIT_BLOCK_FAIL, session);
-        break;
-      }
+    lg_xmit = coap_find_lg_xmit_request_app(session, &pdu->actual_token);
+    if (lg_xmit) {
+      /* Unfortunately need to free this off as potential size change */
+      coap_block_unlink_lg_xmit(session, lg_xmit);
+      coap_block_delete_lg_xmit(session, lg_xmit);
+      lg_xmit = NULL;
+      coap_handle_event(session->context, COAP_EVENT_XMIT_BLOCK_FAIL, session);
     }
+#endif /* COAP_CLIENT_SUPPORT */
   }
   else {
     /* Have to assume that it is a response even if code is 0.00 */
     assert(resource);
     option = COAP_OPTION_BLOCK2;
+    if (request && coap_check_option(request, COAP_OPTION_Q_BLOCK2, &opt_iter))
+      option = COAP_OPTION_Q_BLOCK2;
 #if COAP_SERVER_SUPPORT
     /*
      * Check if resource+query+rtag is already in use for large bodies
@@ -631,7 +1002,7 @@ coap_add_data_large_internal(coap_session_t *session,
     lg_xmit = coap_find_lg_xmit_response(session, request, resource, query);
     if (lg_xmit) {
       /* Unfortunately need to free this off as potential size change */
-      LL_DELETE(session->lg_xmit, lg_xmit);
+      coap_block_unlink_lg_xmit(session, lg_xmit);
       coap_block_delete_lg_xmit(session, lg_xmit);
       lg_xmit = NULL;
       coap_handle_event(session->context, COAP_EVENT_XMIT_BLOCK_FAIL, session);
@@ -752,6 +1123,9 @@ coap_add_data_large_internal(coap_session_t *session,
        * token match is used for Block1 large body transmissions
        */
       lg_xmit->b.b2.resource = resource;
+#if COAP_SERVER_SUPPORT
+      lg_xmit->b.b2.path_key = lg_key_uri_path(resource, request);
+#endif /* COAP_SERVER_SUPPORT */
       if (query) {
         lg_xmit->b.b2.query = coap_new_string(query->length);
         if (lg_xmit->b.b2.query) {
@@ -770,7 +1144,6 @@ coap_add_data_large_internal(coap_session_t *session,
       else {
         lg_xmit->b.b2.rtag_set = 0;
       }
-      lg_xmit->b.b2.etag = etag;
       lg_xmit->b.b2.request_method = request_method;
       if (maxage >= 0) {
         coap_tick_t now;
@@ -791,6 +1164,8 @@ coap_add_data_large_internal(coap_session_t *session,
           ++session->context->etag;
         etag = session->context->etag;
       }
+      /* Kept for matching against ETags in later requests */
+      lg_xmit->b.b2.etag = etag;
       coap_update_option(pdu,
                          COAP_OPTION_ETAG,
                          coap_encode_var_safe8(buf, sizeof(buf), etag),
@@ -865,8 +1240,22 @@ coap_add_data_large_internal(coap_session_t *session,
 
     lg_xmit->last_block = -1;
 
+    if (lg_xmit->option == COAP_OPTION_Q_BLOCK1) {
+      if (COAP_BLOCK_Q_BLOCK_PROBE(session)) {
+        /*
+         * Check Q-Block support with a CON before sending payload sets,
+         * the skeletal PDU keeps the type to use for the following blocks.
+         */
+        pdu->type = COAP_MESSAGE_CON;
+      } else if (pdu->type == COAP_MESSAGE_NON) {
+        /* coap_send() sends the rest of the first payload set */
+        lg_xmit->non_burst = 1;
+        lg_xmit->offset = chunk;
+      }
+    }
+
     /* Link the new lg_xmit in */
-    LL_PREPEND(session->lg_xmit,lg_xmit);
+    coap_block_link_lg_xmit(session, lg_xmit);
   }
   else {
     /* No need to use blocks */
@@ -893,6 +1282,7 @@ add_data:
 
 fail:
   if (lg_xmit) {
+    pdu->lg_xmit = NULL;
     coap_block_delete_lg_xmit(session, lg_xmit);
   } else if (release_func) {
     release_func(session, app_ptr);
@@ -950,6 +1340,12 @@ coap_add_data_large_response(coap_resource_t *resource,
   if (request) {
     if (coap_get_block_b(session, request, COAP_OPTION_BLOCK2, &block)) {
       block_requested = 1;
+    } else if (coap_get_block_b(session, request, COAP_OPTION_Q_BLOCK2,
+                                &block)) {
+      block_requested = 1;
+      block_opt = COAP_OPTION_Q_BLOCK2;
+    }
+    if (block_requested) {
       if (block.num != 0 && length <= (block.num << (block.szx + 4))) {
         coap_log_debug("Illegal block requested (%d > last = %zu)\n",
                  block.num,
@@ -1000,166 +1396,677 @@ coap_add_data_large_response(coap_resource_t *resource,
     response->code = COAP_RESPONSE_CODE(500);
     goto error_released;
   }
-
-  return 1;
-
-error:
-  if (release_func)
-    release_func(session, app_ptr);
-error_released:
-#if COAP_ERROR_PHRASE_LENGTH > 0
-  coap_add_data(response,
-                strlen(coap_response_phrase(response->code)),
-                (const unsigned char *)coap_response_phrase(response->code));
-#endif /* COAP_ERROR_PHRASE_LENGTH > 0 */
-  return 0;
+
+  return 1;
+
+error:
+  if (release_func)
+    release_func(session, app_ptr);
+error_released:
+#if COAP_ERROR_PHRASE_LENGTH > 0
+  coap_add_data(response,
+                strlen(coap_response_phrase(response->code)),
+                (const unsigned char *)coap_response_phrase(response->code));
+#endif /* COAP_ERROR_PHRASE_LENGTH > 0 */
+  return 0;
+}
+#endif /* ! COAP_SERVER_SUPPORT */
+
+static int
+check_if_received_block(const coap_rblock_t *rec_blocks, uint32_t block_num) {
+  return (block_num >> 3) < rec_blocks->bitmap_len &&
+         (rec_blocks->bitmap[block_num >> 3] & (1 << (block_num & 7)));
+}
+
+static int
+update_received_blocks(coap_rblock_t *rec_blocks, uint32_t block_num) {
+  size_t index = block_num >> 3;
+
+  /* Reset as there is activity */
+  rec_blocks->retry = 0;
+
+  if (block_num >= COAP_RBLOCK_MAX_BLOCKS)
+    return 0;
+  if (index >= rec_blocks->bitmap_len) {
+    /* Grow the bitmap to cover this block */
+    size_t new_len = rec_blocks->bitmap_len ? rec_blocks->bitmap_len :
+                                              COAP_RBLOCK_MIN_BITMAP;
+    uint8_t *bitmap;
+
+    while (new_len <= index)
+      new_len *= 2;
+    if (new_len > COAP_RBLOCK_MAX_BLOCKS / 8)
+      new_len = COAP_RBLOCK_MAX_BLOCKS / 8;
+    bitmap = coap_realloc_type(COAP_STRING, rec_blocks->bitmap, new_len);
+    if (!bitmap)
+      return 0;
+    memset(&bitmap[rec_blocks->bitmap_len], 0,
+           new_len - rec_blocks->bitmap_len);
+    rec_blocks->bitmap = bitmap;
+    rec_blocks->bitmap_len = new_len;
+  }
+  if (!(rec_blocks->bitmap[index] & (1 << (block_num & 7)))) {
+    rec_blocks->bitmap[index] |= 1 << (block_num & 7);
+    rec_blocks->used++;
+    if (rec_blocks->used == 1 || block_num > rec_blocks->highest)
+      rec_blocks->highest = block_num;
+    /* Move first_missing past any contiguous set of received blocks */
+    while (check_if_received_block(rec_blocks, rec_blocks->first_missing))
+      rec_blocks->first_missing++;
+  }
+  coap_ticks(&rec_blocks->last_seen);
+  return 1;
+}
+
+/*
+ * Forget about all the received blocks, keeping the bitmap allocated for
+ * re-use.
+ */
+static void
+reset_received_blocks(coap_rblock_t *rec_blocks) {
+  if (rec_blocks->bitmap)
+    memset(rec_blocks->bitmap, 0, rec_blocks->bitmap_len);
+  rec_blocks->used = 0;
+  rec_blocks->first_missing = 0;
+  rec_blocks->highest = 0;
+}
+
+static int
+check_all_blocks_in(const coap_rblock_t *rec_blocks, size_t total_blocks) {
+  /* total_blocks counts from 1 */
+  return rec_blocks->used &&
+         rec_blocks->first_missing > rec_blocks->highest &&
+         rec_blocks->first_missing >= total_blocks;
+}
+
+/*
+ * Hold back block num of a body that is being passed on in order (next is
+ * the block wanted next) in window, which is allocated on first use and has
+ * room for slots blocks of chunk bytes.
+ *
+ * Return 1 if held back, 0 if block num is too far ahead.
+ */
+static int
+hold_back_block(uint8_t **window, uint32_t slots, uint32_t num, uint32_t next,
+                size_t chunk, const uint8_t *data, size_t length) {
+  if (num >= next + slots || length > chunk)
+    return 0;
+  if (!*window) {
+    *window = coap_malloc_type(COAP_STRING, slots * chunk);
+    if (!*window)
+      return 0;
+  }
+  memcpy(&(*window)[(num % slots) * chunk], data, length);
+  return 1;
+}
+
+/* The length of block num of a body that is length end (0 if not known) */
+static size_t
+held_back_length(uint32_t num, size_t chunk, size_t end) {
+  size_t offset = (size_t)num * chunk;
+
+  return end && offset + chunk > end ? end - offset : chunk;
+}
+
+/*
+ * Return the number of the block that follows the last payload set (of
+ * COAP_MAX_PAYLOADS blocks) that has been completely received, or 0 if the
+ * first payload set is not yet complete.
+ */
+static uint32_t
+q_block_sets_complete(const coap_rblock_t *rec_blocks) {
+  return (rec_blocks->first_missing / COAP_MAX_PAYLOADS) * COAP_MAX_PAYLOADS;
+}
+
+/*
+ * Build up a list of (up to COAP_MAX_PAYLOADS) missing blocks, checking up to
+ * the end of the payload set that the highest received block is in.
+ *
+ * Returns the number of blocks in missing.
+ */
+static uint32_t
+q_block_missing(const coap_rblock_t *rec_blocks, size_t total_blocks,
+                uint32_t *missing) {
+  uint32_t num;
+  uint32_t last;
+  uint32_t count = 0;
+
+  if (rec_blocks->used == 0)
+    return 0;
+  last = (rec_blocks->highest / COAP_MAX_PAYLOADS + 1) *
+         COAP_MAX_PAYLOADS - 1;
+  if (total_blocks && last >= total_blocks)
+    last = (uint32_t)(total_blocks - 1);
+  num = rec_blocks->first_missing;
+  for (; num <= last && count < COAP_MAX_PAYLOADS; num++) {
+    if (!check_if_received_block(rec_blocks, num))
+      missing[count++] = num;
+  }
+  return count;
+}
+
+/*
+ * Send block num of lg_xmit as a NON.  Q-Block1 requests use a new token for
+ * each block, Q-Block2 responses use the token of the request.
+ */
+static coap_mid_t
+send_q_block(coap_session_t *session, coap_lg_xmit_t *lg_xmit, uint32_t num,
+             const coap_bin_const_t *token) {
+  size_t chunk = (size_t)1 << (lg_xmit->blk_size + 4);
+  coap_pdu_t *pdu;
+  coap_block_b_t block;
+  uint8_t buf[8];
+
+  if (num * chunk >= lg_xmit->length)
+    return COAP_INVALID_MID;
+
+  if (COAP_PDU_IS_REQUEST(&lg_xmit->pdu)) {
+    uint64_t ltoken = STATE_TOKEN_FULL(lg_xmit->b.b1.state_token,
+                                       ++lg_xmit->b.b1.count);
+    size_t len = coap_encode_var_safe8(buf, sizeof(ltoken), ltoken);
+
+    pdu = coap_pdu_duplicate(&lg_xmit->pdu, session, len, buf, NULL);
+  } else {
+    coap_opt_filter_t drop_options;
+
+    memset(&drop_options, 0, sizeof(coap_opt_filter_t));
+    if (num != 0)
+      coap_option_filter_set(&drop_options, COAP_OPTION_OBSERVE);
+    pdu = coap_pdu_duplicate(&lg_xmit->pdu, session, token->length, token->s,
+                             &drop_options);
+  }
+  if (!pdu)
+    return COAP_INVALID_MID;
+  pdu->type = COAP_MESSAGE_NON;
+
+  memset(&block, 0, sizeof(block));
+  block.num = num;
+  block.szx = block.aszx = lg_xmit->blk_size;
+  block.m = (num + 1) * chunk < lg_xmit->length;
+  if (!coap_update_option(pdu, lg_xmit->option,
+                          coap_encode_var_safe(buf, sizeof(buf),
+                                               (block.num << 4) |
+                                               (block.m << 3) |
+                                               block.aszx),
+                          buf) ||
+      !coap_add_block_b_data(pdu, lg_xmit->length, lg_xmit->data, &block)) {
+    coap_delete_pdu(pdu);
+    return COAP_INVALID_MID;
+  }
+  coap_ticks(&lg_xmit->last_sent);
+  if (!block.m && !COAP_PDU_IS_REQUEST(&lg_xmit->pdu)) {
+    /* Last block - keep in cache for 4 * ACK_TIMOUT */
+    coap_ticks(&lg_xmit->last_all_sent);
+  }
+  lg_xmit_touch(session, lg_xmit);
+  return coap_send_internal(session, pdu);
+}
+
+#if COAP_SERVER_SUPPORT
+/*
+ * Encode num as a CBOR unsigned integer.
+ * Returns the number of bytes used in buf (which must be at least 5 bytes).
+ */
+static size_t
+cbor_put_uint(uint8_t *buf, uint32_t num) {
+  if (num < 24) {
+    buf[0] = (uint8_t)num;
+    return 1;
+  }
+  if (num <= 0xff) {
+    buf[0] = 0x18;
+    buf[1] = (uint8_t)num;
+    return 2;
+  }
+  if (num <= 0xffff) {
+    buf[0] = 0x19;
+    buf[1] = (uint8_t)(num >> 8);
+    buf[2] = (uint8_t)num;
+    return 3;
+  }
+  buf[0] = 0x1a;
+  buf[1] = (uint8_t)(num >> 24);
+  buf[2] = (uint8_t)(num >> 16);
+  buf[3] = (uint8_t)(num >> 8);
+  buf[4] = (uint8_t)num;
+  return 5;
+}
+
+void
+coap_block_send_q_block2_set(coap_session_t *session,
+                             const coap_pdu_t *request,
+                             coap_lg_xmit_t *lg_xmit) {
+  uint32_t num;
+
+  /* Block 0 has gone out as the response */
+  for (num = 1; num < COAP_MAX_PAYLOADS; num++) {
+    if (send_q_block(session, lg_xmit, num,
+                     &request->actual_token) == COAP_INVALID_MID)
+      break;
+  }
+  coap_ticks(&lg_xmit->last_payload);
+}
+#endif /* COAP_SERVER_SUPPORT */
+
+#if COAP_CLIENT_SUPPORT
+/*
+ * Decode a CBOR unsigned integer at the start of buf.
+ * Returns the number of bytes used, or 0 if there is no unsigned integer.
+ */
+static size_t
+cbor_get_uint(const uint8_t *buf, size_t len, uint32_t *num) {
+  size_t size;
+  size_t i;
+
+  if (len == 0 || (buf[0] & 0xe0) != 0)
+    return 0;
+  if (buf[0] < 24) {
+    *num = buf[0];
+    return 1;
+  }
+  switch (buf[0]) {
+  case 0x18:
+    size = 1;
+    break;
+  case 0x19:
+    size = 2;
+    break;
+  case 0x1a:
+    size = 4;
+    break;
+  default:
+    return 0;
+  }
+  if (len < size + 1)
+    return 0;
+  *num = 0;
+  for (i = 1; i <= size; i++)
+    *num = (*num << 8) | buf[i];
+  return size + 1;
+}
+
+void
+coap_block_send_q_block1_set(coap_session_t *session,
+                             coap_lg_xmit_t *lg_xmit) {
+  size_t chunk = (size_t)1 << (lg_xmit->blk_size + 4);
+  uint32_t num = (uint32_t)(lg_xmit->offset / chunk);
+  uint32_t last = (num / COAP_MAX_PAYLOADS + 1) * COAP_MAX_PAYLOADS - 1;
+
+  for (; num <= last; num++) {
+    if (send_q_block(session, lg_xmit, num, NULL) == COAP_INVALID_MID)
+      break;
+  }
+  lg_xmit->offset = num * chunk;
+  coap_ticks(&lg_xmit->last_payload);
+}
+
+/*
+ * A successful response to a request carrying a Q-Block option confirms
+ * that the peer supports Q-Block.
+ */
+static void
+check_q_block_support(coap_session_t *session, const coap_pdu_t *rcvd) {
+  if (COAP_BLOCK_Q_BLOCK_PROBE(session) &&
+      COAP_RESPONSE_CLASS(rcvd->code) == 2) {
+    coap_log_debug("** %s: Q-Block support confirmed\n",
+                   coap_session_str(session));
+    session->block_mode |= COAP_BLOCK_HAS_Q_BLOCK;
+  }
+}
+#endif /* COAP_CLIENT_SUPPORT */
+
+/*
+ * Check whether lg_xmit has timed out (or needs the next Q-Block1 payload
+ * set sending), reducing tim_rem to the time until it next needs checking.
+ */
+static void
+check_lg_xmit_timeout(coap_session_t *session, coap_lg_xmit_t *p,
+                      coap_tick_t now, coap_tick_t *tim_rem) {
+  coap_tick_t idle_timeout = 8 * COAP_TICKS_PER_SECOND;
+  coap_tick_t partial_timeout = COAP_MAX_TRANSMIT_WAIT_TICKS(session);
+
+  if (p->last_all_sent) {
+    if (p->last_all_sent + idle_timeout <= now) {
+      /* Expire this entry */
+      coap_block_unlink_lg_xmit(session, p);
+      coap_block_delete_lg_xmit(session, p);
+    }
+    else {
+      /* Delay until the lg_xmit needs to expire */
+      if (*tim_rem > p->last_all_sent + idle_timeout - now)
+        *tim_rem = p->last_all_sent + idle_timeout - now;
+    }
+  }
+  else if (p->last_sent) {
+    if (p->last_sent + partial_timeout <= now) {
+      /* Expire this entry */
+      coap_block_unlink_lg_xmit(session, p);
+      coap_block_delete_lg_xmit(session, p);
+      coap_handle_event(session->context, COAP_EVENT_XMIT_BLOCK_FAIL, session);
+    }
+    else {
+#if COAP_CLIENT_SUPPORT
+      if (p->non_burst &&
+          (p->offset < p->length ||
+           p->non_retry < COAP_NON_MAX_RETRANSMIT(session))) {
+        coap_tick_t non_timeout = COAP_NON_TIMEOUT_TICKS(session);
+
+        if (p->last_payload + non_timeout <= now) {
+          if (p->offset < p->length) {
+            /* No Continue seen - send the next payload set anyway */
+            coap_block_send_q_block1_set(session, p);
+          }
+          else {
+            /* No response - let the server know where the body ends */
+            size_t chunk = (size_t)1 << (p->blk_size + 4);
+
+            p->non_retry++;
+            send_q_block(session, p, (uint32_t)((p->length - 1) / chunk),
+                         NULL);
+            coap_ticks(&p->last_payload);
+          }
+        }
+        if (*tim_rem > p->last_payload + non_timeout - now)
+          *tim_rem = p->last_payload + non_timeout - now;
+      }
+#endif /* COAP_CLIENT_SUPPORT */
+      /* Delay until the lg_xmit needs to expire */
+      if (*tim_rem > p->last_sent + partial_timeout - now)
+        *tim_rem = p->last_sent + partial_timeout - now;
+    }
+  }
 }
-#endif /* ! COAP_SERVER_SUPPORT */
 
 /*
  * return 1 if there is a future expire time, else 0.
  * update tim_rem with remaining value if return is 1.
+ *
+ * All the entries are only checked when the earliest timeout found last time
+ * has been reached, otherwise just those that have changed since.
  */
 int
 coap_block_check_lg_xmit_timeouts(coap_session_t *session, coap_tick_t now,
                                   coap_tick_t *tim_rem) {
   coap_lg_xmit_t *p;
   coap_lg_xmit_t *q;
-  coap_tick_t idle_timeout = 8 * COAP_TICKS_PER_SECOND;
-  coap_tick_t partial_timeout = COAP_MAX_TRANSMIT_WAIT_TICKS(session);
-  int ret = 0;
 
-  *tim_rem = -1;
+  *tim_rem = COAP_TICK_NONE;
 
-  LL_FOREACH_SAFE(session->lg_xmit, p, q) {
-    if (p->last_all_sent) {
-      if (p->last_all_sent + idle_timeout <= now) {
-        /* Expire this entry */
-        LL_DELETE(session->lg_xmit, p);
-        coap_block_delete_lg_xmit(session, p);
-      }
-      else {
-        /* Delay until the lg_xmit needs to expire */
-        if (*tim_rem > p->last_all_sent + idle_timeout - now) {
-          *tim_rem = p->last_all_sent + idle_timeout - now;
-          ret = 1;
-        }
-      }
+  if (session->lg_xmit_due == 0 || session->lg_xmit_due <= now) {
+    while ((p = session->lg_xmit_dirty) != NULL) {
+      session->lg_xmit_dirty = p->dirty_next;
+      p->dirty = 0;
     }
-    else if (p->last_sent) {
-      if (p->last_sent + partial_timeout <= now) {
-        /* Expire this entry */
-        LL_DELETE(session->lg_xmit, p);
-        coap_block_delete_lg_xmit(session, p);
-        coap_handle_event(session->context, COAP_EVENT_XMIT_BLOCK_FAIL, session);
-      }
-      else {
-        /* Delay until the lg_xmit needs to expire */
-        if (*tim_rem > p->last_sent + partial_timeout - now) {
-          *tim_rem = p->last_sent + partial_timeout - now;
-          ret = 1;
-        }
-      }
+    LL_FOREACH_SAFE(session->lg_xmit, p, q) {
+      check_lg_xmit_timeout(session, p, now, tim_rem);
+    }
+  }
+  else {
+    if (session->lg_xmit_due != COAP_TICK_NONE)
+      *tim_rem = session->lg_xmit_due - now;
+    while ((p = session->lg_xmit_dirty) != NULL) {
+      session->lg_xmit_dirty = p->dirty_next;
+      p->dirty = 0;
+      check_lg_xmit_timeout(session, p, now, tim_rem);
     }
   }
-  return ret;
+  session->lg_xmit_due = *tim_rem == COAP_TICK_NONE ? COAP_TICK_NONE :
+                                                      now + *tim_rem;
+  return *tim_rem != COAP_TICK_NONE;
 }
 
 #if COAP_CLIENT_SUPPORT
+/*
+ * Ask for the missing Q-Block2 blocks, or for the next payload set if
+ * nothing is missing.
+ */
+static void
+request_q_block2_missing(coap_session_t *session, coap_lg_crcv_t *lg_crcv) {
+  size_t chunk = (size_t)1 << (lg_crcv->szx + 4);
+  size_t total = (lg_crcv->total_len + chunk - 1) / chunk;
+  uint32_t missing[COAP_MAX_PAYLOADS];
+  uint32_t count = q_block_missing(&lg_crcv->rec_blocks, total, missing);
+  uint64_t token = STATE_TOKEN_FULL(lg_crcv->state_token,
+                                    ++lg_crcv->retry_counter);
+  uint8_t buf[8];
+  size_t len = coap_encode_var_safe8(buf, sizeof(token), token);
+  coap_opt_filter_t drop_options;
+  coap_pdu_t *pdu;
+  uint32_t i;
+
+  memset(&drop_options, 0, sizeof(coap_opt_filter_t));
+  coap_option_filter_set(&drop_options, COAP_OPTION_Q_BLOCK2);
+  coap_option_filter_set(&drop_options, COAP_OPTION_OBSERVE);
+  pdu = coap_pdu_duplicate(&lg_crcv->pdu, session, len, buf, &drop_options);
+  if (!pdu)
+    return;
+
+  if (count == 0) {
+    uint32_t next = lg_crcv->rec_blocks.highest + 1;
+
+    if (total && next >= total) {
+      coap_delete_pdu(pdu);
+      return;
+    }
+    coap_add_option(pdu, COAP_OPTION_Q_BLOCK2,
+                    coap_encode_var_safe(buf, sizeof(buf),
+                                         (next << 4) | (1 << 3) |
+                                         lg_crcv->szx),
+                    buf);
+  }
+  for (i = 0; i < count; i++) {
+    coap_add_option(pdu, COAP_OPTION_Q_BLOCK2,
+                    coap_encode_var_safe(buf, sizeof(buf),
+                                         (missing[i] << 4) | lg_crcv->szx),
+                    buf);
+  }
+  coap_log_debug("** %s: Q-Block2 requesting %u missing block%s\n",
+                 coap_session_str(session), count, count == 1 ? "" : "s");
+  coap_send_internal(session, pdu);
+}
+
+/*
+ * Check whether lg_crcv has timed out (or needs to ask for missing Q-Block2
+ * blocks), reducing tim_rem to the time until it next needs checking.
+ */
+static void
+check_lg_crcv_timeout(coap_session_t *session, coap_lg_crcv_t *p,
+                      coap_tick_t now, coap_tick_t *tim_rem) {
+  coap_tick_t partial_timeout = COAP_MAX_TRANSMIT_WAIT_TICKS(session);
+
+  if (p->block_option == COAP_OPTION_Q_BLOCK2 &&
+      p->pdu.type == COAP_MESSAGE_NON && !p->initial &&
+      p->rec_blocks.used) {
+    coap_tick_t non_timeout = COAP_NON_RECEIVE_TIMEOUT_TICKS(session);
+
+    if (p->rec_blocks.last_seen + non_timeout <= now) {
+      if (p->rec_blocks.retry >= COAP_NON_MAX_RETRANSMIT(session)) {
+        /* Give up on getting the rest of the body */
+        coap_handle_event(session->context, COAP_EVENT_PARTIAL_BLOCK,
+                          session);
+        coap_block_unlink_lg_crcv(session, p);
+        coap_block_delete_lg_crcv(session, p);
+        return;
+      }
+      p->rec_blocks.retry++;
+      p->rec_blocks.last_seen = now;
+      request_q_block2_missing(session, p);
+    }
+    if (*tim_rem > p->rec_blocks.last_seen + non_timeout - now)
+      *tim_rem = p->rec_blocks.last_seen + non_timeout - now;
+  }
+  if (!p->observe_set && p->last_used &&
+      p->last_used + partial_timeout <= now) {
+    /* Expire this entry */
+    coap_block_unlink_lg_crcv(session, p);
+    coap_block_delete_lg_crcv(session, p);
+  }
+  else if (!p->observe_set && p->last_used) {
+    /* Delay until the lg_crcv needs to expire */
+    if (*tim_rem > p->last_used + partial_timeout - now)
+      *tim_rem = p->last_used + partial_timeout - now;
+  }
+}
+
 /*
  * return 1 if there is a future expire time, else 0.
  * update tim_rem with remaining value if return is 1.
+ *
+ * All the entries are only checked when the earliest timeout found last time
+ * has been reached, otherwise just those that have changed since.
  */
 int
 coap_block_check_lg_crcv_timeouts(coap_session_t *session, coap_tick_t now,
                                   coap_tick_t *tim_rem) {
   coap_lg_crcv_t *p;
   coap_lg_crcv_t *q;
-  coap_tick_t partial_timeout = COAP_MAX_TRANSMIT_WAIT_TICKS(session);
-  int ret = 0;
 
-  *tim_rem = -1;
+  *tim_rem = COAP_TICK_NONE;
 
-  LL_FOREACH_SAFE(session->lg_crcv, p, q) {
-    if (!p->observe_set && p->last_used &&
-        p->last_used + partial_timeout <= now) {
-      /* Expire this entry */
-      LL_DELETE(session->lg_crcv, p);
-      coap_block_delete_lg_crcv(session, p);
-    }
-    else if (!p->observe_set && p->last_used) {
-      /* Delay until the lg_crcv needs to expire */
-      if (*tim_rem > p->last_used + partial_timeout - now) {
-        *tim_rem = p->last_used + partial_timeout - now;
-        ret = 1;
-      }
+  if (session->lg_crcv_due == 0 || session->lg_crcv_due <= now) {
+    while ((p = session->lg_crcv_dirty) != NULL) {
+      session->lg_crcv_dirty = p->dirty_next;
+      p->dirty = 0;
+    }
+    LL_FOREACH_SAFE(session->lg_crcv, p, q) {
+      check_lg_crcv_timeout(session, p, now, tim_rem);
+    }
+  }
+  else {
+    if (session->lg_crcv_due != COAP_TICK_NONE)
+      *tim_rem = session->lg_crcv_due - now;
+    while ((p = session->lg_crcv_dirty) != NULL) {
+      session->lg_crcv_dirty = p->dirty_next;
+      p->dirty = 0;
+      check_lg_crcv_timeout(session, p, now, tim_rem);
     }
   }
-  return ret;
+  session->lg_crcv_due = *tim_rem == COAP_TICK_NONE ? COAP_TICK_NONE :
+                                                      now + *tim_rem;
+  return *tim_rem != COAP_TICK_NONE;
 }
 #endif /* COAP_CLIENT_SUPPORT */
 
+#if COAP_SERVER_SUPPORT
+/*
+ * Send a 4.08 listing the missing Q-Block1 blocks as a CBOR sequence.
+ *
+ * Returns 1 if the 4.08 was sent, else 0.
+ */
 static int
-check_if_received_block(coap_rblock_t *rec_blocks, uint32_t block_num) {
+respond_q_block1_missing(coap_session_t *session, coap_lg_srcv_t *lg_srcv) {
+  size_t chunk = (size_t)1 << (lg_srcv->szx + 4);
+  size_t total = (lg_srcv->total_len + chunk - 1) / chunk;
+  uint32_t missing[COAP_MAX_PAYLOADS];
+  uint32_t count = q_block_missing(&lg_srcv->rec_blocks, total, missing);
+  uint8_t data[COAP_MAX_PAYLOADS * 5];
+  size_t data_len = 0;
+  uint8_t buf[4];
+  coap_pdu_t *pdu;
   uint32_t i;
 
-  for (i = 0; i < rec_blocks->used; i++) {
-    if (block_num < rec_blocks->range[i].begin)
-      return 0;
-    if (block_num <= rec_blocks->range[i].end)
-      return 1;
+  if (count == 0)
+    return 0;
+  pdu = coap_pdu_init(COAP_MESSAGE_NON, COAP_RESPONSE_CODE(408),
+                      coap_new_message_id(session),
+                      coap_session_max_pdu_size(session));
+  if (!pdu)
+    return 0;
+  for (i = 0; i < count; i++)
+    data_len += cbor_put_uint(&data[data_len], missing[i]);
+  if (!coap_add_token(pdu, lg_srcv->last_token->length,
+                      lg_srcv->last_token->s) ||
+      !coap_add_option(pdu, COAP_OPTION_CONTENT_FORMAT,
+                       coap_encode_var_safe(buf, sizeof(buf),
+                                 COAP_MEDIATYPE_APPLICATION_MB_CBOR_SEQ),
+                       buf) ||
+      !coap_add_data(pdu, data_len, data)) {
+    coap_delete_pdu(pdu);
+    return 0;
   }
-  return 0;
+  coap_log_debug("** %s: Q-Block1 requesting %u missing block%s\n",
+                 coap_session_str(session), count, count == 1 ? "" : "s");
+  return coap_send_internal(session, pdu) != COAP_INVALID_MID;
 }
 
-static int
-check_all_blocks_in(coap_rblock_t *rec_blocks, size_t total_blocks) {
-  uint32_t i;
-  uint32_t block = 0;
+/*
+ * Check whether lg_srcv has timed out (or needs to ask for missing Q-Block1
+ * blocks), reducing tim_rem to the time until it next needs checking.
+ */
+static void
+check_lg_srcv_timeout(coap_session_t *session, coap_lg_srcv_t *p,
+                      coap_tick_t now, coap_tick_t *tim_rem) {
+  coap_tick_t partial_timeout = COAP_MAX_TRANSMIT_WAIT_TICKS(session);
 
-  for (i = 0; i < rec_blocks->used; i++) {
-    if (block < rec_blocks->range[i].begin)
-      return 0;
-    if (block < rec_blocks->range[i].end)
-      block = rec_blocks->range[i].end;
+  if (p->block_option == COAP_OPTION_Q_BLOCK1 &&
+      p->last_type == COAP_MESSAGE_NON && p->last_token &&
+      p->rec_blocks.used) {
+    coap_tick_t non_timeout = COAP_NON_RECEIVE_TIMEOUT_TICKS(session);
+
+    if (p->rec_blocks.last_seen + non_timeout <= now) {
+      if (p->rec_blocks.retry >= COAP_NON_MAX_RETRANSMIT(session)) {
+        /* Give up on getting the rest of the body */
+        coap_handle_event(session->context, COAP_EVENT_PARTIAL_BLOCK,
+                          session);
+        coap_block_unlink_lg_srcv(session, p);
+        coap_block_delete_lg_srcv(session, p);
+        return;
+      }
+      if (respond_q_block1_missing(session, p))
+        p->rec_blocks.retry++;
+      p->rec_blocks.last_seen = now;
+    }
+    if (*tim_rem > p->rec_blocks.last_seen + non_timeout - now)
+      *tim_rem = p->rec_blocks.last_seen + non_timeout - now;
+  }
+  if (p->last_used && p->last_used + partial_timeout <= now) {
+    /* Expire this entry */
+    coap_block_unlink_lg_srcv(session, p);
+    coap_block_delete_lg_srcv(session, p);
+  }
+  else if (p->last_used) {
+    /* Delay until the lg_srcv needs to expire */
+    if (*tim_rem > p->last_used + partial_timeout - now)
+      *tim_rem = p->last_used + partial_timeout - now;
   }
-  /* total_blocks counts from 1 */
-  if (block + 1 < total_blocks)
-    return 0;
-
-  return 1;
 }
 
-#if COAP_SERVER_SUPPORT
 /*
  * return 1 if there is a future expire time, else 0.
  * update tim_rem with remaining value if return is 1.
+ *
+ * All the entries are only checked when the earliest timeout found last time
+ * has been reached, otherwise just those that have changed since.
  */
 int
 coap_block_check_lg_srcv_timeouts(coap_session_t *session, coap_tick_t now,
                                   coap_tick_t *tim_rem) {
   coap_lg_srcv_t *p;
   coap_lg_srcv_t *q;
-  coap_tick_t partial_timeout = COAP_MAX_TRANSMIT_WAIT_TICKS(session);
-  int ret = 0;
 
-  *tim_rem = -1;
+  *tim_rem = COAP_TICK_NONE;
 
-  LL_FOREACH_SAFE(session->lg_srcv, p, q) {
-    if (p->last_used && p->last_used + partial_timeout <= now) {
-      /* Expire this entry */
-      LL_DELETE(session->lg_srcv, p);
-      coap_block_delete_lg_srcv(session, p);
+  if (session->lg_srcv_due == 0 || session->lg_srcv_due <= now) {
+    while ((p = session->lg_srcv_dirty) != NULL) {
+      session->lg_srcv_dirty = p->dirty_next;
+      p->dirty = 0;
     }
-    else if (p->last_used) {
-      /* Delay until the lg_srcv needs to expire */
-      if (*tim_rem > p->last_used + partial_timeout - now) {
-        *tim_rem = p->last_used + partial_timeout - now;
-        ret = 1;
-      }
+    LL_FOREACH_SAFE(session->lg_srcv, p, q) {
+      check_lg_srcv_timeout(session, p, now, tim_rem);
+    }
+  }
+  else {
+    if (session->lg_srcv_due != COAP_TICK_NONE)
+      *tim_rem = session->lg_srcv_due - now;
+    while ((p = session->lg_srcv_dirty) != NULL) {
+      session->lg_srcv_dirty = p->dirty_next;
+      p->dirty = 0;
+      check_lg_srcv_timeout(session, p, now, tim_rem);
     }
   }
-  return ret;
+  session->lg_srcv_due = *tim_rem == COAP_TICK_NONE ? COAP_TICK_NONE :
+                                                      now + *tim_rem;
+  return *tim_rem != COAP_TICK_NONE;
 }
 #endif /* COAP_SERVER_SUPPORT */
 
@@ -1289,6 +2196,8 @@ coap_block_delete_lg_crcv(coap_session_t *session,
   if (lg_crcv->pdu.token)
     coap_free_type(COAP_PDU_BUF, lg_crcv->pdu.token - lg_crcv->pdu.max_hdr_size);
   coap_free_type(COAP_STRING, lg_crcv->body_data);
+  coap_free_type(COAP_STRING, lg_crcv->rec_blocks.bitmap);
+  coap_free_type(COAP_STRING, lg_crcv->stream_window);
   coap_log_debug("** %s: lg_crcv %p released\n",
            coap_session_str(session), (void*)lg_crcv);
   coap_delete_binary(lg_crcv->app_token);
@@ -1308,7 +2217,10 @@ coap_block_delete_lg_srcv(coap_session_t *session,
     return;
 
   coap_delete_str_const(lg_srcv->uri_path);
+  coap_delete_bin_const(lg_srcv->last_token);
   coap_free_type(COAP_STRING, lg_srcv->body_data);
+  coap_free_type(COAP_STRING, lg_srcv->rec_blocks.bitmap);
+  coap_free_type(COAP_STRING, lg_srcv->sink_window);
   coap_log_debug("** %s: lg_srcv %p released\n",
          coap_session_str(session), (void*)lg_srcv);
   coap_free_type(COAP_LG_SRCV, lg_srcv);
@@ -1347,8 +2259,8 @@ add_block_send(uint32_t num, uint32_t *out_blocks,
     if (num == out_blocks[i])
       return 0;
     else if (num < out_blocks[i]) {
-      if (*count - i > 1)
-        memmove(&out_blocks[i], &out_blocks[i+1], *count - i -1);
+      memmove(&out_blocks[i+1], &out_blocks[i],
+              (*count - i) * sizeof(out_blocks[0]));
       out_blocks[i] = num;
       (*count)++;
       return 1;
@@ -1386,7 +2298,9 @@ coap_handle_request_send_block(coap_session_t *session,
   coap_lg_xmit_t *p = NULL;
   coap_block_b_t block;
   uint16_t block_opt = 0;
-  uint32_t out_blocks[1];
+  uint32_t out_blocks[COAP_MAX_PAYLOADS];
+  uint32_t max_blocks = 1;
+  uint32_t q_count = 0;
   const char *error_phrase;
   coap_opt_iterator_t opt_iter;
   size_t chunk;
@@ -1396,16 +2310,35 @@ coap_handle_request_send_block(coap_session_t *session,
   coap_opt_t *etag_opt = NULL;
   coap_pdu_t *out_pdu = response;
 
-  if (!coap_get_block_b(session, pdu, COAP_OPTION_BLOCK2, &block))
+  if (coap_get_block_b(session, pdu, COAP_OPTION_BLOCK2, &block)) {
+    block_opt = COAP_OPTION_BLOCK2;
+  }
+  else if (coap_get_block_b(session, pdu, COAP_OPTION_Q_BLOCK2, &block)) {
+    block_opt = COAP_OPTION_Q_BLOCK2;
+    if (pdu->type == COAP_MESSAGE_NON) {
+      coap_opt_filter_t q_filter;
+
+      /* Can be a Continue or a list of missing blocks */
+      coap_option_filter_clear(&q_filter);
+      coap_option_filter_set(&q_filter, COAP_OPTION_Q_BLOCK2);
+      coap_option_iterator_init(pdu, &opt_b_iter, &q_filter);
+      while (coap_option_next(&opt_b_iter))
+        q_count++;
+      max_blocks = COAP_MAX_PAYLOADS;
+    }
+  }
+  else {
     return 0;
-  if (block.num == 0) {
+  }
+  if (block.num == 0 &&
+      (block_opt == COAP_OPTION_BLOCK2 || (!block.m && q_count <= 1))) {
     /* Get a fresh copy of the data */
     return 0;
   }
-  block_opt = COAP_OPTION_BLOCK2;
   p = coap_find_lg_xmit_response(session, pdu, resource, query);
-  if (p == NULL)
+  if (p == NULL || p->option != block_opt)
     return 0;
+  lg_xmit_touch(session, p);
 
   /* lg_xmit (response) found */
 
@@ -1479,8 +2412,22 @@ coap_handle_request_send_block(coap_session_t *session,
       response->code = COAP_RESPONSE_CODE(400);
       return 1;
     }
-    add_block_send(num, out_blocks, &request_cnt, 1);
-    break;
+    if (max_blocks == 1) {
+      add_block_send(num, out_blocks, &request_cnt, 1);
+      break;
+    }
+    if (COAP_OPT_BLOCK_MORE(option)) {
+      /* Continue - send the rest of the payload set starting at num */
+      unsigned int last = (num / COAP_MAX_PAYLOADS + 1) *
+                          COAP_MAX_PAYLOADS - 1;
+
+      for (; num <= last && num * chunk < p->length; num++)
+        add_block_send(num, out_blocks, &request_cnt, max_blocks);
+      break;
+    }
+    /* Missing block */
+    if (num * chunk < p->length)
+      add_block_send(num, out_blocks, &request_cnt, max_blocks);
   }
   if (request_cnt == 0) {
     /* Block2 not found - give them the first block */
@@ -1611,62 +2558,45 @@ skip_app_handler:
 }
 #endif /* COAP_SERVER_SUPPORT */
 
+#if COAP_SERVER_SUPPORT
+/*
+ * Pass block num of the body to the resource's block1_sink, followed by any
+ * blocks held back in sink_window that are now in order.  Out of order
+ * blocks are held back in sink_window.
+ *
+ * Return 1 if the block has been taken, 0 if it cannot be held back (too
+ * far ahead) and -1 if the block1_sink aborted the transfer.
+ */
 static int
-update_received_blocks(coap_rblock_t *rec_blocks, uint32_t block_num) {
-  uint32_t i;
-
-  /* Reset as there is activity */
-  rec_blocks->retry = 0;
-
-  for (i = 0; i < rec_blocks->used; i++) {
-    if (block_num >= rec_blocks->range[i].begin &&
-        block_num <= rec_blocks->range[i].end)
-      break;
-
-    if (block_num < rec_blocks->range[i].begin) {
-      if (block_num + 1 == rec_blocks->range[i].begin) {
-        rec_blocks->range[i].begin = block_num;
-      }
-      else {
-        /* Need to insert a new range */
-        if (rec_blocks->used == COAP_RBLOCK_CNT -1)
-          /* Too many losses */
-          return 0;
-        memmove(&rec_blocks->range[i+1], &rec_blocks->range[i],
-                (rec_blocks->used - i) * sizeof (rec_blocks->range[0]));
-        rec_blocks->range[i].begin = rec_blocks->range[i].end = block_num;
-        rec_blocks->used++;
-      }
-      break;
-    }
-    if (block_num == rec_blocks->range[i].end + 1) {
-      rec_blocks->range[i].end = block_num;
-      if (i + 1 < rec_blocks->used) {
-        if (rec_blocks->range[i+1].begin == block_num + 1) {
-          /* Merge the 2 ranges */
-          rec_blocks->range[i].end = rec_blocks->range[i+1].end;
-          if (i+2 < rec_blocks->used) {
-            memmove (&rec_blocks->range[i+1], &rec_blocks->range[i+2],
-                   (rec_blocks->used - (i+2)) * sizeof (rec_blocks->range[0]));
-          }
-          rec_blocks->used--;
-        }
-      }
-      break;
-    }
-  }
-  if (i == rec_blocks->used) {
-    if (rec_blocks->used == COAP_RBLOCK_CNT -1)
-      /* Too many losses */
-      return 0;
-    rec_blocks->range[i].begin = rec_blocks->range[i].end = block_num;
-    rec_blocks->used++;
+lg_srcv_sink_block(coap_session_t *session, coap_lg_srcv_t *p,
+                   const coap_pdu_t *pdu, uint32_t num, size_t chunk,
+                   const uint8_t *data, size_t length, int last) {
+  coap_block1_sink_t sink = p->resource->block1_sink;
+  size_t offset = (size_t)num * chunk;
+  uint32_t next = (uint32_t)(p->sink_offset / chunk);
+
+  if (last)
+    p->sink_end = offset + length;
+  if (num != next)
+    return hold_back_block(&p->sink_window, COAP_BLOCK1_SINK_WINDOW, num,
+                           next, chunk, data, length);
+  if (sink(p->resource, session, pdu, offset, data, length, p->total_len) <= 0)
+    return -1;
+  p->sink_offset = offset + length;
+
+  /* Pass on the held back blocks that now follow on */
+  while (p->sink_window && check_if_received_block(&p->rec_blocks, ++num)) {
+    offset = (size_t)num * chunk;
+    length = held_back_length(num, chunk, p->sink_end);
+    if (sink(p->resource, session, pdu, offset,
+             &p->sink_window[(num % COAP_BLOCK1_SINK_WINDOW) * chunk],
+             length, p->total_len) <= 0)
+      return -1;
+    p->sink_offset = offset + length;
   }
-  coap_ticks(&rec_blocks->last_seen);
   return 1;
 }
 
-#if COAP_SERVER_SUPPORT
 /*
  * Need to check if this is a large PUT / POST using multiple blocks
  *
@@ -1702,6 +2632,9 @@ coap_handle_request_put_block(coap_context_t *context,
   if (coap_get_block_b(session, pdu, COAP_OPTION_BLOCK1, &block)) {
     block_option = COAP_OPTION_BLOCK1;
   }
+  else if (coap_get_block_b(session, pdu, COAP_OPTION_Q_BLOCK1, &block)) {
+    block_option = COAP_OPTION_Q_BLOCK1;
+  }
   if (block_option) {
     coap_lg_srcv_t *p;
     coap_opt_t *size_opt = coap_check_option(pdu,
@@ -1723,23 +2656,9 @@ coap_handle_request_put_block(coap_context_t *context,
                                         coap_opt_length(size_opt)) : 0;
     offset = block.num << (block.szx + 4);
 
-    LL_FOREACH(session->lg_srcv, p) {
-      if (rtag_opt || p->rtag_set == 1) {
-        if (!(rtag_opt && p->rtag_set == 1))
-          continue;
-        if (p->rtag_length != rtag_length ||
-            memcmp(p->rtag, rtag, rtag_length) != 0)
-          continue;
-      }
-      if (resource == p->resource) {
-        break;
-      }
-      if ((p->resource == context->unknown_resource ||
-           resource == context->proxy_uri_resource) &&
-          coap_string_equal(uri_path, p->uri_path))
-        break;
-    }
-    if (!p && block.num != 0) {
+    p = find_lg_srcv(context, session, resource, uri_path, rtag_opt != NULL,
+                     rtag, rtag_length);
+    if (!p && block.num != 0 && block_option == COAP_OPTION_BLOCK1) {
       /* random access - no need to track */
       pdu->body_data = data;
       pdu->body_length = length;
@@ -1761,7 +2680,7 @@ coap_handle_request_put_block(coap_context_t *context,
       coap_ticks(&p->last_used);
       p->resource = resource;
       if (resource == context->unknown_resource ||
-          resource == context->proxy_uri_resource)
+          resource == context->proxy_uri_resource || resource->is_template)
         p->uri_path = coap_new_str_const(uri_path->s, uri_path->length);
       p->content_format = fmt;
       p->total_len = total;
@@ -1779,9 +2698,10 @@ coap_handle_request_put_block(coap_context_t *context,
         p->rtag_set = 1;
       }
       p->body_data = NULL;
-      LL_PREPEND(session->lg_srcv, p);
+      coap_block_link_lg_srcv(session, p);
     }
     if (p) {
+      lg_srcv_touch(session, p);
       if (fmt != p->content_format) {
         coap_add_data(response, sizeof("Content-Format mismatch")-1,
                       (const uint8_t *)"Content-Format mismatch");
@@ -1790,16 +2710,45 @@ coap_handle_request_put_block(coap_context_t *context,
       }
       p->last_mid = pdu->mid;
       p->last_type = pdu->type;
-      if ((session->block_mode & COAP_BLOCK_SINGLE_BODY) || block.bert) {
+      if (block_option == COAP_OPTION_Q_BLOCK1) {
+        /* Needed for requesting any missing blocks */
+        coap_delete_bin_const(p->last_token);
+        p->last_token = coap_new_bin_const(pdu->actual_token.s,
+                                           pdu->actual_token.length);
+      }
+      if ((session->block_mode & COAP_BLOCK_SINGLE_BODY) || block.bert ||
+          block_option == COAP_OPTION_Q_BLOCK1) {
         size_t chunk = (size_t)1 << (block.szx + 4);
         int update_data = 0;
         unsigned int saved_num = block.num;
         size_t saved_offset = offset;
+        int sink = p->resource && p->resource->block1_sink;
 
         while (offset < saved_offset + length) {
           if (!check_if_received_block(&p->rec_blocks, block.num)) {
+            int taken = 1;
+
+            if (sink) {
+              size_t left = saved_offset + length - offset;
+
+              taken = lg_srcv_sink_block(session, p, pdu, block.num, chunk,
+                                         &data[offset - saved_offset],
+                                         min(left, chunk),
+                                         !block.m && left <= chunk);
+              if (taken == -1) {
+                response->code = COAP_RESPONSE_CODE(500);
+                goto free_lg_srcv;
+              }
+            }
             /* Update list of blocks received */
-            if (!update_received_blocks(&p->rec_blocks, block.num)) {
+            if (!taken ||
+                !update_received_blocks(&p->rec_blocks, block.num)) {
+              if (block_option == COAP_OPTION_Q_BLOCK1 &&
+                  pdu->type == COAP_MESSAGE_NON) {
+                /* Drop it - will be asked for again as a missing block */
+                response->code = 0;
+                goto skip_app_handler;
+              }
               coap_handle_event(context, COAP_EVENT_PARTIAL_BLOCK, session);
               coap_add_data(response, sizeof("Too many missing blocks")-1,
                             (const uint8_t *)"Too many missing blocks");
@@ -1812,7 +2761,7 @@ coap_handle_request_put_block(coap_context_t *context,
           offset = block.num << (block.szx + 4);
         }
         block.num--;
-        if (update_data) {
+        if (update_data && !sink) {
           /* Update saved data */
           p->body_data = coap_block_build_body(p->body_data, length, data,
                                                saved_offset, p->total_len);
@@ -1820,10 +2769,34 @@ coap_handle_request_put_block(coap_context_t *context,
             goto call_app_handler;
 
         }
-        if (block.m ||
+        /* Q-Block1 payloads can arrive in any order */
+        if ((block.m &&
+             (block_option != COAP_OPTION_Q_BLOCK1 || !p->total_len)) ||
             !check_all_blocks_in(&p->rec_blocks,
                                 (uint32_t)(p->total_len + chunk -1)/chunk)) {
           /* Not all the payloads of the body have arrived */
+          if (block_option == COAP_OPTION_Q_BLOCK1 &&
+              pdu->type == COAP_MESSAGE_NON) {
+            uint32_t next = q_block_sets_complete(&p->rec_blocks);
+
+            if (update_data && next > saved_num) {
+              uint8_t buf[4];
+
+              /* This block completed a payload set - ask for the next set */
+              coap_insert_option(response, block_option,
+                               coap_encode_var_safe(buf, sizeof(buf),
+                                 ((next - 1) << 4) |
+                                 (1 << 3) |
+                                 block.aszx),
+                               buf);
+              response->code = COAP_RESPONSE_CODE(231);
+            }
+            else {
+              /* No response - wait for the rest of the payload set */
+              response->code = 0;
+            }
+            goto skip_app_handler;
+          }
           if (block.m) {
             uint8_t buf[4];
 
@@ -1850,10 +2823,23 @@ coap_handle_request_put_block(coap_context_t *context,
                              p->observe_length, p->observe);
         }
         coap_remove_option(pdu, block_option);
-        pdu->body_data = p->body_data->s;
-        pdu->body_length = p->total_len;
-        pdu->body_offset = 0;
-        pdu->body_total = p->total_len;
+        if (sink) {
+          /* The body has all been passed to the block1_sink */
+          if (pdu->data) {
+            pdu->used_size = pdu->data - pdu->token - 1;
+            pdu->data = NULL;
+          }
+          pdu->body_data = NULL;
+          pdu->body_length = 0;
+          pdu->body_offset = 0;
+          pdu->body_total = 0;
+        }
+        else {
+          pdu->body_data = p->body_data->s;
+          pdu->body_length = p->total_len;
+          pdu->body_offset = 0;
+          pdu->body_total = p->total_len;
+        }
         coap_log_debug("Server app version of updated PDU\n");
         coap_show_pdu(COAP_LOG_DEBUG, pdu);
         *pfree_lg_srcv = p;
@@ -1892,7 +2878,7 @@ coap_handle_request_put_block(coap_context_t *context,
       goto call_app_handler;
 
 free_lg_srcv:
-      LL_DELETE(session->lg_srcv, p);
+      coap_block_unlink_lg_srcv(session, p);
       coap_block_delete_lg_srcv(session, p);
       goto skip_app_handler;
     }
@@ -1969,7 +2955,7 @@ check_freshness(coap_session_t *session, coap_pdu_t *rcvd, coap_pdu_t *sent,
           coap_decode_var_bytes(coap_opt_value(opt), coap_opt_length(opt) == 0)) {
         /* Need to update the base PDU's Token for closing down Observe */
         if (lg_xmit) {
-          lg_xmit->b.b1.state_token = token;
+          coap_block_set_lg_xmit_token(session, lg_xmit, token);
         } else {
           lg_crcv->state_token = token;
         }
@@ -2021,25 +3007,106 @@ int
 coap_handle_response_send_block(coap_session_t *session, coap_pdu_t *sent,
                                 coap_pdu_t *rcvd) {
   coap_lg_xmit_t *p;
-  coap_lg_xmit_t *q;
-  uint64_t token_match =
-          STATE_TOKEN_BASE(coap_decode_var_bytes8(rcvd->actual_token.s,
-                                                  rcvd->actual_token.length));
   coap_lg_crcv_t *lg_crcv = NULL;
 
-  LL_FOREACH_SAFE(session->lg_xmit, p, q) {
-    if (!COAP_PDU_IS_REQUEST(&p->pdu) ||
-        (token_match != STATE_TOKEN_BASE(p->b.b1.state_token) &&
-         token_match !=
-           STATE_TOKEN_BASE(coap_decode_var_bytes8(p->b.b1.app_token->s,
-                                                 p->b.b1.app_token->length)))) {
-      /* try out the next one */
-      continue;
-    }
+  p = find_lg_xmit_request(session, &rcvd->actual_token);
+  if (p) {
     /* lg_xmit found */
+    lg_xmit_touch(session, p);
     size_t chunk = (size_t)1 << (p->blk_size + 4);
     coap_block_b_t block;
 
+    if (p->option == COAP_OPTION_Q_BLOCK1) {
+      check_q_block_support(session, rcvd);
+      if (p->pdu.type == COAP_MESSAGE_NON &&
+          (session->block_mode & COAP_BLOCK_HAS_Q_BLOCK))
+        /* Send the remaining payloads as NON payload sets */
+        p->non_burst = 1;
+
+      if (rcvd->code == COAP_RESPONSE_CODE(402) &&
+          COAP_BLOCK_Q_BLOCK_PROBE(session)) {
+        /* Q-Block1 not understood - restart the transfer using Block1 */
+        uint8_t buf[8];
+        coap_pdu_t *pdu;
+        uint64_t token = STATE_TOKEN_FULL(p->b.b1.state_token, ++p->b.b1.count);
+        size_t len = coap_encode_var_safe8(buf, sizeof(token), token);
+
+        coap_log_debug("** %s: Q-Block not supported, using Block1\n",
+                       coap_session_str(session));
+        session->block_mode |= COAP_BLOCK_NOT_Q_BLOCK;
+        coap_remove_option(&p->pdu, COAP_OPTION_Q_BLOCK1);
+        coap_remove_option(&p->pdu, COAP_OPTION_Q_BLOCK2);
+        p->option = COAP_OPTION_BLOCK1;
+        p->non_burst = 0;
+        p->last_block = -1;
+        p->offset = 0;
+
+        pdu = coap_pdu_duplicate(&p->pdu, session, len, buf, NULL);
+        if (!pdu)
+          goto fail_body;
+        memset(&block, 0, sizeof(block));
+        block.szx = block.aszx = p->blk_size;
+        block.m = chunk < p->length;
+        coap_update_option(pdu, p->option,
+                           coap_encode_var_safe(buf, sizeof(buf),
+                             (block.m << 3) | block.aszx),
+                           buf);
+        if (!coap_add_block_b_data(pdu, p->length, p->data, &block))
+          goto fail_body;
+        p->b.b1.bert_size = block.chunk_size;
+        coap_ticks(&p->last_sent);
+        if (coap_send_internal(session, pdu) == COAP_INVALID_MID)
+          goto fail_body;
+        return 1;
+      }
+    }
+    if (p->non_burst) {
+      coap_opt_iterator_t opt_iter;
+      coap_opt_t *fmt_opt;
+
+      if (rcvd->code == COAP_RESPONSE_CODE(231) &&
+          coap_get_block_b(session, rcvd, p->option, &block)) {
+        /* Continue - the payload set up to block.num has arrived */
+        track_echo(session, rcvd);
+        p->non_retry = 0;
+        if ((int)block.num > p->last_block) {
+          p->last_block = block.num;
+          if ((block.num + 1) * chunk < p->length &&
+              (block.num + 1) * chunk >= p->offset) {
+            p->offset = (block.num + 1) * chunk;
+            coap_block_send_q_block1_set(session, p);
+          }
+        }
+        return 1;
+      }
+      fmt_opt = coap_check_option(rcvd, COAP_OPTION_CONTENT_FORMAT, &opt_iter);
+      if (rcvd->code == COAP_RESPONSE_CODE(408) && fmt_opt &&
+          coap_decode_var_bytes(coap_opt_value(fmt_opt),
+                                coap_opt_length(fmt_opt)) ==
+          COAP_MEDIATYPE_APPLICATION_MB_CBOR_SEQ) {
+        /* List of missing blocks to send again */
+        size_t length;
+        const uint8_t *data;
+        size_t used;
+        uint32_t num;
+        uint32_t i;
+
+        p->non_retry = 0;
+        if (coap_get_data(rcvd, &length, &data)) {
+          for (i = 0; i < COAP_MAX_PAYLOADS; i++) {
+            used = cbor_get_uint(data, length, &num);
+            if (used == 0)
+              break;
+            send_q_block(session, p, num, NULL);
+            data += used;
+            length -= used;
+          }
+        }
+        coap_ticks(&p->last_payload);
+        return 1;
+      }
+    }
+
     if (COAP_RESPONSE_CLASS(rcvd->code) == 2 &&
         coap_get_block_b(session, rcvd, p->option, &block)) {
 
@@ -2103,20 +3170,19 @@ coap_handle_response_send_block(coap_session_t *session, coap_pdu_t *sent,
 
         if (p->pdu.code == COAP_REQUEST_CODE_FETCH) {
           /* Need to handle Observe for large FETCH */
-          LL_FOREACH(session->lg_crcv, lg_crcv) {
-            if (coap_binary_equal(p->b.b1.app_token, lg_crcv->app_token)) {
-              coap_bin_const_t *new_token;
-              coap_bin_const_t ctoken = { len, buf };
-
-              /* Need to save/restore Observe Token for large FETCH */
-              new_token = track_fetch_observe(&p->pdu, lg_crcv, block.num + 1,
-                                              &ctoken);
-              if (new_token) {
-                assert(len <= sizeof(buf));
-                len = new_token->length;
-                memcpy(buf, new_token->s, len);
-              }
-              break;
+          lg_crcv = coap_find_lg_crcv_app(session,
+                                     (coap_bin_const_t *)p->b.b1.app_token);
+          if (lg_crcv) {
+            coap_bin_const_t *new_token;
+            coap_bin_const_t ctoken = { len, buf };
+
+            /* Need to save/restore Observe Token for large FETCH */
+            new_token = track_fetch_observe(&p->pdu, lg_crcv, block.num + 1,
+                                            &ctoken);
+            if (new_token) {
+              assert(len <= sizeof(buf));
+              len = new_token->length;
+              memcpy(buf, new_token->s, len);
             }
           }
         }
@@ -2156,7 +3222,7 @@ coap_handle_response_send_block(coap_session_t *session, coap_pdu_t *sent,
         return 1;
     }
     goto lg_xmit_finished;
-  } /* end of LL_FOREACH_SAFE */
+  }
   return 0;
 
 fail_body:
@@ -2164,17 +3230,12 @@ fail_body:
   /* There has been an internal error of some sort */
   rcvd->code = COAP_RESPONSE_CODE(500);
 lg_xmit_finished:
-  if (session->lg_crcv) {
-    LL_FOREACH(session->lg_crcv, lg_crcv) {
-      if (STATE_TOKEN_BASE(p->b.b1.state_token) ==
-          STATE_TOKEN_BASE(lg_crcv->state_token)) {
-        /* In case of observe */
-        lg_crcv->state_token = p->b.b1.state_token;
-        break;
-      }
-    }
+  HASH_FIND(hh, session->lg_crcv_hash, &p->hkey, sizeof(p->hkey), lg_crcv);
+  if (lg_crcv) {
+    /* In case of observe */
+    lg_crcv->state_token = p->b.b1.state_token;
   }
-  if (!lg_crcv) {
+  else {
     /* need to put back original token into rcvd */
     if (p->b.b1.app_token)
       coap_update_token(rcvd, p->b.b1.app_token->length,
@@ -2183,7 +3244,7 @@ lg_xmit_finished:
     coap_show_pdu(COAP_LOG_DEBUG, rcvd);
   }
 
-  LL_DELETE(session->lg_xmit, p);
+  coap_block_unlink_lg_xmit(session, p);
   coap_block_delete_lg_xmit(session, p);
   return 0;
 }
@@ -2233,6 +3294,70 @@ coap_block_build_body(coap_binary_t *body_data, size_t length,
 }
 
 #if COAP_CLIENT_SUPPORT
+/*
+ * Pass the part of a COAP_BLOCK_STREAM_BODY body at offset to the response
+ * handler.
+ *
+ * Return 0 if the response handler does not want any more of the body.
+ */
+static int
+lg_crcv_stream_data(coap_context_t *context, coap_session_t *session,
+                    coap_pdu_t *sent, coap_pdu_t *rcvd, coap_lg_crcv_t *p,
+                    size_t offset, const uint8_t *data, size_t length) {
+  rcvd->body_data = data;
+  rcvd->body_length = length;
+  rcvd->body_offset = offset;
+  if (p->stream_end)
+    rcvd->body_total = p->stream_end;
+  else if (p->total_len > offset + length)
+    rcvd->body_total = p->total_len;
+  else
+    rcvd->body_total = offset + length + 1;
+  p->stream_offset = offset + length;
+  if (!context->response_handler)
+    return 1;
+  coap_log_debug("Client app version of updated PDU (stream)\n");
+  coap_show_pdu(COAP_LOG_DEBUG, rcvd);
+  return context->response_handler(session, sent, rcvd,
+                                   rcvd->mid) != COAP_RESPONSE_FAIL;
+}
+
+/*
+ * Pass block num of a COAP_BLOCK_STREAM_BODY body to the response handler,
+ * followed by any blocks held back in stream_window that are now in order.
+ * Out of order blocks are held back in stream_window.
+ *
+ * Return 1 if the block has been taken, 0 if it cannot be held back (too
+ * far ahead) and -1 if the response handler does not want any more.
+ */
+static int
+lg_crcv_stream_block(coap_context_t *context, coap_session_t *session,
+                     coap_pdu_t *sent, coap_pdu_t *rcvd, coap_lg_crcv_t *p,
+                     uint32_t num, size_t chunk, const uint8_t *data,
+                     size_t length, int last) {
+  size_t offset = (size_t)num * chunk;
+  uint32_t next = (uint32_t)(p->stream_offset / chunk);
+
+  if (last)
+    p->stream_end = offset + length;
+  if (num != next)
+    return hold_back_block(&p->stream_window, COAP_BLOCK2_STREAM_WINDOW, num,
+                           next, chunk, data, length);
+  if (!lg_crcv_stream_data(context, session, sent, rcvd, p, offset,
+                           data, length))
+    return -1;
+
+  /* Pass on the held back blocks that now follow on */
+  while (p->stream_window && check_if_received_block(&p->rec_blocks, ++num)) {
+    if (!lg_crcv_stream_data(context, session, sent, rcvd, p,
+                             (size_t)num * chunk,
+                 &p->stream_window[(num % COAP_BLOCK2_STREAM_WINDOW) * chunk],
+                             held_back_length(num, chunk, p->stream_end)))
+      return -1;
+  }
+  return 1;
+}
+
 /*
  * Need to see if this is a large body response to a request. If so,
  * need to initiate the request for the next block and not trouble the
@@ -2256,23 +3381,17 @@ coap_handle_response_get_block(coap_context_t *context,
   uint16_t block_opt = 0;
   size_t offset;
   int ack_rst_sent = 0;
-  uint64_t token_match =
-          STATE_TOKEN_BASE(coap_decode_var_bytes8(rcvd->actual_token.s,
-                                                  rcvd->actual_token.length));
+  int stream = (session->block_mode & COAP_BLOCK_STREAM_BODY) != 0;
 
   memset(&block, 0, sizeof(block));
-  LL_FOREACH(session->lg_crcv, p) {
+  p = find_lg_crcv(session, &rcvd->actual_token);
+  if (p) {
     size_t chunk = 0;
     uint8_t buf[8];
     coap_opt_iterator_t opt_iter;
 
-    if (token_match != STATE_TOKEN_BASE(p->state_token) &&
-      !coap_binary_equal(&rcvd->actual_token, p->app_token)) {
-      /* try out the next one */
-      continue;
-    }
-
     /* lg_crcv found */
+    lg_crcv_touch(session, p);
 
     if (COAP_RESPONSE_CLASS(rcvd->code) == 2) {
       size_t length;
@@ -2291,6 +3410,12 @@ coap_handle_response_get_block(coap_context_t *context,
         have_block = 1;
         block_opt = COAP_OPTION_BLOCK2;
       }
+      else if (coap_get_block_b(session, rcvd, COAP_OPTION_Q_BLOCK2, &block)) {
+        have_block = 1;
+        block_opt = COAP_OPTION_Q_BLOCK2;
+      }
+      if (coap_check_option(&p->pdu, COAP_OPTION_Q_BLOCK2, &opt_iter))
+        check_q_block_support(session, rcvd);
       track_echo(session, rcvd);
       if (have_block && (block.m || length)) {
         coap_opt_t *fmt_opt = coap_check_option(rcvd,
@@ -2336,7 +3461,9 @@ coap_handle_response_get_block(coap_context_t *context,
           p->szx = block.szx;
           p->block_option = block_opt;
           p->last_type = rcvd->type;
-          p->rec_blocks.used = 0;
+          p->stream_offset = 0;
+          p->stream_end = 0;
+          reset_received_blocks(&p->rec_blocks);
         }
         if (p->total_len < size2)
           p->total_len = size2;
@@ -2352,6 +3479,18 @@ coap_handle_response_get_block(coap_context_t *context,
             size_t len = coap_encode_var_safe8(buf, sizeof(token), token);
             coap_opt_filter_t drop_options;
 
+            if (stream) {
+              /*
+               * The response handler has had some of the old body, so
+               * cannot be given the new one from the start.
+               */
+              coap_log_warn(
+                   "Data body updated during receipt - transfer abandoned\n");
+              coap_handle_event(context, COAP_EVENT_PARTIAL_BLOCK, session);
+              coap_block_unlink_lg_crcv(session, p);
+              coap_block_delete_lg_crcv(session, p);
+              goto skip_app_handler;
+            }
             coap_log_warn(
                  "Data body updated during receipt - new request started\n");
             if (!(session->block_mode & COAP_BLOCK_SINGLE_BODY))
@@ -2402,11 +3541,42 @@ coap_handle_response_get_block(coap_context_t *context,
             p->observe_set = 0;
           }
         }
+        if (stream) {
+          /* The response handler only sees the body, not the blocks */
+          if (!coap_binary_equal(&rcvd->actual_token, p->app_token))
+            coap_update_token(rcvd, p->app_token->length, p->app_token->s);
+          coap_remove_option(rcvd, block_opt);
+          (void)coap_get_data(rcvd, &length, &data);
+        }
         updated_block = 0;
         while (offset < saved_offset + length) {
           if (!check_if_received_block(&p->rec_blocks, block.num)) {
+            int taken = 1;
+
+            if (stream) {
+              size_t left = saved_offset + length - offset;
+
+              taken = lg_crcv_stream_block(context, session, sent, rcvd, p,
+                                           block.num, chunk,
+                                           &data[offset - saved_offset],
+                                           min(left, chunk),
+                                           !block.m && left <= chunk);
+              if (taken == -1) {
+                /* Response handler does not want any more of the body */
+                coap_send_rst(session, rcvd);
+                ack_rst_sent = 1;
+                coap_block_unlink_lg_crcv(session, p);
+                coap_block_delete_lg_crcv(session, p);
+                goto skip_app_handler;
+              }
+            }
             /* Update list of blocks received */
-            if (!update_received_blocks(&p->rec_blocks, block.num)) {
+            if (!taken ||
+                !update_received_blocks(&p->rec_blocks, block.num)) {
+              if (block_opt == COAP_OPTION_Q_BLOCK2 &&
+                  p->pdu.type == COAP_MESSAGE_NON)
+                /* Drop it - will be asked for again as a missing block */
+                goto skip_app_handler;
               coap_handle_event(context, COAP_EVENT_PARTIAL_BLOCK, session);
               goto fail_resp;
             }
@@ -2420,22 +3590,46 @@ coap_handle_response_get_block(coap_context_t *context,
         block.num--;
         /* Only process if not duplicate block */
         if (updated_block) {
-          if ((session->block_mode & COAP_BLOCK_SINGLE_BODY) || block.bert) {
+          if (!stream &&
+              ((session->block_mode & COAP_BLOCK_SINGLE_BODY) || block.bert ||
+               block_opt == COAP_OPTION_Q_BLOCK2)) {
             p->body_data = coap_block_build_body(p->body_data, length, data,
                                                  saved_offset, size2);
             if (p->body_data == NULL) {
               goto fail_resp;
             }
           }
-          if (block.m || !check_all_blocks_in(&p->rec_blocks,
-                                              (size2 + chunk -1) / chunk)) {
+          /* Q-Block2 payloads can arrive in any order */
+          if (block_opt == COAP_OPTION_Q_BLOCK2 ?
+              !check_all_blocks_in(&p->rec_blocks,
+                                   (p->total_len + chunk -1) / chunk) :
+              (block.m || !check_all_blocks_in(&p->rec_blocks,
+                                               (size2 + chunk -1) / chunk))) {
             /* Not all the payloads of the body have arrived */
             size_t len;
             coap_pdu_t *pdu;
             uint64_t token;
-
-            if (block.m) {
-              block.m = 0;
+            int ask_next = block.m;
+            uint8_t next_m = 0;
+
+            if (block_opt == COAP_OPTION_Q_BLOCK2 &&
+                p->pdu.type == COAP_MESSAGE_NON) {
+              /*
+               * Ask for the next payload set once the current one is
+               * complete, or straight away if this block came back in an
+               * ACK (the server will not have sent a payload set).
+               */
+              uint32_t next = rcvd->type != COAP_MESSAGE_NON ?
+                              block.num + 1 :
+                              q_block_sets_complete(&p->rec_blocks);
+
+              ask_next = next > block.num && next * chunk < p->total_len;
+              if (ask_next)
+                block.num = next - 1;
+              next_m = 1;
+            }
+            if (ask_next) {
+              block.m = next_m;
 
               /* Ask for the next block */
               token = STATE_TOKEN_FULL(p->state_token, ++p->retry_counter);
@@ -2459,7 +3653,9 @@ coap_handle_response_get_block(coap_context_t *context,
               if (coap_send_internal(session, pdu) == COAP_INVALID_MID)
                 goto fail_resp;
             }
-            if (session->block_mode & (COAP_BLOCK_SINGLE_BODY) || block.bert)
+            if (stream ||
+                session->block_mode & (COAP_BLOCK_SINGLE_BODY) || block.bert ||
+                block_opt == COAP_OPTION_Q_BLOCK2)
               goto skip_app_handler;
 
             /* need to put back original token into rcvd */
@@ -2470,9 +3666,16 @@ coap_handle_response_get_block(coap_context_t *context,
             coap_show_pdu(COAP_LOG_DEBUG, rcvd);
             goto call_app_handler;
           }
+          if (stream) {
+            /* All of the body has already been passed on */
+            coap_send_ack(session, rcvd);
+            ack_rst_sent = 1;
+            goto body_done;
+          }
           /* need to put back original token into rcvd */
           coap_update_token(rcvd, p->app_token->length, p->app_token->s);
-          if (session->block_mode & (COAP_BLOCK_SINGLE_BODY) || block.bert) {
+          if (session->block_mode & (COAP_BLOCK_SINGLE_BODY) || block.bert ||
+              block_opt == COAP_OPTION_Q_BLOCK2) {
             /* Pretend that there is no block */
             coap_remove_option(rcvd, block_opt);
             if (p->observe_set) {
@@ -2480,7 +3683,8 @@ coap_handle_response_get_block(coap_context_t *context,
                                  p->observe_length, p->observe);
             }
             rcvd->body_data = p->body_data->s;
-            rcvd->body_length = saved_offset + length;
+            rcvd->body_length = block_opt == COAP_OPTION_Q_BLOCK2 ?
+                                p->total_len : saved_offset + length;
             rcvd->body_offset = 0;
             rcvd->body_total = rcvd->body_length;
           }
@@ -2488,6 +3692,16 @@ coap_handle_response_get_block(coap_context_t *context,
             rcvd->body_offset = saved_offset;
             rcvd->body_total = size2;
           }
+#if COAP_SERVER_SUPPORT
+          if (session->proxy_upstream) {
+            /* Relay the response to a request forwarded by the proxy */
+            if (coap_proxy_forward_response(session, rcvd) ==
+                COAP_RESPONSE_FAIL)
+              coap_send_rst(session, rcvd);
+            else
+              coap_send_ack(session, rcvd);
+          } else
+#endif /* COAP_SERVER_SUPPORT */
           if (context->response_handler) {
             if (block.m != 0 || block.num != 0) {
               coap_log_debug("Client app version of updated PDU (1)\n");
@@ -2503,9 +3717,10 @@ coap_handle_response_get_block(coap_context_t *context,
             coap_send_ack(session, rcvd);
           }
           ack_rst_sent = 1;
+body_done:
           if (p->observe_set == 0) {
             /* Expire this entry */
-            LL_DELETE(session->lg_crcv, p);
+            coap_block_unlink_lg_crcv(session, p);
             coap_block_delete_lg_crcv(session, p);
             goto skip_app_handler;
           }
@@ -2549,6 +3764,31 @@ coap_handle_response_get_block(coap_context_t *context,
 #endif /* !HAVE_OSCORE */
         goto skip_app_handler;
       goto expire_lg_crcv;
+    } else if (rcvd->code == COAP_RESPONSE_CODE(402) &&
+               COAP_BLOCK_Q_BLOCK_PROBE(session) &&
+               coap_check_option(&p->pdu, COAP_OPTION_Q_BLOCK2, &opt_iter)) {
+      /* Q-Block2 not understood - ask again without it */
+      coap_pdu_t *pdu;
+      uint64_t token = STATE_TOKEN_FULL(p->state_token, ++p->retry_counter);
+      size_t len = coap_encode_var_safe8(buf, sizeof(token), token);
+      size_t length;
+      const uint8_t *data;
+
+      coap_log_debug("** %s: Q-Block not supported, using Block2\n",
+                     coap_session_str(session));
+      session->block_mode |= COAP_BLOCK_NOT_Q_BLOCK;
+      coap_remove_option(&p->pdu, COAP_OPTION_Q_BLOCK2);
+      pdu = coap_pdu_duplicate(&p->pdu, session, len, buf, NULL);
+      if (!pdu)
+        goto expire_lg_crcv;
+      if (sent && coap_get_data(sent, &length, &data) &&
+          !coap_add_data(pdu, length, data)) {
+        coap_delete_pdu(pdu);
+        goto expire_lg_crcv;
+      }
+      if (coap_send_internal(session, pdu) == COAP_INVALID_MID)
+        goto expire_lg_crcv;
+      goto skip_app_handler;
     } else {
       /* Not 2.xx or 4.01 - assume it is a failure of some sort */
       goto expire_lg_crcv;
@@ -2566,11 +3806,12 @@ fail_resp:
       coap_log_debug("Client app version of updated PDU (3)\n");
       coap_show_pdu(COAP_LOG_DEBUG, rcvd);
     }
-    break;
-  } /* LL_FOREACH() */
+  }
 
   /* Check if receiving a block response and if blocks can be set up */
   if (recursive == COAP_RECURSE_OK && !p) {
+    coap_opt_iterator_t opt_iter;
+
     if (!sent) {
       if (coap_get_block_b(session, rcvd, COAP_OPTION_BLOCK2, &block)) {
         coap_log_debug("** %s: large body receive internal issue\n",
@@ -2578,9 +3819,11 @@ fail_resp:
         goto skip_app_handler;
       }
     } else if (COAP_RESPONSE_CLASS(rcvd->code) == 2) {
-      if (coap_get_block_b(session, rcvd, COAP_OPTION_BLOCK2, &block)) {
+      if (coap_check_option(sent, COAP_OPTION_Q_BLOCK2, &opt_iter))
+        check_q_block_support(session, rcvd);
+      if (coap_get_block_b(session, rcvd, COAP_OPTION_BLOCK2, &block) ||
+          coap_get_block_b(session, rcvd, COAP_OPTION_Q_BLOCK2, &block)) {
         have_block = 1;
-        block_opt = COAP_OPTION_BLOCK2;
         if (block.num != 0) {
           /* Assume random access and just give the single response to app */
           size_t length;
@@ -2597,17 +3840,19 @@ fail_resp:
         coap_lg_crcv_t *lg_crcv = coap_block_new_lg_crcv(session, sent, NULL);
 
         if (lg_crcv) {
-          LL_PREPEND(session->lg_crcv, lg_crcv);
+          coap_block_link_lg_crcv(session, lg_crcv);
           return coap_handle_response_get_block(context, session, sent, rcvd,
                                                 COAP_RECURSE_NO);
         }
       }
       track_echo(session, rcvd);
-    } else if (rcvd->code == COAP_RESPONSE_CODE(401)) {
+    } else if (rcvd->code == COAP_RESPONSE_CODE(401) ||
+               (rcvd->code == COAP_RESPONSE_CODE(402) &&
+                coap_check_option(sent, COAP_OPTION_Q_BLOCK2, &opt_iter))) {
       coap_lg_crcv_t *lg_crcv = coap_block_new_lg_crcv(session, sent, NULL);
 
       if (lg_crcv) {
-        LL_PREPEND(session->lg_crcv, lg_crcv);
+        coap_block_link_lg_crcv(session, lg_crcv);
         return coap_handle_response_get_block(context, session, sent, rcvd,
                                               COAP_RECURSE_NO);
       }
@@ -2623,7 +3868,7 @@ expire_lg_crcv:
     coap_show_pdu(COAP_LOG_DEBUG, rcvd);
   }
   /* Expire this entry */
-  LL_DELETE(session->lg_crcv, p);
+  coap_block_unlink_lg_crcv(session, p);
   coap_block_delete_lg_crcv(session, p);
 
 call_app_handler:
@@ -2665,20 +3910,20 @@ coap_check_update_token(coap_session_t *session, coap_pdu_t *pdu) {
   coap_lg_crcv_t *lg_crcv;
 
   if (session->lg_crcv) {
-    LL_FOREACH(session->lg_crcv, lg_crcv) {
+    lg_crcv = find_lg_crcv(session, &pdu->actual_token);
+    if (lg_crcv) {
       if (coap_binary_equal(&pdu->actual_token, lg_crcv->app_token))
         return;
-      if (token_match == STATE_TOKEN_BASE(lg_crcv->state_token)) {
-        coap_update_token(pdu, lg_crcv->app_token->length,
-                          lg_crcv->app_token->s);
-        coap_log_debug("Client app version of updated PDU\n");
-        coap_show_pdu(COAP_LOG_DEBUG, pdu);
-        return;
-      }
+      coap_update_token(pdu, lg_crcv->app_token->length,
+                        lg_crcv->app_token->s);
+      coap_log_debug("Client app version of updated PDU\n");
+      coap_show_pdu(COAP_LOG_DEBUG, pdu);
+      return;
     }
   }
   if (COAP_PDU_IS_REQUEST(pdu) && session->lg_xmit) {
-    LL_FOREACH(session->lg_xmit, lg_xmit) {
+    lg_xmit = find_lg_xmit_request(session, &pdu->actual_token);
+    if (lg_xmit) {
       if (coap_binary_equal(&pdu->actual_token, lg_xmit->b.b1.app_token))
         return;
       if (token_match == STATE_TOKEN_BASE(lg_xmit->b.b1.state_token)) {
@@ -167,69 +167,19 @@ update_port(coap_address_t *addr, uint16_t port, uint16_t default_port) {
 #include <netdb.h>
 #endif
 
-coap_addr_info_t *
-coap_resolve_address_info(const coap_str_const_t *server,
-                          uint16_t port,
-                          uint16_t secure_port,
-                          int ai_hints_flags,
-                          int scheme_hint_bits) {
-
-  struct addrinfo *res, *ainfo;
-  struct addrinfo hints;
-  static char addrstr[256];
-  int error;
+/*
+ * Converts the getaddrinfo() results in res to coap_addr_info_t, for the
+ * schemes in scheme_hint_bits.
+ */
+static coap_addr_info_t *
+coap_addr_info_from_addrinfo(struct addrinfo *res, uint16_t port,
+                             uint16_t secure_port, int scheme_hint_bits) {
+  struct addrinfo *ainfo;
   coap_addr_info_t *info = NULL;
   coap_addr_info_t *info_prev = NULL;
   coap_addr_info_t *info_list = NULL;
   coap_uri_scheme_t scheme;
 
-#if !defined(WITH_LWIP) && !defined(WITH_CONTIKI)
-  if (server && coap_host_is_unix_domain(server)) {
-    /* There can only be one unique filename entry for AF_UNIX */
-    if (server->length >= COAP_UNIX_PATH_MAX) {
-      coap_log_err("Unix Domain host too long\n");
-      return NULL;
-    }
-    info = coap_malloc_type(COAP_STRING, sizeof(coap_addr_info_t));
-    if (info == NULL)
-      return NULL;
-    info->next = NULL;
-
-    /* Need to chose the first defined one  in scheme_hint_bits */
-    for (scheme = 0; scheme < COAP_URI_SCHEME_LAST; scheme++) {
-      if (scheme_hint_bits & (1 << scheme)) {
-        info->scheme = scheme;
-        break;
-      }
-    }
-    if (scheme == COAP_URI_SCHEME_LAST)
-      return NULL;
-
-    coap_address_init(&info->addr);
-    coap_address_set_unix_domain(&info->addr, server->s,
-                                 server->length);
-    return info;
-  }
-#endif /* ! WITH_LWIP && ! WITH_CONTIKI */
-
-  memset(addrstr, 0, sizeof(addrstr));
-  if (server && server->length)
-    memcpy(addrstr, server->s, server->length);
-  else
-    memcpy(addrstr, "localhost", 9);
-
-  memset ((char *)&hints, 0, sizeof(hints));
-  hints.ai_socktype = 0;
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_flags = ai_hints_flags;
-
-  error = getaddrinfo(addrstr, NULL, &hints, &res);
-
-  if (error != 0) {
-    coap_log_warn("getaddrinfo: %s\n", gai_strerror(error));
-    return NULL;
-  }
-
   for (ainfo = res; ainfo != NULL; ainfo = ainfo->ai_next) {
     if (ainfo->ai_addrlen > (socklen_t)sizeof(info->addr.addr))
       continue;
@@ -355,10 +305,725 @@ coap_resolve_address_info(const coap_str_const_t *server,
     }
   }
 
+  return info_list;
+}
+
+coap_addr_info_t *
+coap_resolve_address_info(const coap_str_const_t *server,
+                          uint16_t port,
+                          uint16_t secure_port,
+                          int ai_hints_flags,
+                          int scheme_hint_bits) {
+
+  struct addrinfo *res;
+  struct addrinfo hints;
+  static char addrstr[256];
+  int error;
+  coap_addr_info_t *info = NULL;
+  coap_addr_info_t *info_list = NULL;
+  coap_uri_scheme_t scheme;
+
+#if !defined(WITH_LWIP) && !defined(WITH_CONTIKI)
+  if (server && coap_host_is_unix_domain(server)) {
+    /* There can only be one unique filename entry for AF_UNIX */
+    if (server->length >= COAP_UNIX_PATH_MAX) {
+      coap_log_err("Unix Domain host too long\n");
+      return NULL;
+    }
+    info = coap_malloc_type(COAP_STRING, sizeof(coap_addr_info_t));
+    if (info == NULL)
+      return NULL;
+    info->next = NULL;
+
+    /* Need to chose the first defined one  in scheme_hint_bits */
+    for (scheme = 0; scheme < COAP_URI_SCHEME_LAST; scheme++) {
+      if (scheme_hint_bits & (1 << scheme)) {
+        info->scheme = scheme;
+        break;
+      }
+    }
+    if (scheme == COAP_URI_SCHEME_LAST)
+      return NULL;
+
+    coap_address_init(&info->addr);
+    coap_address_set_unix_domain(&info->addr, server->s,
+                                 server->length);
+    return info;
+  }
+#endif /* ! WITH_LWIP && ! WITH_CONTIKI */
+
+  memset(addrstr, 0, sizeof(addrstr));
+  if (server && server->length)
+    memcpy(addrstr, server->s, server->length);
+  else
+    memcpy(addrstr, "localhost", 9);
+
+  memset ((char *)&hints, 0, sizeof(hints));
+  hints.ai_socktype = 0;
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_flags = ai_hints_flags;
+
+  error = getaddrinfo(addrstr, NULL, &hints, &res);
+
+  if (error != 0) {
+    coap_log_warn("getaddrinfo: %s\n", gai_strerror(error));
+    return NULL;
+  }
+
+  info_list = coap_addr_info_from_addrinfo(res, port, secure_port,
+                                          scheme_hint_bits);
   freeaddrinfo(res);
   return info_list;
 }
-#endif /* !WITH_CONTIKI */
+
+/*
+ * Names are looked up by a pool of up to COAP_RESOLVE_WORKERS long-lived
+ * worker threads, taking them in turn from a queue, so that a name that is
+ * slow to look up does not hold up the others. A worker wakes the I/O loop of
+ * the context through a pipe once each is done.
+ */
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_CREATE) && \
+    !defined(WITH_LWIP) && !defined(RIOT_VERSION) && !defined(_WIN32)
+#define COAP_RESOLVE_THREAD 1
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef COAP_EPOLL_SUPPORT
+#include <sys/epoll.h>
+#endif /* COAP_EPOLL_SUPPORT */
+
+/* Guards the queue, and what the worker sets in coap_resolve_entry_t */
+static pthread_mutex_t coap_resolve_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Signalled when the queue is added to, or the workers are to stop */
+static pthread_cond_t coap_resolve_cond = PTHREAD_COND_INITIALIZER;
+/* Entries waiting for a worker, oldest first */
+static coap_resolve_entry_t *coap_resolve_queue = NULL;
+/* The worker threads running, and those of them waiting for the queue */
+static unsigned int coap_resolve_workers = 0;
+static unsigned int coap_resolve_idle = 0;
+/* Set by coap_cleanup(), so that the workers exit once the queue is empty */
+static int coap_resolve_stop = 0;
+#else /* ! (HAVE_PTHREAD_H && HAVE_PTHREAD_CREATE && ...) */
+#define COAP_RESOLVE_THREAD 0
+#endif /* ! (HAVE_PTHREAD_H && HAVE_PTHREAD_CREATE && ...) */
+
+#if !defined(WITH_LWIP)
+#define COAP_ADDR_FAMILY(a) ((a)->addr.sa.sa_family)
+#else /* WITH_LWIP */
+#define COAP_ADDR_FAMILY(a) 0
+#endif /* WITH_LWIP */
+
+/* Copies the addresses of entry, those of its preferred family first */
+static coap_addr_info_t *
+coap_resolve_entry_addresses(const coap_resolve_entry_t *entry) {
+  const coap_addr_info_t *info;
+  coap_addr_info_t *copy = NULL;
+  coap_addr_info_t **last = &copy;
+  int pass;
+
+  for (pass = entry->prefer_family ? 0 : 1; pass < 2; pass++) {
+    for (info = entry->info_list; info; info = info->next) {
+      if (entry->prefer_family &&
+          (COAP_ADDR_FAMILY(&info->addr) == entry->prefer_family) != !pass)
+        continue;
+      *last = coap_malloc_type(COAP_STRING, sizeof(coap_addr_info_t));
+      if (!*last)
+        return copy;
+      memcpy(*last, info, sizeof(coap_addr_info_t));
+      (*last)->next = NULL;
+      last = &(*last)->next;
+    }
+  }
+  return copy;
+}
+
+static void
+coap_resolve_waiters_free(coap_resolve_waiter_t *waiters) {
+  coap_resolve_waiter_t *waiter, *wtmp;
+
+  LL_FOREACH_SAFE(waiters, waiter, wtmp) {
+    coap_free_address_info(waiter->info_list);
+    coap_free_type(COAP_STRING, waiter);
+  }
+}
+
+static void
+coap_resolve_entry_free(coap_resolve_entry_t *entry) {
+  coap_resolve_waiters_free(entry->waiters);
+  coap_free_address_info(entry->info_list);
+  coap_free_type(COAP_STRING, entry);
+}
+
+static void
+coap_resolve_entry_set(coap_resolve_entry_t *entry,
+                       coap_addr_info_t *info_list, coap_tick_t now) {
+  entry->info_list = info_list;
+  entry->resolving = 0;
+  entry->expire = now + (info_list ? COAP_RESOLVE_CACHE_TTL :
+                         COAP_RESOLVE_CACHE_FAIL_TTL) * COAP_TICKS_PER_SECOND;
+}
+
+#if COAP_RESOLVE_THREAD
+static void *
+coap_resolve_thread(void *arg COAP_UNUSED) {
+  coap_resolve_entry_t *entry;
+  struct addrinfo hints;
+  struct addrinfo *res;
+  int error;
+
+  pthread_mutex_lock(&coap_resolve_mutex);
+  while (1) {
+    coap_resolve_idle++;
+    while (!coap_resolve_queue && !coap_resolve_stop)
+      pthread_cond_wait(&coap_resolve_cond, &coap_resolve_mutex);
+    coap_resolve_idle--;
+    if (!coap_resolve_queue)
+      break;
+    entry = coap_resolve_queue;
+    LL_DELETE2(coap_resolve_queue, entry, next_queued);
+    entry->running = 1;
+    pthread_mutex_unlock(&coap_resolve_mutex);
+
+    res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_flags = entry->ai_hints_flags;
+    error = getaddrinfo(entry->host, NULL, &hints, &res);
+
+    pthread_mutex_lock(&coap_resolve_mutex);
+    if (entry->abandoned) {
+      if (error == 0)
+        freeaddrinfo(res);
+      coap_free_type(COAP_STRING, entry);
+      continue;
+    }
+    entry->res = error == 0 ? res : NULL;
+    entry->error = error;
+    entry->done = 1;
+    /* The pipe is not closed while the context has the entry */
+    if (write(entry->wake_fd, "", 1) == -1) {
+      /* A full pipe already wakes the I/O loop */
+    }
+  }
+  coap_resolve_workers--;
+  pthread_mutex_unlock(&coap_resolve_mutex);
+  return NULL;
+}
+
+/* IP literals are not looked up, so are resolved without the worker */
+static int
+coap_host_is_literal(const char *host) {
+  struct in_addr addr4;
+  struct in6_addr addr6;
+
+  return inet_pton(AF_INET, host, &addr4) == 1 ||
+         inet_pton(AF_INET6, host, &addr6) == 1;
+}
+
+static int
+coap_resolve_wake_init(coap_context_t *context) {
+  int i;
+
+  if (pipe(context->resolve_fd) == -1) {
+    coap_log_warn("coap_resolve: pipe: %s\n", coap_socket_strerror());
+    context->resolve_fd[0] = context->resolve_fd[1] = -1;
+    return 0;
+  }
+  for (i = 0; i < 2; i++) {
+    if (fcntl(context->resolve_fd[i], F_SETFL,
+              fcntl(context->resolve_fd[i], F_GETFL) | O_NONBLOCK) == -1)
+      coap_log_warn("coap_resolve: fcntl: %s\n", coap_socket_strerror());
+  }
+#ifdef COAP_EPOLL_SUPPORT
+  {
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    /* Special cased by coap_io_do_epoll() */
+    event.data.ptr = context->resolve_fd;
+    if (epoll_ctl(context->epfd, EPOLL_CTL_ADD, context->resolve_fd[0],
+                  &event) == -1)
+      coap_log_warn("coap_resolve: epoll_ctl ADD failed: %s\n",
+                    coap_socket_strerror());
+  }
+#endif /* COAP_EPOLL_SUPPORT */
+  return 1;
+}
+
+/* Queues entry for a worker thread, returning 0 if it is not to be */
+static int
+coap_resolve_start(coap_context_t *context, coap_resolve_entry_t *entry) {
+  coap_resolve_entry_t *queued;
+  unsigned int waiting = 0;
+  pthread_attr_t attr;
+  pthread_t thread;
+  int ret = 0;
+
+  if (coap_host_is_literal(entry->host))
+    return 0;
+  if (context->resolve_fd[0] == -1 && !coap_resolve_wake_init(context))
+    return 0;
+  entry->wake_fd = context->resolve_fd[1];
+
+  pthread_mutex_lock(&coap_resolve_mutex);
+  LL_COUNT2(coap_resolve_queue, queued, waiting, next_queued);
+  /* Another worker is started if all the idle ones have a name to look up */
+  if (coap_resolve_idle <= waiting &&
+      coap_resolve_workers < COAP_RESOLVE_WORKERS) {
+    ret = pthread_attr_init(&attr);
+    if (ret == 0) {
+      pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+      ret = pthread_create(&thread, &attr, coap_resolve_thread, NULL);
+      pthread_attr_destroy(&attr);
+    }
+    if (ret == 0) {
+      coap_resolve_workers++;
+    } else {
+      coap_log_warn("coap_resolve: pthread_create: %s\n", strerror(ret));
+      if (!coap_resolve_workers) {
+        pthread_mutex_unlock(&coap_resolve_mutex);
+        return 0;
+      }
+      /* Left to the workers already running */
+    }
+  }
+  /* Workers that have been told to stop, but not yet, carry on */
+  coap_resolve_stop = 0;
+  LL_APPEND2(coap_resolve_queue, entry, next_queued);
+  pthread_cond_signal(&coap_resolve_cond);
+  pthread_mutex_unlock(&coap_resolve_mutex);
+
+  entry->resolving = 1;
+  coap_log_debug("coap_resolve: resolving '%s'\n", entry->host);
+  return 1;
+}
+#endif /* COAP_RESOLVE_THREAD */
+
+/*
+ * Looks server up in the cache of context. If it is not there, it is queued
+ * for the worker thread unless blocking is set, or it cannot be, when it is
+ * resolved there and then.
+ */
+static int
+coap_resolve_lookup(coap_context_t *context,
+                    const coap_str_const_t *server,
+                    uint16_t port,
+                    uint16_t secure_port,
+                    int ai_hints_flags,
+                    int scheme_hint_bits,
+                    int blocking,
+                    coap_resolve_handler_t handler,
+                    void *app_data,
+                    coap_addr_info_t **info_list) {
+  coap_resolve_entry_t *entry, *etmp;
+  coap_resolve_entry_t *oldest = NULL;
+  coap_resolve_entry_t *found = NULL;
+  coap_resolve_waiter_t *waiter;
+  const char *host = server && server->length ? (const char *)server->s :
+                     "localhost";
+  size_t host_length = server && server->length ? server->length : 9;
+  size_t count = 0;
+  size_t pending = 0;
+  coap_tick_t now;
+
+  *info_list = NULL;
+#if !defined(WITH_LWIP)
+  if (server && coap_host_is_unix_domain(server)) {
+    *info_list = coap_resolve_address_info(server, port, secure_port,
+                                           ai_hints_flags, scheme_hint_bits);
+    return 1;
+  }
+#endif /* ! WITH_LWIP */
+
+  coap_ticks(&now);
+  LL_FOREACH_SAFE(context->resolve_cache, entry, etmp) {
+    /* Those with waiters are kept until coap_resolve_check() calls them */
+    if (!entry->resolving && !entry->waiters && entry->expire <= now) {
+      LL_DELETE(context->resolve_cache, entry);
+      coap_resolve_entry_free(entry);
+      continue;
+    }
+    if (entry->host_length == host_length &&
+        memcmp(entry->host, host, host_length) == 0 &&
+        entry->port == port && entry->secure_port == secure_port &&
+        entry->ai_hints_flags == ai_hints_flags &&
+        entry->scheme_hint_bits == scheme_hint_bits)
+      found = entry;
+    else if (!entry->resolving && !entry->waiters)
+      oldest = entry;
+    if (entry->resolving)
+      pending++;
+    count++;
+  }
+
+  entry = found;
+  if (blocking && entry && entry->resolving) {
+    /* Not to wait for the worker, and not to be cached twice */
+    *info_list = coap_resolve_address_info(server, port, secure_port,
+                                           ai_hints_flags, scheme_hint_bits);
+    return 1;
+  }
+  if (!entry) {
+    if (count >= COAP_RESOLVE_CACHE_MAX) {
+      if (!oldest) {
+        coap_log_debug("coap_resolve: cache full, not resolving '%.*s'\n",
+                       (int)host_length, host);
+        return -2;
+      }
+      LL_DELETE(context->resolve_cache, oldest);
+      coap_resolve_entry_free(oldest);
+    }
+    entry = coap_malloc_type(COAP_STRING,
+                             sizeof(coap_resolve_entry_t) + host_length);
+    if (!entry) {
+      *info_list = coap_resolve_address_info(server, port, secure_port,
+                                             ai_hints_flags,
+                                             scheme_hint_bits);
+      return 1;
+    }
+    memset(entry, 0, sizeof(coap_resolve_entry_t));
+    memcpy(entry->host, host, host_length);
+    entry->host[host_length] = '\000';
+    entry->host_length = host_length;
+    entry->port = port;
+    entry->secure_port = secure_port;
+    entry->ai_hints_flags = ai_hints_flags;
+    entry->scheme_hint_bits = scheme_hint_bits;
+#if COAP_RESOLVE_THREAD
+    if (!blocking && pending >= COAP_RESOLVE_MAX_PENDING &&
+        !coap_host_is_literal(entry->host)) {
+      coap_log_debug("coap_resolve: %zu hosts being resolved, not "
+                     "resolving '%s'\n", pending, entry->host);
+      coap_free_type(COAP_STRING, entry);
+      return -2;
+    }
+#endif /* COAP_RESOLVE_THREAD */
+    LL_PREPEND(context->resolve_cache, entry);
+#if COAP_RESOLVE_THREAD
+    if (blocking || !coap_resolve_start(context, entry))
+#endif /* COAP_RESOLVE_THREAD */
+      coap_resolve_entry_set(entry,
+                             coap_resolve_address_info(server, port,
+                                                       secure_port,
+                                                       ai_hints_flags,
+                                                       scheme_hint_bits),
+                             now);
+  }
+
+  if (!entry->resolving) {
+    *info_list = coap_resolve_entry_addresses(entry);
+    return 1;
+  }
+  LL_FOREACH(entry->waiters, waiter) {
+    if (waiter->handler == handler && waiter->app_data == app_data)
+      /* Only called the once */
+      return 0;
+  }
+  if (handler) {
+    waiter = coap_malloc_type(COAP_STRING, sizeof(coap_resolve_waiter_t));
+    if (!waiter)
+      return -1;
+    memset(waiter, 0, sizeof(coap_resolve_waiter_t));
+    waiter->handler = handler;
+    waiter->app_data = app_data;
+    LL_APPEND(entry->waiters, waiter);
+  }
+  return 0;
+}
+
+int
+coap_resolve_address_info_cached(coap_context_t *context,
+                                 const coap_str_const_t *server,
+                                 uint16_t port,
+                                 uint16_t secure_port,
+                                 int ai_hints_flags,
+                                 int scheme_hint_bits,
+                                 coap_resolve_handler_t handler,
+                                 void *app_data,
+                                 coap_addr_info_t **info_list) {
+  return coap_resolve_lookup(context, server, port, secure_port,
+                             ai_hints_flags, scheme_hint_bits, 0, handler,
+                             app_data, info_list);
+}
+
+coap_addr_info_t *
+coap_context_resolve_address_info(coap_context_t *context,
+                                  const coap_str_const_t *server,
+                                  uint16_t port,
+                                  uint16_t secure_port,
+                                  int ai_hints_flags,
+                                  int scheme_hint_bits) {
+  coap_addr_info_t *info_list;
+
+  if (coap_resolve_lookup(context, server, port, secure_port,
+                          ai_hints_flags, scheme_hint_bits, 1, NULL, NULL,
+                          &info_list) != 1)
+    return NULL;
+  return info_list;
+}
+
+int
+coap_resolve_address_info_async(coap_context_t *context,
+                                const coap_str_const_t *server,
+                                uint16_t port,
+                                uint16_t secure_port,
+                                int ai_hints_flags,
+                                int scheme_hint_bits,
+                                coap_resolve_handler_t handler,
+                                void *app_data) {
+  coap_addr_info_t *info_list;
+
+  switch (coap_resolve_address_info_cached(context, server, port,
+                                           secure_port, ai_hints_flags,
+                                           scheme_hint_bits, handler,
+                                           app_data, &info_list)) {
+  case 1:
+    handler(context, info_list, app_data);
+    return 1;
+  case 0:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+void
+coap_resolve_check(coap_context_t *context) {
+#if COAP_RESOLVE_THREAD
+  coap_resolve_entry_t *entry;
+  coap_resolve_waiter_t *ready = NULL;
+  coap_resolve_waiter_t *waiter;
+  struct addrinfo *res;
+  char buf[16];
+  int done;
+  int error;
+  coap_tick_t now;
+
+  if (context->resolve_fd[0] == -1)
+    return;
+  while (read(context->resolve_fd[0], buf, sizeof(buf)) > 0) {
+  }
+
+  coap_ticks(&now);
+  LL_FOREACH(context->resolve_cache, entry) {
+    if (!entry->resolving)
+      continue;
+    pthread_mutex_lock(&coap_resolve_mutex);
+    done = entry->done;
+    res = entry->res;
+    error = entry->error;
+    pthread_mutex_unlock(&coap_resolve_mutex);
+    if (!done)
+      continue;
+    if (error != 0)
+      coap_log_warn("getaddrinfo: %s: %s\n", entry->host,
+                    gai_strerror(error));
+    coap_resolve_entry_set(entry,
+                           res ? coap_addr_info_from_addrinfo(res,
+                                   entry->port, entry->secure_port,
+                                   entry->scheme_hint_bits) : NULL,
+                           now);
+    if (res)
+      freeaddrinfo(res);
+    coap_log_debug("coap_resolve: resolved '%s'\n", entry->host);
+
+    /*
+     * Each waiter gets its copy before any handler is called, as the
+     * handlers may look up other hosts and so evict this entry.
+     */
+    LL_FOREACH(entry->waiters, waiter) {
+      waiter->info_list = coap_resolve_entry_addresses(entry);
+    }
+    LL_CONCAT(ready, entry->waiters);
+    entry->waiters = NULL;
+  }
+
+  while (ready) {
+    waiter = ready;
+    ready = waiter->next;
+    waiter->handler(context, waiter->info_list, waiter->app_data);
+    coap_free_type(COAP_STRING, waiter);
+  }
+#else /* ! COAP_RESOLVE_THREAD */
+  (void)context;
+#endif /* ! COAP_RESOLVE_THREAD */
+}
+
+#if !defined(WITH_LWIP)
+/* Returns the resolved entry that server is one of the addresses of */
+static coap_resolve_entry_t *
+coap_resolve_find_address(coap_context_t *context,
+                          const coap_address_t *server) {
+  coap_resolve_entry_t *entry;
+  coap_addr_info_t *info;
+
+  LL_FOREACH(context->resolve_cache, entry) {
+    if (entry->resolving)
+      continue;
+    for (info = entry->info_list; info; info = info->next) {
+      if (coap_address_equals(&info->addr, server))
+        return entry;
+    }
+  }
+  return NULL;
+}
+
+coap_address_t *
+coap_resolve_cache_alternatives(coap_context_t *context,
+                                const coap_address_t *server,
+                                size_t *count) {
+  coap_resolve_entry_t *entry = coap_resolve_find_address(context, server);
+  const coap_addr_info_t *info;
+  const coap_addr_info_t *next[2];
+  coap_address_t *alternatives;
+  size_t total = 0;
+  size_t i;
+  int family[2];
+  int f;
+
+  *count = 0;
+  if (!entry)
+    return NULL;
+  for (info = entry->info_list; info; info = info->next)
+    total++;
+  alternatives = coap_malloc_type(COAP_STRING, total * sizeof(coap_address_t));
+  if (!alternatives)
+    return NULL;
+
+  /*
+   * The families are interleaved (RFC8305 4), starting with the other family
+   * to that of server.
+   */
+  family[0] = COAP_ADDR_FAMILY(server) == AF_INET6 ? AF_INET : AF_INET6;
+  family[1] = COAP_ADDR_FAMILY(server);
+  next[0] = next[1] = entry->info_list;
+  for (f = 0; next[0] || next[1]; f = !f) {
+    for (info = next[f]; info; info = info->next) {
+      if (COAP_ADDR_FAMILY(&info->addr) != family[f] ||
+          coap_address_get_port(&info->addr) != coap_address_get_port(server) ||
+          coap_address_equals(&info->addr, server))
+        continue;
+      for (i = 0; i < *count; i++) {
+        if (coap_address_equals(&alternatives[i], &info->addr))
+          break;
+      }
+      if (i == *count)
+        break;
+    }
+    if (info) {
+      coap_address_copy(&alternatives[(*count)++], &info->addr);
+      info = info->next;
+    }
+    next[f] = info;
+  }
+  if (*count == 0) {
+    coap_free_type(COAP_STRING, alternatives);
+    return NULL;
+  }
+  return alternatives;
+}
+
+void
+coap_resolve_cache_prefer(coap_context_t *context,
+                          const coap_address_t *connected) {
+  coap_resolve_entry_t *entry = coap_resolve_find_address(context, connected);
+
+  if (entry)
+    entry->prefer_family = COAP_ADDR_FAMILY(connected);
+}
+#endif /* ! WITH_LWIP */
+
+void
+coap_resolve_free(coap_context_t *context) {
+  coap_resolve_entry_t *entry, *etmp;
+
+  LL_FOREACH_SAFE(context->resolve_cache, entry, etmp) {
+#if COAP_RESOLVE_THREAD
+    if (entry->resolving) {
+      int owned = 1;
+
+      coap_resolve_waiters_free(entry->waiters);
+      pthread_mutex_lock(&coap_resolve_mutex);
+      if (entry->done) {
+        if (entry->res)
+          freeaddrinfo(entry->res);
+      } else if (entry->running) {
+        /* Left for the worker thread to free */
+        entry->abandoned = 1;
+        owned = 0;
+      } else {
+        LL_DELETE2(coap_resolve_queue, entry, next_queued);
+      }
+      pthread_mutex_unlock(&coap_resolve_mutex);
+      if (owned)
+        coap_free_type(COAP_STRING, entry);
+      continue;
+    }
+#endif /* COAP_RESOLVE_THREAD */
+    coap_resolve_entry_free(entry);
+  }
+  context->resolve_cache = NULL;
+#if COAP_RESOLVE_THREAD
+  if (context->resolve_fd[0] != -1) {
+#ifdef COAP_EPOLL_SUPPORT
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    epoll_ctl(context->epfd, EPOLL_CTL_DEL, context->resolve_fd[0], &event);
+#endif /* COAP_EPOLL_SUPPORT */
+    close(context->resolve_fd[0]);
+    close(context->resolve_fd[1]);
+    context->resolve_fd[0] = context->resolve_fd[1] = -1;
+  }
+#endif /* COAP_RESOLVE_THREAD */
+}
+
+void
+coap_resolve_shutdown(void) {
+#if COAP_RESOLVE_THREAD
+  pthread_mutex_lock(&coap_resolve_mutex);
+  coap_resolve_stop = 1;
+  pthread_cond_broadcast(&coap_resolve_cond);
+  pthread_mutex_unlock(&coap_resolve_mutex);
+#endif /* COAP_RESOLVE_THREAD */
+}
+#else /* WITH_CONTIKI */
+
+coap_addr_info_t *
+coap_context_resolve_address_info(coap_context_t *context COAP_UNUSED,
+                                  const coap_str_const_t *server COAP_UNUSED,
+                                  uint16_t port COAP_UNUSED,
+                                  uint16_t secure_port COAP_UNUSED,
+                                  int ai_hints_flags COAP_UNUSED,
+                                  int scheme_hint_bits COAP_UNUSED) {
+  return NULL;
+}
+
+int
+coap_resolve_address_info_async(coap_context_t *context COAP_UNUSED,
+                                const coap_str_const_t *server COAP_UNUSED,
+                                uint16_t port COAP_UNUSED,
+                                uint16_t secure_port COAP_UNUSED,
+                                int ai_hints_flags COAP_UNUSED,
+                                int scheme_hint_bits COAP_UNUSED,
+                                coap_resolve_handler_t handler COAP_UNUSED,
+                                void *app_data COAP_UNUSED) {
+  return 0;
+}
+
+void
+coap_resolve_check(coap_context_t *context COAP_UNUSED) {
+}
+
+void
+coap_resolve_free(coap_context_t *context COAP_UNUSED) {
+}
+
+void
+coap_resolve_shutdown(void) {
+}
+#endif /* WITH_CONTIKI */
 
 void
 coap_free_address_info(coap_addr_info_t *info) {
@@ -70,41 +70,78 @@ coap_cache_ignore_options(coap_context_t *ctx,
   return 1;
 }
 
-coap_cache_key_t *
-coap_cache_derive_key_w_ignore(const coap_session_t *session,
-                               const coap_pdu_t *pdu,
-                               coap_cache_session_based_t session_based,
-                               const uint16_t *cache_ignore_options,
-                               size_t cache_ignore_count) {
+int
+coap_cache_set_key_hash(coap_context_t *context, coap_cache_key_hash_t hash) {
+  switch (hash) {
+  case COAP_CACHE_KEY_HASH_DIGEST:
+    break;
+  case COAP_CACHE_KEY_HASH_SIPHASH:
+    if (!coap_prng(context->cache_key_secret,
+                   sizeof(context->cache_key_secret)))
+      return 0;
+    break;
+  default:
+    return 0;
+  }
+  context->cache_key_hash = hash;
+  return 1;
+}
+
+/* The hash that a cache-key is being derived with */
+typedef struct coap_cache_hash_t {
+  coap_digest_ctx_t *dctx;  /* NULL for COAP_CACHE_KEY_HASH_SIPHASH */
+  coap_siphash_t siphash;
+} coap_cache_hash_t;
+
+static int
+cache_hash_update(coap_cache_hash_t *hash, const uint8_t *data, size_t len) {
+  if (hash->dctx)
+    return coap_digest_update(hash->dctx, data, len);
+  coap_siphash_update(&hash->siphash, data, len);
+  return 1;
+}
+
+/* Derives the cache-key for pdu into cache_key */
+static int
+cache_derive_key(const coap_session_t *session,
+                 const coap_pdu_t *pdu,
+                 coap_cache_session_based_t session_based,
+                 const uint16_t *cache_ignore_options,
+                 size_t cache_ignore_count,
+                 coap_cache_key_t *cache_key) {
   coap_opt_t *option;
   coap_opt_iterator_t opt_iter;
-  coap_digest_ctx_t *dctx;
+  coap_cache_hash_t hash;
   coap_digest_t digest;
-  coap_cache_key_t *cache_key;
 
   if (!coap_option_iterator_init(pdu, &opt_iter, COAP_OPT_ALL)) {
-    return NULL;
+    return 0;
   }
 
-  dctx = coap_digest_setup();
-  if (!dctx)
-    return NULL;
+  if (session->context->cache_key_hash == COAP_CACHE_KEY_HASH_SIPHASH) {
+    hash.dctx = NULL;
+    coap_siphash_init(&hash.siphash, session->context->cache_key_secret, 16);
+  } else {
+    hash.dctx = coap_digest_setup();
+    if (!hash.dctx)
+      return 0;
+  }
 
   if (session_based == COAP_CACHE_IS_SESSION_BASED) {
     /* Include the session ptr */
-    if (!coap_digest_update(dctx, (const uint8_t*)&session, sizeof(session))) {
+    if (!cache_hash_update(&hash, (const uint8_t*)&session, sizeof(session))) {
       goto update_fail;
     }
   }
   while ((option = coap_option_next(&opt_iter))) {
     if (is_cache_key(opt_iter.number, cache_ignore_count,
                      cache_ignore_options)) {
-      if (!coap_digest_update(dctx, (const uint8_t *)&opt_iter.number,
-                              sizeof(opt_iter.number))) {
+      if (!cache_hash_update(&hash, (const uint8_t *)&opt_iter.number,
+                             sizeof(opt_iter.number))) {
         goto update_fail;
       }
-      if (!coap_digest_update(dctx, coap_opt_value(option),
-                              coap_opt_length(option))) {
+      if (!cache_hash_update(&hash, coap_opt_value(option),
+                             coap_opt_length(option))) {
         goto update_fail;
       }
     }
@@ -116,24 +153,45 @@ coap_cache_derive_key_w_ignore(const coap_session_t *session,
     size_t len;
     const uint8_t *data;
     if (coap_get_data(pdu, &len, &data)) {
-      if (!coap_digest_update(dctx, data, len)) {
+      if (!cache_hash_update(&hash, data, len)) {
         goto update_fail;
       }
     }
   }
 
-  if (!coap_digest_final(dctx, &digest)) {
+  if (!hash.dctx) {
+    memset(cache_key, 0, sizeof(*cache_key));
+    coap_siphash_final(&hash.siphash, cache_key->key);
+    return 1;
+  }
+  if (!coap_digest_final(hash.dctx, &digest)) {
     /* coap_digest_final() is guaranteed to free off dctx no matter what */
-    return NULL;
+    return 0;
   }
+  memcpy(cache_key->key, digest.key, sizeof(cache_key->key));
+  return 1;
+update_fail:
+  if (hash.dctx)
+    coap_digest_free(hash.dctx);
+  return 0;
+}
+
+coap_cache_key_t *
+coap_cache_derive_key_w_ignore(const coap_session_t *session,
+                               const coap_pdu_t *pdu,
+                               coap_cache_session_based_t session_based,
+                               const uint16_t *cache_ignore_options,
+                               size_t cache_ignore_count) {
+  coap_cache_key_t *cache_key;
+
   cache_key = coap_malloc_type(COAP_CACHE_KEY, sizeof(coap_cache_key_t));
-  if (cache_key) {
-    memcpy(cache_key->key, digest.key, sizeof(cache_key->key));
+  if (cache_key &&
+      !cache_derive_key(session, pdu, session_based, cache_ignore_options,
+                        cache_ignore_count, cache_key)) {
+    coap_free_type(COAP_CACHE_KEY, cache_key);
+    return NULL;
   }
   return cache_key;
-update_fail:
-  coap_digest_free(dctx);
-  return NULL;
 }
 
 coap_cache_key_t *
@@ -150,6 +208,151 @@ coap_delete_cache_key(coap_cache_key_t *cache_key) {
   coap_free_type(COAP_CACHE_KEY, cache_key);
 }
 
+/* Heap of the cache-entries that expire, earliest expire_ticks first */
+static void
+cache_heap_set(coap_context_t *ctx, size_t i, coap_cache_entry_t *entry) {
+  ctx->cache_expiry[i] = entry;
+  entry->heap_index = i + 1;
+}
+
+static void
+cache_heap_up(coap_context_t *ctx, size_t i) {
+  coap_cache_entry_t *entry = ctx->cache_expiry[i];
+
+  while (i > 0) {
+    size_t parent = (i - 1) / 2;
+
+    if (ctx->cache_expiry[parent]->expire_ticks <= entry->expire_ticks)
+      break;
+    cache_heap_set(ctx, i, ctx->cache_expiry[parent]);
+    i = parent;
+  }
+  cache_heap_set(ctx, i, entry);
+}
+
+static void
+cache_heap_down(coap_context_t *ctx, size_t i) {
+  coap_cache_entry_t *entry = ctx->cache_expiry[i];
+  size_t count = ctx->cache_expiry_count;
+
+  for (;;) {
+    size_t child = 2 * i + 1;
+
+    if (child >= count)
+      break;
+    if (child + 1 < count &&
+        ctx->cache_expiry[child + 1]->expire_ticks <
+        ctx->cache_expiry[child]->expire_ticks)
+      child++;
+    if (entry->expire_ticks <= ctx->cache_expiry[child]->expire_ticks)
+      break;
+    cache_heap_set(ctx, i, ctx->cache_expiry[child]);
+    i = child;
+  }
+  cache_heap_set(ctx, i, entry);
+}
+
+static int
+cache_heap_add(coap_context_t *ctx, coap_cache_entry_t *entry) {
+  if (ctx->cache_expiry_count == ctx->cache_expiry_size) {
+    size_t size = ctx->cache_expiry_size ? 2 * ctx->cache_expiry_size : 16;
+    coap_cache_entry_t **expiry;
+
+    expiry = coap_realloc_type(COAP_STRING, ctx->cache_expiry,
+                               size * sizeof(expiry[0]));
+    if (!expiry)
+      return 0;
+    ctx->cache_expiry = expiry;
+    ctx->cache_expiry_size = size;
+  }
+  cache_heap_set(ctx, ctx->cache_expiry_count++, entry);
+  cache_heap_up(ctx, ctx->cache_expiry_count - 1);
+  return 1;
+}
+
+static void
+cache_heap_remove(coap_context_t *ctx, coap_cache_entry_t *entry) {
+  size_t i = entry->heap_index - 1;
+  coap_cache_entry_t *last;
+
+  entry->heap_index = 0;
+  last = ctx->cache_expiry[--ctx->cache_expiry_count];
+  if (last == entry)
+    return;
+  cache_heap_set(ctx, i, last);
+  cache_heap_up(ctx, i);
+  cache_heap_down(ctx, last->heap_index - 1);
+}
+
+/* A cache-entry has been used, so move it to the end of the LRU list and
+ * restart any idle timeout */
+static void
+cache_entry_touch(coap_context_t *ctx, coap_cache_entry_t *entry) {
+  DL_DELETE2(ctx->cache_lru, entry, lru_prev, lru_next);
+  DL_APPEND2(ctx->cache_lru, entry, lru_prev, lru_next);
+  if (entry->idle_timeout > 0) {
+    coap_ticks(&entry->expire_ticks);
+    entry->expire_ticks += entry->idle_timeout * COAP_TICKS_PER_SECOND;
+    cache_heap_down(ctx, entry->heap_index - 1);
+  }
+}
+
+static coap_pdu_t *
+cache_copy_pdu(const coap_pdu_t *pdu) {
+  coap_pdu_t *copy;
+
+  copy = coap_pdu_init(pdu->type, pdu->code, pdu->mid, pdu->alloc_size);
+  if (copy) {
+    if (!coap_pdu_resize(copy, pdu->alloc_size)) {
+      coap_delete_pdu(copy);
+      return NULL;
+    }
+    /* Need to get the appropriate data across */
+    memcpy(copy, pdu, offsetof(coap_pdu_t, token));
+    memcpy(copy->token, pdu->token, pdu->used_size);
+    /* And adjust all the pointers etc. */
+    copy->data = copy->token + (pdu->data - pdu->token);
+  }
+  return copy;
+}
+
+/*
+ * Adds a new cache-entry to the hash, LRU list and expiry heap of ctx, and
+ * evicts the least recently used entries while the cache is over its size
+ * limit. Returns 0 (with entry freed off) on failure.
+ */
+static int
+cache_entry_add(coap_context_t *ctx, coap_cache_entry_t *entry) {
+  entry->size = sizeof(coap_cache_entry_t) + sizeof(coap_cache_key_t);
+  if (entry->pdu)
+    entry->size += sizeof(coap_pdu_t) + entry->pdu->alloc_size;
+  if (ctx->cache_max_size && entry->size > ctx->cache_max_size) {
+    coap_log_debug("cache-entry of %zu bytes exceeds the cache size\n",
+                   entry->size);
+    goto fail;
+  }
+  if (entry->expire_ticks && !cache_heap_add(ctx, entry))
+    goto fail;
+
+  HASH_ADD(hh, ctx->cache, cache_key[0], sizeof(coap_cache_key_t), entry);
+  DL_APPEND2(ctx->cache_lru, entry, lru_prev, lru_next);
+  ctx->cache_size += entry->size;
+
+  while (ctx->cache_max_size && ctx->cache_size > ctx->cache_max_size &&
+         ctx->cache_lru != entry) {
+    ctx->cache_stats.evictions++;
+    coap_delete_cache_entry(ctx, ctx->cache_lru);
+  }
+  return 1;
+
+fail:
+  if (entry->pdu)
+    coap_delete_pdu(entry->pdu);
+  coap_delete_cache_key(entry->cache_key);
+  coap_free_type(COAP_CACHE_ENTRY, entry);
+  return 0;
+}
+
 coap_cache_entry_t *
 coap_new_cache_entry(coap_session_t *session, const coap_pdu_t *pdu,
                coap_cache_record_pdu_t record_pdu,
@@ -164,22 +367,16 @@ coap_new_cache_entry(coap_session_t *session, const coap_pdu_t *pdu,
   memset(entry, 0, sizeof(coap_cache_entry_t));
   entry->session = session;
   if (record_pdu == COAP_CACHE_RECORD_PDU) {
-    entry->pdu = coap_pdu_init(pdu->type, pdu->code, pdu->mid, pdu->alloc_size);
-    if (entry->pdu) {
-      if (!coap_pdu_resize(entry->pdu, pdu->alloc_size)) {
-        coap_delete_pdu(entry->pdu);
-        coap_free_type(COAP_CACHE_ENTRY, entry);
-        return NULL;
-      }
-      /* Need to get the appropriate data across */
-      memcpy(entry->pdu, pdu, offsetof(coap_pdu_t, token));
-      memcpy(entry->pdu->token, pdu->token, pdu->used_size);
-      /* And adjust all the pointers etc. */
-      entry->pdu->data = entry->pdu->token + (pdu->data - pdu->token);
+    entry->pdu = cache_copy_pdu(pdu);
+    if (!entry->pdu) {
+      coap_free_type(COAP_CACHE_ENTRY, entry);
+      return NULL;
     }
   }
   entry->cache_key = coap_cache_derive_key(session, pdu, session_based);
   if (!entry->cache_key) {
+    if (entry->pdu)
+      coap_delete_pdu(entry->pdu);
     coap_free_type(COAP_CACHE_ENTRY, entry);
     return NULL;
   }
@@ -189,7 +386,78 @@ coap_new_cache_entry(coap_session_t *session, const coap_pdu_t *pdu,
     entry->expire_ticks += idle_timeout * COAP_TICKS_PER_SECOND;
   }
 
-  HASH_ADD(hh, session->context->cache, cache_key[0], sizeof(coap_cache_key_t), entry);
+  if (!cache_entry_add(session->context, entry))
+    return NULL;
+  return entry;
+}
+
+coap_cache_entry_t *
+coap_cache_add_response(coap_session_t *session, const coap_pdu_t *request,
+                        const coap_pdu_t *response,
+                        coap_cache_session_based_t session_based) {
+  coap_cache_key_t *cache_key;
+  coap_cache_entry_t *entry;
+
+  cache_key = coap_cache_derive_key(session, request, session_based);
+  if (!cache_key)
+    return NULL;
+  entry = coap_cache_add_response_by_key(session, cache_key, response,
+                                         session_based);
+  coap_delete_cache_key(cache_key);
+  return entry;
+}
+
+coap_cache_entry_t *
+coap_cache_add_response_by_key(coap_session_t *session,
+                               const coap_cache_key_t *cache_key,
+                               const coap_pdu_t *response,
+                             coap_cache_session_based_t session_based) {
+  coap_context_t *ctx = session->context;
+  coap_cache_entry_t *entry;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  unsigned int max_age = COAP_DEFAULT_MAX_AGE;
+
+  option = coap_check_option(response, COAP_OPTION_MAXAGE, &opt_iter);
+  if (option)
+    max_age = coap_decode_var_bytes(coap_opt_value(option),
+                                    coap_opt_length(option));
+  if (max_age == 0)
+    return NULL;
+
+  entry = coap_malloc_type(COAP_CACHE_ENTRY, sizeof(coap_cache_entry_t));
+  if (!entry)
+    return NULL;
+  memset(entry, 0, sizeof(coap_cache_entry_t));
+  if (session_based == COAP_CACHE_IS_SESSION_BASED)
+    entry->session = session;
+  entry->cache_key = coap_malloc_type(COAP_CACHE_KEY, sizeof(coap_cache_key_t));
+  if (!entry->cache_key) {
+    coap_free_type(COAP_CACHE_ENTRY, entry);
+    return NULL;
+  }
+  memcpy(entry->cache_key, cache_key, sizeof(coap_cache_key_t));
+  entry->pdu = cache_copy_pdu(response);
+  if (!entry->pdu) {
+    coap_delete_cache_key(entry->cache_key);
+    coap_free_type(COAP_CACHE_ENTRY, entry);
+    return NULL;
+  }
+  coap_ticks(&entry->expire_ticks);
+  entry->expire_ticks += (coap_tick_t)max_age * COAP_TICKS_PER_SECOND;
+
+  /* A newer response replaces what is held for the request */
+  {
+    coap_cache_entry_t *old;
+
+    HASH_FIND(hh, ctx->cache, entry->cache_key, sizeof(coap_cache_key_t),
+              old);
+    if (old)
+      coap_delete_cache_entry(ctx, old);
+  }
+
+  if (!cache_entry_add(ctx, entry))
+    return NULL;
   return entry;
 }
 
@@ -201,9 +469,23 @@ coap_cache_get_by_key(coap_context_t *ctx, const coap_cache_key_t *cache_key) {
   if (cache_key) {
     HASH_FIND(hh, ctx->cache, cache_key, sizeof(coap_cache_key_t), cache_entry);
   }
-  if (cache_entry && cache_entry->idle_timeout > 0) {
-    coap_ticks(&cache_entry->expire_ticks);
-    cache_entry->expire_ticks += cache_entry->idle_timeout * COAP_TICKS_PER_SECOND;
+  if (cache_entry && cache_entry->idle_timeout == 0 &&
+      cache_entry->expire_ticks) {
+    coap_tick_t now;
+
+    /* A response that is no longer fresh is of no use */
+    coap_ticks(&now);
+    if (cache_entry->expire_ticks <= now) {
+      ctx->cache_stats.expirations++;
+      coap_delete_cache_entry(ctx, cache_entry);
+      cache_entry = NULL;
+    }
+  }
+  if (cache_entry) {
+    ctx->cache_stats.hits++;
+    cache_entry_touch(ctx, cache_entry);
+  } else {
+    ctx->cache_stats.misses++;
   }
   return cache_entry;
 }
@@ -212,19 +494,14 @@ coap_cache_entry_t *
 coap_cache_get_by_pdu(coap_session_t *session,
                       const coap_pdu_t *request,
                       coap_cache_session_based_t session_based) {
-  coap_cache_key_t *cache_key = coap_cache_derive_key(session, request, session_based);
-  coap_cache_entry_t *cache_entry;
+  coap_cache_key_t cache_key;
 
-  if (!cache_key)
+  if (!cache_derive_key(session, request, session_based,
+                        session->context->cache_ignore_options,
+                        session->context->cache_ignore_count, &cache_key))
     return NULL;
 
-  cache_entry = coap_cache_get_by_key(session->context, cache_key);
-  coap_delete_cache_key(cache_key);
-  if (cache_entry && cache_entry->idle_timeout > 0) {
-    coap_ticks(&cache_entry->expire_ticks);
-    cache_entry->expire_ticks += cache_entry->idle_timeout * COAP_TICKS_PER_SECOND;
-  }
-  return cache_entry;
+  return coap_cache_get_by_key(session->context, &cache_key);
 }
 
 void
@@ -235,6 +512,10 @@ coap_delete_cache_entry(coap_context_t *ctx, coap_cache_entry_t *cache_entry) {
   if (cache_entry) {
     HASH_DELETE(hh, ctx->cache, cache_entry);
   }
+  DL_DELETE2(ctx->cache_lru, cache_entry, lru_prev, lru_next);
+  if (cache_entry->heap_index)
+    cache_heap_remove(ctx, cache_entry);
+  ctx->cache_size -= cache_entry->size;
   if (cache_entry->pdu) {
     coap_delete_pdu(cache_entry->pdu);
   }
@@ -245,6 +526,35 @@ coap_delete_cache_entry(coap_context_t *ctx, coap_cache_entry_t *cache_entry) {
   coap_free_type(COAP_CACHE_ENTRY, cache_entry);
 }
 
+unsigned int
+coap_cache_get_max_age(const coap_cache_entry_t *cache_entry) {
+  coap_tick_t now;
+
+  if (cache_entry->idle_timeout > 0 || !cache_entry->expire_ticks)
+    return 0;
+  coap_ticks(&now);
+  if (cache_entry->expire_ticks <= now)
+    return 0;
+  return (unsigned int)((cache_entry->expire_ticks - now) /
+                        COAP_TICKS_PER_SECOND);
+}
+
+void
+coap_cache_set_max_size(coap_context_t *ctx, size_t max_size) {
+  ctx->cache_max_size = max_size;
+  while (max_size && ctx->cache_size > max_size && ctx->cache_lru) {
+    ctx->cache_stats.evictions++;
+    coap_delete_cache_entry(ctx, ctx->cache_lru);
+  }
+}
+
+void
+coap_cache_get_stats(const coap_context_t *ctx, coap_cache_stats_t *stats) {
+  *stats = ctx->cache_stats;
+  stats->entries = HASH_COUNT(ctx->cache);
+  stats->size = ctx->cache_size;
+}
+
 const coap_pdu_t *
 coap_cache_get_pdu(const coap_cache_entry_t *cache_entry) {
         return cache_entry->pdu;
@@ -263,18 +573,266 @@ coap_cache_get_app_data(const coap_cache_entry_t *cache_entry) {
   return cache_entry->app_data;
 }
 
+coap_cache_body_t *
+coap_cache_body_new(const coap_pdu_t *response) {
+  coap_cache_body_t *body;
+  size_t length;
+  size_t offset;
+  size_t total;
+  const uint8_t *data;
+
+  if (!coap_get_data_large(response, &length, &data, &offset, &total) ||
+      length != total)
+    return NULL;
+  body = coap_malloc_type(COAP_STRING, sizeof(coap_cache_body_t) + length - 1);
+  if (body) {
+    body->ref = 1;
+    body->length = length;
+    memcpy(body->s, data, length);
+  }
+  return body;
+}
+
+void
+coap_cache_body_release(coap_session_t *session COAP_UNUSED, void *app_ptr) {
+  coap_cache_body_t *body = (coap_cache_body_t *)app_ptr;
+
+  assert(body->ref > 0);
+  if (--body->ref == 0)
+    coap_free_type(COAP_STRING, body);
+}
+
+void
+coap_cache_fill_response(coap_resource_t *resource, coap_session_t *session,
+                         const coap_pdu_t *request, coap_pdu_t *pdu,
+                         const coap_pdu_t *response, coap_cache_body_t *body,
+                         int max_age) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  uint16_t media_type = COAP_MEDIATYPE_TEXT_PLAIN;
+  int maxage = max_age;
+  uint64_t etag = 0;
+  uint8_t buf[4];
+
+  pdu->code = response->code;
+  /* Options set by coap_add_data_large_response() are picked out */
+  coap_option_iterator_init(response, &opt_iter, COAP_OPT_ALL);
+  while ((option = coap_option_next(&opt_iter))) {
+    switch (opt_iter.number) {
+    case COAP_OPTION_CONTENT_FORMAT:
+      if (!body)
+        goto add_in;
+      media_type = coap_decode_var_bytes(coap_opt_value(option),
+                                         coap_opt_length(option));
+      break;
+    case COAP_OPTION_MAXAGE:
+      if (max_age >= 0)
+        break;
+      if (!body)
+        goto add_in;
+      maxage = coap_decode_var_bytes(coap_opt_value(option),
+                                     coap_opt_length(option));
+      break;
+    case COAP_OPTION_ETAG:
+      if (!body)
+        goto add_in;
+      etag = coap_decode_var_bytes8(coap_opt_value(option),
+                                    coap_opt_length(option));
+      break;
+    case COAP_OPTION_OBSERVE:
+    case COAP_OPTION_BLOCK2:
+    case COAP_OPTION_Q_BLOCK2:
+    case COAP_OPTION_SIZE2:
+      break;
+    default:
+add_in:
+      coap_add_option_internal(pdu, opt_iter.number, coap_opt_length(option),
+                               coap_opt_value(option));
+      break;
+    }
+  }
+  if (max_age >= 0 && !body)
+    coap_insert_option(pdu, COAP_OPTION_MAXAGE,
+                       coap_encode_var_safe(buf, sizeof(buf), max_age), buf);
+
+  if (body) {
+    coap_string_t *query = coap_get_query(request);
+
+    body->ref++;
+    coap_add_data_large_response(resource, session, request, pdu, query,
+                                 media_type, maxage, etag, body->length,
+                                 body->s, coap_cache_body_release, body);
+    coap_delete_string(query);
+  }
+}
+
+#ifndef WITHOUT_ASYNC
+coap_cache_flight_status_t
+coap_cache_flight_join(coap_session_t *session, const coap_pdu_t *request,
+                       const coap_cache_key_t *cache_key) {
+  coap_context_t *ctx = session->context;
+  coap_cache_flight_t *flight;
+  coap_cache_waiter_t *waiter;
+  coap_opt_iterator_t opt_iter;
+
+  if ((request->code != COAP_REQUEST_CODE_GET &&
+       request->code != COAP_REQUEST_CODE_FETCH) ||
+      coap_check_option(request, COAP_OPTION_OBSERVE, &opt_iter) ||
+      coap_find_async(session, request->actual_token))
+    return COAP_CACHE_FLIGHT_NONE;
+
+  HASH_FIND(hh, ctx->cache_flights, cache_key, sizeof(coap_cache_key_t),
+            flight);
+  if (!flight) {
+    flight = coap_malloc_type(COAP_STRING, sizeof(coap_cache_flight_t));
+    if (!flight)
+      return COAP_CACHE_FLIGHT_NONE;
+    memset(flight, 0, sizeof(coap_cache_flight_t));
+    flight->cache_key = *cache_key;
+    HASH_ADD(hh, ctx->cache_flights, cache_key, sizeof(coap_cache_key_t),
+             flight);
+    return COAP_CACHE_FLIGHT_LEADER;
+  }
+
+  waiter = coap_malloc_type(COAP_STRING, sizeof(coap_cache_waiter_t));
+  if (!waiter)
+    return COAP_CACHE_FLIGHT_NONE;
+  memset(waiter, 0, sizeof(coap_cache_waiter_t));
+  waiter->token = coap_new_bin_const(request->actual_token.s,
+                                     request->actual_token.length);
+  if (!waiter->token || !coap_register_async(session, request, 0)) {
+    coap_delete_bin_const(waiter->token);
+    coap_free_type(COAP_STRING, waiter);
+    return COAP_CACHE_FLIGHT_NONE;
+  }
+  waiter->session = coap_session_reference(session);
+  LL_APPEND(flight->waiters, waiter);
+  return COAP_CACHE_FLIGHT_PARKED;
+}
+
+/*
+ * Sends a parked request a separate response with the code, options and body
+ * of response.
+ */
+static void
+cache_flight_respond(coap_resource_t *resource, coap_async_t *async,
+                     const coap_pdu_t *response, coap_cache_body_t *body) {
+  coap_session_t *session = async->session;
+  const coap_pdu_t *request = async->pdu;
+  coap_pdu_t *pdu;
+
+  pdu = coap_pdu_init(request->type == COAP_MESSAGE_CON ?
+                      COAP_MESSAGE_CON : COAP_MESSAGE_NON,
+                      response->code, coap_new_message_id(session),
+                      coap_session_max_pdu_size(session));
+  if (!pdu)
+    return;
+  if (!coap_add_token(pdu, request->actual_token.length,
+                      request->actual_token.s)) {
+    coap_delete_pdu(pdu);
+    return;
+  }
+  coap_cache_fill_response(resource, session, request, pdu, response, body,
+                           -1);
+  coap_send(session, pdu);
+}
+
+size_t
+coap_cache_flight_complete(coap_resource_t *resource,
+                           const coap_cache_key_t *cache_key,
+                           const coap_pdu_t *response) {
+  coap_context_t *ctx = resource->context;
+  coap_cache_flight_t *flight;
+  coap_cache_waiter_t *waiter, *tmp;
+  coap_cache_body_t *body = NULL;
+  size_t count = 0;
+
+  if (!ctx)
+    return 0;
+  HASH_FIND(hh, ctx->cache_flights, cache_key, sizeof(coap_cache_key_t),
+            flight);
+  if (!flight)
+    return 0;
+  HASH_DELETE(hh, ctx->cache_flights, flight);
+
+  if (response && flight->waiters)
+    body = coap_cache_body_new(response);
+
+  LL_FOREACH_SAFE(flight->waiters, waiter, tmp) {
+    coap_async_t *async = coap_find_async(waiter->session, *waiter->token);
+
+    if (async) {
+      if (response) {
+        cache_flight_respond(resource, async, response, body);
+        coap_free_async(waiter->session, async);
+        ctx->cache_stats.coalesced++;
+      } else {
+        coap_async_trigger(async);
+      }
+      count++;
+    }
+    coap_session_release(waiter->session);
+    coap_delete_bin_const(waiter->token);
+    coap_free_type(COAP_STRING, waiter);
+  }
+  if (body)
+    coap_cache_body_release(NULL, body);
+  coap_free_type(COAP_STRING, flight);
+  return count;
+}
+
+void
+coap_delete_cache_flights(coap_context_t *ctx) {
+  coap_cache_flight_t *flight, *ftmp;
+  coap_cache_waiter_t *waiter, *wtmp;
+
+  HASH_ITER(hh, ctx->cache_flights, flight, ftmp) {
+    HASH_DELETE(hh, ctx->cache_flights, flight);
+    LL_FOREACH_SAFE(flight->waiters, waiter, wtmp) {
+      coap_session_release(waiter->session);
+      coap_delete_bin_const(waiter->token);
+      coap_free_type(COAP_STRING, waiter);
+    }
+    coap_free_type(COAP_STRING, flight);
+  }
+}
+
+#else /* WITHOUT_ASYNC */
+
+coap_cache_flight_status_t
+coap_cache_flight_join(coap_session_t *session, const coap_pdu_t *request,
+                       const coap_cache_key_t *cache_key) {
+  (void)session;
+  (void)request;
+  (void)cache_key;
+  return COAP_CACHE_FLIGHT_NONE;
+}
+
+size_t
+coap_cache_flight_complete(coap_resource_t *resource,
+                           const coap_cache_key_t *cache_key,
+                           const coap_pdu_t *response) {
+  (void)resource;
+  (void)cache_key;
+  (void)response;
+  return 0;
+}
+
+void
+coap_delete_cache_flights(coap_context_t *ctx) {
+  (void)ctx;
+}
+#endif /* WITHOUT_ASYNC */
+
 void
 coap_expire_cache_entries(coap_context_t *ctx) {
   coap_tick_t now;
-  coap_cache_entry_t *cp, *ctmp;
 
   coap_ticks(&now);
-  HASH_ITER(hh, ctx->cache, cp, ctmp) {
-    if (cp->idle_timeout > 0) {
-      if (cp->expire_ticks <= now) {
-        coap_delete_cache_entry(ctx, cp);
-      }
-    }
+  while (ctx->cache_expiry_count &&
+         ctx->cache_expiry[0]->expire_ticks <= now) {
+    ctx->cache_stats.expirations++;
+    coap_delete_cache_entry(ctx, ctx->cache_expiry[0]);
   }
 }
 
@@ -434,10 +434,12 @@ msg_option_string(uint8_t code, uint16_t option_type) {
     { COAP_OPTION_URI_QUERY, "Uri-Query" },
     { COAP_OPTION_HOP_LIMIT, "Hop-Limit" },
     { COAP_OPTION_ACCEPT, "Accept" },
+    { COAP_OPTION_Q_BLOCK1, "Q-Block1" },
     { COAP_OPTION_LOCATION_QUERY, "Location-Query" },
     { COAP_OPTION_BLOCK2, "Block2" },
     { COAP_OPTION_BLOCK1, "Block1" },
     { COAP_OPTION_SIZE2, "Size2" },
+    { COAP_OPTION_Q_BLOCK2, "Q-Block2" },
     { COAP_OPTION_PROXY_URI, "Proxy-Uri" },
     { COAP_OPTION_PROXY_SCHEME, "Proxy-Scheme" },
     { COAP_OPTION_SIZE1, "Size1" },
@@ -523,6 +525,7 @@ print_content_format(unsigned int format_type,
     { COAP_MEDIATYPE_APPLICATION_JSON, "application/json" },
     { COAP_MEDIATYPE_APPLICATION_CBOR, "application/cbor" },
     { COAP_MEDIATYPE_APPLICATION_CWT, "application/cwt" },
+    { COAP_MEDIATYPE_APPLICATION_LINK_FORMAT_CBOR, "application/link-format+cbor" },
     { COAP_MEDIATYPE_APPLICATION_COAP_GROUP_JSON, "application/coap-group+json" },
     { COAP_MEDIATYPE_APPLICATION_COSE_SIGN, "application/cose; cose-type=\"cose-sign\"" },
     { COAP_MEDIATYPE_APPLICATION_COSE_SIGN1, "application/cose; cose-type=\"cose-sign1\"" },
@@ -541,6 +544,7 @@ print_content_format(unsigned int format_type,
     { COAP_MEDIATYPE_APPLICATION_SENML_XML, "application/senml+xml" },
     { COAP_MEDIATYPE_APPLICATION_SENSML_XML, "application/sensml+xml" },
     { COAP_MEDIATYPE_APPLICATION_DOTS_CBOR, "application/dots+cbor" },
+    { COAP_MEDIATYPE_APPLICATION_MB_CBOR_SEQ, "application/missing-blocks+cbor-seq" },
     { COAP_MEDIATYPE_APPLICATION_ACE_CBOR, "application/ace+cbor" },
     { COAP_MEDIATYPE_APPLICATION_OSCORE, "application/oscore"},
     { 75, "application/dcaf+cbor" }
@@ -705,6 +709,8 @@ coap_show_pdu(coap_log_t level, const coap_pdu_t *pdu) {
 
     case COAP_OPTION_BLOCK1:
     case COAP_OPTION_BLOCK2:
+    case COAP_OPTION_Q_BLOCK1:
+    case COAP_OPTION_Q_BLOCK2:
       /* split block option into number/more/size where more is the
        * letter M if set, the _ otherwise */
       if (COAP_OPT_BLOCK_SZX(option) == 7) {
@@ -31,3 +31,113 @@ coap_hash_impl(const unsigned char *s, size_t len, coap_key_t h) {
   }
 }
 
+#define SIP_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+static void
+sip_round(uint64_t *v) {
+  v[0] += v[1];
+  v[1] = SIP_ROTL(v[1], 13);
+  v[1] ^= v[0];
+  v[0] = SIP_ROTL(v[0], 32);
+  v[2] += v[3];
+  v[3] = SIP_ROTL(v[3], 16);
+  v[3] ^= v[2];
+  v[0] += v[3];
+  v[3] = SIP_ROTL(v[3], 21);
+  v[3] ^= v[0];
+  v[2] += v[1];
+  v[1] = SIP_ROTL(v[1], 17);
+  v[1] ^= v[2];
+  v[2] = SIP_ROTL(v[2], 32);
+}
+
+static uint64_t
+sip_get64(const uint8_t *p) {
+  return (uint64_t)p[0] | (uint64_t)p[1] << 8 |
+         (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+         (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+         (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static void
+sip_put64(uint8_t *p, uint64_t v) {
+  size_t i;
+
+  for (i = 0; i < 8; i++) {
+    p[i] = (uint8_t)(v >> (8 * i));
+  }
+}
+
+static void
+sip_compress(coap_siphash_t *state, uint64_t m) {
+  state->v[3] ^= m;
+  sip_round(state->v);
+  sip_round(state->v);
+  state->v[0] ^= m;
+}
+
+void
+coap_siphash_init(coap_siphash_t *state, const uint8_t key[16],
+                  uint8_t outlen) {
+  uint64_t k0 = sip_get64(key);
+  uint64_t k1 = sip_get64(key + 8);
+
+  assert(outlen == 8 || outlen == 16);
+  state->v[0] = 0x736f6d6570736575ULL ^ k0;
+  state->v[1] = 0x646f72616e646f6dULL ^ k1;
+  state->v[2] = 0x6c7967656e657261ULL ^ k0;
+  state->v[3] = 0x7465646279746573ULL ^ k1;
+  if (outlen == 16)
+    state->v[1] ^= 0xee;
+  state->tail = 0;
+  state->length = 0;
+  state->outlen = outlen;
+}
+
+void
+coap_siphash_update(coap_siphash_t *state, const uint8_t *data,
+                    size_t length) {
+  size_t used = state->length & 7;
+
+  state->length += length;
+  /* Complete a partial word left over from the last update */
+  while (used && length) {
+    state->tail |= (uint64_t)*data++ << (8 * used);
+    length--;
+    used = (used + 1) & 7;
+    if (used == 0) {
+      sip_compress(state, state->tail);
+      state->tail = 0;
+    }
+  }
+  while (length >= 8) {
+    sip_compress(state, sip_get64(data));
+    data += 8;
+    length -= 8;
+  }
+  while (length) {
+    state->tail |= (uint64_t)*data++ << (8 * used++);
+    length--;
+  }
+}
+
+void
+coap_siphash_final(coap_siphash_t *state, uint8_t *out) {
+  uint64_t *v = state->v;
+
+  sip_compress(state, state->tail | (uint64_t)state->length << 56);
+  v[2] ^= state->outlen == 16 ? 0xee : 0xff;
+  sip_round(v);
+  sip_round(v);
+  sip_round(v);
+  sip_round(v);
+  sip_put64(out, v[0] ^ v[1] ^ v[2] ^ v[3]);
+  if (state->outlen == 8)
+    return;
+  v[1] ^= 0xdd;
+  sip_round(v);
+  sip_round(v);
+  sip_round(v);
+  sip_round(v);
+  sip_put64(out + 8, v[0] ^ v[1] ^ v[2] ^ v[3]);
+}
@@ -1124,6 +1124,17 @@ coap_io_prepare_io(coap_context_t *ctx,
   timeout = coap_check_async(ctx, now);
 #endif /* WITHOUT_ASYNC */
 
+#if COAP_SERVER_SUPPORT && COAP_CLIENT_SUPPORT
+  /* Check to see if we need to health check any proxy servers */
+  s_timeout = coap_proxy_check_backends(ctx, now);
+  if (s_timeout && (timeout == 0 || s_timeout < timeout))
+    timeout = s_timeout;
+  /* Check to see if any proxy requests or upstream sessions have timed out */
+  s_timeout = coap_proxy_check_timeouts(ctx, now);
+  if (s_timeout && (timeout == 0 || s_timeout < timeout))
+    timeout = s_timeout;
+#endif /* COAP_SERVER_SUPPORT && COAP_CLIENT_SUPPORT */
+
   /* Check to see if we need to send off any retransmit request */
   nextpdu = coap_peek_next(ctx);
   while (nextpdu && now >= ctx->sendqueue_basetime &&
@@ -1220,6 +1231,9 @@ coap_io_prepare_io(coap_context_t *ctx,
               timeout = s_timeout;
           }
         }
+        /* Write out any coalesced PDUs */
+        if (s->write_buf_used)
+          coap_session_flush_write_buf(s);
 #if !defined(COAP_EPOLL_SUPPORT) && !defined(WITH_LWIP)
         if (s->sock.flags & (COAP_SOCKET_WANT_READ|COAP_SOCKET_WANT_WRITE)) {
           if (*num_sockets < max_sockets)
@@ -1255,6 +1269,14 @@ release_1:
         timeout = s_timeout;
     }
 
+#if COAP_CONNECT_RACE
+    if (s->connect_race) {
+      /* Time to also try the next address of the server? */
+      s_timeout = coap_session_race_check(s, now);
+      if (s_timeout && (timeout == 0 || s_timeout < timeout))
+        timeout = s_timeout;
+    }
+#endif /* COAP_CONNECT_RACE */
 #if !COAP_DISABLE_TCP
     if (s->type == COAP_SESSION_TYPE_CLIENT && COAP_PROTO_RELIABLE(s->proto) &&
         s->state == COAP_SESSION_STATE_CSM && ctx->csm_timeout > 0) {
@@ -1310,6 +1332,10 @@ release_1:
       }
     }
 
+    /* Write out any coalesced PDUs */
+    if (s->write_buf_used)
+      coap_session_flush_write_buf(s);
+
 #if !defined(COAP_EPOLL_SUPPORT) && !defined(WITHLWIP)
     assert(s->ref > 1);
     if (s->sock.flags & (COAP_SOCKET_WANT_READ |
@@ -1318,6 +1344,17 @@ release_1:
       if (*num_sockets < max_sockets)
         sockets[(*num_sockets)++] = &s->sock;
     }
+#if COAP_CONNECT_RACE
+    if (s->connect_race) {
+      size_t i;
+
+      for (i = 0; i < COAP_CONNECT_RACE_MAX; i++) {
+        if ((s->connect_race->sock[i].flags & COAP_SOCKET_WANT_CONNECT) &&
+            *num_sockets < max_sockets)
+          sockets[(*num_sockets)++] = &s->connect_race->sock[i];
+      }
+    }
+#endif /* COAP_CONNECT_RACE */
 #endif /* ! COAP_EPOLL_SUPPORT && ! WITH_LWIP */
 release_2:
     coap_session_release(s);
@@ -1328,6 +1365,36 @@ release_2:
 }
 
 #if !defined(RIOT_VERSION) && !defined(WITH_LWIP) && !defined(CONTIKI)
+/*
+ * Write out the PDUs that have been coalesced during this I/O iteration.
+ */
+static void
+coap_io_flush_write_bufs(coap_context_t *ctx) {
+  coap_session_t *s, *rtmp;
+#if COAP_SERVER_SUPPORT
+  coap_endpoint_t *ep;
+
+  LL_FOREACH(ctx->endpoint, ep) {
+    SESSIONS_ITER_SAFE(ep->sessions, s, rtmp) {
+      if (s->write_buf_used) {
+        coap_session_reference(s);
+        coap_session_flush_write_buf(s);
+        coap_session_release(s);
+      }
+    }
+  }
+#endif /* COAP_SERVER_SUPPORT */
+#if COAP_CLIENT_SUPPORT
+  SESSIONS_ITER_SAFE(ctx->sessions, s, rtmp) {
+    if (s->write_buf_used) {
+      coap_session_reference(s);
+      coap_session_flush_write_buf(s);
+      coap_session_release(s);
+    }
+  }
+#endif /* COAP_CLIENT_SUPPORT */
+}
+
 int
 coap_io_process(coap_context_t *ctx, uint32_t timeout_ms) {
   return coap_io_process_with_fds(ctx, timeout_ms, 0, NULL, NULL, NULL);
@@ -1393,6 +1460,13 @@ coap_io_process_with_fds(coap_context_t *ctx, uint32_t timeout_ms,
     }
 #endif /* !COAP_DISABLE_TCP */
   }
+#ifndef _WIN32
+  if (ctx->resolve_fd[0] != -1) {
+    if (ctx->resolve_fd[0] + 1 > nfds)
+      nfds = ctx->resolve_fd[0] + 1;
+    FD_SET(ctx->resolve_fd[0], &ctx->readfds);
+  }
+#endif /* ! _WIN32 */
 
   if (timeout_ms == COAP_IO_NO_WAIT) {
     tv.tv_usec = 0;
@@ -1447,6 +1521,11 @@ coap_io_process_with_fds(coap_context_t *ctx, uint32_t timeout_ms,
         ctx->sockets[i]->flags |= COAP_SOCKET_CAN_CONNECT;
 #endif /* !COAP_DISABLE_TCP */
     }
+#ifndef _WIN32
+    if (ctx->resolve_fd[0] != -1 &&
+        FD_ISSET(ctx->resolve_fd[0], &ctx->readfds))
+      coap_resolve_check(ctx);
+#endif /* ! _WIN32 */
   }
 
   coap_ticks(&now);
@@ -1512,6 +1591,7 @@ coap_io_process_with_fds(coap_context_t *ctx, uint32_t timeout_ms,
   coap_check_async(ctx, now);
   coap_ticks(&now);
 #endif /* WITHOUT_ASYNC */
+  coap_io_flush_write_bufs(ctx);
 
   return (int)(((now - before) * 1000) / COAP_TICKS_PER_SECOND);
 }
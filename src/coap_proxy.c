@@ -0,0 +1,1992 @@
+/* coap_proxy.c -- helper functions for proxy handling
+ *
+ * Copyright (C) 2023 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+/**
+ * @file coap_proxy.c
+ * @brief CoAP Proxy handling
+ */
+
+#include "coap3/coap_internal.h"
+
+#if COAP_SERVER_SUPPORT && COAP_CLIENT_SUPPORT
+
+#ifndef max
+#define max(a,b) ((a) > (b) ? (a) : (b))
+#endif
+
+#ifndef INET6_ADDRSTRLEN
+#define INET6_ADDRSTRLEN 40
+#endif
+
+/*
+ * Not passed upstream (the whole body is fetched) or tied to the client, so
+ * requests that only differ in these share a cache-entry or single-flight.
+ */
+static const uint16_t proxy_ignore_options[] = { COAP_OPTION_BLOCK2,
+                                                 COAP_OPTION_Q_BLOCK2,
+                                                 COAP_OPTION_RTAG
+                                               };
+
+int
+coap_proxy_is_supported(void) {
+  return 1;
+}
+
+static void proxy_resolved(coap_context_t *context,
+                           coap_addr_info_t *info_list, void *app_data);
+
+/* Case-insensitive match of a Proxy-Scheme option value */
+static int
+proxy_scheme_match(const uint8_t *s, size_t length, const char *name) {
+  size_t i;
+
+  if (length != strlen(name))
+    return 0;
+  for (i = 0; i < length; i++) {
+    if ((s[i] | 0x20) != name[i])
+      return 0;
+  }
+  return 1;
+}
+
+/*
+ * Fills in uri from the Proxy-Scheme option opt and the Uri-Host, Uri-Port,
+ * Uri-Path and Uri-Query options of request. The path and query of uri
+ * point into *uri_path and *uri_query.
+ */
+static int
+proxy_scheme_uri(const coap_pdu_t *request, coap_opt_t *opt, coap_uri_t *uri,
+                 coap_string_t **uri_path, coap_string_t **uri_query) {
+  const uint8_t *opt_val = coap_opt_value(opt);
+  size_t opt_len = coap_opt_length(opt);
+  coap_opt_iterator_t opt_iter;
+
+  if (proxy_scheme_match(opt_val, opt_len, "coaps+tcp")) {
+    uri->scheme = COAP_URI_SCHEME_COAPS_TCP;
+    uri->port = COAPS_DEFAULT_PORT;
+  } else if (proxy_scheme_match(opt_val, opt_len, "coap+tcp")) {
+    uri->scheme = COAP_URI_SCHEME_COAP_TCP;
+    uri->port = COAP_DEFAULT_PORT;
+  } else if (proxy_scheme_match(opt_val, opt_len, "coaps")) {
+    uri->scheme = COAP_URI_SCHEME_COAPS;
+    uri->port = COAPS_DEFAULT_PORT;
+  } else if (proxy_scheme_match(opt_val, opt_len, "coap")) {
+    uri->scheme = COAP_URI_SCHEME_COAP;
+    uri->port = COAP_DEFAULT_PORT;
+  } else {
+    coap_log_warn("Unsupported Proxy-Scheme '%.*s'\n", (int)opt_len, opt_val);
+    return 0;
+  }
+
+  opt = coap_check_option(request, COAP_OPTION_URI_HOST, &opt_iter);
+  if (!opt) {
+    coap_log_warn("Proxy-Scheme requires Uri-Host\n");
+    return 0;
+  }
+  uri->host.length = coap_opt_length(opt);
+  uri->host.s = coap_opt_value(opt);
+  opt = coap_check_option(request, COAP_OPTION_URI_PORT, &opt_iter);
+  if (opt)
+    uri->port = coap_decode_var_bytes(coap_opt_value(opt),
+                                      coap_opt_length(opt));
+  *uri_path = coap_get_uri_path(request);
+  if (*uri_path) {
+    uri->path.s = (*uri_path)->s;
+    uri->path.length = (*uri_path)->length;
+  }
+  *uri_query = coap_get_query(request);
+  if (*uri_query) {
+    uri->query.s = (*uri_query)->s;
+    uri->query.length = (*uri_query)->length;
+  }
+  return 1;
+}
+
+/* Checks that requests for scheme can be forwarded */
+static int
+proxy_scheme_supported(coap_uri_scheme_t scheme) {
+  switch (scheme) {
+  case COAP_URI_SCHEME_COAP:
+    return 1;
+  case COAP_URI_SCHEME_COAPS:
+    return coap_dtls_is_supported();
+  case COAP_URI_SCHEME_COAP_TCP:
+    return coap_tcp_is_supported();
+  case COAP_URI_SCHEME_COAPS_TCP:
+    return coap_tls_is_supported();
+  case COAP_URI_SCHEME_HTTP:
+  case COAP_URI_SCHEME_HTTPS:
+  case COAP_URI_SCHEME_LAST:
+  default:
+    return 0;
+  }
+}
+
+static void
+proxy_upstream_free(coap_context_t *context, coap_proxy_upstream_t *upstream) {
+  HASH_DELETE(hh, context->proxy_upstreams, upstream);
+  coap_session_release(upstream->session);
+  coap_free_type(COAP_STRING, upstream);
+}
+
+/*
+ * Fills in the key that the upstream pool and the health records use for
+ * server, which is its scheme, port and host. key has room for 3 + 255 bytes.
+ */
+static int
+proxy_server_key(const coap_uri_t *server, uint8_t *key, size_t *key_length) {
+  if (server->host.length > 255)
+    return 0;
+  key[0] = (uint8_t)server->scheme;
+  key[1] = (uint8_t)(server->port >> 8);
+  key[2] = (uint8_t)(server->port & 0xff);
+  memcpy(&key[3], server->host.s, server->host.length);
+  *key_length = 3 + server->host.length;
+  return 1;
+}
+
+/*
+ * Holds request until the name of the server it is going to resolves, taking
+ * over body.
+ */
+static int
+proxy_park(coap_session_t *session, const coap_pdu_t *request,
+           coap_resource_t *resource, coap_proxy_server_list_t *server_list,
+           coap_cache_body_t *body) {
+  coap_proxy_parked_t *parked;
+
+  parked = coap_malloc_type(COAP_STRING, sizeof(coap_proxy_parked_t));
+  if (!parked)
+    return 0;
+  memset(parked, 0, sizeof(coap_proxy_parked_t));
+  parked->request = coap_pdu_duplicate(request, session,
+                                       request->actual_token.length,
+                                       request->actual_token.s, NULL);
+  if (!parked->request) {
+    coap_free_type(COAP_STRING, parked);
+    return 0;
+  }
+  parked->request->type = request->type;
+  parked->request->mid = request->mid;
+  parked->request->lg_xmit = NULL;
+  if (body) {
+    parked->request->body_data = body->s;
+    parked->request->body_length = body->length;
+    parked->request->body_total = body->length;
+  }
+  parked->body = body;
+  parked->incoming = coap_session_reference(session);
+  parked->resource = resource;
+  parked->server_list = server_list;
+  LL_APPEND(session->context->proxy_parked, parked);
+  coap_log_debug("proxy: request held until the server name is resolved\n");
+  return 1;
+}
+
+static void
+proxy_parked_free(coap_proxy_parked_t *parked) {
+  coap_delete_pdu(parked->request);
+  if (parked->body)
+    coap_cache_body_release(parked->incoming, parked->body);
+  coap_session_release(parked->incoming);
+  coap_free_type(COAP_STRING, parked);
+}
+
+/* IP literals are not sent as the SNI (RFC6066 3) */
+static int
+proxy_host_is_literal(const coap_str_const_t *host) {
+  size_t i;
+
+  if (memchr(host->s, ':', host->length))
+    return 1;
+  for (i = 0; i < host->length; i++) {
+    if (host->s[i] != '.' && (host->s[i] < '0' || host->s[i] > '9'))
+      return 0;
+  }
+  return 1;
+}
+
+/*
+ * Returns the SNI to send to server, given the setup's client_sni. If that
+ * is not set, it is the host of server, which is copied into sni.
+ */
+static char *
+proxy_client_sni(const coap_uri_t *server, char *client_sni,
+                 char *sni, size_t size) {
+  size_t length;
+
+  if (client_sni || server->host.length == 0 ||
+      proxy_host_is_literal(&server->host))
+    return client_sni;
+  length = server->host.length < size - 1 ? server->host.length : size - 1;
+  memcpy(sni, server->host.s, length);
+  sni[length] = '\000';
+  return sni;
+}
+
+/*
+ * Gets the pooled session to server, or creates one. Sessions that have
+ * failed are dropped, rather than reused.
+ */
+static coap_proxy_upstream_t *
+proxy_get_upstream(coap_context_t *context, const coap_uri_t *server,
+                   coap_dtls_pki_t *dtls_pki, coap_dtls_cpsk_t *dtls_cpsk,
+                   coap_pdu_code_t *fail_code) {
+  coap_proxy_upstream_t *upstream;
+  uint8_t key[3 + 255];
+  size_t key_length;
+  coap_addr_info_t *info_list;
+  coap_address_t dst;
+  coap_session_t *session = NULL;
+  coap_proto_t proto;
+  coap_dtls_pki_t pki;
+  coap_dtls_cpsk_t cpsk;
+
+  if (!proxy_server_key(server, key, &key_length)) {
+    *fail_code = COAP_RESPONSE_CODE_PROXYING_NOT_SUPPORTED;
+    return NULL;
+  }
+
+  HASH_FIND(hh, context->proxy_upstreams, key, key_length, upstream);
+  if (upstream) {
+    if (upstream->session->state != COAP_SESSION_STATE_NONE)
+      return upstream;
+    if (upstream->pending == 0)
+      proxy_upstream_free(context, upstream);
+    else
+      /* Make way, the requests still pending are answered shortly */
+      HASH_DELETE(hh, context->proxy_upstreams, upstream);
+  }
+
+  /* Not looked up here, so as not to hold up other requests */
+  switch (coap_resolve_address_info_cached(context, &server->host,
+                                           server->port, server->port, 0,
+                                           1 << server->scheme,
+                                           proxy_resolved, NULL,
+                                           &info_list)) {
+  case 0:
+    /* Still being resolved */
+    *fail_code = COAP_EMPTY_CODE;
+    return NULL;
+  case -2:
+    /* Too many other names are being resolved */
+    *fail_code = COAP_RESPONSE_CODE_SERVICE_UNAVAILABLE;
+    return NULL;
+  case 1:
+    if (info_list)
+      break;
+    /* Fall through */
+  default:
+    *fail_code = COAP_RESPONSE_CODE_BAD_GATEWAY;
+    return NULL;
+  }
+  dst = info_list->addr;
+  coap_free_address_info(info_list);
+
+  upstream = coap_malloc_type(COAP_STRING,
+                              sizeof(coap_proxy_upstream_t) + key_length - 1);
+  if (!upstream) {
+    *fail_code = COAP_RESPONSE_CODE_INTERNAL_ERROR;
+    return NULL;
+  }
+  memset(upstream, 0, sizeof(coap_proxy_upstream_t));
+
+  switch (server->scheme) {
+  case COAP_URI_SCHEME_COAP:
+  case COAP_URI_SCHEME_COAP_TCP:
+    session = coap_new_client_session(context, NULL, &dst,
+                                      server->scheme == COAP_URI_SCHEME_COAP ?
+                                      COAP_PROTO_UDP : COAP_PROTO_TCP);
+    break;
+  case COAP_URI_SCHEME_COAPS:
+  case COAP_URI_SCHEME_COAPS_TCP:
+    proto = server->scheme == COAP_URI_SCHEME_COAPS ?
+            COAP_PROTO_DTLS : COAP_PROTO_TLS;
+    /* Each server is named by its own host, unless the setup names one */
+    if (dtls_cpsk) {
+      cpsk = *dtls_cpsk;
+      cpsk.client_sni = proxy_client_sni(server, dtls_cpsk->client_sni,
+                                         upstream->client_sni,
+                                         sizeof(upstream->client_sni));
+      session = coap_new_client_session_psk2(context, NULL, &dst, proto,
+                                             &cpsk);
+    } else if (dtls_pki) {
+      pki = *dtls_pki;
+      pki.client_sni = proxy_client_sni(server, dtls_pki->client_sni,
+                                        upstream->client_sni,
+                                        sizeof(upstream->client_sni));
+      session = coap_new_client_session_pki(context, NULL, &dst, proto, &pki);
+    } else {
+      session = coap_new_client_session_pki(context, NULL, &dst, proto,
+                                            NULL);
+    }
+    break;
+  case COAP_URI_SCHEME_HTTP:
+  case COAP_URI_SCHEME_HTTPS:
+  case COAP_URI_SCHEME_LAST:
+  default:
+    break;
+  }
+  if (!session) {
+    coap_free_type(COAP_STRING, upstream);
+    *fail_code = COAP_RESPONSE_CODE_PROXYING_NOT_SUPPORTED;
+    return NULL;
+  }
+
+  /* The session was created with a reference, which the pool holds */
+  upstream->session = session;
+  upstream->key_length = key_length;
+  memcpy(upstream->key, key, key_length);
+  session->proxy_upstream = 1;
+  /*
+   * Only stateless requests have long tokens, so the server is checked for
+   * them (RFC8974 2.2.2) now, rather than by coap_send() blocking until it
+   * has been.  Requests are forwarded with state in the meantime.  Over TCP,
+   * the CSM has the size.
+   */
+  if (COAP_PROTO_RELIABLE(session->proto) ||
+      session->max_token_size <= COAP_TOKEN_DEFAULT_MAX) {
+    session->max_token_checked = COAP_EXT_T_CHECKED;
+  } else if (coap_send_test_extended_token(session) == COAP_INVALID_MID) {
+    session->max_token_size = COAP_TOKEN_DEFAULT_MAX;
+    session->max_token_checked = COAP_EXT_T_CHECKED;
+  }
+  /* Responses are relayed whole, and whole bodies are forwarded */
+  session->block_mode |= COAP_BLOCK_USE_LIBCOAP | COAP_BLOCK_SINGLE_BODY;
+  HASH_ADD(hh, context->proxy_upstreams, key[0], key_length, upstream);
+  coap_log_debug("***%s: new proxy upstream session\n",
+                 coap_session_str(session));
+  return upstream;
+}
+
+/* Gets the upstream session to an entry of server_list */
+static coap_proxy_upstream_t *
+proxy_entry_upstream(coap_context_t *context,
+                     coap_proxy_server_list_t *server_list,
+                     coap_proxy_server_t *server, coap_pdu_code_t *fail_code) {
+  if (server->dtls_pki || server->dtls_cpsk)
+    return proxy_get_upstream(context, &server->uri, server->dtls_pki,
+                              server->dtls_cpsk, fail_code);
+  return proxy_get_upstream(context, &server->uri, server_list->dtls_pki,
+                            server_list->dtls_cpsk, fail_code);
+}
+
+/* Gets the health record of an entry of server_list, or creates one */
+static coap_proxy_backend_t *
+proxy_get_backend(coap_context_t *context,
+                  coap_proxy_server_list_t *server_list,
+                  coap_proxy_server_t *server) {
+  coap_proxy_backend_t *backend;
+  uint8_t key[3 + 255];
+  size_t key_length;
+
+  if (!proxy_server_key(&server->uri, key, &key_length))
+    return NULL;
+  HASH_FIND(hh, context->proxy_backends, key, key_length, backend);
+  if (backend)
+    return backend;
+
+  backend = coap_malloc_type(COAP_STRING,
+                             sizeof(coap_proxy_backend_t) + key_length - 1);
+  if (!backend)
+    return NULL;
+  memset(backend, 0, sizeof(coap_proxy_backend_t));
+  backend->server_list = server_list;
+  backend->server = server;
+  backend->key_length = key_length;
+  memcpy(backend->key, key, key_length);
+  HASH_ADD(hh, context->proxy_backends, key[0], key_length, backend);
+  return backend;
+}
+
+static int
+proxy_backend_is_up(const coap_proxy_backend_t *backend, coap_tick_t now) {
+  if (!backend->down)
+    return 1;
+  /* Without health checks, a request is the check */
+  return backend->server_list->health_check_secs == 0 &&
+         backend->retry_at <= now;
+}
+
+static void
+proxy_backend_failed(coap_proxy_backend_t *backend) {
+  coap_tick_t now;
+
+  coap_ticks(&now);
+  backend->retry_at = now + COAP_PROXY_BACKEND_RETRY * COAP_TICKS_PER_SECOND;
+  if (++backend->fails >= COAP_PROXY_BACKEND_MAX_FAILS && !backend->down) {
+    backend->down = 1;
+    coap_log_warn("proxy: server %.*s:%u is down\n",
+                  (int)backend->server->uri.host.length,
+                  backend->server->uri.host.s, backend->server->uri.port);
+  }
+}
+
+static void
+proxy_backend_ok(coap_proxy_backend_t *backend) {
+  if (backend->down)
+    coap_log_info("proxy: server %.*s:%u is up\n",
+                  (int)backend->server->uri.host.length,
+                  backend->server->uri.host.s, backend->server->uri.port);
+  backend->down = 0;
+  backend->fails = 0;
+}
+
+/*
+ * Rendezvous (highest random weight) hashing: each request goes to the entry
+ * with the highest score for its lb_key, so that only the requests of an
+ * entry that is down move elsewhere.
+ */
+static uint64_t
+proxy_lb_score(const coap_string_t *lb_key, const coap_proxy_server_t *server) {
+  static const uint8_t hash_key[16] = { 0 };
+  coap_siphash_t state;
+  uint8_t port[2];
+  uint8_t out[8];
+  uint64_t score;
+
+  coap_siphash_init(&state, hash_key, sizeof(out));
+  coap_siphash_update(&state, lb_key->s, lb_key->length);
+  port[0] = (uint8_t)(server->uri.port >> 8);
+  port[1] = (uint8_t)(server->uri.port & 0xff);
+  coap_siphash_update(&state, port, sizeof(port));
+  coap_siphash_update(&state, server->uri.host.s, server->uri.host.length);
+  coap_siphash_final(&state, out);
+  memcpy(&score, out, sizeof(score));
+  return score;
+}
+
+/* The Uri-Path or client address that a request is hashed on, or NULL */
+static coap_string_t *
+proxy_lb_key(coap_session_t *session, const coap_pdu_t *request,
+             coap_proxy_lb_t lb) {
+  coap_address_t remote;
+  coap_string_t *lb_key;
+  unsigned char addr[INET6_ADDRSTRLEN + 8];
+  size_t length;
+
+  switch (lb) {
+  case COAP_PROXY_LB_HASH_PATH:
+    lb_key = coap_get_uri_path(request);
+    /* The path of the root resource is empty */
+    return lb_key ? lb_key : coap_new_string(0);
+  case COAP_PROXY_LB_HASH_CLIENT:
+    /* Any port, as a client may use a new one for each session */
+    coap_address_copy(&remote, coap_session_get_addr_remote(session));
+    coap_address_set_port(&remote, 0);
+    length = coap_print_addr(&remote, addr, sizeof(addr));
+    lb_key = coap_new_string(length);
+    if (lb_key)
+      memcpy(lb_key->s, addr, length);
+    return lb_key;
+  case COAP_PROXY_LB_ROUND_ROBIN:
+  default:
+    return NULL;
+  }
+}
+
+/*
+ * Chooses the entry of server_list to send request to, other than exclude.
+ * Entries that are down are only used if all of them are.
+ */
+static coap_proxy_server_t *
+proxy_choose_server(coap_session_t *session, const coap_pdu_t *request,
+                    coap_proxy_server_list_t *server_list,
+                    const coap_proxy_server_t *exclude) {
+  size_t count = server_list->entry_count;
+  coap_proxy_server_t *chosen = NULL;
+  coap_proxy_backend_t *backend;
+  coap_string_t *lb_key = NULL;
+  uint64_t best = 0;
+  uint64_t score;
+  coap_tick_t now;
+  size_t i;
+  int any;
+
+  if (server_list->lb != COAP_PROXY_LB_ROUND_ROBIN) {
+    lb_key = proxy_lb_key(session, request, server_list->lb);
+    if (!lb_key)
+      return NULL;
+  }
+  coap_ticks(&now);
+  for (any = 0; any < 2 && !chosen; any++) {
+    for (i = 0; i < count; i++) {
+      size_t j = lb_key ? i : (server_list->next_entry + i) % count;
+      coap_proxy_server_t *server = &server_list->entry[j];
+
+      if (server == exclude)
+        continue;
+      backend = proxy_get_backend(session->context, server_list, server);
+      if (!any && backend && !proxy_backend_is_up(backend, now))
+        continue;
+      if (!lb_key) {
+        server_list->next_entry = j + 1;
+        chosen = server;
+        break;
+      }
+      score = proxy_lb_score(lb_key, server);
+      if (!chosen || score > best) {
+        chosen = server;
+        best = score;
+      }
+    }
+  }
+  coap_delete_string(lb_key);
+  return chosen;
+}
+
+/*
+ * Drops the hold of req on its upstream session, which is freed if it has
+ * failed and is no longer in the pool.
+ */
+static void
+proxy_req_detach(coap_context_t *context, coap_proxy_req_t *req) {
+  coap_proxy_upstream_t *upstream = req->upstream;
+  coap_proxy_upstream_t *pooled;
+  coap_tick_t now;
+
+  if (!upstream)
+    return;
+  req->upstream = NULL;
+  coap_ticks(&now);
+  upstream->pending--;
+  upstream->last_used = now;
+  if (upstream->pending == 0 &&
+      upstream->session->state == COAP_SESSION_STATE_NONE) {
+    HASH_FIND(hh, context->proxy_upstreams, upstream->key,
+              upstream->key_length, pooled);
+    if (pooled != upstream) {
+      coap_session_release(upstream->session);
+      coap_free_type(COAP_STRING, upstream);
+    }
+  }
+}
+
+static void
+proxy_req_free(coap_context_t *context, coap_proxy_req_t *req) {
+  if (!req->ended)
+    HASH_DELETE(hh, context->proxy_reqs, req);
+  if (req->is_observe) {
+    if (req->ended)
+      HASH_DELETE(hh_observe, context->proxy_ended_observes, req);
+    else
+      HASH_DELETE(hh_observe, context->proxy_observes, req);
+  }
+  proxy_req_detach(context, req);
+  if (req->cache_key) {
+    if (req->is_flight)
+      /* Let any identical requests waiting on this one try themselves */
+      coap_cache_flight_complete(req->resource, req->cache_key, NULL);
+    coap_delete_cache_key(req->cache_key);
+  }
+  if (req->body)
+    coap_cache_body_release(req->incoming, req->body);
+  if (req->latest_body)
+    coap_cache_body_release(req->incoming, req->latest_body);
+  coap_delete_pdu(req->latest);
+  coap_delete_pdu(req->request);
+  coap_session_release(req->incoming);
+  coap_free_type(COAP_STRING, req);
+}
+
+/*
+ * Keeps response as the latest of the observation relayed by req, and has
+ * it sent to the downstream observers. Returns the number of observers.
+ */
+static unsigned int
+proxy_observe_update(coap_proxy_req_t *req, const coap_pdu_t *response) {
+  coap_pdu_t *latest;
+
+  latest = coap_pdu_duplicate(response, req->incoming, 0, NULL, NULL);
+  if (latest) {
+    if (req->latest_body)
+      coap_cache_body_release(req->incoming, req->latest_body);
+    coap_delete_pdu(req->latest);
+    req->latest = latest;
+    req->latest_body = coap_cache_body_new(response);
+  }
+  return coap_resource_observers_by_key(req->resource, &req->observe_key, 1);
+}
+
+/*
+ * Stops relaying the observation of req upstream. req is kept for a second,
+ * so that the downstream observers can be sent its latest response, but
+ * new observers of the representation start a new observation.
+ */
+static void
+proxy_observe_end(coap_context_t *context, coap_proxy_req_t *req) {
+  coap_tick_t now;
+
+  HASH_DELETE(hh, context->proxy_reqs, req);
+  HASH_DELETE(hh_observe, context->proxy_observes, req);
+  HASH_ADD(hh_observe, context->proxy_ended_observes, observe_key,
+           sizeof(coap_cache_key_t), req);
+  proxy_req_detach(context, req);
+  req->ended = 1;
+  coap_ticks(&now);
+  req->expire = now + COAP_TICKS_PER_SECOND;
+}
+
+/* Cancels the upstream observation of req, which has no observers left */
+static void
+proxy_observe_cancel(coap_context_t *context, coap_proxy_req_t *req) {
+  coap_binary_t token;
+
+  coap_log_debug("proxy: cancelling observation with no observers\n");
+  token.length = req->key.token_length;
+  token.s = req->key.token;
+  if (req->upstream)
+    coap_cancel_observe(req->key.upstream, &token, COAP_MESSAGE_CON);
+  proxy_req_free(context, req);
+}
+
+/*
+ * Sends response (an upstream response or an error) as a separate response
+ * to request, received on resource over incoming.
+ */
+static void
+proxy_send_response(coap_resource_t *resource, coap_session_t *incoming,
+                    const coap_pdu_t *request, const coap_pdu_t *response) {
+  coap_cache_body_t *body;
+  coap_pdu_t *pdu;
+
+  pdu = coap_pdu_init(request->type == COAP_MESSAGE_NON ?
+                      COAP_MESSAGE_NON : COAP_MESSAGE_CON,
+                      response->code, coap_new_message_id(incoming),
+                      coap_session_max_pdu_size(incoming));
+  if (!pdu)
+    return;
+  if (!coap_add_token(pdu, request->actual_token.length,
+                      request->actual_token.s)) {
+    coap_delete_pdu(pdu);
+    return;
+  }
+  body = coap_cache_body_new(response);
+  coap_cache_fill_response(resource, incoming, request, pdu, response, body,
+                           -1);
+  if (body)
+    coap_cache_body_release(incoming, body);
+  if (coap_send(incoming, pdu) == COAP_INVALID_MID)
+    coap_log_info("proxy: failed to relay %d.%02d response\n",
+                  COAP_RESPONSE_CLASS(response->code), response->code & 0x1f);
+}
+
+/*
+ * Relays response (an upstream response or an error) to the downstream
+ * client of req, and to any identical requests waiting on it.
+ */
+static void
+proxy_req_respond(coap_proxy_req_t *req, const coap_pdu_t *response) {
+  if (req->is_observe) {
+    /* The downstream observers are sent it as a notification */
+    proxy_observe_update(req, response);
+    return;
+  }
+
+  proxy_send_response(req->resource, req->incoming, req->request, response);
+  if (req->is_flight) {
+    /* Answer the identical requests that were waiting on this one */
+    coap_cache_flight_complete(req->resource, req->cache_key, response);
+    req->is_flight = 0;
+  }
+}
+
+/* Sends the downstream client of req an error response and drops req */
+static void
+proxy_req_fail(coap_context_t *context, coap_proxy_req_t *req,
+               coap_pdu_code_t code) {
+  coap_pdu_t *error;
+
+  error = coap_pdu_init(COAP_MESSAGE_CON, code, 0, 0);
+  if (error) {
+    proxy_req_respond(req, error);
+    coap_delete_pdu(error);
+  }
+  if (req->is_observe)
+    proxy_observe_end(context, req);
+  else
+    proxy_req_free(context, req);
+}
+
+/*
+ * Builds the request to send upstream, or returns NULL. If uri is set, the
+ * request is going to the server it names, so its Proxy-* options are
+ * replaced by Uri-* options. A reverse proxy drops the Uri-Host and
+ * Uri-Port that named it.
+ */
+static coap_pdu_t *
+proxy_build_request(coap_session_t *upstream, const coap_pdu_t *request,
+                    coap_uri_t *uri, int reverse, size_t token_length,
+                    const uint8_t *token, coap_cache_body_t *body) {
+  coap_pdu_t *pdu;
+  coap_optlist_t *optlist = NULL;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+
+  pdu = coap_pdu_init(request->type == COAP_MESSAGE_NON ?
+                      COAP_MESSAGE_NON : COAP_MESSAGE_CON,
+                      request->code, coap_new_message_id(upstream),
+                      coap_session_max_pdu_size(upstream));
+  if (!pdu)
+    return NULL;
+  if (!coap_add_token(pdu, token_length, token))
+    goto fail;
+
+  if (uri) {
+    /* The server is named by the Uri-* options rather than Proxy-* */
+    size_t buflen = max(uri->path.length, uri->query.length) + 1;
+    uint8_t *buf = coap_malloc_type(COAP_STRING, buflen);
+    int ret;
+
+    if (!buf)
+      goto fail;
+    ret = coap_uri_into_options(uri, &optlist, 1, buf, buflen);
+    coap_free_type(COAP_STRING, buf);
+    if (ret < 0)
+      goto fail;
+  }
+
+  coap_option_iterator_init(request, &opt_iter, COAP_OPT_ALL);
+  while ((option = coap_option_next(&opt_iter))) {
+    switch (opt_iter.number) {
+    case COAP_OPTION_PROXY_URI:
+    case COAP_OPTION_PROXY_SCHEME:
+    case COAP_OPTION_URI_PATH:
+    case COAP_OPTION_URI_QUERY:
+      if (uri)
+        break;
+      goto add_in;
+    case COAP_OPTION_URI_HOST:
+      if (reverse)
+        break;
+      goto add_in;
+    case COAP_OPTION_URI_PORT:
+      if (uri || reverse)
+        break;
+      goto add_in;
+    case COAP_OPTION_BLOCK1:
+    case COAP_OPTION_BLOCK2:
+    case COAP_OPTION_Q_BLOCK1:
+    case COAP_OPTION_Q_BLOCK2:
+    case COAP_OPTION_SIZE1:
+    case COAP_OPTION_RTAG:
+      /* These are per hop, and added back as needed */
+      break;
+    default:
+add_in:
+      coap_insert_optlist(&optlist,
+                          coap_new_optlist(opt_iter.number,
+                                           coap_opt_length(option),
+                                           coap_opt_value(option)));
+      break;
+    }
+  }
+  /* A request for the root resource may have no options left */
+  if (optlist && !coap_add_optlist_pdu(pdu, &optlist)) {
+    coap_delete_optlist(optlist);
+    goto fail;
+  }
+  coap_delete_optlist(optlist);
+
+  if (body) {
+    /* The new reference is released once the body has been sent */
+    body->ref++;
+    if (!coap_add_data_large_request(upstream, pdu, body->length, body->s,
+                                     coap_cache_body_release, body))
+      goto fail;
+  }
+  return pdu;
+
+fail:
+  coap_delete_pdu(pdu);
+  return NULL;
+}
+
+/* Checks that a request can be sent twice with the same outcome */
+static int
+proxy_is_idempotent(coap_pdu_code_t code) {
+  return code == COAP_REQUEST_CODE_GET || code == COAP_REQUEST_CODE_PUT ||
+         code == COAP_REQUEST_CODE_DELETE || code == COAP_REQUEST_CODE_FETCH ||
+         code == COAP_REQUEST_CODE_IPATCH;
+}
+
+/*
+ * Sends req again to another entry of its server list after the entry it
+ * was sent to failed. Returns 0 if req cannot be sent again.
+ */
+static int
+proxy_req_retry(coap_context_t *context, coap_proxy_req_t *req) {
+  coap_proxy_server_list_t *server_list = req->server_list;
+  coap_proxy_server_t *server;
+  coap_proxy_upstream_t *upstream;
+  coap_pdu_code_t fail_code;
+  coap_pdu_t *pdu;
+  uint8_t token[8];
+  size_t token_length;
+  coap_tick_t now;
+
+  if (!req->server || req->retries + 1 >= server_list->entry_count ||
+      !proxy_is_idempotent(req->request->code))
+    return 0;
+  server = proxy_choose_server(req->incoming, req->request, server_list,
+                               req->server);
+  if (!server)
+    return 0;
+  upstream = proxy_entry_upstream(context, server_list, server, &fail_code);
+  if (!upstream)
+    return 0;
+  coap_session_new_token(upstream->session, &token_length, token);
+  pdu = proxy_build_request(upstream->session, req->request, NULL,
+                            server_list->type == COAP_PROXY_REVERSE,
+                            token_length, token, req->body);
+  if (!pdu)
+    return 0;
+  coap_log_info("proxy: sending request again to %.*s:%u\n",
+                (int)server->uri.host.length, server->uri.host.s,
+                server->uri.port);
+
+  /* The request is now known by its new upstream session and token */
+  HASH_DELETE(hh, context->proxy_reqs, req);
+  proxy_req_detach(context, req);
+  memset(&req->key, 0, sizeof(req->key));
+  req->key.upstream = upstream->session;
+  req->key.token_length = token_length;
+  memcpy(req->key.token, token, token_length);
+  req->upstream = upstream;
+  req->server = server;
+  req->backend = proxy_get_backend(context, server_list, server);
+  req->retries++;
+  req->observing = 0;
+  coap_ticks(&now);
+  req->expire = now + COAP_PROXY_REQ_LIFETIME * COAP_TICKS_PER_SECOND;
+  upstream->pending++;
+  upstream->last_used = now;
+  upstream->idle_timeout_secs = server_list->idle_timeout_secs;
+  HASH_ADD(hh, context->proxy_reqs, key, sizeof(coap_proxy_req_key_t), req);
+
+  return coap_send(upstream->session, pdu) != COAP_INVALID_MID;
+}
+
+/*
+ * Marks the entry that req was sent to as failing, and sends req again to
+ * another entry if it can be, else sends the downstream client code.
+ */
+static void
+proxy_req_upstream_failed(coap_context_t *context, coap_proxy_req_t *req,
+                          coap_pdu_code_t code) {
+  if (req->backend)
+    proxy_backend_failed(req->backend);
+  if (!proxy_req_retry(context, req))
+    proxy_req_fail(context, req, code);
+}
+
+/*
+ * Returns the notify key that the downstream observers of request share if
+ * request registered an observation of resource, else NULL. *notifying is
+ * set if request is that of an observer being sent a notification, rather
+ * than a new registration.
+ */
+static const coap_cache_key_t *
+proxy_observe_key(coap_resource_t *resource, coap_session_t *session,
+                  const coap_pdu_t *request, int *notifying) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *opt;
+  coap_subscription_t *subscription;
+
+  if (!resource->observable)
+    return NULL;
+  opt = coap_check_option(request, COAP_OPTION_OBSERVE, &opt_iter);
+  if (!opt || coap_decode_var_bytes(coap_opt_value(opt),
+                                    coap_opt_length(opt)) !=
+      COAP_OBSERVE_ESTABLISH)
+    return NULL;
+  subscription = coap_find_observer(resource, session, &request->actual_token);
+  if (!subscription)
+    return NULL;
+  /* Notifications are built from the subscription's copy of the request */
+  *notifying = subscription->pdu == request;
+  return coap_observer_notify_key(subscription);
+}
+
+/*
+ * A stateless upstream token (RFC8974 3) holds all that is needed to relay
+ * the response, so nothing is kept for the request:
+ *
+ *   version (1) and nonce (8),
+ *   the state, encrypted with a SipHash keystream for the nonce:
+ *     when sent, in seconds (4), downstream request code (1) and flags (1),
+ *     downstream protocol (1) and local port (2),
+ *     downstream remote address family (1), port (2) and address (4, or 16
+ *     and the scope id (4) for IPv6),
+ *     downstream token length (1) and token (up to 8),
+ *     length (2) of the downstream options that the response is built from,
+ *     each as number (2), length (1) and value,
+ *   MAC (16), a SipHash-2-4-128 of all the above.
+ *
+ * The nonce counts the tokens of the context, so that no keystream is used
+ * twice.
+ */
+#define PROXY_STATELESS_VERSION 2
+#define PROXY_STATELESS_NON     0x01 /* the downstream request was NON */
+#define PROXY_STATELESS_UNKNOWN 0x02 /* received on the unknown resource */
+#define PROXY_STATELESS_NONCE   8
+#define PROXY_STATELESS_MAC     16
+/* Upper bound on the token size, so that the token can be built on stack */
+#define PROXY_STATELESS_MAX     (COAP_PROXY_STATELESS_TOKEN_SIZE + 256)
+
+/* Offset of the encrypted state in a stateless token */
+#define PROXY_STATELESS_STATE   (1 + PROXY_STATELESS_NONCE)
+
+/* The downstream options carried, for the response and any later blocks */
+static const uint16_t proxy_stateless_options[] = { COAP_OPTION_ETAG,
+                                                    COAP_OPTION_URI_PATH,
+                                                    COAP_OPTION_URI_QUERY,
+                                                    COAP_OPTION_BLOCK2,
+                                                    COAP_OPTION_Q_BLOCK2,
+                                                    COAP_OPTION_RTAG
+                                                  };
+
+/* Encrypts, or decrypts, length bytes of data in place */
+static void
+proxy_stateless_crypt(coap_context_t *context,
+                      const uint8_t nonce[PROXY_STATELESS_NONCE],
+                      uint8_t *data, size_t length) {
+  coap_siphash_t state;
+  uint8_t block[8];
+  uint8_t counter[4];
+  uint32_t i;
+  size_t j;
+
+  for (i = 0; length > 0; i++) {
+    counter[0] = (uint8_t)(i >> 24);
+    counter[1] = (uint8_t)(i >> 16);
+    counter[2] = (uint8_t)(i >> 8);
+    counter[3] = (uint8_t)i;
+    coap_siphash_init(&state, context->proxy_token_key, sizeof(block));
+    coap_siphash_update(&state, nonce, PROXY_STATELESS_NONCE);
+    coap_siphash_update(&state, counter, sizeof(counter));
+    coap_siphash_final(&state, block);
+    for (j = 0; j < sizeof(block) && length > 0; j++, length--)
+      *data++ ^= block[j];
+  }
+}
+
+static void
+proxy_stateless_mac(coap_context_t *context, const uint8_t *token,
+                    size_t length, uint8_t mac[PROXY_STATELESS_MAC]) {
+  coap_siphash_t state;
+
+  coap_siphash_init(&state, &context->proxy_token_key[16],
+                    PROXY_STATELESS_MAC);
+  coap_siphash_update(&state, token, length);
+  coap_siphash_final(&state, mac);
+}
+
+/*
+ * Adds the family, port and address of addr to token at *length, returning
+ * 0 if addr is not of a family that can be carried.
+ */
+static int
+proxy_stateless_put_address(const coap_address_t *addr, uint8_t *token,
+                            size_t *length) {
+#if defined(WITH_LWIP) || defined(WITH_CONTIKI)
+  (void)addr;
+  (void)token;
+  (void)length;
+  return 0;
+#else /* ! WITH_LWIP && ! WITH_CONTIKI */
+  uint16_t port = coap_address_get_port(addr);
+  size_t l = *length;
+  uint32_t scope_id;
+
+  if (addr->addr.sa.sa_family == AF_INET) {
+    token[l++] = 4;
+    token[l++] = (uint8_t)(port >> 8);
+    token[l++] = (uint8_t)(port & 0xff);
+    memcpy(&token[l], &addr->addr.sin.sin_addr, 4);
+    l += 4;
+  } else if (addr->addr.sa.sa_family == AF_INET6) {
+    scope_id = addr->addr.sin6.sin6_scope_id;
+    token[l++] = 6;
+    token[l++] = (uint8_t)(port >> 8);
+    token[l++] = (uint8_t)(port & 0xff);
+    memcpy(&token[l], &addr->addr.sin6.sin6_addr, 16);
+    l += 16;
+    token[l++] = (uint8_t)(scope_id >> 24);
+    token[l++] = (uint8_t)(scope_id >> 16);
+    token[l++] = (uint8_t)(scope_id >> 8);
+    token[l++] = (uint8_t)scope_id;
+  } else {
+    return 0;
+  }
+  *length = l;
+  return 1;
+#endif /* ! WITH_LWIP && ! WITH_CONTIKI */
+}
+
+/*
+ * Recovers an address added by proxy_stateless_put_address() from the
+ * length bytes of state at *offset, returning 0 if it is not valid.
+ */
+static int
+proxy_stateless_get_address(const uint8_t *state, size_t length,
+                            size_t *offset, coap_address_t *addr) {
+#if defined(WITH_LWIP) || defined(WITH_CONTIKI)
+  (void)state;
+  (void)length;
+  (void)offset;
+  (void)addr;
+  return 0;
+#else /* ! WITH_LWIP && ! WITH_CONTIKI */
+  size_t l = *offset;
+  uint16_t port;
+
+  if (l + 3 > length)
+    return 0;
+  /* As for coap_address_copy(), so that the session is found by its hash */
+  memset(addr, 0, sizeof(coap_address_t));
+  port = (uint16_t)(state[l + 1] << 8 | state[l + 2]);
+  if (state[l] == 4 && l + 7 <= length) {
+    addr->size = sizeof(struct sockaddr_in);
+    addr->addr.sin.sin_family = AF_INET;
+    memcpy(&addr->addr.sin.sin_addr, &state[l + 3], 4);
+    l += 7;
+  } else if (state[l] == 6 && l + 23 <= length) {
+    addr->size = sizeof(struct sockaddr_in6);
+    addr->addr.sin6.sin6_family = AF_INET6;
+    memcpy(&addr->addr.sin6.sin6_addr, &state[l + 3], 16);
+    addr->addr.sin6.sin6_scope_id = (uint32_t)state[l + 19] << 24 |
+                                    (uint32_t)state[l + 20] << 16 |
+                                    (uint32_t)state[l + 21] << 8 |
+                                    state[l + 22];
+    l += 23;
+  } else {
+    return 0;
+  }
+  coap_address_set_port(addr, port);
+  *offset = l;
+  return 1;
+#endif /* ! WITH_LWIP && ! WITH_CONTIKI */
+}
+
+/*
+ * Builds the stateless upstream token for request, returning its length, or
+ * 0 if request is to be forwarded with state. Observations (the relay is
+ * state), long downstream tokens and options that do not fit in the token
+ * size allowed by the context are left out.
+ */
+static size_t
+proxy_stateless_token(coap_session_t *session, const coap_pdu_t *request,
+                      coap_resource_t *resource,
+                      uint8_t token[PROXY_STATELESS_MAX]) {
+  coap_context_t *context = session->context;
+  coap_opt_filter_t filter;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  size_t max_length = context->max_token_size < PROXY_STATELESS_MAX ?
+                      context->max_token_size : PROXY_STATELESS_MAX;
+  size_t length;
+  size_t opt_start;
+  size_t i;
+  uint32_t sent;
+  uint64_t nonce;
+  coap_tick_t now;
+
+  if (session->type != COAP_SESSION_TYPE_SERVER || !session->endpoint ||
+      (resource != context->proxy_uri_resource &&
+       resource != context->unknown_resource) ||
+      request->actual_token.length > 8 ||
+      coap_check_option(request, COAP_OPTION_OBSERVE, &opt_iter))
+    return 0;
+  if (max_length < COAP_PROXY_STATELESS_TOKEN_SIZE) {
+    coap_log_debug("proxy: max token size too small to be stateless\n");
+    return 0;
+  }
+  if (!context->proxy_token_key_set) {
+    if (!coap_prng(context->proxy_token_key,
+                   sizeof(context->proxy_token_key)))
+      return 0;
+    context->proxy_token_key_set = 1;
+  }
+
+  nonce = ++context->proxy_token_nonce;
+  token[0] = PROXY_STATELESS_VERSION;
+  for (i = 0; i < PROXY_STATELESS_NONCE; i++)
+    token[1 + i] = (uint8_t)(nonce >> (8 * (PROXY_STATELESS_NONCE - 1 - i)));
+
+  coap_ticks(&now);
+  sent = (uint32_t)(now / COAP_TICKS_PER_SECOND);
+  length = PROXY_STATELESS_STATE;
+  token[length++] = (uint8_t)(sent >> 24);
+  token[length++] = (uint8_t)(sent >> 16);
+  token[length++] = (uint8_t)(sent >> 8);
+  token[length++] = (uint8_t)sent;
+  token[length++] = (uint8_t)request->code;
+  token[length++] = (request->type == COAP_MESSAGE_NON ?
+                     PROXY_STATELESS_NON : 0) |
+                    (resource == context->unknown_resource ?
+                     PROXY_STATELESS_UNKNOWN : 0);
+  token[length++] = (uint8_t)session->addr_hash.proto;
+  token[length++] = (uint8_t)(session->addr_hash.lport >> 8);
+  token[length++] = (uint8_t)(session->addr_hash.lport & 0xff);
+  if (!proxy_stateless_put_address(&session->addr_hash.remote, token,
+                                   &length))
+    return 0;
+  token[length++] = (uint8_t)request->actual_token.length;
+  memcpy(&token[length], request->actual_token.s,
+         request->actual_token.length);
+  length += request->actual_token.length;
+
+  opt_start = length;
+  length += 2;
+  coap_option_filter_clear(&filter);
+  for (i = 0; i < sizeof(proxy_stateless_options) /
+       sizeof(proxy_stateless_options[0]); i++)
+    coap_option_filter_set(&filter, proxy_stateless_options[i]);
+  coap_option_iterator_init(request, &opt_iter, &filter);
+  while ((option = coap_option_next(&opt_iter))) {
+    if (coap_opt_length(option) > 255 ||
+        length + 3 + coap_opt_length(option) + PROXY_STATELESS_MAC >
+        max_length) {
+      coap_log_debug("proxy: options too long to be stateless\n");
+      return 0;
+    }
+    token[length++] = (uint8_t)(opt_iter.number >> 8);
+    token[length++] = (uint8_t)(opt_iter.number & 0xff);
+    token[length++] = (uint8_t)coap_opt_length(option);
+    memcpy(&token[length], coap_opt_value(option), coap_opt_length(option));
+    length += coap_opt_length(option);
+  }
+  token[opt_start] = (uint8_t)((length - opt_start - 2) >> 8);
+  token[opt_start + 1] = (uint8_t)((length - opt_start - 2) & 0xff);
+
+  proxy_stateless_crypt(context, &token[1], &token[PROXY_STATELESS_STATE],
+                        length - PROXY_STATELESS_STATE);
+  proxy_stateless_mac(context, token, length, &token[length]);
+  return length + PROXY_STATELESS_MAC;
+}
+
+coap_session_t *
+coap_proxy_stateless_decode(coap_context_t *context, const coap_pdu_t *pdu,
+                            coap_tick_t now, coap_pdu_t **request,
+                            coap_resource_t **resource) {
+  const uint8_t *token = pdu->actual_token.s;
+  size_t length = pdu->actual_token.length;
+  uint8_t state[PROXY_STATELESS_MAX];
+  uint8_t mac[PROXY_STATELESS_MAC];
+  uint8_t diff = 0;
+  coap_addr_hash_t addr_hash;
+  coap_address_t remote;
+  coap_endpoint_t *endpoint;
+  coap_session_t *session = NULL;
+  size_t offset;
+  size_t opt_start;
+  size_t token_length;
+  size_t i;
+  uint32_t sent;
+
+  if (!context->proxy_token_key_set ||
+      length < PROXY_STATELESS_STATE + PROXY_STATELESS_MAC ||
+      length > PROXY_STATELESS_MAX || token[0] != PROXY_STATELESS_VERSION)
+    return NULL;
+  length -= PROXY_STATELESS_MAC;
+  proxy_stateless_mac(context, token, length, mac);
+  for (i = 0; i < PROXY_STATELESS_MAC; i++)
+    diff |= mac[i] ^ token[length + i];
+  if (diff) {
+    coap_log_debug("proxy: stateless token not authentic\n");
+    return NULL;
+  }
+  length -= PROXY_STATELESS_STATE;
+  memcpy(state, &token[PROXY_STATELESS_STATE], length);
+  proxy_stateless_crypt(context, &token[1], state, length);
+
+  /* sent (4), code (1), flags (1), protocol (1) and local port (2) */
+  if (length < 9)
+    return NULL;
+  sent = (uint32_t)state[0] << 24 | (uint32_t)state[1] << 16 |
+         (uint32_t)state[2] << 8 | state[3];
+  if ((uint32_t)(now / COAP_TICKS_PER_SECOND) - sent >
+      COAP_PROXY_REQ_LIFETIME) {
+    coap_log_debug("proxy: stateless token has expired\n");
+    return NULL;
+  }
+  offset = 9;
+  if (!proxy_stateless_get_address(state, length, &offset, &remote) ||
+      offset + 1 > length)
+    return NULL;
+  token_length = state[offset++];
+  if (token_length > 8 || offset + token_length + 2 > length)
+    return NULL;
+  opt_start = offset + token_length + 2;
+  if (opt_start + (state[opt_start - 2] << 8 | state[opt_start - 1]) !=
+      length)
+    return NULL;
+
+  memset(&addr_hash, 0, sizeof(addr_hash));
+  coap_address_copy(&addr_hash.remote, &remote);
+  addr_hash.lport = (uint16_t)(state[7] << 8 | state[8]);
+  addr_hash.proto = (coap_proto_t)state[6];
+  LL_FOREACH(context->endpoint, endpoint) {
+    if (endpoint->proto != addr_hash.proto)
+      continue;
+    SESSIONS_FIND(endpoint->sessions, addr_hash, session);
+    if (session)
+      break;
+  }
+  *resource = state[5] & PROXY_STATELESS_UNKNOWN ?
+              context->unknown_resource : context->proxy_uri_resource;
+  if (!session || !*resource) {
+    coap_log_debug("proxy: downstream session has gone\n");
+    return NULL;
+  }
+
+  *request = coap_pdu_init(state[5] & PROXY_STATELESS_NON ?
+                           COAP_MESSAGE_NON : COAP_MESSAGE_CON,
+                           state[4], 0, length - opt_start + 8 + 16);
+  if (!*request)
+    return NULL;
+  if (!coap_add_token(*request, token_length, &state[offset]))
+    goto fail;
+  /* Carried in order, so can be added in turn */
+  for (i = opt_start; i + 3 <= length; i += 3 + state[i + 2]) {
+    if (i + 3 + state[i + 2] > length ||
+        !coap_add_option(*request, (uint16_t)(state[i] << 8 | state[i + 1]),
+                         state[i + 2], &state[i + 3]))
+      goto fail;
+  }
+  return session;
+
+fail:
+  coap_delete_pdu(*request);
+  return NULL;
+}
+
+/* The health record of the server that upstream is pooled for, or NULL */
+static coap_proxy_backend_t *
+proxy_session_backend(coap_context_t *context, coap_session_t *upstream) {
+  coap_proxy_upstream_t *pooled, *utmp;
+  coap_proxy_backend_t *backend = NULL;
+
+  HASH_ITER(hh, context->proxy_upstreams, pooled, utmp) {
+    if (pooled->session == upstream) {
+      HASH_FIND(hh, context->proxy_backends, pooled->key, pooled->key_length,
+                backend);
+      break;
+    }
+  }
+  return backend;
+}
+
+/*
+ * Relays response to a request that was forwarded statelessly with the token
+ * of sent, and marks the server as up or down. Returns 0 if the token is not
+ * a valid stateless one.
+ */
+static int
+proxy_stateless_respond(coap_session_t *upstream, const coap_pdu_t *sent,
+                        const coap_pdu_t *response, int server_up) {
+  coap_context_t *context = upstream->context;
+  coap_proxy_backend_t *backend;
+  coap_resource_t *resource;
+  coap_session_t *incoming;
+  coap_pdu_t *request;
+  coap_tick_t now;
+
+  coap_ticks(&now);
+  incoming = coap_proxy_stateless_decode(context, sent, now, &request,
+                                         &resource);
+  if (!incoming)
+    return 0;
+  backend = proxy_session_backend(context, upstream);
+  if (backend) {
+    if (server_up)
+      proxy_backend_ok(backend);
+    else
+      proxy_backend_failed(backend);
+  }
+  proxy_send_response(resource, incoming, request, response);
+  coap_delete_pdu(request);
+  return 1;
+}
+
+int
+coap_proxy_forward_request(coap_session_t *session,
+                           const coap_pdu_t *request,
+                           coap_pdu_t *response,
+                           coap_resource_t *resource,
+                           coap_proxy_server_list_t *server_list) {
+  coap_context_t *context = session->context;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *opt;
+  coap_uri_t uri;
+  coap_string_t *uri_path = NULL;
+  coap_string_t *uri_query = NULL;
+  coap_proxy_server_t *next_hop = NULL;
+  coap_cache_key_t *cache_key;
+  const coap_cache_key_t *observe_key;
+  coap_cache_entry_t *cache_entry;
+  coap_cache_body_t *body = NULL;
+  coap_proxy_upstream_t *upstream;
+  coap_proxy_backend_t *backend = NULL;
+  coap_proxy_req_t *req = NULL;
+  coap_pdu_t *pdu;
+  coap_pdu_code_t fail_code = COAP_RESPONSE_CODE_PROXYING_NOT_SUPPORTED;
+  uint8_t token[PROXY_STATELESS_MAX];
+  size_t token_length = 0;
+  size_t length;
+  size_t offset;
+  size_t total;
+  const uint8_t *data;
+  int is_flight = 0;
+  int notifying = 0;
+  int stateless;
+  coap_tick_t now;
+
+  memset(&uri, 0, sizeof(uri));
+  if (server_list->type == COAP_PROXY_REVERSE) {
+    /* The request is for this server, and goes to one of the entries */
+    if (server_list->entry_count == 0) {
+      coap_log_warn("proxy: reverse proxy has no servers\n");
+      fail_code = COAP_RESPONSE_CODE_BAD_GATEWAY;
+      goto fail;
+    }
+  } else {
+    opt = coap_check_option(request, COAP_OPTION_PROXY_SCHEME, &opt_iter);
+    if (opt) {
+      if (!proxy_scheme_uri(request, opt, &uri, &uri_path, &uri_query))
+        goto fail;
+    } else {
+      opt = coap_check_option(request, COAP_OPTION_PROXY_URI, &opt_iter);
+      if (!opt) {
+        fail_code = COAP_RESPONSE_CODE_NOT_FOUND;
+        goto fail;
+      }
+      if (coap_split_proxy_uri(coap_opt_value(opt), coap_opt_length(opt),
+                               &uri) < 0) {
+        /* Need to return a 5.05 RFC7252 Section 5.7.2 */
+        coap_log_warn("Proxy-Uri not decodable\n");
+        goto fail;
+      }
+    }
+    if (uri.host.length == 0 || !proxy_scheme_supported(uri.scheme)) {
+      coap_log_warn("proxy: URI scheme %d not supported\n", uri.scheme);
+      goto fail;
+    }
+  }
+
+  observe_key = proxy_observe_key(resource, session, request, &notifying);
+  if (observe_key) {
+    HASH_FIND(hh_observe, context->proxy_observes, observe_key,
+              sizeof(coap_cache_key_t), req);
+    if (!req && notifying)
+      /* The last notification of an observation that has since ended */
+      HASH_FIND(hh_observe, context->proxy_ended_observes, observe_key,
+                sizeof(coap_cache_key_t), req);
+    if (req) {
+      /*
+       * Already observed upstream. The response is completed from the latest
+       * notification, or left empty until the first one comes in.
+       */
+      if (req->latest)
+        coap_cache_fill_response(resource, session, request, response,
+                                 req->latest, req->latest_body, -1);
+      req = NULL;
+      goto done;
+    }
+  }
+
+  cache_key = coap_cache_derive_key_w_ignore(session, request,
+                                             COAP_CACHE_NOT_SESSION_BASED,
+                                             proxy_ignore_options,
+                                             sizeof(proxy_ignore_options) /
+                                             sizeof(proxy_ignore_options[0]));
+  if (cache_key && server_list->cache_responses &&
+      !coap_check_option(request, COAP_OPTION_OBSERVE, &opt_iter)) {
+    cache_entry = coap_cache_get_by_key(context, cache_key);
+    if (cache_entry && coap_cache_get_pdu(cache_entry) &&
+        coap_cache_get_max_age(cache_entry) > 0) {
+      const coap_pdu_t *cached = coap_cache_get_pdu(cache_entry);
+
+      body = coap_cache_body_new(cached);
+      coap_log_debug("proxy: response from cache\n");
+      coap_cache_fill_response(resource, session, request, response, cached,
+                               body, coap_cache_get_max_age(cache_entry));
+      if (body)
+        coap_cache_body_release(session, body);
+      coap_delete_cache_key(cache_key);
+      goto done;
+    }
+  }
+  if (server_list->stateless)
+    token_length = proxy_stateless_token(session, request, resource, token);
+  stateless = token_length != 0;
+  /* A stateless request has no req to answer the identical requests from */
+  if (cache_key && !stateless) {
+    switch (coap_cache_flight_join(session, request, cache_key)) {
+    case COAP_CACHE_FLIGHT_PARKED:
+      /* Empty ACK, the separate response is sent by the leader */
+      coap_delete_cache_key(cache_key);
+      goto done;
+    case COAP_CACHE_FLIGHT_LEADER:
+      is_flight = 1;
+      break;
+    case COAP_CACHE_FLIGHT_NONE:
+    default:
+      break;
+    }
+  }
+
+  /* The body is kept, in case the request has to be sent again */
+  if (coap_get_data_large(request, &length, &data, &offset, &total)) {
+    if (length != total) {
+      coap_log_warn("proxy: request body is incomplete, "
+                    "COAP_BLOCK_SINGLE_BODY needs to be set\n");
+      fail_code = COAP_RESPONSE_CODE_INTERNAL_ERROR;
+      goto fail_flight;
+    }
+    body = coap_cache_body_new(request);
+    if (!body) {
+      fail_code = COAP_RESPONSE_CODE_INTERNAL_ERROR;
+      goto fail_flight;
+    }
+  }
+
+  if (server_list->entry_count) {
+    next_hop = proxy_choose_server(session, request, server_list, NULL);
+    if (!next_hop) {
+      fail_code = COAP_RESPONSE_CODE_INTERNAL_ERROR;
+      goto fail_flight;
+    }
+    backend = proxy_get_backend(context, server_list, next_hop);
+    upstream = proxy_entry_upstream(context, server_list, next_hop,
+                                    &fail_code);
+    /* Not failed while the name is being, or yet to be, resolved */
+    if (!upstream && backend && fail_code != COAP_EMPTY_CODE &&
+        fail_code != COAP_RESPONSE_CODE_SERVICE_UNAVAILABLE)
+      proxy_backend_failed(backend);
+  } else {
+    upstream = proxy_get_upstream(context, &uri, server_list->dtls_pki,
+                                  server_list->dtls_cpsk, &fail_code);
+  }
+  if (!upstream && fail_code == COAP_EMPTY_CODE) {
+    /* Held (with an empty ACK) until the server name has been resolved */
+    if (!proxy_park(session, request, resource, server_list, body)) {
+      fail_code = COAP_RESPONSE_CODE_INTERNAL_ERROR;
+      goto fail_flight;
+    }
+    if (is_flight)
+      coap_cache_flight_complete(resource, cache_key, NULL);
+    coap_delete_cache_key(cache_key);
+    goto done;
+  }
+  if (!upstream)
+    goto fail_flight;
+
+  /*
+   * Over TCP the token is all that tells the responses apart, but there is
+   * no retransmission to hold up, so the request is only kept there.  The
+   * server also needs to have been found to take the token.
+   */
+  if (stateless && !COAP_PROTO_RELIABLE(upstream->session->proto) &&
+      upstream->session->max_token_checked == COAP_EXT_T_CHECKED &&
+      token_length <= upstream->session->max_token_size) {
+    pdu = proxy_build_request(upstream->session, request,
+                              next_hop ? NULL : &uri,
+                              server_list->type == COAP_PROXY_REVERSE,
+                              token_length, token, body);
+    if (!pdu) {
+      fail_code = COAP_RESPONSE_CODE_INTERNAL_ERROR;
+      goto fail_flight;
+    }
+    /* A NON request would be tracked until its response comes in */
+    pdu->type = COAP_MESSAGE_CON;
+    coap_delete_cache_key(cache_key);
+    if (body)
+      coap_cache_body_release(session, body);
+    coap_ticks(&upstream->last_used);
+    if (coap_send(upstream->session, pdu) == COAP_INVALID_MID) {
+      if (backend)
+        proxy_backend_failed(backend);
+      coap_delete_string(uri_path);
+      coap_delete_string(uri_query);
+      coap_pdu_set_code(response, COAP_RESPONSE_CODE_BAD_GATEWAY);
+      return 0;
+    }
+    coap_log_debug("proxy: request forwarded statelessly\n");
+    goto done;
+  }
+
+  req = coap_malloc_type(COAP_STRING, sizeof(coap_proxy_req_t));
+  if (!req) {
+    fail_code = COAP_RESPONSE_CODE_INTERNAL_ERROR;
+    goto fail_flight;
+  }
+  memset(req, 0, sizeof(coap_proxy_req_t));
+  req->backend = backend;
+
+  coap_session_new_token(upstream->session, &token_length, token);
+  pdu = proxy_build_request(upstream->session, request,
+                            next_hop ? NULL : &uri,
+                            server_list->type == COAP_PROXY_REVERSE,
+                            token_length, token, body);
+  if (!pdu) {
+    fail_code = COAP_RESPONSE_CODE_INTERNAL_ERROR;
+    goto fail_flight;
+  }
+
+  req->request = coap_pdu_duplicate(request, session,
+                                    request->actual_token.length,
+                                    request->actual_token.s, NULL);
+  if (!req->request) {
+    coap_delete_pdu(pdu);
+    fail_code = COAP_RESPONSE_CODE_INTERNAL_ERROR;
+    goto fail_flight;
+  }
+  req->request->type = request->type;
+  req->request->mid = request->mid;
+  req->request->lg_xmit = NULL;
+  req->key.upstream = upstream->session;
+  req->key.token_length = token_length;
+  memcpy(req->key.token, token, token_length);
+  req->upstream = upstream;
+  req->incoming = coap_session_reference(session);
+  req->resource = resource;
+  req->cache_key = cache_key;
+  req->is_flight = is_flight;
+  req->cache_responses = server_list->cache_responses;
+  req->body = body;
+  req->server_list = server_list;
+  req->server = next_hop;
+  coap_ticks(&now);
+  req->expire = now + COAP_PROXY_REQ_LIFETIME * COAP_TICKS_PER_SECOND;
+  upstream->pending++;
+  upstream->last_used = now;
+  upstream->idle_timeout_secs = server_list->idle_timeout_secs;
+  HASH_ADD(hh, context->proxy_reqs, key, sizeof(coap_proxy_req_key_t), req);
+  if (observe_key) {
+    /* Later observers of the same representation share this observation */
+    req->is_observe = 1;
+    memcpy(&req->observe_key, observe_key, sizeof(coap_cache_key_t));
+    HASH_ADD(hh_observe, context->proxy_observes, observe_key,
+             sizeof(coap_cache_key_t), req);
+  }
+
+  if (coap_send(upstream->session, pdu) == COAP_INVALID_MID) {
+    if (req->backend)
+      proxy_backend_failed(req->backend);
+    if (!proxy_req_retry(context, req)) {
+      /* This completes any flight and deletes cache_key */
+      proxy_req_free(context, req);
+      coap_delete_string(uri_path);
+      coap_delete_string(uri_query);
+      coap_pdu_set_code(response, COAP_RESPONSE_CODE_BAD_GATEWAY);
+      return 0;
+    }
+  }
+  /*
+   * The response is left empty (hence an empty ACK), as a separate
+   * response is sent when the upstream response comes back
+   */
+done:
+  coap_delete_string(uri_path);
+  coap_delete_string(uri_query);
+  return 1;
+
+fail_flight:
+  if (is_flight)
+    /* Not going upstream, so let any waiting requests try for themselves */
+    coap_cache_flight_complete(resource, cache_key, NULL);
+  coap_delete_cache_key(cache_key);
+  if (body)
+    coap_cache_body_release(session, body);
+  if (req)
+    coap_free_type(COAP_STRING, req);
+fail:
+  coap_delete_string(uri_path);
+  coap_delete_string(uri_query);
+  coap_pdu_set_code(response, fail_code);
+  return 0;
+}
+
+static coap_proxy_req_t *
+proxy_find_req(coap_session_t *session, const coap_pdu_t *pdu) {
+  coap_proxy_req_key_t key;
+  coap_proxy_req_t *req;
+
+  if (pdu->actual_token.length > sizeof(key.token))
+    return NULL;
+  memset(&key, 0, sizeof(key));
+  key.upstream = session;
+  key.token_length = pdu->actual_token.length;
+  memcpy(key.token, pdu->actual_token.s, pdu->actual_token.length);
+  HASH_FIND(hh, session->context->proxy_reqs, &key,
+            sizeof(coap_proxy_req_key_t), req);
+  return req;
+}
+
+coap_response_t
+coap_proxy_forward_response(coap_session_t *session,
+                            const coap_pdu_t *received) {
+  coap_context_t *context = session->context;
+  coap_opt_iterator_t opt_iter;
+  coap_proxy_req_t *req;
+
+  req = proxy_find_req(session, received);
+  if (!req && received->actual_token.length > sizeof(req->key.token) &&
+      proxy_stateless_respond(session, received, received, 1)) {
+    coap_log_debug("proxy: relayed %d.%02d response statelessly\n",
+                   COAP_RESPONSE_CLASS(received->code),
+                   received->code & 0x1f);
+    return COAP_RESPONSE_OK;
+  }
+  if (!req) {
+    coap_log_debug("proxy: response for unknown request\n");
+    /* A notification is rejected to cancel the observation (RFC7641 3.6) */
+    return coap_check_option(received, COAP_OPTION_OBSERVE, &opt_iter) ?
+           COAP_RESPONSE_FAIL : COAP_RESPONSE_OK;
+  }
+  coap_log_debug("proxy: relaying %d.%02d response\n",
+                 COAP_RESPONSE_CLASS(received->code), received->code & 0x1f);
+  if (req->backend)
+    /* Any response shows that the server is up */
+    proxy_backend_ok(req->backend);
+
+  if (req->is_observe) {
+    if (COAP_RESPONSE_CLASS(received->code) == 2 &&
+        coap_check_option(received, COAP_OPTION_OBSERVE, &opt_iter)) {
+      req->observing = 1;
+      req->retries = 0;
+      if (!proxy_observe_update(req, received))
+        proxy_observe_cancel(context, req);
+    } else {
+      /* The upstream server has ended, or not taken on, the observation */
+      proxy_observe_update(req, received);
+      proxy_observe_end(context, req);
+    }
+    return COAP_RESPONSE_OK;
+  }
+
+  /*
+   * Only responses that are in a single PDU are held, as the cache does not
+   * keep re-assembled bodies
+   */
+  if (req->cache_responses && req->cache_key &&
+      received->code == COAP_RESPONSE_CODE(205) && !received->body_data)
+    coap_cache_add_response_by_key(session, req->cache_key, received,
+                                   COAP_CACHE_NOT_SESSION_BASED);
+  proxy_req_respond(req, received);
+  proxy_req_free(context, req);
+  return COAP_RESPONSE_OK;
+}
+
+void
+coap_proxy_upstream_nack(coap_session_t *session, const coap_pdu_t *sent,
+                         coap_nack_reason_t reason) {
+  coap_proxy_req_t *req;
+  coap_pdu_t *error;
+  coap_pdu_code_t code = reason == COAP_NACK_TOO_MANY_RETRIES ?
+                         COAP_RESPONSE_CODE_GATEWAY_TIMEOUT :
+                         COAP_RESPONSE_CODE_BAD_GATEWAY;
+
+  if (session->max_token_checked == COAP_EXT_T_CHECKING &&
+      session->max_token_mid == sent->mid) {
+    /* No answer to whether long tokens are taken, so they are not */
+    session->max_token_size = COAP_TOKEN_DEFAULT_MAX;
+    session->max_token_checked = COAP_EXT_T_CHECKED;
+    return;
+  }
+  req = proxy_find_req(session, sent);
+  if (req) {
+    proxy_req_upstream_failed(session->context, req, code);
+  } else if (sent->actual_token.length > sizeof(req->key.token)) {
+    /* Forwarded statelessly, so is not sent again */
+    error = coap_pdu_init(COAP_MESSAGE_CON, code, 0, 0);
+    if (error) {
+      proxy_stateless_respond(session, sent, error, 0);
+      coap_delete_pdu(error);
+    }
+  }
+}
+
+void
+coap_proxy_upstream_disconnected(coap_session_t *session) {
+  coap_context_t *context = session->context;
+  coap_proxy_req_t *req, *rtmp;
+  coap_queue_t *node, *next;
+  coap_pdu_t *error;
+
+  HASH_ITER(hh, context->proxy_reqs, req, rtmp) {
+    /* Requests sent again are on another session, and are skipped */
+    if (req->key.upstream == session) {
+      /* The session is still in use, so is left for the pool to drop */
+      req->upstream->pending--;
+      req->upstream = NULL;
+      proxy_req_upstream_failed(context, req,
+                                COAP_RESPONSE_CODE_BAD_GATEWAY);
+    }
+  }
+
+  /* Stateless requests are only known by their retransmissions */
+  error = coap_pdu_init(COAP_MESSAGE_CON, COAP_RESPONSE_CODE_BAD_GATEWAY, 0,
+                        0);
+  for (node = context->sendqueue; node; node = next) {
+    next = node->next;
+    if (node->session != session ||
+        node->pdu->actual_token.length <= sizeof(req->key.token))
+      continue;
+    if (coap_remove_from_queue(&context->sendqueue, session, node->id,
+                               &node)) {
+      if (error)
+        proxy_stateless_respond(session, node->pdu, error, 0);
+      coap_delete_node(node);
+    }
+  }
+  coap_delete_pdu(error);
+}
+
+/*
+ * Called when a server name has been resolved. The held requests are
+ * forwarded again, those going to a server still being resolved being held
+ * again.
+ */
+static void
+proxy_resolved(coap_context_t *context, coap_addr_info_t *info_list,
+               void *app_data COAP_UNUSED) {
+  coap_proxy_parked_t *parked_list = context->proxy_parked;
+  coap_proxy_parked_t *parked;
+  coap_pdu_t *response;
+
+  coap_free_address_info(info_list);
+  context->proxy_parked = NULL;
+  while (parked_list) {
+    parked = parked_list;
+    parked_list = parked->next;
+    parked->next = NULL;
+    response = coap_pdu_init(COAP_MESSAGE_CON, COAP_EMPTY_CODE, 0,
+                             coap_session_max_pdu_size(parked->incoming));
+    if (!response) {
+      proxy_parked_free(parked);
+      continue;
+    }
+    coap_proxy_forward_request(parked->incoming, parked->request, response,
+                               parked->resource, parked->server_list);
+    /* Otherwise it has been forwarded, or held again */
+    if (response->code != COAP_EMPTY_CODE)
+      proxy_send_response(parked->resource, parked->incoming,
+                          parked->request, response);
+    coap_delete_pdu(response);
+    proxy_parked_free(parked);
+  }
+}
+
+/* Marks backend as failing its health check */
+static void
+proxy_backend_check_failed(coap_context_t *context,
+                           coap_proxy_backend_t *backend) {
+  coap_proxy_upstream_t *upstream;
+
+  proxy_backend_failed(backend);
+  backend->check_sent = 0;
+  /*
+   * Start again with a new session, rather than queue pings behind the
+   * unanswered one (NSTART)
+   */
+  HASH_FIND(hh, context->proxy_upstreams, backend->key, backend->key_length,
+            upstream);
+  if (upstream && upstream->pending == 0)
+    proxy_upstream_free(context, upstream);
+}
+
+/*
+ * Checks the health of backend with a ping over its pooled session. It is
+ * up if the session is established and answers the ping within
+ * health_check_secs. A session still being set up is given the same time to
+ * be established instead.
+ */
+static void
+proxy_backend_check(coap_context_t *context, coap_proxy_backend_t *backend,
+                    coap_tick_t now) {
+  coap_tick_t interval = (coap_tick_t)backend->server_list->health_check_secs *
+                         COAP_TICKS_PER_SECOND;
+  coap_proxy_upstream_t *upstream;
+  coap_pdu_code_t fail_code;
+  coap_mid_t mid;
+
+  if (backend->check_sent) {
+    HASH_FIND(hh, context->proxy_upstreams, backend->key, backend->key_length,
+              upstream);
+    if (upstream &&
+        upstream->session->state == COAP_SESSION_STATE_ESTABLISHED &&
+        (!backend->ping_sent ||
+         upstream->session->last_pong >= backend->check_sent)) {
+      proxy_backend_ok(backend);
+      backend->check_sent = 0;
+    } else if (backend->check_sent + interval <= now) {
+      proxy_backend_check_failed(context, backend);
+    }
+  }
+  if (backend->check_sent || backend->next_check > now)
+    return;
+
+  backend->next_check = now + interval;
+  upstream = proxy_entry_upstream(context, backend->server_list,
+                                  backend->server, &fail_code);
+  if (!upstream) {
+    /* Not failed if the name is still being, or yet to be, resolved */
+    if (fail_code != COAP_EMPTY_CODE &&
+        fail_code != COAP_RESPONSE_CODE_SERVICE_UNAVAILABLE)
+      proxy_backend_failed(backend);
+    return;
+  }
+  /* Health checked sessions are kept, rather than closed when idle */
+  upstream->last_used = now;
+  backend->check_sent = now;
+  backend->ping_sent = 0;
+  if (upstream->session->state == COAP_SESSION_STATE_ESTABLISHED) {
+    mid = coap_session_send_ping(upstream->session);
+    if (mid == COAP_INVALID_MID) {
+      proxy_backend_check_failed(context, backend);
+      return;
+    }
+    /* So that the RST answering it is taken as a pong */
+    upstream->session->last_ping_mid = mid;
+    upstream->session->last_ping = now;
+    backend->ping_sent = 1;
+  }
+}
+
+coap_tick_t
+coap_proxy_check_backends(coap_context_t *context, coap_tick_t now) {
+  coap_proxy_backend_t *backend, *btmp;
+  coap_tick_t timeout = 0;
+  coap_tick_t due;
+
+  HASH_ITER(hh, context->proxy_backends, backend, btmp) {
+    if (backend->server_list->health_check_secs == 0)
+      continue;
+    proxy_backend_check(context, backend, now);
+    /* Any outstanding check times out when the next one is due */
+    due = backend->next_check;
+    if (due > now && (timeout == 0 || due - now < timeout))
+      timeout = due - now;
+  }
+  return timeout;
+}
+
+coap_tick_t
+coap_proxy_check_timeouts(coap_context_t *context, coap_tick_t now) {
+  coap_proxy_req_t *req, *rtmp;
+  coap_proxy_upstream_t *upstream, *utmp;
+  coap_tick_t timeout = 0;
+  coap_tick_t due;
+
+  HASH_ITER(hh, context->proxy_reqs, req, rtmp) {
+    if (req->observing)
+      continue;
+    if (req->expire <= now) {
+      proxy_req_upstream_failed(context, req,
+                                COAP_RESPONSE_CODE_GATEWAY_TIMEOUT);
+      continue;
+    }
+    if (timeout == 0 || req->expire - now < timeout)
+      timeout = req->expire - now;
+  }
+  HASH_ITER(hh_observe, context->proxy_ended_observes, req, rtmp) {
+    if (req->expire <= now) {
+      proxy_req_free(context, req);
+      continue;
+    }
+    due = req->expire - now;
+    if (timeout == 0 || due < timeout)
+      timeout = due;
+  }
+  HASH_ITER(hh_observe, context->proxy_observes, req, rtmp) {
+    if (req->observing &&
+        !coap_resource_observers_by_key(req->resource,
+                                        &req->observe_key, 0)) {
+      proxy_observe_cancel(context, req);
+      continue;
+    }
+    /* Checked again for observers that have gone */
+    due = COAP_TICKS_PER_SECOND;
+    if (timeout == 0 || due < timeout)
+      timeout = due;
+  }
+  HASH_ITER(hh, context->proxy_upstreams, upstream, utmp) {
+    if (upstream->pending)
+      continue;
+    due = upstream->last_used +
+          (coap_tick_t)upstream->idle_timeout_secs * COAP_TICKS_PER_SECOND;
+    if (upstream->session->state == COAP_SESSION_STATE_NONE ||
+        (upstream->idle_timeout_secs && due <= now)) {
+      coap_log_debug("***%s: proxy upstream session closed\n",
+                     coap_session_str(upstream->session));
+      proxy_upstream_free(context, upstream);
+      continue;
+    }
+    if (upstream->idle_timeout_secs &&
+        (timeout == 0 || due - now < timeout))
+      timeout = due - now;
+  }
+  return timeout;
+}
+
+void
+coap_delete_proxy(coap_context_t *context) {
+  coap_proxy_req_t *req, *rtmp;
+  coap_proxy_upstream_t *upstream, *utmp;
+  coap_proxy_backend_t *backend, *btmp;
+  coap_proxy_parked_t *parked, *ptmp;
+
+  LL_FOREACH_SAFE(context->proxy_parked, parked, ptmp) {
+    proxy_parked_free(parked);
+  }
+  context->proxy_parked = NULL;
+  HASH_ITER(hh, context->proxy_reqs, req, rtmp) {
+    /* Flights are deleted with the cache */
+    req->is_flight = 0;
+    req->upstream = NULL;
+    proxy_req_free(context, req);
+  }
+  /* Those left have ended, and have no upstream session */
+  HASH_ITER(hh_observe, context->proxy_ended_observes, req, rtmp) {
+    proxy_req_free(context, req);
+  }
+  HASH_ITER(hh, context->proxy_upstreams, upstream, utmp) {
+    proxy_upstream_free(context, upstream);
+  }
+  HASH_ITER(hh, context->proxy_backends, backend, btmp) {
+    HASH_DELETE(hh, context->proxy_backends, backend);
+    coap_free_type(COAP_STRING, backend);
+  }
+}
+
+#else /* ! (COAP_SERVER_SUPPORT && COAP_CLIENT_SUPPORT) */
+
+int
+coap_proxy_is_supported(void) {
+  return 0;
+}
+
+#if COAP_SERVER_SUPPORT
+int
+coap_proxy_forward_request(coap_session_t *session COAP_UNUSED,
+                           const coap_pdu_t *request COAP_UNUSED,
+                           coap_pdu_t *response,
+                           coap_resource_t *resource COAP_UNUSED,
+                           coap_proxy_server_list_t *server_list COAP_UNUSED) {
+  coap_log_warn("proxy: needs client support\n");
+  coap_pdu_set_code(response, COAP_RESPONSE_CODE_PROXYING_NOT_SUPPORTED);
+  return 0;
+}
+#endif /* COAP_SERVER_SUPPORT */
+
+#endif /* ! (COAP_SERVER_SUPPORT && COAP_CLIENT_SUPPORT) */
@@ -115,6 +115,172 @@ coap_session_get_probing_rate(const coap_session_t *session) {
   return session->probing_rate;
 }
 
+/* CoCoA limits (draft-ietf-core-cocoa) */
+#define COAP_RTT_MAX_RTO (32 * COAP_TICKS_PER_SECOND)
+#define COAP_RTT_STRONG_K 4
+#define COAP_RTT_WEAK_K 1
+#define COAP_RTT_MAX_WEAK_RETRANSMIT 2
+
+static coap_tick_t
+coap_session_ack_timeout_ticks(const coap_session_t *session) {
+  return ((coap_tick_t)session->ack_timeout.integer_part * 1000 +
+          session->ack_timeout.fractional_part) *
+         COAP_TICKS_PER_SECOND / 1000;
+}
+
+static coap_rtt_estimator_t *
+coap_session_rtt_attach(coap_session_t *session) {
+  coap_context_t *context = session->context;
+  coap_rtt_estimator_t *est;
+  coap_address_t remote;
+
+  coap_address_copy(&remote, &session->addr_info.remote);
+  coap_address_set_port(&remote, 0);
+
+  if (context->rtt_estimation == COAP_RTT_ESTIMATION_SHARED) {
+    LL_FOREACH(context->rtt_estimators, est) {
+      if (coap_address_equals(&est->remote, &remote)) {
+        est->ref++;
+        return est;
+      }
+    }
+  }
+  est = coap_malloc_type(COAP_STRING, sizeof(coap_rtt_estimator_t));
+  if (!est)
+    return NULL;
+  memset(est, 0, sizeof(coap_rtt_estimator_t));
+  coap_address_copy(&est->remote, &remote);
+  est->ref = 1;
+  est->rto = coap_session_ack_timeout_ticks(session);
+  coap_ticks(&est->last_update);
+  if (context->rtt_estimation == COAP_RTT_ESTIMATION_SHARED)
+    LL_PREPEND(context->rtt_estimators, est);
+  return est;
+}
+
+void
+coap_session_rtt_release(coap_session_t *session) {
+  coap_rtt_estimator_t *est = session->rtt_est;
+
+  if (!est)
+    return;
+  session->rtt_est = NULL;
+  if (--est->ref > 0)
+    return;
+  if (session->context) {
+    coap_rtt_estimator_t *el;
+
+    LL_FOREACH(session->context->rtt_estimators, el) {
+      if (el == est) {
+        LL_DELETE(session->context->rtt_estimators, est);
+        break;
+      }
+    }
+  }
+  coap_free_type(COAP_STRING, est);
+}
+
+int
+coap_session_rtt_get_rto(coap_session_t *session, coap_tick_t *rto) {
+  coap_rtt_estimator_t *est = session->rtt_est;
+  coap_tick_t now;
+
+  if (!est) {
+    if (session->context->rtt_estimation == COAP_RTT_ESTIMATION_NONE ||
+        COAP_PROTO_RELIABLE(session->proto))
+      return 0;
+    est = session->rtt_est = coap_session_rtt_attach(session);
+    if (!est)
+      return 0;
+  }
+
+  /* RTO aging */
+  coap_ticks(&now);
+  if (est->rto < COAP_TICKS_PER_SECOND &&
+      now - est->last_update > 16 * est->rto) {
+    est->rto *= 2;
+    est->last_update = now;
+  } else if (est->rto > 3 * COAP_TICKS_PER_SECOND &&
+             now - est->last_update > 4 * est->rto) {
+    est->rto = COAP_TICKS_PER_SECOND + est->rto / 2;
+    est->last_update = now;
+  }
+  *rto = est->rto;
+  return 1;
+}
+
+/*
+ * RFC6298 smoothing, returns SRTT + K * RTTVAR.
+ */
+static coap_tick_t
+coap_rtt_estimate(coap_tick_t *srtt, coap_tick_t *rttvar, uint32_t samples,
+                  coap_tick_t rtt, unsigned int k) {
+  if (samples == 0) {
+    *srtt = rtt;
+    *rttvar = rtt / 2;
+  } else {
+    coap_tick_t delta = *srtt > rtt ? *srtt - rtt : rtt - *srtt;
+
+    *rttvar = (3 * *rttvar + delta) / 4;
+    *srtt = (7 * *srtt + rtt) / 8;
+  }
+  return *srtt + k * *rttvar;
+}
+
+void
+coap_session_rtt_update(coap_session_t *session, const coap_queue_t *node,
+                        coap_tick_t now) {
+  coap_rtt_estimator_t *est = session->rtt_est;
+  coap_tick_t rtt;
+  coap_tick_t rto;
+
+  if (!est || node->retransmit_cnt > COAP_RTT_MAX_WEAK_RETRANSMIT ||
+      now < node->tx_time)
+    return;
+
+  rtt = now - node->tx_time;
+  if (node->retransmit_cnt == 0) {
+    rto = coap_rtt_estimate(&est->srtt_strong, &est->rttvar_strong,
+                            est->strong_samples++, rtt, COAP_RTT_STRONG_K);
+    est->rto = (est->rto + rto) / 2;
+  } else {
+    /* RTT is measured from the initial transmission */
+    rto = coap_rtt_estimate(&est->srtt_weak, &est->rttvar_weak,
+                            est->weak_samples++, rtt, COAP_RTT_WEAK_K);
+    est->rto = (3 * est->rto + rto) / 4;
+  }
+  if (est->rto > COAP_RTT_MAX_RTO)
+    est->rto = COAP_RTT_MAX_RTO;
+  else if (est->rto == 0)
+    est->rto = 1;
+  est->last_update = now;
+  coap_log_debug("***%s: RTT %ums (%s), RTO now %ums\n",
+                 coap_session_str(session),
+                 (unsigned)(rtt * 1000 / COAP_TICKS_PER_SECOND),
+                 node->retransmit_cnt ? "weak" : "strong",
+                 (unsigned)(est->rto * 1000 / COAP_TICKS_PER_SECOND));
+}
+
+int
+coap_session_get_rtt_info(const coap_session_t *session,
+                          coap_rtt_info_t *info) {
+  const coap_rtt_estimator_t *est = session ? session->rtt_est : NULL;
+
+  assert(info);
+  memset(info, 0, sizeof(*info));
+  if (!est)
+    return 0;
+  info->rto = est->rto;
+  info->srtt_strong = est->srtt_strong;
+  info->rttvar_strong = est->rttvar_strong;
+  info->srtt_weak = est->srtt_weak;
+  info->rttvar_weak = est->rttvar_weak;
+  info->strong_samples = est->strong_samples;
+  info->weak_samples = est->weak_samples;
+  info->shared = est->ref;
+  return 1;
+}
+
 coap_session_t *
 coap_session_reference(coap_session_t *session) {
   ++session->ref;
@@ -249,11 +415,16 @@ void coap_session_mfree(coap_session_t *session) {
         continue;
       }
     }
-    LL_DELETE(session->lg_crcv, lg_crcv);
+    coap_block_unlink_lg_crcv(session, lg_crcv);
     coap_block_delete_lg_crcv(session, lg_crcv);
   }
 #endif /* COAP_CLIENT_SUPPORT */
 
+  if (session->write_buf) {
+    /* Try to get out anything that is still coalesced */
+    coap_session_flush_write_buf(session);
+    coap_free_type(COAP_STRING, session->write_buf);
+  }
   if (session->partial_pdu)
     coap_delete_pdu(session->partial_pdu);
   if (session->proto == COAP_PROTO_DTLS)
@@ -262,6 +433,12 @@ void coap_session_mfree(coap_session_t *session) {
   else if (session->proto == COAP_PROTO_TLS)
     coap_tls_free_session(session);
 #endif /* !COAP_DISABLE_TCP */
+#if COAP_CONNECT_RACE
+  if (session->connect_race) {
+    coap_session_race_end(session);
+    coap_free_type(COAP_STRING, session->connect_race);
+  }
+#endif /* COAP_CONNECT_RACE */
   if (coap_netif_available(session))
     coap_netif_close(session);
   if (session->psk_identity)
@@ -270,6 +447,7 @@ void coap_session_mfree(coap_session_t *session) {
     coap_delete_bin_const(session->psk_key);
   if (session->psk_hint)
     coap_delete_bin_const(session->psk_hint);
+  coap_session_rtt_release(session);
 
 #if COAP_SERVER_SUPPORT
   coap_cache_entry_t *cp, *ctmp;
@@ -292,14 +470,14 @@ void coap_session_mfree(coap_session_t *session) {
     coap_delete_node(q);
   }
   LL_FOREACH_SAFE(session->lg_xmit, lq, ltmp) {
-    LL_DELETE(session->lg_xmit, lq);
+    coap_block_unlink_lg_xmit(session, lq);
     coap_block_delete_lg_xmit(session, lq);
   }
 #if COAP_SERVER_SUPPORT
   coap_lg_srcv_t *sq, *stmp;
 
   LL_FOREACH_SAFE(session->lg_srcv, sq, stmp) {
-    LL_DELETE(session->lg_srcv, sq);
+    coap_block_unlink_lg_srcv(session, sq);
     coap_block_delete_lg_srcv(session, sq);
   }
 #endif /* COAP_SERVER_SUPPORT */
@@ -580,6 +758,10 @@ void coap_session_disconnected(coap_session_t *session, coap_nack_reason_t reaso
            coap_session_str(session), reason);
 #if COAP_SERVER_SUPPORT
   coap_delete_observers( session->context, session );
+#if COAP_CLIENT_SUPPORT
+  if (session->proxy_upstream)
+    coap_proxy_upstream_disconnected(session);
+#endif /* COAP_CLIENT_SUPPORT */
 #endif /* COAP_SERVER_SUPPORT */
 
   if ( session->tls) {
@@ -604,6 +786,9 @@ void coap_session_disconnected(coap_session_t *session, coap_nack_reason_t reaso
     session->partial_pdu = NULL;
   }
   session->partial_read = 0;
+  session->write_buf_used = 0;
+  session->write_buf_sent = 0;
+  session->write_buf_flushing = 0;
 
   while (session->delayqueue) {
     coap_queue_t *q = session->delayqueue;
@@ -646,17 +831,17 @@ void coap_session_disconnected(coap_session_t *session, coap_nack_reason_t reaso
 
     /* Need to do this before (D)TLS and socket is closed down */
     LL_FOREACH_SAFE(session->lg_crcv, cq, etmp) {
-      LL_DELETE(session->lg_crcv, cq);
+      coap_block_unlink_lg_crcv(session, cq);
       coap_block_delete_lg_crcv(session, cq);
     }
 #endif /* COAP_CLIENT_SUPPORT */
     LL_FOREACH_SAFE(session->lg_xmit, lq, ltmp) {
-      LL_DELETE(session->lg_xmit, lq);
+      coap_block_unlink_lg_xmit(session, lq);
       coap_block_delete_lg_xmit(session, lq);
     }
 #if COAP_SERVER_SUPPORT
     LL_FOREACH_SAFE(session->lg_srcv, sq, stmp) {
-      LL_DELETE(session->lg_srcv, sq);
+      coap_block_unlink_lg_srcv(session, sq);
       coap_block_delete_lg_srcv(session, sq);
     }
 #endif /* COAP_SERVER_SUPPORT */
@@ -678,6 +863,10 @@ void coap_session_disconnected(coap_session_t *session, coap_nack_reason_t reaso
 
 #if !COAP_DISABLE_TCP
   if (COAP_PROTO_RELIABLE(session->proto)) {
+#if COAP_CONNECT_RACE
+    if (session->connect_race)
+      coap_session_race_end(session);
+#endif /* COAP_CONNECT_RACE */
     if (coap_netif_available(session)) {
       coap_netif_close(session);
       coap_handle_event(session->context,
@@ -776,6 +965,8 @@ coap_endpoint_get_session(coap_endpoint_t *endpoint,
     coap_log_debug(
              "Oustanding sessions in COAP_SESSION_STATE_HANDSHAKE too "
              "large.  New request ignored\n");
+    endpoint->stats.handshake_dropped++;
+    endpoint->context->stats.handshake_dropped++;
     return NULL;
   }
 
@@ -859,6 +1050,214 @@ coap_session_new_dtls_session(coap_session_t *session,
 }
 #endif /* COAP_SERVER_SUPPORT */
 
+#if COAP_CONNECT_RACE
+/* Starts a connection attempt to addr on sock, returning 0 if it failed */
+static int
+coap_session_race_attempt(coap_session_t *session, coap_socket_t *sock,
+                          const coap_address_t *addr, int default_port) {
+  coap_address_t local_addr;
+  coap_address_t remote_addr;
+  unsigned char addr_str[INET6_ADDRSTRLEN + 8];
+
+  coap_address_init(&local_addr);
+  coap_address_init(&remote_addr);
+  sock->flags = 0;
+  if (!coap_socket_connect_tcp1(sock, NULL, addr, default_port, &local_addr,
+                                &remote_addr))
+    return 0;
+  /* Also if connected already, so as to be finished in the same way */
+  sock->flags |= COAP_SOCKET_NOT_EMPTY | COAP_SOCKET_WANT_CONNECT;
+  sock->session = session;
+#ifdef COAP_EPOLL_SUPPORT
+  coap_epoll_ctl_add(sock, EPOLLIN | EPOLLOUT, __func__);
+#endif /* COAP_EPOLL_SUPPORT */
+  if (coap_print_addr(addr, addr_str, sizeof(addr_str)))
+    coap_log_debug("***%s: also connecting to %s\n",
+                   coap_session_str(session), addr_str);
+  return 1;
+}
+
+/* Starts the next attempt that does not fail at once, if there is room */
+static coap_socket_t *
+coap_session_race_next(coap_session_t *session, coap_tick_t now) {
+  coap_connect_race_t *race = session->connect_race;
+  size_t i;
+
+  for (i = 0; i < COAP_CONNECT_RACE_MAX; i++) {
+    if (race->sock[i].fd == COAP_INVALID_SOCKET)
+      break;
+  }
+  if (i == COAP_CONNECT_RACE_MAX)
+    return NULL;
+  while (race->next < race->count) {
+    if (coap_session_race_attempt(session, &race->sock[i],
+                                  &race->addr[race->next++],
+                                  race->default_port)) {
+      race->next_attempt = now + COAP_CONNECT_ATTEMPT_DELAY *
+                           COAP_TICKS_PER_SECOND / 1000;
+      return &race->sock[i];
+    }
+  }
+  return NULL;
+}
+
+/* Moves the attempt on sock into the session socket */
+static void
+coap_session_race_take(coap_session_t *session, coap_socket_t *sock,
+                       int connecting) {
+  session->sock = *sock;
+  session->sock.session = session;
+  session->sock.flags |= COAP_SOCKET_WANT_READ;
+  sock->fd = COAP_INVALID_SOCKET;
+  sock->flags = 0;
+  sock->session = NULL;
+#ifdef COAP_EPOLL_SUPPORT
+  coap_epoll_ctl_mod(&session->sock, EPOLLIN | (connecting ? EPOLLOUT : 0),
+                     __func__);
+#else /* ! COAP_EPOLL_SUPPORT */
+  (void)connecting;
+#endif /* ! COAP_EPOLL_SUPPORT */
+}
+
+int
+coap_session_race_connect(coap_session_t *session, coap_socket_t *sock,
+                          coap_tick_t now) {
+  coap_connect_race_t *race = session->connect_race;
+  coap_address_t local_addr;
+  coap_address_t remote_addr;
+  coap_socket_t *pending = NULL;
+  size_t i;
+
+  if (race->done)
+    return coap_netif_strm_connect2(session) ? 1 : -1;
+
+  coap_address_init(&local_addr);
+  coap_address_init(&remote_addr);
+  if (coap_socket_connect_tcp2(sock, &local_addr, &remote_addr)) {
+    if (sock != &session->sock) {
+      coap_socket_close(&session->sock);
+      coap_session_race_take(session, sock, 0);
+    }
+    coap_address_copy(&session->addr_info.local, &local_addr);
+    coap_address_copy(&session->addr_info.remote, &remote_addr);
+    coap_session_race_end(session);
+    /* So that the next session to the host tries this family first */
+    coap_resolve_cache_prefer(session->context, &remote_addr);
+    return 1;
+  }
+
+  /* The attempt has failed, and sock has been closed */
+  if (sock != &session->sock) {
+    /* The next attempt is started at once (RFC8305 5) */
+    coap_session_race_next(session, now);
+    return 0;
+  }
+  /* The session socket takes over another attempt */
+  for (i = 0; i < COAP_CONNECT_RACE_MAX; i++) {
+    if (race->sock[i].fd != COAP_INVALID_SOCKET) {
+      pending = &race->sock[i];
+      break;
+    }
+  }
+  if (!pending)
+    pending = coap_session_race_next(session, now);
+  if (!pending) {
+    coap_session_race_end(session);
+    return -1;
+  }
+  coap_session_race_take(session, pending, 1);
+  return 0;
+}
+
+coap_tick_t
+coap_session_race_check(coap_session_t *session, coap_tick_t now) {
+  coap_connect_race_t *race = session->connect_race;
+
+  if (race->done || session->state != COAP_SESSION_STATE_CONNECTING) {
+    coap_session_race_end(session);
+    coap_free_type(COAP_STRING, race);
+    session->connect_race = NULL;
+    return 0;
+  }
+  if (race->next < race->count && race->next_attempt <= now)
+    coap_session_race_next(session, now);
+  if (race->next < race->count && race->next_attempt > now)
+    return race->next_attempt - now;
+  return 0;
+}
+
+void
+coap_session_race_end(coap_session_t *session) {
+  coap_connect_race_t *race = session->connect_race;
+  size_t i;
+
+  /* Kept until coap_session_race_check(), as epoll events may refer to it */
+  race->done = 1;
+  for (i = 0; i < COAP_CONNECT_RACE_MAX; i++) {
+    if (race->sock[i].fd != COAP_INVALID_SOCKET)
+      coap_socket_close(&race->sock[i]);
+    race->sock[i].flags = 0;
+    race->sock[i].session = NULL;
+  }
+}
+
+/*
+ * Connects session to server or, if that fails at once, to the next of the
+ * other addresses of its host that does not. The remaining addresses are
+ * tried as well if the connection is not made within
+ * COAP_CONNECT_ATTEMPT_DELAY.
+ */
+static int
+coap_session_race_init(coap_session_t *session,
+                       const coap_address_t *local_if,
+                       const coap_address_t *server, int default_port) {
+  coap_address_t *alternatives = NULL;
+  coap_connect_race_t *race;
+  size_t count = 0;
+  size_t next = 0;
+  size_t i;
+  coap_tick_t now;
+  int ret = 1;
+
+  /* A bound session keeps to the family of local_if */
+  if (!local_if || !local_if->addr.sa.sa_family)
+    alternatives = coap_resolve_cache_alternatives(session->context, server,
+                                                   &count);
+  while (!coap_netif_strm_connect1(session, local_if,
+                                   next ? &alternatives[next - 1] : server,
+                                   default_port)) {
+    if (next == count) {
+      ret = 0;
+      goto done;
+    }
+    next++;
+    session->sock.session = session;
+  }
+  if (next == count || !(session->sock.flags & COAP_SOCKET_WANT_CONNECT))
+    goto done;
+
+  race = coap_malloc_type(COAP_STRING, sizeof(coap_connect_race_t) +
+                          (count - next - 1) * sizeof(coap_address_t));
+  if (!race)
+    goto done;
+  memset(race, 0, sizeof(coap_connect_race_t));
+  for (i = 0; i < COAP_CONNECT_RACE_MAX; i++)
+    race->sock[i].fd = COAP_INVALID_SOCKET;
+  memcpy(race->addr, &alternatives[next],
+         (count - next) * sizeof(coap_address_t));
+  race->count = count - next;
+  race->default_port = default_port;
+  coap_ticks(&now);
+  race->next_attempt = now + COAP_CONNECT_ATTEMPT_DELAY *
+                       COAP_TICKS_PER_SECOND / 1000;
+  session->connect_race = race;
+
+done:
+  coap_free_type(COAP_STRING, alternatives);
+  return ret;
+}
+#endif /* COAP_CONNECT_RACE */
+
 #if COAP_CLIENT_SUPPORT
 static coap_session_t *
 coap_session_create_client(coap_context_t *ctx,
@@ -930,9 +1329,15 @@ coap_session_create_client(coap_context_t *ctx,
 #endif /* WITH_CONTIKI */
 #if !COAP_DISABLE_TCP
   } else if (COAP_PROTO_RELIABLE(proto)) {
+#if COAP_CONNECT_RACE
+    if (!coap_session_race_init(session, local_if, server, default_port)) {
+      goto error;
+    }
+#else /* ! COAP_CONNECT_RACE */
     if (!coap_netif_strm_connect1(session, local_if, server, default_port)) {
       goto error;
     }
+#endif /* ! COAP_CONNECT_RACE */
 #endif /* !COAP_DISABLE_TCP */
   }
 
@@ -1670,7 +2075,27 @@ const char *coap_endpoint_str(const coap_endpoint_t *endpoint) {
 
   return szEndpoint;
 }
+
+void
+coap_endpoint_get_stats(const coap_endpoint_t *endpoint,
+                        coap_stats_t *stats) {
+  assert(stats);
+  if (endpoint)
+    *stats = endpoint->stats;
+  else
+    memset(stats, 0, sizeof(*stats));
+}
 #endif /* COAP_SERVER_SUPPORT */
+
+void
+coap_session_get_stats(const coap_session_t *session, coap_stats_t *stats) {
+  assert(stats);
+  if (session)
+    *stats = session->stats;
+  else
+    memset(stats, 0, sizeof(*stats));
+}
+
 #if COAP_CLIENT_SUPPORT
 void
 coap_session_set_no_observe_cancel(coap_session_t *session) {
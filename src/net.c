@@ -410,6 +410,36 @@ coap_context_get_max_handshake_sessions(const coap_context_t *context) {
   return context->max_handshake_sessions;
 }
 
+void
+coap_context_set_write_coalesce_size(coap_context_t *context, size_t size) {
+  context->write_coalesce_size = size;
+}
+
+size_t
+coap_context_get_write_coalesce_size(const coap_context_t *context) {
+  return context->write_coalesce_size;
+}
+
+void
+coap_context_set_rtt_estimation(coap_context_t *context,
+                                coap_rtt_estimation_t mode) {
+  context->rtt_estimation = mode;
+}
+
+coap_rtt_estimation_t
+coap_context_get_rtt_estimation(const coap_context_t *context) {
+  return context->rtt_estimation;
+}
+
+void
+coap_context_get_stats(const coap_context_t *context, coap_stats_t *stats) {
+  assert(stats);
+  if (context)
+    *stats = context->stats;
+  else
+    memset(stats, 0, sizeof(*stats));
+}
+
 void
 coap_context_set_csm_timeout(coap_context_t *context,
                              unsigned int csm_timeout) {
@@ -470,6 +500,7 @@ coap_new_context(
     return NULL;
   }
   memset(c, 0, sizeof(coap_context_t));
+  c->resolve_fd[0] = c->resolve_fd[1] = -1;
 
 #ifdef COAP_EPOLL_SUPPORT
   c->epfd = epoll_create1(0);
@@ -559,6 +590,10 @@ coap_free_context(coap_context_t *context) {
   if (!context)
     return;
 
+#if COAP_SERVER_SUPPORT && COAP_CLIENT_SUPPORT
+  coap_delete_proxy(context);
+#endif /* COAP_SERVER_SUPPORT && COAP_CLIENT_SUPPORT */
+
 #if COAP_SERVER_SUPPORT
   /* Removing a resource may cause a CON observe to be sent */
   coap_delete_all_resources(context);
@@ -584,10 +619,16 @@ coap_free_context(coap_context_t *context) {
 
 #if COAP_SERVER_SUPPORT
   coap_cache_entry_t *cp, *ctmp;
+  coap_pdu_template_t *tp, *ttmp;
 
   HASH_ITER(hh, context->cache, cp, ctmp) {
     coap_delete_cache_entry(context, cp);
   }
+  coap_free_type(COAP_STRING, context->cache_expiry);
+  coap_delete_cache_flights(context);
+  LL_FOREACH_SAFE(context->error_templates, tp, ttmp) {
+    coap_pdu_template_free(tp);
+  }
   if (context->cache_ignore_count) {
     coap_free_type(COAP_STRING, context->cache_ignore_options);
   }
@@ -607,6 +648,8 @@ coap_free_context(coap_context_t *context) {
   }
 #endif /* COAP_CLIENT_SUPPORT */
 
+  coap_resolve_free(context);
+
   if (context->dtls_context)
     coap_dtls_free_context(context->dtls_context);
 #ifdef COAP_EPOLL_SUPPORT
@@ -664,10 +707,16 @@ coap_option_check_critical(coap_session_t *session,
       case COAP_OPTION_BLOCK2:
       case COAP_OPTION_BLOCK1:
         break;
+      case COAP_OPTION_Q_BLOCK1:
+      case COAP_OPTION_Q_BLOCK2:
+        /* Valid critical if doing Q-Block */
+        if (session->block_mode & COAP_BLOCK_TRY_Q_BLOCK)
+          break;
+        /* Fall Through */
       case COAP_OPTION_OSCORE:
         /* Valid critical if doing OSCORE */
 #if HAVE_OSCORE
-        if (ctx->p_osc_ctx)
+        if (ctx->p_osc_ctx && opt_iter.number == COAP_OPTION_OSCORE)
           break;
 #endif /* HAVE_OSCORE */
         /* Fall Through */
@@ -756,6 +805,107 @@ coap_send_ack(coap_session_t *session, const coap_pdu_t *request) {
   return result;
 }
 
+#if !COAP_DISABLE_TCP
+static ssize_t
+coap_session_strm_write(coap_session_t *session, const uint8_t *data,
+                        size_t datalen) {
+  if (session->proto == COAP_PROTO_TLS)
+    return coap_tls_write(session, data, datalen);
+  return coap_netif_strm_write(session, data, datalen);
+}
+
+int
+coap_session_flush_write_buf(coap_session_t *session) {
+  ssize_t bytes_written;
+
+  if (session->write_buf_used == 0)
+    return 1;
+  if (!coap_netif_available(session) ||
+      (session->proto == COAP_PROTO_TLS && !session->tls)) {
+    goto fail;
+  }
+  bytes_written = coap_session_strm_write(session,
+                                    session->write_buf + session->write_buf_sent,
+                                    session->write_buf_used -
+                                      session->write_buf_sent);
+  if (bytes_written < 0)
+    goto fail;
+  session->write_buf_sent += (size_t)bytes_written;
+  if (session->write_buf_sent < session->write_buf_used) {
+    /* Remainder (with same base) has to go out once socket is writable */
+    session->write_buf_flushing = 1;
+    return 0;
+  }
+  coap_log_debug("*  %s: flushed %zu coalesced bytes\n",
+                 coap_session_str(session), session->write_buf_used);
+  session->write_buf_used = 0;
+  session->write_buf_sent = 0;
+  session->write_buf_flushing = 0;
+  return 1;
+
+fail:
+  coap_log_debug("*  %s: dropped %zu coalesced bytes\n",
+                 coap_session_str(session),
+                 session->write_buf_used - session->write_buf_sent);
+  session->write_buf_used = 0;
+  session->write_buf_sent = 0;
+  session->write_buf_flushing = 0;
+  return -1;
+}
+
+/*
+ * Either add the data to the session's output buffer for later
+ * coap_session_flush_write_buf(), or write it out directly.
+ *
+ * return +ve Number of bytes written (or buffered).
+ *          0 No data written.
+ *         -1 Error.
+ */
+static ssize_t
+coap_session_strm_send(coap_session_t *session, const uint8_t *data,
+                       size_t datalen) {
+  size_t buf_size = session->context->write_coalesce_size;
+
+  if (buf_size && datalen <= buf_size) {
+    if (!session->write_buf) {
+      session->write_buf = coap_malloc_type(COAP_STRING, buf_size);
+      if (!session->write_buf)
+        goto send_direct;
+      session->write_buf_used = 0;
+      session->write_buf_sent = 0;
+    }
+    if (!session->write_buf_flushing &&
+        session->write_buf_used + datalen > buf_size) {
+      /* No room left - need to write out what is there first */
+      if (coap_session_flush_write_buf(session) < 0)
+        return -1;
+    }
+    if (session->write_buf_flushing)
+      return 0;
+    memcpy(session->write_buf + session->write_buf_used, data, datalen);
+    session->write_buf_used += datalen;
+    return (ssize_t)datalen;
+  }
+
+send_direct:
+  /* Any data already buffered has to go out first to keep PDU order */
+  switch (coap_session_flush_write_buf(session)) {
+  case 1:
+    break;
+  case 0:
+    return 0;
+  default:
+    return -1;
+  }
+  return coap_session_strm_write(session, data, datalen);
+}
+#else /* COAP_DISABLE_TCP */
+int
+coap_session_flush_write_buf(coap_session_t *session COAP_UNUSED) {
+  return 1;
+}
+#endif /* COAP_DISABLE_TCP */
+
 ssize_t
 coap_session_send_pdu(coap_session_t *session, coap_pdu_t *pdu) {
   ssize_t bytes_written = -1;
@@ -771,21 +921,21 @@ coap_session_send_pdu(coap_session_t *session, coap_pdu_t *pdu) {
                                      pdu->used_size + pdu->hdr_size);
       break;
     case COAP_PROTO_TCP:
-#if !COAP_DISABLE_TCP
-      bytes_written = coap_netif_strm_write(session, pdu->token - pdu->hdr_size,
-                                            pdu->used_size + pdu->hdr_size);
-#endif /* !COAP_DISABLE_TCP */
-      break;
     case COAP_PROTO_TLS:
 #if !COAP_DISABLE_TCP
-      bytes_written = coap_tls_write(session, pdu->token - pdu->hdr_size,
-                                     pdu->used_size + pdu->hdr_size);
+      bytes_written = coap_session_strm_send(session,
+                                             pdu->token - pdu->hdr_size,
+                                             pdu->used_size + pdu->hdr_size);
 #endif /* !COAP_DISABLE_TCP */
       break;
     case COAP_PROTO_NONE:
     default:
       break;
   }
+  if (bytes_written > 0) {
+    COAP_STATS_ADD(session, pdus_sent, 1);
+    COAP_STATS_ADD(session, bytes_sent, (size_t)bytes_written);
+  }
   coap_show_pdu(COAP_LOG_DEBUG, pdu);
   return bytes_written;
 }
@@ -923,6 +1073,7 @@ coap_send_message_type(coap_session_t *session, const coap_pdu_t *request,
 unsigned int
 coap_calc_timeout(coap_session_t *session, unsigned char r) {
   unsigned int result;
+  coap_tick_t rto;
 
   /* The integer 1.0 as a Qx.FRAC_BITS */
 #define FP1 Q(FRAC_BITS, ((coap_fixed_point_t){1,0}))
@@ -934,6 +1085,11 @@ coap_calc_timeout(coap_session_t *session, unsigned char r) {
    * make the result a rounded Qx.FRAC_BITS */
   result = SHR_FP((ACK_RANDOM_FACTOR - FP1) * r, MAX_BITS);
 
+  if (coap_session_rtt_get_rto(session, &rto)) {
+    /* Use the estimated RTO instead of ACK_TIMEOUT (already in ticks) */
+    return (unsigned int)SHR_FP(((result + FP1) * rto), FRAC_BITS);
+  }
+
   /* Add 1 to the inner term and multiply with ACK_TIMEOUT, then
    * make the result a rounded Qx.FRAC_BITS */
   result = SHR_FP(((result + FP1) * ACK_TIMEOUT), FRAC_BITS);
@@ -946,10 +1102,36 @@ coap_calc_timeout(coap_session_t *session, unsigned char r) {
 #undef SHR_FP
 }
 
+/*
+ * Returns the time to wait for the next retransmission of @p node.  This
+ * doubles for each retransmission unless there is an RTT estimator, in which
+ * case the CoCoA variable backoff factor (3 if the initial timeout is below
+ * 1s, 1.5 if above 3s, else 2) is used.
+ */
+static coap_tick_t
+coap_retransmit_interval(const coap_queue_t *node) {
+  coap_tick_t interval = node->timeout;
+  unsigned int i;
+
+  if (!node->session->rtt_est)
+    return interval << node->retransmit_cnt;
+
+  for (i = 0; i < node->retransmit_cnt; i++) {
+    if (node->timeout < COAP_TICKS_PER_SECOND)
+      interval *= 3;
+    else if (node->timeout > 3 * COAP_TICKS_PER_SECOND)
+      interval += interval / 2;
+    else
+      interval *= 2;
+  }
+  return interval;
+}
+
 coap_mid_t
 coap_wait_ack(coap_context_t *context, coap_session_t *session,
               coap_queue_t *node) {
   coap_tick_t now;
+  coap_tick_t interval;
 
   node->session = coap_session_reference(session);
 
@@ -962,21 +1144,22 @@ coap_wait_ack(coap_context_t *context, coap_session_t *session,
   * an adjusted relative time.
   */
   coap_ticks(&now);
+  if (node->retransmit_cnt == 0)
+    node->tx_time = now;
+  interval = coap_retransmit_interval(node);
   if (context->sendqueue == NULL) {
-    node->t = node->timeout << node->retransmit_cnt;
+    node->t = interval;
     context->sendqueue_basetime = now;
   } else {
     /* make node->t relative to context->sendqueue_basetime */
-    node->t = (now - context->sendqueue_basetime) +
-              (node->timeout << node->retransmit_cnt);
+    node->t = (now - context->sendqueue_basetime) + interval;
   }
 
   coap_insert_node(&context->sendqueue, node);
 
   coap_log_debug("** %s: mid=0x%x: added to retransmit queue (%ums)\n",
     coap_session_str(node->session), node->id,
-    (unsigned)((node->timeout << node->retransmit_cnt) * 1000 /
-                                                         COAP_TICKS_PER_SECOND));
+    (unsigned)(interval * 1000 / COAP_TICKS_PER_SECOND));
 
 #ifdef COAP_EPOLL_SUPPORT
   coap_update_epoll_timer(context, node->t);
@@ -989,7 +1172,7 @@ coap_wait_ack(coap_context_t *context, coap_session_t *session,
 /*
  * Sent out a test PDU for Extended Token
  */
-static coap_mid_t
+coap_mid_t
 coap_send_test_extended_token(coap_session_t *session) {
   coap_pdu_t *pdu;
   coap_mid_t mid = COAP_INVALID_MID;
@@ -1081,6 +1264,8 @@ coap_send(coap_session_t *session, coap_pdu_t *pdu) {
   coap_block_b_t block;
   int observe_action = -1;
   int have_block1 = 0;
+  int q_block_probe = 0;
+  coap_lg_xmit_t *burst_lg_xmit = NULL;
   coap_opt_t *opt;
 #endif /* COAP_CLIENT_SUPPORT */
 
@@ -1177,7 +1362,8 @@ coap_send(coap_session_t *session, coap_pdu_t *pdu) {
                                                      coap_opt_length(opt));
     }
 
-    if (coap_get_block_b(session, pdu, COAP_OPTION_BLOCK1, &block) &&
+    if ((coap_get_block_b(session, pdu, COAP_OPTION_BLOCK1, &block) ||
+         coap_get_block_b(session, pdu, COAP_OPTION_Q_BLOCK1, &block)) &&
         (block.m == 1 || block.bert == 1))
       have_block1 = 1;
     if (observe_action != COAP_OBSERVE_CANCEL) {
@@ -1198,6 +1384,23 @@ coap_send(coap_session_t *session, coap_pdu_t *pdu) {
                          coap_encode_var_safe(buf, sizeof(buf),
                                                ++session->tx_rtag),
                          buf);
+    if (COAP_BLOCK_Q_BLOCK_OK(session) &&
+        (pdu->code == COAP_REQUEST_CODE_GET ||
+         pdu->code == COAP_REQUEST_CODE_FETCH) &&
+        !coap_check_option(pdu, COAP_OPTION_BLOCK2, &opt_iter) &&
+        !coap_check_option(pdu, COAP_OPTION_Q_BLOCK2, &opt_iter)) {
+      /* Indicate that Q-Block2 responses are supported */
+      coap_insert_option(pdu,
+                         COAP_OPTION_Q_BLOCK2,
+                         coap_encode_var_safe(buf, sizeof(buf),
+                                              COAP_MAX_BLOCK_SZX),
+                         buf);
+      if (COAP_BLOCK_Q_BLOCK_PROBE(session) &&
+          pdu->type == COAP_MESSAGE_NON)
+        q_block_probe = 1;
+    }
+    if (pdu->lg_xmit && pdu->lg_xmit->non_burst)
+      burst_lg_xmit = pdu->lg_xmit;
   } else {
     memset(&block, 0, sizeof(block));
   }
@@ -1221,45 +1424,35 @@ coap_send(coap_session_t *session, coap_pdu_t *pdu) {
       coap_show_pdu(COAP_LOG_DEBUG, pdu);
     }
     /* See if this token is already in use for large body responses */
-    LL_FOREACH(session->lg_crcv, lg_crcv) {
-      if (coap_binary_equal(&pdu->actual_token, lg_crcv->app_token)) {
-
-        if (observe_action == COAP_OBSERVE_CANCEL) {
-          uint8_t buf[8];
-          size_t len;
-
-          /* Need to update token to server's version */
-          len = coap_encode_var_safe8(buf, sizeof(lg_crcv->state_token),
-                                      lg_crcv->state_token);
-          if (pdu->code == COAP_REQUEST_CODE_FETCH && lg_crcv->obs_token &&
-              lg_crcv->obs_token[0]) {
-            memcpy(buf, lg_crcv->obs_token[0]->s, lg_crcv->obs_token[0]->length);
-            len = lg_crcv->obs_token[0]->length;
-          }
-          coap_update_token(pdu, len, buf);
-          lg_crcv->initial = 1;
-          lg_crcv->observe_set = 0;
-          /* de-reference lg_crcv as potentially linking in later */
-          LL_DELETE(session->lg_crcv, lg_crcv);
-          goto send_it;
+    lg_crcv = coap_find_lg_crcv_app(session, &pdu->actual_token);
+    if (lg_crcv) {
+      if (observe_action == COAP_OBSERVE_CANCEL) {
+        uint8_t buf[8];
+        size_t len;
+
+        /* Need to update token to server's version */
+        len = coap_encode_var_safe8(buf, sizeof(lg_crcv->state_token),
+                                    lg_crcv->state_token);
+        if (pdu->code == COAP_REQUEST_CODE_FETCH && lg_crcv->obs_token &&
+            lg_crcv->obs_token[0]) {
+          memcpy(buf, lg_crcv->obs_token[0]->s, lg_crcv->obs_token[0]->length);
+          len = lg_crcv->obs_token[0]->length;
         }
-
-        /* Need to terminate and clean up previous response setup */
-        LL_DELETE(session->lg_crcv, lg_crcv);
-        coap_block_delete_lg_crcv(session, lg_crcv);
-        break;
+        coap_update_token(pdu, len, buf);
+        lg_crcv->initial = 1;
+        lg_crcv->observe_set = 0;
+        /* de-reference lg_crcv as potentially linking in later */
+        coap_block_unlink_lg_crcv(session, lg_crcv);
+        goto send_it;
       }
-    }
 
-    if (have_block1 && session->lg_xmit) {
-      LL_FOREACH(session->lg_xmit, lg_xmit) {
-        if (COAP_PDU_IS_REQUEST(&lg_xmit->pdu) &&
-            lg_xmit->b.b1.app_token &&
-            coap_binary_equal(&pdu->actual_token, lg_xmit->b.b1.app_token)) {
-          break;
-        }
-      }
+      /* Need to terminate and clean up previous response setup */
+      coap_block_unlink_lg_crcv(session, lg_crcv);
+      coap_block_delete_lg_crcv(session, lg_crcv);
     }
+
+    if (have_block1 && session->lg_xmit)
+      lg_xmit = coap_find_lg_xmit_request_app(session, &pdu->actual_token);
     lg_crcv = coap_block_new_lg_crcv(session, pdu, lg_xmit);
     if (lg_crcv == NULL) {
       coap_delete_pdu(pdu);
@@ -1267,22 +1460,34 @@ coap_send(coap_session_t *session, coap_pdu_t *pdu) {
     }
     if (lg_xmit) {
       /* Need to update the token as set up in the session->lg_xmit */
-      lg_xmit->b.b1.state_token = lg_crcv->state_token;
+      coap_block_set_lg_xmit_token(session, lg_xmit, lg_crcv->state_token);
     }
   }
 
+  if (q_block_probe) {
+    /*
+     * Check Q-Block support with a CON, the lg_crcv skeletal PDU stays as
+     * NON for the following requests.
+     */
+    pdu->type = COAP_MESSAGE_CON;
+  }
+
 send_it:
 #endif /* COAP_CLIENT_SUPPORT */
   mid = coap_send_internal(session, pdu);
 #if COAP_CLIENT_SUPPORT
   if (lg_crcv) {
     if (mid != COAP_INVALID_MID) {
-      LL_PREPEND(session->lg_crcv, lg_crcv);
+      coap_block_link_lg_crcv(session, lg_crcv);
     }
     else {
       coap_block_delete_lg_crcv(session, lg_crcv);
     }
   }
+  if (burst_lg_xmit && mid != COAP_INVALID_MID) {
+    /* Send the rest of the first Q-Block1 payload set */
+    coap_block_send_q_block1_set(session, burst_lg_xmit);
+  }
 #endif /* COAP_CLIENT_SUPPORT */
   return mid;
 }
@@ -1525,15 +1730,17 @@ coap_retransmit(coap_context_t *context, coap_queue_t *node) {
     coap_tick_t now;
 
     node->retransmit_cnt++;
+    COAP_STATS_ADD(node->session, retransmits, 1);
     coap_handle_event(context, COAP_EVENT_MSG_RETRANSMITTED, node->session);
 
     coap_ticks(&now);
     if (context->sendqueue == NULL) {
-      node->t = node->timeout << node->retransmit_cnt;
+      node->t = coap_retransmit_interval(node);
       context->sendqueue_basetime = now;
     } else {
       /* make node->t relative to context->sendqueue_basetime */
-      node->t = (now - context->sendqueue_basetime) + (node->timeout << node->retransmit_cnt);
+      node->t = (now - context->sendqueue_basetime) +
+                coap_retransmit_interval(node);
     }
     coap_insert_node(&context->sendqueue, node);
 
@@ -1569,6 +1776,7 @@ coap_retransmit(coap_context_t *context, coap_queue_t *node) {
   /* no more retransmissions, remove node from system */
   coap_log_warn("** %s: mid=0x%x: give up after %d attempts\n",
            coap_session_str(node->session), node->id, node->retransmit_cnt);
+  COAP_STATS_ADD(node->session, retransmit_failed, 1);
 
 #if COAP_SERVER_SUPPORT
   /* Check if subscriptions exist that should be canceled after
@@ -1593,6 +1801,13 @@ coap_retransmit(coap_context_t *context, coap_queue_t *node) {
  }
 
   /* And finally delete the node */
+#if COAP_SERVER_SUPPORT && COAP_CLIENT_SUPPORT
+  if (node->pdu->type == COAP_MESSAGE_CON && node->session->proxy_upstream) {
+    coap_check_update_token(node->session, node->pdu);
+    coap_proxy_upstream_nack(node->session, node->pdu,
+                             COAP_NACK_TOO_MANY_RETRIES);
+  } else
+#endif /* COAP_SERVER_SUPPORT && COAP_CLIENT_SUPPORT */
   if (node->pdu->type == COAP_MESSAGE_CON && context->nack_handler) {
     coap_check_update_token(node->session, node->pdu);
     context->nack_handler(node->session, node->pdu, COAP_NACK_TOO_MANY_RETRIES, node->id);
@@ -1626,13 +1841,28 @@ coap_handle_dgram_for_proto(coap_context_t *ctx, coap_session_t *session, coap_p
 static void
 coap_connect_session(coap_context_t *ctx,
                           coap_session_t *session,
+                          coap_socket_t *sock,
                           coap_tick_t now) {
   (void)ctx;
 #if COAP_DISABLE_TCP
   (void)session;
+  (void)sock;
   (void)now;
 #else /* !COAP_DISABLE_TCP */
-  if (coap_netif_strm_connect2(session)) {
+  int tcp_connected;
+
+#if COAP_CONNECT_RACE
+  if (session->connect_race) {
+    tcp_connected = coap_session_race_connect(session, sock, now);
+    if (tcp_connected == 0)
+      /* Still connecting to another address */
+      return;
+  } else
+#else /* ! COAP_CONNECT_RACE */
+  (void)sock;
+#endif /* ! COAP_CONNECT_RACE */
+    tcp_connected = coap_netif_strm_connect2(session) ? 1 : -1;
+  if (tcp_connected > 0) {
     session->last_rx_tx = now;
     coap_handle_event(session->context, COAP_EVENT_TCP_CONNECTED, session);
     if (session->proto == COAP_PROTO_TCP) {
@@ -1665,6 +1895,10 @@ coap_write_session(coap_context_t *ctx, coap_session_t *session, coap_tick_t now
   (void)ctx;
   assert(session->sock.flags & COAP_SOCKET_CONNECTED);
 
+  /* Coalesced data was queued before anything on the delayqueue */
+  if (coap_session_flush_write_buf(session) == 0)
+    return;
+
   while (session->delayqueue) {
     ssize_t bytes_written;
     coap_queue_t *q = session->delayqueue;
@@ -1685,7 +1919,7 @@ coap_write_session(coap_context_t *ctx, coap_session_t *session, coap_tick_t now
 #if !COAP_DISABLE_TCP
         bytes_written = coap_tls_write(
           session,
-          q->pdu->token - q->pdu->hdr_size - session->partial_write,
+          q->pdu->token - q->pdu->hdr_size + session->partial_write,
           q->pdu->used_size + q->pdu->hdr_size - session->partial_write
         );
 #endif /* !COAP_DISABLE_TCP */
@@ -1697,8 +1931,12 @@ coap_write_session(coap_context_t *ctx, coap_session_t *session, coap_tick_t now
         bytes_written = -1;
         break;
     }
-    if (bytes_written > 0)
+    if (bytes_written > 0) {
       session->last_rx_tx = now;
+      if (session->partial_write == 0)
+        COAP_STATS_ADD(session, pdus_sent, 1);
+      COAP_STATS_ADD(session, bytes_sent, (size_t)bytes_written);
+    }
     if (bytes_written <= 0 || (size_t)bytes_written < q->pdu->used_size + q->pdu->hdr_size - session->partial_write) {
       if (bytes_written > 0)
         session->partial_write += (size_t)bytes_written;
@@ -1785,6 +2023,8 @@ coap_read_session(coap_context_t *ctx, coap_session_t *session, coap_tick_t now)
 #if COAP_CONSTRAINED_STACK
               coap_mutex_lock(&s_static_mutex);
 #endif /* COAP_CONSTRAINED_STACK */
+            } else {
+              COAP_STATS_ADD(session, bad_pdus, 1);
             }
             coap_delete_pdu(session->partial_pdu);
             session->partial_pdu = NULL;
@@ -1838,6 +2078,8 @@ coap_read_session(coap_context_t *ctx, coap_session_t *session, coap_tick_t now)
 #if COAP_CONSTRAINED_STACK
                 coap_mutex_lock(&s_static_mutex);
 #endif /* COAP_CONSTRAINED_STACK */
+              } else {
+                COAP_STATS_ADD(session, bad_pdus, 1);
               }
               coap_delete_pdu(session->partial_pdu);
               session->partial_pdu = NULL;
@@ -1975,8 +2217,18 @@ coap_io_do_io(coap_context_t *ctx, coap_tick_t now) {
     /* Make sure the session object is not deleted in one of the callbacks  */
     coap_session_reference(s);
     if ((s->sock.flags & COAP_SOCKET_CAN_CONNECT) != 0) {
-      coap_connect_session(ctx, s, now);
+      coap_connect_session(ctx, s, &s->sock, now);
     }
+#if COAP_CONNECT_RACE
+    if (s->connect_race) {
+      size_t i;
+
+      for (i = 0; i < COAP_CONNECT_RACE_MAX; i++) {
+        if ((s->connect_race->sock[i].flags & COAP_SOCKET_CAN_CONNECT) != 0)
+          coap_connect_session(ctx, s, &s->connect_race->sock[i], now);
+      }
+    }
+#endif /* COAP_CONNECT_RACE */
     if ((s->sock.flags & COAP_SOCKET_CAN_READ) != 0 && s->ref > 1) {
       coap_read_session(ctx, s, now);
     }
@@ -2009,6 +2261,11 @@ coap_io_do_epoll(coap_context_t *ctx, struct epoll_event *events, size_t nevents
   for(j = 0; j < nevents; j++) {
     coap_socket_t *sock = (coap_socket_t*)events[j].data.ptr;
 
+    /* A resolver thread is done */
+    if (events[j].data.ptr == ctx->resolve_fd) {
+      coap_resolve_check(ctx);
+      continue;
+    }
     /* Ignore 'timer trigger' ptr  which is NULL */
     if (sock) {
 #if COAP_SERVER_SUPPORT
@@ -2050,10 +2307,17 @@ coap_io_do_epoll(coap_context_t *ctx, struct epoll_event *events, size_t nevents
         if ((sock->flags & COAP_SOCKET_WANT_CONNECT) &&
             (events[j].events & (EPOLLOUT|EPOLLERR|EPOLLHUP|EPOLLRDHUP))) {
           sock->flags |= COAP_SOCKET_CAN_CONNECT;
-          coap_connect_session(session->context, session, now);
+          coap_connect_session(session->context, session, sock, now);
+          /* sock may have lost a connection race, or another have won it */
           if (coap_netif_available(session) &&
-              !(sock->flags & COAP_SOCKET_WANT_WRITE)) {
-            coap_epoll_ctl_mod(sock, EPOLLIN, __func__);
+              !(session->sock.flags & (COAP_SOCKET_WANT_WRITE |
+                                       COAP_SOCKET_WANT_CONNECT))) {
+            coap_epoll_ctl_mod(&session->sock, EPOLLIN, __func__);
+          }
+          if (sock->flags & COAP_SOCKET_WANT_CONNECT) {
+            /* Another attempt has taken over sock, so the events are stale */
+            coap_session_release(session);
+            continue;
           }
         }
 #endif /* COAP_CLIENT_SUPPORT */
@@ -2107,6 +2371,7 @@ coap_handle_dgram(coap_context_t *ctx, coap_session_t *session,
   assert(COAP_PROTO_NOT_RELIABLE(session->proto));
   if (msg_len < 4) {
     /* Minimum size of CoAP header - ignore runt */
+    COAP_STATS_ADD(session, bad_pdus, 1);
     return -1;
   }
 
@@ -2118,6 +2383,7 @@ coap_handle_dgram(coap_context_t *ctx, coap_session_t *session,
   if (!coap_pdu_parse(session->proto, msg, msg_len, pdu)) {
     coap_handle_event(session->context, COAP_EVENT_BAD_PACKET, session);
     coap_log_warn("discard malformed PDU\n");
+    COAP_STATS_ADD(session, bad_pdus, 1);
     goto error;
   }
 
@@ -2365,6 +2631,42 @@ coap_new_error_response(const coap_pdu_t *request, coap_pdu_code_t code,
 }
 
 #if COAP_SERVER_SUPPORT
+/*
+ * As coap_new_error_response(), but an error response that does not echo
+ * any options of the request is copied from a template that @p context
+ * keeps for @p code, rather than built up again.
+ */
+static coap_pdu_t *
+coap_context_error_response(coap_context_t *context,
+                            const coap_pdu_t *request, coap_pdu_code_t code,
+                            coap_opt_filter_t *opts) {
+  coap_pdu_template_t *tmpl;
+  coap_pdu_t *response;
+
+  /* As dropped by coap_new_error_response() */
+  coap_option_filter_unset(opts, COAP_OPTION_CONTENT_FORMAT);
+  coap_option_filter_unset(opts, COAP_OPTION_HOP_LIMIT);
+  coap_option_filter_unset(opts, COAP_OPTION_OSCORE);
+  /* 5.08 has the IP filled in by coap_send_internal() */
+  if (opts->mask != 0 || code == COAP_RESPONSE_CODE(508))
+    return coap_new_error_response(request, code, opts);
+
+  LL_SEARCH_SCALAR(context->error_templates, tmpl, code, code);
+  if (tmpl)
+    return coap_pdu_from_template(tmpl, request->type == COAP_MESSAGE_CON ?
+                                        COAP_MESSAGE_ACK : COAP_MESSAGE_NON,
+                                  request->mid, &request->actual_token,
+                                  request->e_token_length + tmpl->length);
+
+  response = coap_new_error_response(request, code, opts);
+  if (response) {
+    tmpl = coap_pdu_template_new(response);
+    if (tmpl)
+      LL_PREPEND(context->error_templates, tmpl);
+  }
+  return response;
+}
+
 /**
  * Quick hack to determine the size of the resource description for
  * .well-known/core.
@@ -2397,33 +2699,89 @@ hnd_get_wellknown(coap_resource_t *resource,
                   const coap_string_t *query,
                   coap_pdu_t *response) {
   size_t len = 0;
-  coap_string_t *data_string = NULL;
+  const uint8_t *data = NULL;
+  coap_release_large_data_t release_func = NULL;
+  void *app_ptr = NULL;
+  uint64_t etag = 0;
   int result = 0;
-  ssize_t wkc_len = get_wkc_len(session->context, query);
+  uint16_t media_type = COAP_MEDIATYPE_APPLICATION_LINK_FORMAT;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *accept;
 
-  if (wkc_len) {
-    if (wkc_len < 0)
+  accept = coap_check_option(request, COAP_OPTION_ACCEPT, &opt_iter);
+  if (accept) {
+    unsigned int accept_type = coap_decode_var_bytes(coap_opt_value(accept),
+                                                     coap_opt_length(accept));
+
+    if (accept_type != COAP_MEDIATYPE_APPLICATION_LINK_FORMAT &&
+        accept_type != COAP_MEDIATYPE_APPLICATION_LINK_FORMAT_CBOR) {
+      response->code = COAP_RESPONSE_CODE(406);
+      return;
+    }
+    media_type = (uint16_t)accept_type;
+  }
+
+  if (!query) {
+    /* The unfiltered document is only rendered again after a change */
+    coap_wkc_cache_t *cache = coap_wkc_cache_get(session->context, media_type);
+
+    if (!cache)
+      goto error;
+    release_func = coap_wkc_cache_release;
+    app_ptr = cache;
+    data = cache->s;
+    len = cache->length;
+    etag = cache->etag;
+  } else if (media_type == COAP_MEDIATYPE_APPLICATION_LINK_FORMAT_CBOR) {
+    coap_string_t *data_string;
+
+    if (!coap_print_wellknown_cbor(session->context, NULL, &len, query))
       goto error;
-    data_string = coap_new_string(wkc_len);
+    data_string = coap_new_string(len);
     if (!data_string)
       goto error;
-
-    len = wkc_len;
-    result = coap_print_wellknown(session->context, data_string->s, &len, 0,
-                                  query);
-    if ((result & COAP_PRINT_STATUS_ERROR) != 0) {
-      coap_log_debug("coap_print_wellknown failed\n");
+    release_func = free_wellknown_response;
+    app_ptr = data_string;
+    if (!coap_print_wellknown_cbor(session->context, data_string->s, &len,
+                                   query)) {
+      coap_log_debug("coap_print_wellknown_cbor failed\n");
       goto error;
     }
-    assert (len <= (size_t)wkc_len);
     data_string->length = len;
+    data = data_string->s;
+  } else {
+    ssize_t wkc_len = get_wkc_len(session->context, query);
+    coap_string_t *data_string;
+
+    if (wkc_len < 0)
+      goto error;
+    if (wkc_len) {
+      data_string = coap_new_string(wkc_len);
+      if (!data_string)
+        goto error;
+      release_func = free_wellknown_response;
+      app_ptr = data_string;
+
+      len = wkc_len;
+      result = coap_print_wellknown(session->context, data_string->s, &len, 0,
+                                    query);
+      if ((result & COAP_PRINT_STATUS_ERROR) != 0) {
+        coap_log_debug("coap_print_wellknown failed\n");
+        goto error;
+      }
+      assert (len <= (size_t)wkc_len);
+      data_string->length = len;
+      data = data_string->s;
+    }
+  }
 
+  if (len) {
     if (!(session->block_mode & COAP_BLOCK_USE_LIBCOAP)) {
       uint8_t buf[4];
 
       if (!coap_insert_option(response, COAP_OPTION_CONTENT_FORMAT,
                          coap_encode_var_safe(buf, sizeof(buf),
-                         COAP_MEDIATYPE_APPLICATION_LINK_FORMAT), buf)) {
+                         media_type), buf)) {
         goto error;
       }
       if (response->used_size + len + 1 > response->max_size) {
@@ -2431,30 +2789,53 @@ hnd_get_wellknown(coap_resource_t *resource,
          * Data does not fit into a packet and no libcoap block support
          * +1 for end of options marker
          */
-        coap_log_debug(
+        size_t avail = response->max_size - response->used_size - 1;
+
+        if (media_type == COAP_MEDIATYPE_APPLICATION_LINK_FORMAT_CBOR) {
+          /* A cut CBOR array is malformed, so only send whole links */
+          coap_string_t *data_string = coap_new_string(avail);
+
+          if (!data_string)
+            goto error;
+          release_func(session, app_ptr);
+          release_func = free_wellknown_response;
+          app_ptr = data_string;
+          data_string->length = avail;
+          if (!coap_print_wellknown_cbor(session->context, data_string->s,
+                                         &data_string->length, query)) {
+            coap_log_debug("coap_print_wellknown_cbor failed\n");
+            goto error;
+          }
+          coap_log_debug(".well-known/core: truncating data length to %zu "
+                         "from %zu\n", data_string->length, len);
+          data = data_string->s;
+          len = data_string->length;
+        } else {
+          coap_log_debug(
                  ".well-known/core: truncating data length to %zu from %zu\n",
                  len, response->max_size  - response->used_size - 1);
-        len = response->max_size - response->used_size - 1;
+          len = avail;
+        }
       }
-      if (!coap_add_data(response, len, data_string->s)) {
+      if (!coap_add_data(response, len, data)) {
         goto error;
       }
-      free_wellknown_response(session, data_string);
+      release_func(session, app_ptr);
     } else if (!coap_add_data_large_response(resource, session, request,
-                                             response, query,
-                                      COAP_MEDIATYPE_APPLICATION_LINK_FORMAT,
-                                             -1, 0, data_string->length,
-                                             data_string->s,
-                                             free_wellknown_response,
-                                             data_string)) {
+                                             response, query, media_type,
+                                             -1, etag, len, data,
+                                             release_func, app_ptr)) {
       goto error_released;
     }
+  } else if (release_func) {
+    release_func(session, app_ptr);
   }
   response->code = COAP_RESPONSE_CODE(205);
   return;
 
 error:
-  free_wellknown_response(session, data_string);
+  if (release_func)
+    release_func(session, app_ptr);
 error_released:
   if (response->code == 0) {
     /* set error code 5.03 and remove all options and data from response */
@@ -2485,12 +2866,17 @@ coap_cancel(coap_context_t *context, const coap_queue_t *sent) {
   (void)context;
 
 #if COAP_SERVER_SUPPORT
-  /* remove observer for this resource, if any
-   * Use token from sent and try to find a matching resource. Uh!
-   */
-  RESOURCES_ITER(context->resources, r) {
+  /* remove observers with the token from sent, if any */
+  if (context->resources) {
+    coap_subscription_t *obs, *tmp;
+
     coap_cancel_all_messages(context, sent->session, &sent->pdu->actual_token);
-    num_cancelled += coap_delete_observer(r, sent->session, &sent->pdu->actual_token);
+    DL_FOREACH_SAFE2(sent->session->subscriptions, obs, tmp, session_next) {
+      if (coap_binary_equal(&sent->pdu->actual_token,
+                            &obs->pdu->actual_token))
+        num_cancelled += coap_delete_observer(obs->resource, sent->session,
+                                              &sent->pdu->actual_token);
+    }
   }
 #endif /* COAP_SERVER_SUPPORT */
 
@@ -2650,6 +3036,7 @@ static coap_resource_t resource_uri_wellknown;
 static void
 handle_request(coap_context_t *context, coap_session_t *session, coap_pdu_t *pdu) {
   coap_method_handler_t h = NULL;
+  coap_pdu_template_t *tmpl = NULL;
   coap_pdu_t *response = NULL;
   coap_opt_filter_t opt_filter;
   coap_resource_t *resource = NULL;
@@ -2813,14 +3200,9 @@ handle_request(coap_context_t *context, coap_session_t *session, coap_pdu_t *pdu
     }
   }
 
-  uri_path = coap_get_uri_path(pdu);
-  if (!uri_path)
-    return;
-
   if (!is_proxy_uri && !is_proxy_scheme) {
-    /* try to find the resource from the request URI */
-    coap_str_const_t uri_path_c = { uri_path->length, uri_path->s };
-    resource = coap_get_resource_from_uri_path(context, &uri_path_c);
+    /* try to find the resource from the request Uri-Path options */
+    resource = coap_resource_match(context, pdu);
   }
 
   if ((resource == NULL) || (resource->is_unknown == 1) ||
@@ -2831,6 +3213,9 @@ handle_request(coap_context_t *context, coap_session_t *session, coap_pdu_t *pdu
     if (resource != NULL)
       /* Close down unexpected match */
       resource = NULL;
+    uri_path = coap_get_uri_path(pdu);
+    if (!uri_path)
+      return;
     /*
      * Check if the request URI happens to be the well-known URI, or if the
      * unknown resource handler is defined, a PUT or optionally other methods,
@@ -2896,12 +3281,20 @@ handle_request(coap_context_t *context, coap_session_t *session, coap_pdu_t *pdu
       goto fail_response;
     }
 
+  } else if (resource->is_template &&
+             (coap_check_option(pdu, COAP_OPTION_BLOCK1, &opt_iter) ||
+              coap_check_option(pdu, COAP_OPTION_Q_BLOCK1, &opt_iter))) {
+    /* Large bodies for a template resource are tracked by the actual path */
+    uri_path = coap_get_uri_path(pdu);
+    if (!uri_path)
+      return;
   }
 
 #if HAVE_OSCORE
   if ((resource->flags & COAP_RESOURCE_FLAGS_OSCORE_ONLY) && !session->oscore_encryption) {
       coap_log_debug("request for OSCORE only resource '%*.*s', return 4.04\n",
-               (int)uri_path->length, (int)uri_path->length, uri_path->s);
+               (int)resource->uri_path->length,
+               (int)resource->uri_path->length, resource->uri_path->s);
       resp = 401;
       goto fail_response;
   }
@@ -2917,10 +3310,12 @@ handle_request(coap_context_t *context, coap_session_t *session, coap_pdu_t *pdu
 
   /* the resource was found, check if there is a registered handler */
   if ((size_t)pdu->code - 1 <
-    sizeof(resource->handler) / sizeof(coap_method_handler_t))
+    sizeof(resource->handler) / sizeof(coap_method_handler_t)) {
     h = resource->handler[pdu->code - 1];
+    tmpl = resource->response_template[pdu->code - 1];
+  }
 
-  if (h == NULL) {
+  if (h == NULL && tmpl == NULL) {
     resp = 405;
     goto fail_response;
   }
@@ -2939,6 +3334,33 @@ handle_request(coap_context_t *context, coap_session_t *session, coap_pdu_t *pdu
     goto fail_response;
   }
 
+  if (tmpl &&
+#ifndef WITHOUT_ASYNC
+      !async &&
+#endif /* WITHOUT_ASYNC */
+      (h == NULL ||
+       ((!resource->observable ||
+         !coap_check_option(pdu, COAP_OPTION_OBSERVE, &opt_iter)) &&
+        !coap_check_option(pdu, COAP_OPTION_BLOCK2, &opt_iter) &&
+        !coap_check_option(pdu, COAP_OPTION_Q_BLOCK2, &opt_iter)))) {
+    /* Pre-encoded response, only the header and token need filling in */
+    response = coap_pdu_from_template(tmpl, pdu->type == COAP_MESSAGE_CON ?
+                                            COAP_MESSAGE_ACK :
+                                            COAP_MESSAGE_NON,
+                                      pdu->mid, &pdu->actual_token,
+                                      coap_session_max_pdu_size(session));
+    if (response) {
+      coap_log_debug("response template for resource '%*.*s'\n",
+                     (int)resource->uri_path->length,
+                     (int)resource->uri_path->length, resource->uri_path->s);
+      goto skip_handler;
+    }
+  }
+  if (h == NULL) {
+    resp = tmpl ? 500 : 405;
+    goto fail_response;
+  }
+
   response = coap_pdu_init(pdu->type == COAP_MESSAGE_CON
     ? COAP_MESSAGE_ACK
     : COAP_MESSAGE_NON,
@@ -3041,11 +3463,29 @@ handle_request(coap_context_t *context, coap_session_t *session, coap_pdu_t *pdu
       coap_log_debug(
                "Duplicate request with mid=0x%04x - not processed\n",
                pdu->mid);
+      COAP_STATS_ADD(session, duplicates, 1);
       goto drop_it_no_debug;
     }
     session->last_con_mid = pdu->mid;
   }
 
+  if ((resource->flags & COAP_RESOURCE_FLAGS_CACHE_REPRESENTATION) &&
+      !observe && !added_block &&
+      (pdu->code == COAP_REQUEST_CODE_GET ||
+       pdu->code == COAP_REQUEST_CODE_FETCH)) {
+    coap_pdu_t *kept = coap_resource_rep_respond(resource, session, pdu,
+                                                 response);
+
+    if (kept) {
+      coap_log_debug("response for resource '%*.*s' kept\n",
+                     (int)resource->uri_path->length,
+                     (int)resource->uri_path->length, resource->uri_path->s);
+      coap_delete_pdu(response);
+      response = kept;
+      goto skip_handler;
+    }
+  }
+
   /*
    * Call the request handler with everything set up
    */
@@ -3057,13 +3497,17 @@ handle_request(coap_context_t *context, coap_session_t *session, coap_pdu_t *pdu
   /* Check if lg_xmit generated and update PDU code if so */
   coap_check_code_lg_xmit(session, pdu, response, resource, query);
 
+  if ((resource->flags & COAP_RESOURCE_FLAGS_CACHE_REPRESENTATION) &&
+      !added_block)
+    coap_resource_rep_update(resource, session, pdu, query, response);
+
   if (free_lg_srcv) {
     /* Check to see if the server is doing a 4.01 + Echo response */
     if (response->code ==  COAP_RESPONSE_CODE(401) &&
         coap_check_option(response, COAP_OPTION_ECHO, &opt_iter)) {
       /* Need to keep lg_srcv around for client's response */
     } else {
-      LL_DELETE(session->lg_srcv, free_lg_srcv);
+      coap_block_unlink_lg_srcv(session, free_lg_srcv);
       coap_block_delete_lg_srcv(session, free_lg_srcv);
     }
   }
@@ -3113,8 +3557,14 @@ skip_handler:
         (context->mcast_per_resource &&
           resource &&
           (resource->flags & COAP_RESOURCE_FLAGS_LIB_DIS_MCAST_DELAYS))) {
+      coap_lg_xmit_t *lg_xmit = response->lg_xmit;
+
       if (coap_send_internal(session, response) == COAP_INVALID_MID) {
         coap_log_debug("cannot send response for mid=0x%x\n", mid);
+      } else if (lg_xmit && lg_xmit->option == COAP_OPTION_Q_BLOCK2 &&
+                 pdu->type == COAP_MESSAGE_NON) {
+        /* Send the rest of the first Q-Block2 payload set */
+        coap_block_send_q_block2_set(session, pdu, lg_xmit);
       }
     } else {
       /* Need to delay mcast response */
@@ -3164,7 +3614,7 @@ clean_up:
 fail_response:
   coap_delete_pdu(response);
   response =
-     coap_new_error_response(pdu, COAP_RESPONSE_CODE(resp),
+     coap_context_error_response(context, pdu, COAP_RESPONSE_CODE(resp),
        &opt_filter);
   if (response)
     goto skip_handler;
@@ -3189,12 +3639,14 @@ handle_response(coap_context_t *context, coap_session_t *session,
     if (rcvd->type == COAP_MESSAGE_CON) {
       if (rcvd->mid == session->last_con_mid) {
         /* Duplicate response */
+        COAP_STATS_ADD(session, duplicates, 1);
         return;
       }
       session->last_con_mid = rcvd->mid;
     } else if (rcvd->type == COAP_MESSAGE_ACK) {
       if (rcvd->mid == session->last_ack_mid) {
         /* Duplicate response */
+        COAP_STATS_ADD(session, duplicates, 1);
         return;
       }
       session->last_ack_mid = rcvd->mid;
@@ -3237,6 +3689,16 @@ handle_response(coap_context_t *context, coap_session_t *session,
     session->doing_first = 0;
 
   /* Call application-specific response handler when available. */
+#if COAP_SERVER_SUPPORT
+  if (session->proxy_upstream) {
+    /* Relay the response to a request forwarded by the proxy */
+    if (coap_proxy_forward_response(session, rcvd) == COAP_RESPONSE_FAIL)
+      coap_send_rst(session, rcvd);
+    else
+      coap_send_ack(session, rcvd);
+    return;
+  }
+#endif /* COAP_SERVER_SUPPORT */
   if (context->response_handler) {
     if (context->response_handler(session, sent, rcvd,
                                   rcvd->mid) == COAP_RESPONSE_FAIL)
@@ -3362,6 +3824,8 @@ coap_dispatch(coap_context_t *context, coap_session_t *session,
 #endif /* HAVE_OSCORE */
   int is_ext_token_rst;
 
+  COAP_STATS_ADD(session, pdus_received, 1);
+  COAP_STATS_ADD(session, bytes_received, pdu->used_size + pdu->hdr_size);
   coap_show_pdu(COAP_LOG_DEBUG, pdu);
 
   memset(&opt_filter, 0, sizeof(coap_opt_filter_t));
@@ -3451,6 +3915,13 @@ coap_dispatch(coap_context_t *context, coap_session_t *session,
       /* find message id in sendqueue to stop retransmission */
       coap_remove_from_queue(&context->sendqueue, session, pdu->mid, &sent);
 
+      if (sent && session->rtt_est) {
+        coap_tick_t now;
+
+        coap_ticks(&now);
+        coap_session_rtt_update(session, sent, now);
+      }
+
       if (sent && session->con_active) {
         session->con_active--;
         if (session->state == COAP_SESSION_STATE_ESTABLISHED)
@@ -3472,6 +3943,22 @@ coap_dispatch(coap_context_t *context, coap_session_t *session,
 #endif /* COAP_SERVER_SUPPORT */
 
       if (pdu->code == 0) {
+#if COAP_CLIENT_SUPPORT
+        /*
+         * A separate response follows, by when sent is no longer held.  Set
+         * up lg_crcv now in case the response is Block2 (e.g. from a proxy).
+         */
+        if (sent && COAP_PDU_IS_REQUEST(sent->pdu) &&
+            (session->block_mode & COAP_BLOCK_USE_LIBCOAP) &&
+            sent->pdu->code != COAP_REQUEST_CODE_DELETE &&
+            !coap_find_lg_crcv_app(session, &sent->pdu->actual_token)) {
+          coap_lg_crcv_t *lg_crcv = coap_block_new_lg_crcv(session, sent->pdu,
+                                                           NULL);
+
+          if (lg_crcv)
+            coap_block_link_lg_crcv(session, lg_crcv);
+        }
+#endif /* COAP_CLIENT_SUPPORT */
         /* an empty ACK needs no further handling */
         goto cleanup;
       }
@@ -3486,6 +3973,12 @@ coap_dispatch(coap_context_t *context, coap_session_t *session,
       if (pdu->mid == session->last_ping_mid &&
           context->ping_timeout && session->last_ping > 0)
         is_ping_rst = 1;
+#if COAP_CLIENT_SUPPORT
+      /* Proxy health check pings are sent without keepalive */
+      if (pdu->mid == session->last_ping_mid &&
+          session->proxy_upstream && session->last_ping > 0)
+        is_ping_rst = 1;
+#endif /* COAP_CLIENT_SUPPORT */
 
       /* Check to see if checking out extended token support */
       is_ext_token_rst = 0;
@@ -3514,6 +4007,13 @@ coap_dispatch(coap_context_t *context, coap_session_t *session,
         coap_cancel(context, sent);
 
         if (!is_ping_rst && !is_ext_token_rst) {
+#if COAP_SERVER_SUPPORT && COAP_CLIENT_SUPPORT
+          if (sent->pdu->type == COAP_MESSAGE_CON &&
+              sent->session->proxy_upstream) {
+            coap_check_update_token(sent->session, sent->pdu);
+            coap_proxy_upstream_nack(sent->session, sent->pdu, COAP_NACK_RST);
+          } else
+#endif /* COAP_SERVER_SUPPORT && COAP_CLIENT_SUPPORT */
           if(sent->pdu->type==COAP_MESSAGE_CON && context->nack_handler) {
             coap_check_update_token(sent->session, sent->pdu);
             context->nack_handler(sent->session, sent->pdu,
@@ -3531,13 +4031,12 @@ coap_dispatch(coap_context_t *context, coap_session_t *session,
 #if COAP_SERVER_SUPPORT
       else {
         /* Need to check is there is a subscription active and delete it */
-        RESOURCES_ITER(context->resources, r) {
-          coap_subscription_t *obs, *tmp;
-          LL_FOREACH_SAFE(r->subscribers, obs, tmp) {
-            if (obs->pdu->mid == pdu->mid && obs->session == session) {
-              coap_delete_observer(r, session, &obs->pdu->actual_token);
-              goto cleanup;
-            }
+        coap_subscription_t *obs, *tmp;
+        DL_FOREACH_SAFE2(session->subscriptions, obs, tmp, session_next) {
+          if (obs->pdu->mid == pdu->mid) {
+            coap_delete_observer(obs->resource, session,
+                                 &obs->pdu->actual_token);
+            goto cleanup;
           }
         }
       }
@@ -3633,6 +4132,7 @@ coap_dispatch(coap_context_t *context, coap_session_t *session,
 
 cleanup:
   if (packet_is_bad) {
+    COAP_STATS_ADD(session, bad_pdus, 1);
     if (sent) {
       if (context->nack_handler) {
         coap_check_update_token(session, sent->pdu);
@@ -3755,6 +4255,7 @@ void coap_cleanup(void) {
 #elif defined(WITH_CONTIKI)
   coap_stop_io_process();
 #endif
+  coap_resolve_shutdown();
   coap_dtls_shutdown();
 }
 
@@ -207,6 +207,19 @@ oscore_cbor_put_unsigned(uint8_t **buffer, size_t *buf_size, uint64_t value) {
   }
 }
 
+size_t
+oscore_cbor_head_size(uint64_t value) {
+  if (value < 0x18)
+    return 1;
+  else if (value < 0x100)
+    return 2;
+  else if (value < 0x10000)
+    return 3;
+  else if (value < 0x100000000)
+    return 5;
+  return 9;
+}
+
 static inline uint8_t
 get_byte(const uint8_t *buffer) {
   return *buffer;
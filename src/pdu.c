@@ -234,6 +234,52 @@ fail:
 }
 
 
+coap_pdu_template_t *
+coap_pdu_template_new(const coap_pdu_t *pdu) {
+  size_t length = pdu->used_size - pdu->e_token_length;
+  coap_pdu_template_t *tmpl;
+
+  tmpl = coap_malloc_type(COAP_STRING, sizeof(coap_pdu_template_t) + length);
+  if (!tmpl)
+    return NULL;
+  tmpl->next = NULL;
+  tmpl->code = pdu->code;
+  tmpl->max_opt = pdu->max_opt;
+  tmpl->data_offset = pdu->data ?
+          (size_t)(pdu->data - pdu->token) - pdu->e_token_length : 0;
+  tmpl->length = length;
+  if (length)
+    memcpy(tmpl->s, pdu->token + pdu->e_token_length, length);
+  return tmpl;
+}
+
+void
+coap_pdu_template_free(coap_pdu_template_t *tmpl) {
+  coap_free_type(COAP_STRING, tmpl);
+}
+
+coap_pdu_t *
+coap_pdu_from_template(const coap_pdu_template_t *tmpl, coap_pdu_type_t type,
+                       coap_mid_t mid, const coap_bin_const_t *token,
+                       size_t max_size) {
+  coap_pdu_t *pdu;
+
+  pdu = coap_pdu_init(type, tmpl->code, mid, max_size);
+  if (!pdu)
+    return NULL;
+  if (!coap_add_token(pdu, token->length, token->s) ||
+      !coap_pdu_check_resize(pdu, pdu->used_size + tmpl->length)) {
+    coap_delete_pdu(pdu);
+    return NULL;
+  }
+  memcpy(pdu->token + pdu->used_size, tmpl->s, tmpl->length);
+  pdu->used_size += tmpl->length;
+  pdu->max_opt = tmpl->max_opt;
+  if (tmpl->data_offset)
+    pdu->data = pdu->token + pdu->e_token_length + tmpl->data_offset;
+  return pdu;
+}
+
 /*
  * The new size does not include the coap header (max_hdr_size)
  */
@@ -542,6 +588,7 @@ coap_option_check_repeatable(coap_option_num_t number) {
   case COAP_OPTION_URI_QUERY:
   case COAP_OPTION_LOCATION_QUERY:
   case COAP_OPTION_RTAG:
+  case COAP_OPTION_Q_BLOCK2:
     break;
   /* Protest at the known non-repeatable options and ignore them */
   case COAP_OPTION_URI_HOST:
@@ -553,6 +600,7 @@ coap_option_check_repeatable(coap_option_num_t number) {
   case COAP_OPTION_MAXAGE:
   case COAP_OPTION_HOP_LIMIT:
   case COAP_OPTION_ACCEPT:
+  case COAP_OPTION_Q_BLOCK1:
   case COAP_OPTION_BLOCK2:
   case COAP_OPTION_BLOCK1:
   case COAP_OPTION_SIZE2:
@@ -1128,9 +1176,11 @@ coap_pdu_parse_opt_base(coap_pdu_t *pdu, uint16_t len) {
   case COAP_OPTION_URI_QUERY:     if (len < 1 || len > 255) res = 0;  break;
   case COAP_OPTION_HOP_LIMIT:     if (len != 1) res = 0;              break;
   case COAP_OPTION_ACCEPT:        if (len > 2) res = 0;               break;
+  case COAP_OPTION_Q_BLOCK1:      if (len > 3) res = 0;               break;
   case COAP_OPTION_LOCATION_QUERY:if (len > 255) res = 0;             break;
   case COAP_OPTION_BLOCK2:        if (len > 3) res = 0;               break;
   case COAP_OPTION_BLOCK1:        if (len > 3) res = 0;               break;
+  case COAP_OPTION_Q_BLOCK2:      if (len > 3) res = 0;               break;
   case COAP_OPTION_SIZE2:         if (len > 4) res = 0;               break;
   case COAP_OPTION_PROXY_URI:     if (len < 1 || len > 1034) res = 0; break;
   case COAP_OPTION_PROXY_SCHEME:  if (len < 1 || len > 255) res = 0;  break;
@@ -16,12 +16,23 @@
 #include "coap3/coap_internal.h"
 
 #if COAP_SERVER_SUPPORT
+#include <limits.h>
 #include <stdio.h>
+#include <string.h>
 
 #ifdef COAP_EPOLL_SUPPORT
 #include <sys/epoll.h>
 #include <sys/timerfd.h>
 #endif /* COAP_EPOLL_SUPPORT */
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif /* HAVE_UNISTD_H */
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif /* HAVE_SYS_STAT_H */
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif /* HAVE_SYS_INOTIFY_H */
 
 #define COAP_PRINT_STATUS_MAX (~COAP_PRINT_STATUS_MASK)
 
@@ -103,46 +114,77 @@ match(const coap_str_const_t *text, const coap_str_const_t *pattern, int match_p
     memcmp(text->s, pattern->s, pattern->length) == 0;
 }
 
+#ifndef WITHOUT_QUERY_FILTER
+static int coap_wkc_index_lookup(coap_context_t *context,
+                                 const coap_str_const_t *name,
+                                 const coap_str_const_t *value,
+                                 coap_resource_t ***list, size_t *count);
+#endif /* WITHOUT_QUERY_FILTER */
+
+/** Called by coap_wkc_select() for each resource that passes the filter */
+typedef coap_print_status_t (*coap_wkc_visit_t)(coap_resource_t *r,
+                                                void *arg);
+
+/** State of coap_print_wellknown() between links */
+typedef struct coap_wkc_print_t {
+  unsigned char *p;
+  const uint8_t *bufend;
+  size_t offset;
+  size_t written;
+  int subsequent_resource;
+} coap_wkc_print_t;
+
+/* Prints the link for r, preceded by a ',' if not the first */
+static coap_print_status_t
+print_wellknown_link(coap_resource_t *r, void *arg) {
+  coap_wkc_print_t *state = (coap_wkc_print_t *)arg;
+  size_t left;
+  coap_print_status_t result;
+
+  if (!state->subsequent_resource) {        /* this is the first resource  */
+    state->subsequent_resource = 1;
+  } else {
+    PRINT_COND_WITH_OFFSET(state->p, state->bufend, state->offset, ',',
+                           state->written);
+  }
+
+  left = state->bufend - state->p; /* calculate available space */
+  result = coap_print_link(r, state->p, &left, &state->offset);
+
+  if (result & COAP_PRINT_STATUS_ERROR) {
+    return result;
+  }
+
+  /* coap_print_link() returns the number of characters that
+   * where actually written to p. Now advance to its end. */
+  state->p += COAP_PRINT_OUTPUT_LENGTH(result);
+  state->written += left;
+  return result;
+}
+
 /**
- * Prints the names of all known resources to @p buf. This function
- * sets @p buflen to the number of bytes actually written and returns
- * @c 1 on succes. On error, the value in @p buflen is undefined and
- * the return value will be @c 0.
+ * Calls @p visit for each resource of @p context that passes
+ * @p query_filter, until @p visit returns COAP_PRINT_STATUS_ERROR.
  *
- * @param context The context with the resource map.
- * @param buf     The buffer to write the result.
- * @param buflen  Must be initialized to the maximum length of @p buf and will be
- *                set to the length of the well-known response on return.
- * @param offset  The offset in bytes where the output shall start and is
- *                shifted accordingly with the characters that have been
- *                processed. This parameter is used to support the block
- *                option.
- * @param query_filter A filter query according to <a href="http://tools.ietf.org/html/draft-ietf-core-link-format-11#section-4.1">Link Format</a>
- *
- * @return COAP_PRINT_STATUS_ERROR on error. Otherwise, the lower 28 bits are
- *         set to the number of bytes that have actually been written to
- *         @p buf. COAP_PRINT_STATUS_TRUNC is set when the output has been
- *         truncated.
+ * @return The result of the last call of @p visit, or @c 0.
  */
 #if defined(__GNUC__) && defined(WITHOUT_QUERY_FILTER)
-coap_print_status_t
-coap_print_wellknown(coap_context_t *context, unsigned char *buf, size_t *buflen,
-                size_t offset,
-                const coap_string_t *query_filter COAP_UNUSED) {
+static coap_print_status_t
+coap_wkc_select(coap_context_t *context,
+                const coap_string_t *query_filter COAP_UNUSED,
+                coap_wkc_visit_t visit, void *arg) {
 #else /* not a GCC */
-coap_print_status_t
-coap_print_wellknown(coap_context_t *context, unsigned char *buf, size_t *buflen,
-                size_t offset, const coap_string_t *query_filter) {
+static coap_print_status_t
+coap_wkc_select(coap_context_t *context, const coap_string_t *query_filter,
+                coap_wkc_visit_t visit, void *arg) {
 #endif /* GCC */
-  size_t output_length = 0;
-  unsigned char *p = buf;
-  const uint8_t *bufend = buf + *buflen;
-  size_t left, written = 0;
-  coap_print_status_t result;
-  const size_t old_offset = offset;
-  int subsequent_resource = 0;
+  coap_print_status_t result = 0;
+  coap_resource_t **list = NULL;
+  size_t list_count = 0;
+  int use_list = 0;
 #ifndef WITHOUT_QUERY_FILTER
   coap_str_const_t resource_param = { 0, NULL }, query_pattern = { 0, NULL };
+  coap_resource_t *found = NULL;
   int flags = 0; /* MATCH_SUBSTRING, MATCH_PREFIX, MATCH_URI */
 #define MATCH_URI       0x01
 #define MATCH_PREFIX    0x02
@@ -198,54 +240,110 @@ coap_print_wellknown(coap_context_t *context, unsigned char *buf, size_t *buflen
   }
 #endif /* WITHOUT_QUERY_FILTER */
 
-  RESOURCES_ITER(context->resources, r) {
-
 #ifndef WITHOUT_QUERY_FILTER
-    if (resource_param.length) { /* there is a query filter */
-
-      if (flags & MATCH_URI) {        /* match resource URI */
-        if (!match(r->uri_path, &query_pattern, (flags & MATCH_PREFIX) != 0,
-            (flags & MATCH_SUBSTRING) != 0))
-          continue;
-      } else {                        /* match attribute */
-        coap_attr_t *attr;
-        coap_str_const_t unquoted_val;
-        attr = coap_find_attr(r, &resource_param);
-        if (!attr || !attr->value) continue;
-        unquoted_val = *attr->value;
-        if (attr->value->s[0] == '"') {          /* if attribute has a quoted value, remove double quotes */
-          unquoted_val.length -= 2;
-          unquoted_val.s += 1;
-        }
-        if (!(match(&unquoted_val, &query_pattern,
-                    (flags & MATCH_PREFIX) != 0,
-                    (flags & MATCH_SUBSTRING) != 0)))
-          continue;
+  /*
+   * An exact href= filter, or an exact attribute value filter, picks out the
+   * matching resources directly instead of testing every resource.
+   */
+  if (resource_param.length && resource_param.length < query_filter->length &&
+      !(flags & MATCH_PREFIX)) {
+    if (flags & MATCH_URI) {
+      RESOURCES_FIND(context->resources, &query_pattern, found);
+      if (found) {
+        list = &found;
+        list_count = 1;
       }
+      use_list = 1;
+    } else {
+      use_list = coap_wkc_index_lookup(context, &resource_param,
+                                       &query_pattern, &list, &list_count);
     }
+  }
 #endif /* WITHOUT_QUERY_FILTER */
 
-    if (!subsequent_resource) {        /* this is the first resource  */
-      subsequent_resource = 1;
-    } else {
-      PRINT_COND_WITH_OFFSET(p, bufend, offset, ',', written);
+  if (use_list) {
+    size_t i;
+
+    for (i = 0; i < list_count; i++) {
+      result = visit(list[i], arg);
+      if (result & COAP_PRINT_STATUS_ERROR)
+        break;
     }
+  } else {
+    RESOURCES_ITER(context->resources, r) {
 
-    left = bufend - p; /* calculate available space */
-    result = coap_print_link(r, p, &left, &offset);
+#ifndef WITHOUT_QUERY_FILTER
+      if (resource_param.length) { /* there is a query filter */
+
+        if (flags & MATCH_URI) {        /* match resource URI */
+          if (!match(r->uri_path, &query_pattern, (flags & MATCH_PREFIX) != 0,
+              (flags & MATCH_SUBSTRING) != 0))
+            continue;
+        } else {                        /* match attribute */
+          coap_attr_t *attr;
+          coap_str_const_t unquoted_val;
+          attr = coap_find_attr(r, &resource_param);
+          if (!attr || !attr->value) continue;
+          unquoted_val = *attr->value;
+          if (attr->value->s[0] == '"') {          /* if attribute has a quoted value, remove double quotes */
+            unquoted_val.length -= 2;
+            unquoted_val.s += 1;
+          }
+          if (!(match(&unquoted_val, &query_pattern,
+                      (flags & MATCH_PREFIX) != 0,
+                      (flags & MATCH_SUBSTRING) != 0)))
+            continue;
+        }
+      }
+#endif /* WITHOUT_QUERY_FILTER */
 
-    if (result & COAP_PRINT_STATUS_ERROR) {
-      break;
+      result = visit(r, arg);
+      if (result & COAP_PRINT_STATUS_ERROR)
+        break;
     }
-
-    /* coap_print_link() returns the number of characters that
-     * where actually written to p. Now advance to its end. */
-    p += COAP_PRINT_OUTPUT_LENGTH(result);
-    written += left;
   }
 
-  *buflen = written;
-  output_length = p - buf;
+  return result;
+}
+
+/**
+ * Prints the names of all known resources to @p buf. This function
+ * sets @p buflen to the number of bytes actually written and returns
+ * @c 1 on succes. On error, the value in @p buflen is undefined and
+ * the return value will be @c 0.
+ *
+ * @param context The context with the resource map.
+ * @param buf     The buffer to write the result.
+ * @param buflen  Must be initialized to the maximum length of @p buf and will be
+ *                set to the length of the well-known response on return.
+ * @param offset  The offset in bytes where the output shall start and is
+ *                shifted accordingly with the characters that have been
+ *                processed. This parameter is used to support the block
+ *                option.
+ * @param query_filter A filter query according to <a href="http://tools.ietf.org/html/draft-ietf-core-link-format-11#section-4.1">Link Format</a>
+ *
+ * @return COAP_PRINT_STATUS_ERROR on error. Otherwise, the lower 28 bits are
+ *         set to the number of bytes that have actually been written to
+ *         @p buf. COAP_PRINT_STATUS_TRUNC is set when the output has been
+ *         truncated.
+ */
+coap_print_status_t
+coap_print_wellknown(coap_context_t *context, unsigned char *buf, size_t *buflen,
+                size_t offset, const coap_string_t *query_filter) {
+  size_t output_length = 0;
+  coap_print_status_t result;
+  const size_t old_offset = offset;
+  coap_wkc_print_t state;
+
+  state.p = buf;
+  state.bufend = buf + *buflen;
+  state.offset = offset;
+  state.written = 0;
+  state.subsequent_resource = 0;
+  coap_wkc_select(context, query_filter, print_wellknown_link, &state);
+
+  *buflen = state.written;
+  output_length = state.p - buf;
 
   if (output_length > COAP_PRINT_STATUS_MAX) {
     return COAP_PRINT_STATUS_ERROR;
@@ -253,12 +351,249 @@ coap_print_wellknown(coap_context_t *context, unsigned char *buf, size_t *buflen
 
   result = (coap_print_status_t)output_length;
 
-  if (result + old_offset - offset < *buflen) {
+  if (result + old_offset - state.offset < *buflen) {
     result |= COAP_PRINT_STATUS_TRUNC;
   }
   return result;
 }
 
+/*
+ * Keys of the link-format+cbor encoding that stand in for the text of the
+ * well-known link attribute names.
+ */
+static const struct {
+  uint8_t key;
+  coap_str_const_t name;
+} coap_link_cbor_keys[] = {
+  {  1, {4, (const uint8_t *)"href"} },
+  {  2, {3, (const uint8_t *)"rel"} },
+  {  3, {6, (const uint8_t *)"anchor"} },
+  {  4, {3, (const uint8_t *)"rev"} },
+  {  5, {8, (const uint8_t *)"hreflang"} },
+  {  6, {5, (const uint8_t *)"media"} },
+  {  7, {5, (const uint8_t *)"title"} },
+  {  8, {4, (const uint8_t *)"type"} },
+  {  9, {2, (const uint8_t *)"rt"} },
+  { 10, {2, (const uint8_t *)"if"} },
+  { 11, {2, (const uint8_t *)"sz"} },
+  { 12, {2, (const uint8_t *)"ct"} },
+  { 13, {3, (const uint8_t *)"obs"} }
+};
+
+#define COAP_LINK_CBOR_HREF 1
+#define COAP_LINK_CBOR_OBS 13
+
+/*
+ * The link_cbor_*() helpers add an item at *p, or only return its size
+ * when *p is NULL.
+ */
+static size_t
+link_cbor_text(uint8_t **p, size_t *left, const uint8_t *s, size_t length) {
+  if (!*p)
+    return oscore_cbor_head_size(length) + length;
+  return oscore_cbor_put_text(p, left, (const char *)s, length);
+}
+
+static size_t
+link_cbor_key(uint8_t **p, size_t *left, const coap_str_const_t *name) {
+  size_t i;
+
+  for (i = 0; i < sizeof(coap_link_cbor_keys)/sizeof(coap_link_cbor_keys[0]);
+       i++) {
+    if (coap_string_equal(name, &coap_link_cbor_keys[i].name)) {
+      if (!*p)
+        return oscore_cbor_head_size(coap_link_cbor_keys[i].key);
+      return oscore_cbor_put_unsigned(p, left, coap_link_cbor_keys[i].key);
+    }
+  }
+  return link_cbor_text(p, left, name->s, name->length);
+}
+
+static size_t
+link_cbor_value(uint8_t **p, size_t *left, const coap_str_const_t *value) {
+  if (!value || !value->s) {
+    /* A flag attribute such as obs */
+    if (!*p)
+      return 1;
+    return oscore_cbor_put_true(p, left);
+  }
+  if (value->length >= 2 && value->s[0] == '"' &&
+      value->s[value->length - 1] == '"')
+    return link_cbor_text(p, left, value->s + 1, value->length - 2);
+  return link_cbor_text(p, left, value->s, value->length);
+}
+
+static size_t
+link_cbor_uint(uint8_t **p, size_t *left, uint64_t value) {
+  if (!*p)
+    return oscore_cbor_head_size(value);
+  return oscore_cbor_put_unsigned(p, left, value);
+}
+
+/* Returns the number of attributes of resource named as attr, or 0 if an
+ * earlier attribute has the same name. */
+static size_t
+link_cbor_attr_count(const coap_resource_t *resource,
+                     const coap_attr_t *attr) {
+  const coap_attr_t *other;
+  size_t count = 0;
+
+  LL_FOREACH(resource->link_attr, other) {
+    if (coap_string_equal(other->name, attr->name)) {
+      if (other != attr && count == 0)
+        return 0;
+      count++;
+    }
+  }
+  return count;
+}
+
+/*
+ * Adds the map of the link to resource in the link-format+cbor encoding, or
+ * only returns its size when *p is NULL. An attribute given more than once
+ * becomes an array of its values.
+ */
+static size_t
+print_link_cbor(const coap_resource_t *resource, uint8_t **p, size_t *left) {
+  coap_attr_t *attr, *other;
+  size_t entries = 1;
+  size_t length;
+  size_t count;
+  uint8_t *head;
+
+  LL_FOREACH(resource->link_attr, attr) {
+    if (link_cbor_attr_count(resource, attr))
+      entries++;
+  }
+  if (resource->observable)
+    entries++;
+#if HAVE_OSCORE
+  if (resource->flags & COAP_RESOURCE_FLAGS_OSCORE_ONLY)
+    entries++;
+#endif /* HAVE_OSCORE */
+
+  if (*p)
+    length = oscore_cbor_put_map(p, left, entries);
+  else
+    length = oscore_cbor_head_size(entries);
+
+  /* href is the path with a leading '/' */
+  length += link_cbor_uint(p, left, COAP_LINK_CBOR_HREF);
+  if (*p) {
+    head = *p;
+    length += oscore_cbor_put_unsigned(p, left, resource->uri_path->length + 1);
+    *head |= 0x60;
+    assert(*left >= resource->uri_path->length + 1);
+    *(*p)++ = '/';
+    memcpy(*p, resource->uri_path->s, resource->uri_path->length);
+    *p += resource->uri_path->length;
+    *left -= resource->uri_path->length + 1;
+  } else {
+    length += oscore_cbor_head_size(resource->uri_path->length + 1);
+  }
+  length += resource->uri_path->length + 1;
+
+  LL_FOREACH(resource->link_attr, attr) {
+    count = link_cbor_attr_count(resource, attr);
+    if (count == 0)
+      continue;
+    length += link_cbor_key(p, left, attr->name);
+    if (count == 1) {
+      length += link_cbor_value(p, left, attr->value);
+      continue;
+    }
+    if (*p)
+      length += oscore_cbor_put_array(p, left, count);
+    else
+      length += oscore_cbor_head_size(count);
+    LL_FOREACH(attr, other) {
+      if (coap_string_equal(other->name, attr->name))
+        length += link_cbor_value(p, left, other->value);
+    }
+  }
+
+  if (resource->observable) {
+    length += link_cbor_uint(p, left, COAP_LINK_CBOR_OBS);
+    length += link_cbor_value(p, left, NULL);
+  }
+#if HAVE_OSCORE
+  if (resource->flags & COAP_RESOURCE_FLAGS_OSCORE_ONLY) {
+    length += link_cbor_text(p, left, (const uint8_t *)"osc", 3);
+    length += link_cbor_value(p, left, NULL);
+  }
+#endif /* HAVE_OSCORE */
+  return length;
+}
+
+/** State of coap_print_wellknown_cbor() between links */
+typedef struct coap_wkc_cbor_t {
+  uint8_t *p;    /**< next byte to write, or NULL when sizing */
+  size_t left;   /**< space left at p */
+  size_t length; /**< length of the links so far */
+  size_t count;  /**< number of links so far */
+  size_t limit;  /**< space for the whole array when sizing, or 0 */
+  size_t max;    /**< number of links to write */
+} coap_wkc_cbor_t;
+
+static coap_print_status_t
+print_wellknown_link_cbor(coap_resource_t *r, void *arg) {
+  coap_wkc_cbor_t *state = (coap_wkc_cbor_t *)arg;
+  size_t length;
+
+  if (state->count == state->max)
+    return 0;
+  length = print_link_cbor(r, &state->p, &state->left);
+  if (state->limit &&
+      oscore_cbor_head_size(state->count + 1) + state->length + length >
+      state->limit) {
+    /* Only whole links, so none after the first that does not fit */
+    state->max = state->count;
+    return 0;
+  }
+  state->length += length;
+  state->count++;
+  return 0;
+}
+
+int
+coap_print_wellknown_cbor(coap_context_t *context, uint8_t *buf,
+                          size_t *buflen, const coap_string_t *query_filter) {
+  coap_wkc_cbor_t state;
+  size_t length;
+
+  memset(&state, 0, sizeof(state));
+  state.max = (size_t)-1;
+  coap_wkc_select(context, query_filter, print_wellknown_link_cbor, &state);
+  length = oscore_cbor_head_size(state.count) + state.length;
+  if (!buf) {
+    *buflen = length;
+    return 1;
+  }
+  if (*buflen < length) {
+    /* Size again, keeping the leading links that fit */
+    if (*buflen < oscore_cbor_head_size(0))
+      return 0;
+    state.count = 0;
+    state.length = 0;
+    state.limit = *buflen;
+    coap_wkc_select(context, query_filter, print_wellknown_link_cbor, &state);
+    length = oscore_cbor_head_size(state.count) + state.length;
+  }
+
+  state.p = buf;
+  state.left = length;
+  oscore_cbor_put_array(&state.p, &state.left, state.count);
+  state.max = state.count;
+  state.count = 0;
+  state.length = 0;
+  state.limit = 0;
+  coap_wkc_select(context, query_filter, print_wellknown_link_cbor, &state);
+  if ((size_t)(state.p - buf) != length)
+    return 0;
+  *buflen = length;
+  return 1;
+}
+
 static coap_str_const_t null_path_value = {0, (const uint8_t*)""};
 static coap_str_const_t *null_path = &null_path_value;
 
@@ -286,6 +621,7 @@ coap_resource_init(coap_str_const_t *uri_path, int flags) {
       r->uri_path = uri_path;
 
     r->flags = flags;
+    r->is_template = (flags & COAP_RESOURCE_FLAGS_URI_TEMPLATE) != 0;
     r->observe = 2;
   } else {
     coap_log_debug("coap_resource_init: no memory left\n");
@@ -382,6 +718,257 @@ coap_resource_proxy_uri_init(coap_method_handler_t handler,
                                        host_name_list, 0);
 }
 
+/*
+ * A read-only copy of the file behind a coap_resource_file_init() resource,
+ * so that the file changing cannot affect transfers in progress.
+ */
+typedef struct coap_file_image_t {
+  uint8_t *data;         /* owned, read-only once loaded */
+  size_t length;
+  uint64_t etag;
+  unsigned int ref;      /* the resource plus each transfer in progress */
+} coap_file_image_t;
+
+typedef struct coap_file_res_t {
+  char *path;
+  coap_file_image_t *image; /* current contents, NULL if file is missing */
+  uint16_t media_type;
+  int maxage;
+#ifdef HAVE_SYS_INOTIFY_H
+  int watch_fd;             /* non-blocking inotify fd, -1 if none */
+#endif /* HAVE_SYS_INOTIFY_H */
+#ifdef HAVE_SYS_STAT_H
+  struct stat st;           /* identity of the file the image came from */
+#endif /* HAVE_SYS_STAT_H */
+} coap_file_res_t;
+
+static void
+coap_file_image_release(coap_session_t *session COAP_UNUSED, void *app_ptr) {
+  coap_file_image_t *image = (coap_file_image_t *)app_ptr;
+
+  assert(image->ref > 0);
+  if (--image->ref)
+    return;
+  coap_free_type(COAP_STRING, image->data);
+  coap_free_type(COAP_STRING, image);
+}
+
+static coap_file_image_t *
+coap_file_image_load(coap_file_res_t *f) {
+  coap_file_image_t *image;
+  uint64_t etag = 0xcbf29ce484222325ULL;
+  FILE *fp;
+  uint8_t *data;
+  size_t size = 1024;
+  size_t len;
+  size_t i;
+
+  image = coap_malloc_type(COAP_STRING, sizeof(coap_file_image_t));
+  if (!image)
+    return NULL;
+  memset(image, 0, sizeof(coap_file_image_t));
+
+  fp = fopen(f->path, "rb");
+  if (!fp)
+    goto fail;
+#ifdef HAVE_SYS_STAT_H
+  /* The identity of the file that is read, sizing the copy */
+  if (fstat(fileno(fp), &f->st) == 0 && f->st.st_size > 0)
+    size = (size_t)f->st.st_size + 1;
+#endif /* HAVE_SYS_STAT_H */
+  data = coap_malloc_type(COAP_STRING, size);
+  while (data &&
+         (len = fread(data + image->length, 1, size - image->length,
+                      fp)) > 0) {
+    image->length += len;
+    if (image->length == size) {
+      uint8_t *new_data = coap_realloc_type(COAP_STRING, data, size * 2);
+
+      if (!new_data)
+        coap_free_type(COAP_STRING, data);
+      data = new_data;
+      size *= 2;
+    }
+  }
+  fclose(fp);
+  if (!data)
+    goto fail;
+  image->data = data;
+
+  /* Strong ETag, FNV-1a over the contents */
+  for (i = 0; i < image->length; i++)
+    etag = (etag ^ image->data[i]) * 0x100000001b3ULL;
+  image->etag = etag ? etag : 1;
+  image->ref = 1;
+  coap_log_debug("file %s: loaded %zu bytes\n", f->path, image->length);
+  return image;
+
+fail:
+  coap_log_warn("file %s: cannot load: %s\n", f->path, strerror(errno));
+  coap_free_type(COAP_STRING, image);
+  return NULL;
+}
+
+/*
+ * Drop the current image if the file has changed since it was loaded.
+ * Returns 1 if it has changed, else 0.
+ */
+static int
+coap_file_res_changed(coap_file_res_t *f) {
+#ifdef HAVE_SYS_INOTIFY_H
+  if (f->watch_fd != -1) {
+    char buf[1024];
+    int changed = 0;
+
+    while (read(f->watch_fd, buf, sizeof(buf)) > 0)
+      changed = 1;
+    if (!changed && f->image)
+      return 0;
+    /* Replacing the file by rename() drops the watch, so always re-arm it */
+    inotify_add_watch(f->watch_fd, f->path, IN_MODIFY | IN_CLOSE_WRITE |
+                      IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+    return 1;
+  }
+#endif /* HAVE_SYS_INOTIFY_H */
+#if defined(HAVE_SYS_STAT_H)
+  {
+    struct stat st;
+
+    /* No inotify watch, so see if the file has been replaced or written */
+    if (stat(f->path, &st) == -1)
+      return f->image != NULL;
+    return !f->image || st.st_ino != f->st.st_ino ||
+           st.st_size != f->st.st_size || st.st_mtime != f->st.st_mtime;
+  }
+#else /* ! HAVE_SYS_STAT_H */
+  return f->image == NULL;
+#endif /* ! HAVE_SYS_STAT_H */
+}
+
+static void
+coap_file_res_get(coap_resource_t *resource,
+                  coap_session_t *session,
+                  const coap_pdu_t *request,
+                  const coap_string_t *query,
+                  coap_pdu_t *response) {
+  coap_file_res_t *f = resource->file;
+  coap_file_image_t *image;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_filter_t filter;
+  coap_opt_t *option;
+  coap_block_b_t block;
+  uint8_t buf[8];
+
+  if (coap_file_res_changed(f)) {
+    if (f->image)
+      coap_file_image_release(session, f->image);
+    f->image = coap_file_image_load(f);
+  }
+  image = f->image;
+  if (!image) {
+    coap_pdu_set_code(response, COAP_RESPONSE_CODE_NOT_FOUND);
+    return;
+  }
+
+  /* Validate any ETags unless a later block is being asked for */
+  if (!(coap_get_block_b(session, request, COAP_OPTION_BLOCK2, &block) ||
+        coap_get_block_b(session, request, COAP_OPTION_Q_BLOCK2, &block)) ||
+      block.num == 0) {
+    coap_option_filter_clear(&filter);
+    coap_option_filter_set(&filter, COAP_OPTION_ETAG);
+    coap_option_iterator_init(request, &opt_iter, &filter);
+    while ((option = coap_option_next(&opt_iter))) {
+      if (coap_decode_var_bytes8(coap_opt_value(option),
+                                 coap_opt_length(option)) == image->etag) {
+        coap_pdu_set_code(response, COAP_RESPONSE_CODE_VALID);
+        coap_add_option(response, COAP_OPTION_ETAG,
+                        coap_encode_var_safe8(buf, sizeof(buf), image->etag),
+                        buf);
+        if (f->maxage >= 0)
+          coap_add_option(response, COAP_OPTION_MAXAGE,
+                          coap_encode_var_safe(buf, sizeof(buf), f->maxage),
+                          buf);
+        return;
+      }
+    }
+  }
+
+  coap_pdu_set_code(response, COAP_RESPONSE_CODE_CONTENT);
+  image->ref++;
+  coap_add_data_large_response(resource, session, request, response, query,
+                               f->media_type, f->maxage, image->etag,
+                               image->length, image->data,
+                               coap_file_image_release, image);
+}
+
+static void
+coap_file_res_free(coap_file_res_t *f) {
+  if (f->image)
+    coap_file_image_release(NULL, f->image);
+#ifdef HAVE_SYS_INOTIFY_H
+  if (f->watch_fd != -1)
+    close(f->watch_fd);
+#endif /* HAVE_SYS_INOTIFY_H */
+  coap_free_type(COAP_STRING, f->path);
+  coap_free_type(COAP_STRING, f);
+}
+
+coap_resource_t *
+coap_resource_file_init(coap_str_const_t *uri_path, const char *path,
+                        uint16_t media_type, int maxage, int flags) {
+  coap_resource_t *r;
+  coap_file_res_t *f;
+  size_t len = strlen(path);
+
+  f = coap_malloc_type(COAP_STRING, sizeof(coap_file_res_t));
+  if (!f)
+    return NULL;
+  memset(f, 0, sizeof(coap_file_res_t));
+  f->path = coap_malloc_type(COAP_STRING, len + 1);
+  if (!f->path) {
+    coap_free_type(COAP_STRING, f);
+    return NULL;
+  }
+  memcpy(f->path, path, len + 1);
+  f->media_type = media_type;
+  f->maxage = maxage;
+#ifdef HAVE_SYS_INOTIFY_H
+  f->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (f->watch_fd != -1 &&
+      inotify_add_watch(f->watch_fd, f->path, IN_MODIFY | IN_CLOSE_WRITE |
+                        IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF) == -1) {
+    close(f->watch_fd);
+    f->watch_fd = -1;
+  }
+#endif /* HAVE_SYS_INOTIFY_H */
+
+  f->image = coap_file_image_load(f);
+  if (!f->image) {
+    coap_file_res_free(f);
+    return NULL;
+  }
+  r = coap_resource_init(uri_path, flags);
+  if (!r) {
+    coap_file_res_free(f);
+    return NULL;
+  }
+  r->file = f;
+  coap_register_request_handler(r, COAP_REQUEST_GET, coap_file_res_get);
+  return r;
+}
+
+void
+coap_resource_file_unwatch(coap_resource_t *resource) {
+#ifdef HAVE_SYS_INOTIFY_H
+  if (resource->file && resource->file->watch_fd != -1) {
+    close(resource->file->watch_fd);
+    resource->file->watch_fd = -1;
+  }
+#else /* ! HAVE_SYS_INOTIFY_H */
+  (void)resource;
+#endif /* ! HAVE_SYS_INOTIFY_H */
+}
+
 coap_attr_t *
 coap_add_attr(coap_resource_t *resource,
               coap_str_const_t *name,
@@ -411,6 +998,8 @@ coap_add_attr(coap_resource_t *resource,
 
     /* add attribute to resource list */
     LL_PREPEND(resource->link_attr, attr);
+    if (resource->context)
+      coap_wkc_invalidate(resource->context);
   } else {
     coap_log_debug("coap_add_attr: no memory left\n");
   }
@@ -435,6 +1024,237 @@ coap_find_attr(coap_resource_t *resource,
   return NULL;
 }
 
+#ifndef WITHOUT_QUERY_FILTER
+/* Finds the index entry for name=value. Returns 0 if out of memory. */
+static int
+coap_wkc_index_find(coap_context_t *context, const coap_str_const_t *name,
+                    const uint8_t *value, size_t value_length,
+                    coap_wkc_index_t **entry) {
+  size_t key_length = name->length + 1 + value_length;
+  uint8_t buf[64];
+  uint8_t *key = buf;
+
+  if (key_length > sizeof(buf)) {
+    key = coap_malloc_type(COAP_STRING, key_length);
+    if (!key)
+      return 0;
+  }
+  memcpy(key, name->s, name->length);
+  key[name->length] = '=';
+  memcpy(&key[name->length + 1], value, value_length);
+  HASH_FIND(hh, context->wkc_index, key, key_length, *entry);
+  if (key != buf)
+    coap_free_type(COAP_STRING, key);
+  return 1;
+}
+
+static int
+coap_wkc_index_add(coap_context_t *context, const coap_str_const_t *name,
+                   const uint8_t *value, size_t value_length,
+                   coap_resource_t *r) {
+  coap_wkc_index_t *entry;
+  size_t key_length = name->length + 1 + value_length;
+
+  if (!coap_wkc_index_find(context, name, value, value_length, &entry))
+    return 0;
+  if (!entry) {
+    entry = coap_malloc_type(COAP_STRING,
+                             sizeof(coap_wkc_index_t) + key_length);
+    if (!entry)
+      return 0;
+    memset(entry, 0, sizeof(coap_wkc_index_t));
+    memcpy(entry->key, name->s, name->length);
+    entry->key[name->length] = '=';
+    memcpy(&entry->key[name->length + 1], value, value_length);
+    entry->key_length = key_length;
+    HASH_ADD(hh, context->wkc_index, key[0], key_length, entry);
+  }
+  /* A value listed twice by the same resource is only printed once */
+  if (entry->count && entry->resources[entry->count - 1] == r)
+    return 1;
+  if (entry->count == entry->size) {
+    size_t size = entry->size ? entry->size * 2 : 4;
+    coap_resource_t **resources;
+
+    resources = coap_realloc_type(COAP_STRING, entry->resources,
+                                  size * sizeof(coap_resource_t *));
+    if (!resources)
+      return 0;
+    entry->resources = resources;
+    entry->size = size;
+  }
+  entry->resources[entry->count++] = r;
+  return 1;
+}
+
+static void
+coap_wkc_index_free(coap_context_t *context) {
+  coap_wkc_index_t *entry, *tmp;
+
+  HASH_ITER(hh, context->wkc_index, entry, tmp) {
+    HASH_DELETE(hh, context->wkc_index, entry);
+    coap_free_type(COAP_STRING, entry->resources);
+    coap_free_type(COAP_STRING, entry);
+  }
+  context->wkc_index_built = 0;
+}
+
+/*
+ * Indexes the (unquoted) value of the first attribute of each name for every
+ * resource, in the same way as match() compares them. The values of rt, if
+ * and rel are split into their space separated tokens.
+ */
+static int
+coap_wkc_index_build(coap_context_t *context) {
+  RESOURCES_ITER(context->resources, r) {
+    coap_attr_t *attr;
+
+    LL_FOREACH(r->link_attr, attr) {
+      coap_str_const_t value;
+      int tokens;
+
+      if (!attr->value || coap_find_attr(r, attr->name) != attr)
+        continue;
+      value = *attr->value;
+      if (value.length >= 2 && value.s[0] == '"') {
+        value.length -= 2;
+        value.s += 1;
+      }
+      tokens = (attr->name->length == 2 &&
+                (memcmp(attr->name->s, "rt", 2) == 0 ||
+                 memcmp(attr->name->s, "if", 2) == 0)) ||
+               (attr->name->length == 3 &&
+                memcmp(attr->name->s, "rel", 3) == 0);
+      if (!tokens) {
+        if (!coap_wkc_index_add(context, attr->name, value.s, value.length,
+                                r))
+          goto fail;
+        continue;
+      }
+      while (value.length) {
+        const uint8_t *space = memchr(value.s, ' ', value.length);
+        size_t token_length = space ? (size_t)(space - value.s) :
+                                      value.length;
+
+        if (!coap_wkc_index_add(context, attr->name, value.s, token_length,
+                                r))
+          goto fail;
+        value.s += token_length;
+        value.length -= token_length;
+        if (space) {
+          value.s++;
+          value.length--;
+        }
+      }
+    }
+  }
+  context->wkc_index_built = 1;
+  return 1;
+
+fail:
+  coap_wkc_index_free(context);
+  return 0;
+}
+
+/*
+ * Finds the resources with the attribute name=value. Returns 0 if the
+ * index cannot be used, in which case every resource has to be checked.
+ */
+static int
+coap_wkc_index_lookup(coap_context_t *context, const coap_str_const_t *name,
+                      const coap_str_const_t *value,
+                      coap_resource_t ***list, size_t *count) {
+  coap_wkc_index_t *entry;
+
+  if (!context->wkc_index_built && !coap_wkc_index_build(context))
+    return 0;
+  if (!coap_wkc_index_find(context, name, value->s, value->length, &entry))
+    return 0;
+  if (entry) {
+    *list = entry->resources;
+    *count = entry->count;
+  } else {
+    *list = NULL;
+    *count = 0;
+  }
+  return 1;
+}
+#endif /* WITHOUT_QUERY_FILTER */
+
+void
+coap_wkc_cache_release(coap_session_t *session COAP_UNUSED, void *app_ptr) {
+  coap_wkc_cache_t *cache = (coap_wkc_cache_t *)app_ptr;
+
+  assert(cache->ref > 0);
+  if (--cache->ref == 0)
+    coap_free_type(COAP_STRING, cache);
+}
+
+coap_wkc_cache_t *
+coap_wkc_cache_get(coap_context_t *context, uint16_t media_type) {
+  coap_wkc_cache_t **cachep;
+  coap_wkc_cache_t *cache;
+  uint64_t etag = 0xcbf29ce484222325ULL;
+  size_t len = 0;
+  size_t i;
+  uint8_t buf[1];
+
+  if (media_type == COAP_MEDIATYPE_APPLICATION_LINK_FORMAT_CBOR)
+    cachep = &context->wkc_cache_cbor;
+  else
+    cachep = &context->wkc_cache;
+  cache = *cachep;
+  if (cache) {
+    cache->ref++;
+    return cache;
+  }
+  /* Size the document first */
+  if (cachep == &context->wkc_cache_cbor) {
+    if (!coap_print_wellknown_cbor(context, NULL, &len, NULL))
+      return NULL;
+  } else if (coap_print_wellknown(context, buf, &len, UINT_MAX, NULL) &
+             COAP_PRINT_STATUS_ERROR) {
+    return NULL;
+  }
+  cache = coap_malloc_type(COAP_STRING, sizeof(coap_wkc_cache_t) + len);
+  if (!cache)
+    return NULL;
+  cache->length = len;
+  if (cachep == &context->wkc_cache_cbor) {
+    if (!coap_print_wellknown_cbor(context, cache->s, &cache->length, NULL)) {
+      coap_free_type(COAP_STRING, cache);
+      return NULL;
+    }
+  } else if (coap_print_wellknown(context, cache->s, &cache->length, 0,
+                                  NULL) & COAP_PRINT_STATUS_ERROR) {
+    coap_free_type(COAP_STRING, cache);
+    return NULL;
+  }
+  for (i = 0; i < cache->length; i++)
+    etag = (etag ^ cache->s[i]) * 0x100000001b3ULL;
+  cache->etag = etag ? etag : 1;
+  /* One reference for the context, one for the caller */
+  cache->ref = 2;
+  *cachep = cache;
+  return cache;
+}
+
+void
+coap_wkc_invalidate(coap_context_t *context) {
+  if (context->wkc_cache) {
+    coap_wkc_cache_release(NULL, context->wkc_cache);
+    context->wkc_cache = NULL;
+  }
+  if (context->wkc_cache_cbor) {
+    coap_wkc_cache_release(NULL, context->wkc_cache_cbor);
+    context->wkc_cache_cbor = NULL;
+  }
+#ifndef WITHOUT_QUERY_FILTER
+  if (context->wkc_index_built)
+    coap_wkc_index_free(context);
+#endif /* WITHOUT_QUERY_FILTER */
+}
+
 coap_str_const_t *
 coap_attr_get_value(coap_attr_t *attr) {
   if (attr)
@@ -451,53 +1271,320 @@ coap_delete_attr(coap_attr_t *attr) {
     coap_delete_str_const(attr->value);
   }
 
-  coap_free_type(COAP_RESOURCEATTR, attr);
+  coap_free_type(COAP_RESOURCEATTR, attr);
+}
+
+typedef enum coap_deleting_resource_t {
+  COAP_DELETING_RESOURCE,
+  COAP_NOT_DELETING_RESOURCE
+} coap_deleting_resource_t;
+
+static void coap_notify_observers(coap_context_t *context, coap_resource_t *r,
+                                  coap_deleting_resource_t deleting);
+static void coap_free_observer(coap_subscription_t *s);
+
+static void
+coap_free_resource(coap_resource_t *resource) {
+  coap_attr_t *attr, *tmp;
+  coap_subscription_t *obs, *otmp;
+  size_t i;
+
+  assert(resource);
+
+  coap_resource_notify_observers(resource, NULL);
+  coap_notify_observers(resource->context, resource, COAP_DELETING_RESOURCE);
+
+  if (resource->context->release_userdata && resource->user_data)
+    resource->context->release_userdata(resource->user_data);
+
+  /* delete registered attributes */
+  LL_FOREACH_SAFE(resource->link_attr, attr, tmp) coap_delete_attr(attr);
+
+  /* Either the application provided or libcoap copied - need to delete it */
+  coap_delete_str_const(resource->uri_path);
+
+  /* free all elements from resource->subscribers */
+  LL_FOREACH_SAFE( resource->subscribers, obs, otmp ) {
+    coap_free_observer(obs);
+  }
+  if (resource->proxy_name_count && resource->proxy_name_list) {
+    for (i = 0; i < resource->proxy_name_count; i++) {
+      coap_delete_str_const(resource->proxy_name_list[i]);
+    }
+    coap_free_type(COAP_STRING, resource->proxy_name_list);
+  }
+  if (resource->file)
+    coap_file_res_free(resource->file);
+  for (i = 0; i < sizeof(resource->response_template) /
+                  sizeof(resource->response_template[0]); i++) {
+    coap_pdu_template_free(resource->response_template[i]);
+  }
+
+  coap_free_type(COAP_RESOURCE, resource);
+}
+
+/*
+ * Incoming requests are routed through a trie of Uri-Path segments, so that
+ * they can be matched straight from their options, and so that template
+ * resources can match whole families of paths.
+ */
+
+/* Gets the next '/' separated segment of path, starting at *pos */
+static int
+coap_uri_next_segment(const coap_str_const_t *path, size_t *pos,
+                      coap_str_const_t *seg) {
+  size_t end;
+
+  if (path->length == 0 || *pos > path->length)
+    return 0;
+  for (end = *pos; end < path->length && path->s[end] != '/'; end++)
+    ;
+  seg->s = &path->s[*pos];
+  seg->length = end - *pos;
+  *pos = end + 1;
+  return 1;
+}
+
+static int
+coap_uri_is_param(const coap_str_const_t *seg) {
+  return seg->length >= 2 && seg->s[0] == '{' && seg->s[seg->length-1] == '}';
+}
+
+static int
+coap_uri_is_prefix(const coap_str_const_t *path, size_t pos,
+                   const coap_str_const_t *seg) {
+  return seg->length == 1 && seg->s[0] == '*' && pos > path->length;
 }
 
-typedef enum coap_deleting_resource_t {
-  COAP_DELETING_RESOURCE,
-  COAP_NOT_DELETING_RESOURCE
-} coap_deleting_resource_t;
+static int
+coap_uri_hex(uint8_t c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
 
-static void coap_notify_observers(coap_context_t *context, coap_resource_t *r,
-                                  coap_deleting_resource_t deleting);
+/* The longest a Uri-Path option can be */
+#define COAP_URI_SEGMENT_MAX 255
 
-static void
-coap_free_resource(coap_resource_t *resource) {
-  coap_attr_t *attr, *tmp;
-  coap_subscription_t *obs, *otmp;
+/*
+ * Percent-decodes seg into key (which must be COAP_URI_SEGMENT_MAX bytes), as
+ * that is how the segment will turn up in a Uri-Path option. Returns the
+ * decoded length, or -1 if it is too long to ever match.
+ */
+static ssize_t
+coap_uri_decode_segment(const coap_str_const_t *seg, uint8_t *key) {
+  size_t i;
+  size_t len = 0;
+
+  for (i = 0; i < seg->length; i++) {
+    if (len == COAP_URI_SEGMENT_MAX)
+      return -1;
+    if (seg->s[i] == '%' && i + 2 < seg->length &&
+        coap_uri_hex(seg->s[i+1]) >= 0 && coap_uri_hex(seg->s[i+2]) >= 0) {
+      key[len++] = (uint8_t)(coap_uri_hex(seg->s[i+1]) << 4 |
+                             coap_uri_hex(seg->s[i+2]));
+      i += 2;
+    } else {
+      key[len++] = seg->s[i];
+    }
+  }
+  return len;
+}
 
-  assert(resource);
+static coap_uri_node_t *
+coap_uri_node_new(const uint8_t *key, size_t length) {
+  coap_uri_node_t *node;
 
-  coap_resource_notify_observers(resource, NULL);
-  coap_notify_observers(resource->context, resource, COAP_DELETING_RESOURCE);
+  node = coap_malloc_type(COAP_STRING, sizeof(coap_uri_node_t) + length);
+  if (node) {
+    memset(node, 0, sizeof(coap_uri_node_t));
+    if (length)
+      memcpy(node->seg, key, length);
+    node->seg_length = length;
+  }
+  return node;
+}
 
-  if (resource->context->release_userdata && resource->user_data)
-    resource->context->release_userdata(resource->user_data);
+static void
+coap_uri_node_free(coap_uri_node_t *node) {
+  coap_uri_node_t *child, *tmp;
 
-  /* delete registered attributes */
-  LL_FOREACH_SAFE(resource->link_attr, attr, tmp) coap_delete_attr(attr);
+  HASH_ITER(hh, node->children, child, tmp) {
+    HASH_DELETE(hh, node->children, child);
+    coap_uri_node_free(child);
+  }
+  if (node->param)
+    coap_uri_node_free(node->param);
+  coap_free_type(COAP_STRING, node);
+}
 
-  /* Either the application provided or libcoap copied - need to delete it */
-  coap_delete_str_const(resource->uri_path);
+static int
+coap_uri_node_empty(const coap_uri_node_t *node) {
+  return !node->children && !node->param && !node->resource && !node->prefix;
+}
 
-  /* free all elements from resource->subscribers */
-  LL_FOREACH_SAFE( resource->subscribers, obs, otmp ) {
-    coap_session_release( obs->session );
-    coap_delete_pdu(obs->pdu);
-    coap_delete_cache_key(obs->cache_key);
-    coap_free_type(COAP_SUBSCRIPTION, obs);
+static int
+coap_resource_trie_add(coap_context_t *context, coap_resource_t *resource) {
+  const coap_str_const_t *path = resource->uri_path;
+  coap_str_const_t seg;
+  coap_uri_node_t *node;
+  coap_uri_node_t *child;
+  coap_resource_t **slot;
+  uint8_t key[COAP_URI_SEGMENT_MAX];
+  ssize_t key_len;
+  size_t pos = 0;
+
+  if (!context->resource_trie) {
+    context->resource_trie = coap_uri_node_new(NULL, 0);
+    if (!context->resource_trie)
+      return 0;
   }
-  if (resource->proxy_name_count && resource->proxy_name_list) {
-    size_t i;
+  node = context->resource_trie;
+  slot = &node->resource;
+  while (coap_uri_next_segment(path, &pos, &seg)) {
+    if (resource->is_template && coap_uri_is_prefix(path, pos, &seg)) {
+      slot = &node->prefix;
+      break;
+    }
+    if (resource->is_template && coap_uri_is_param(&seg)) {
+      if (!node->param) {
+        node->param = coap_uri_node_new(NULL, 0);
+        if (!node->param)
+          return 0;
+      }
+      node = node->param;
+    } else {
+      key_len = coap_uri_decode_segment(&seg, key);
+      if (key_len < 0)
+        return 0;
+      HASH_FIND(hh, node->children, key, key_len, child);
+      if (!child) {
+        child = coap_uri_node_new(key, key_len);
+        if (!child)
+          return 0;
+        HASH_ADD(hh, node->children, seg[0], child->seg_length, child);
+      }
+      node = child;
+    }
+    slot = &node->resource;
+  }
+  if (*slot && *slot != resource) {
+    coap_log_warn("coap_add_resource: '%*.*s' now handles requests for '%*.*s'\n",
+                  (int)path->length, (int)path->length, path->s,
+                  (int)(*slot)->uri_path->length,
+                  (int)(*slot)->uri_path->length, (*slot)->uri_path->s);
+  }
+  *slot = resource;
+  return 1;
+}
 
-    for (i = 0; i < resource->proxy_name_count; i++) {
-      coap_delete_str_const(resource->proxy_name_list[i]);
+static void
+coap_uri_node_remove(coap_uri_node_t *node, const coap_resource_t *resource,
+                     size_t pos) {
+  const coap_str_const_t *path = resource->uri_path;
+  coap_str_const_t seg;
+  coap_uri_node_t *child;
+  uint8_t key[COAP_URI_SEGMENT_MAX];
+  ssize_t key_len;
+
+  if (!coap_uri_next_segment(path, &pos, &seg)) {
+    if (node->resource == resource)
+      node->resource = NULL;
+    return;
+  }
+  if (resource->is_template && coap_uri_is_prefix(path, pos, &seg)) {
+    if (node->prefix == resource)
+      node->prefix = NULL;
+    return;
+  }
+  if (resource->is_template && coap_uri_is_param(&seg)) {
+    if (node->param) {
+      coap_uri_node_remove(node->param, resource, pos);
+      if (coap_uri_node_empty(node->param)) {
+        coap_uri_node_free(node->param);
+        node->param = NULL;
+      }
+    }
+    return;
+  }
+  key_len = coap_uri_decode_segment(&seg, key);
+  if (key_len < 0)
+    return;
+  HASH_FIND(hh, node->children, key, key_len, child);
+  if (child) {
+    coap_uri_node_remove(child, resource, pos);
+    if (coap_uri_node_empty(child)) {
+      HASH_DELETE(hh, node->children, child);
+      coap_uri_node_free(child);
     }
-    coap_free_type(COAP_STRING, resource->proxy_name_list);
   }
+}
 
-  coap_free_type(COAP_RESOURCE, resource);
+static coap_resource_t *
+coap_uri_node_match(const coap_uri_node_t *node,
+                    const coap_opt_iterator_t *opt_iter) {
+  coap_opt_iterator_t next = *opt_iter;
+  coap_opt_t *opt = coap_option_next(&next);
+  coap_uri_node_t *child;
+  coap_resource_t *r;
+
+  if (!opt)
+    return node->resource ? node->resource : node->prefix;
+  HASH_FIND(hh, node->children, coap_opt_value(opt), coap_opt_length(opt),
+            child);
+  if (child && (r = coap_uri_node_match(child, &next)) != NULL)
+    return r;
+  if (node->param && (r = coap_uri_node_match(node->param, &next)) != NULL)
+    return r;
+  return node->prefix;
+}
+
+coap_resource_t *
+coap_resource_match(coap_context_t *context, const coap_pdu_t *pdu) {
+  coap_opt_filter_t filter;
+  coap_opt_iterator_t opt_iter;
+
+  if (!context->resource_trie)
+    return NULL;
+  coap_option_filter_clear(&filter);
+  coap_option_filter_set(&filter, COAP_OPTION_URI_PATH);
+  coap_option_iterator_init(pdu, &opt_iter, &filter);
+  return coap_uri_node_match(context->resource_trie, &opt_iter);
+}
+
+int
+coap_resource_get_uri_param(const coap_resource_t *resource,
+                            const coap_pdu_t *request,
+                            const char *name,
+                            coap_str_const_t *value) {
+  coap_opt_filter_t filter;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *opt;
+  coap_str_const_t seg;
+  size_t name_len = strlen(name);
+  size_t pos = 0;
+
+  if (!resource->is_template)
+    return 0;
+  coap_option_filter_clear(&filter);
+  coap_option_filter_set(&filter, COAP_OPTION_URI_PATH);
+  coap_option_iterator_init(request, &opt_iter, &filter);
+  while (coap_uri_next_segment(resource->uri_path, &pos, &seg)) {
+    opt = coap_option_next(&opt_iter);
+    if (!opt)
+      break;
+    if (coap_uri_is_param(&seg) && seg.length == name_len + 2 &&
+        memcmp(&seg.s[1], name, name_len) == 0) {
+      value->s = coap_opt_value(opt);
+      value->length = coap_opt_length(opt);
+      return 1;
+    }
+  }
+  return 0;
 }
 
 void
@@ -524,6 +1611,12 @@ coap_add_resource(coap_context_t *context, coap_resource_t *resource) {
       coap_delete_resource(context, r);
     }
     RESOURCES_ADD(context->resources, resource);
+    coap_wkc_invalidate(context);
+    if (!coap_resource_trie_add(context, resource)) {
+      coap_log_warn("coap_add_resource: '%*.*s' cannot be routed to\n",
+                    (int)resource->uri_path->length,
+                    (int)resource->uri_path->length, resource->uri_path->s);
+    }
   }
   assert(resource->context == NULL);
   resource->context = context;
@@ -550,6 +1643,9 @@ coap_delete_resource(coap_context_t *context, coap_resource_t *resource) {
   } else if (context) {
     /* remove resource from list */
     RESOURCES_DELETE(context->resources, resource);
+    coap_wkc_invalidate(context);
+    if (context->resource_trie)
+      coap_uri_node_remove(context->resource_trie, resource, 0);
   }
 
   /* and free its allocated memory */
@@ -572,6 +1668,11 @@ coap_delete_all_resources(coap_context_t *context) {
   }
 
   context->resources = NULL;
+  coap_wkc_invalidate(context);
+  if (context->resource_trie) {
+    coap_uri_node_free(context->resource_trie);
+    context->resource_trie = NULL;
+  }
 
   if (context->unknown_resource) {
     coap_free_resource(context->unknown_resource);
@@ -668,6 +1769,115 @@ coap_register_request_handler(coap_resource_t *resource,
   resource->handler[method-1] = handler;
 }
 
+int
+coap_resource_set_response_template(coap_resource_t *resource,
+                                    coap_request_t method,
+                                    const coap_pdu_t *response) {
+  coap_pdu_template_t *tmpl = NULL;
+
+  assert(resource);
+  assert(method > 0 && (size_t)(method-1) <
+         sizeof(resource->response_template)/sizeof(coap_pdu_template_t *));
+  if (response) {
+    if (!COAP_PDU_IS_RESPONSE(response)) {
+      coap_log_warn("coap_resource_set_response_template: "
+                    "PDU is not a response\n");
+      return 0;
+    }
+    tmpl = coap_pdu_template_new(response);
+    if (!tmpl)
+      return 0;
+  }
+  coap_pdu_template_free(resource->response_template[method-1]);
+  resource->response_template[method-1] = tmpl;
+  return 1;
+}
+
+void
+coap_resource_set_block1_sink(coap_resource_t *resource,
+                              coap_block1_sink_t sink) {
+  assert(resource);
+  resource->block1_sink = sink;
+}
+
+/* FNV-1a hash of the subscriber's session and token */
+static uint64_t
+coap_observer_hkey(const coap_session_t *session,
+                   const coap_bin_const_t *token) {
+  const uint8_t *p = (const uint8_t *)&session;
+  uint64_t hkey = 0xcbf29ce484222325ULL;
+  size_t i;
+
+  for (i = 0; i < sizeof(session); i++)
+    hkey = (hkey ^ p[i]) * 0x100000001b3ULL;
+  for (i = 0; i < token->length; i++)
+    hkey = (hkey ^ token->s[i]) * 0x100000001b3ULL;
+  return hkey;
+}
+
+/*
+ * A subscription is on the resource's subscribers list, in the resource's
+ * subscriber_hash, on the session's subscriptions list and subscription_keys
+ * hash and, if its notify key can be derived, in the resource's notify group
+ * for that key.
+ */
+static void
+coap_link_observer(coap_resource_t *resource, coap_session_t *session,
+                   coap_subscription_t *s) {
+  coap_cache_key_t *notify_key;
+  coap_notify_group_t *group;
+
+  s->resource = resource;
+  s->session = coap_session_reference(session);
+  s->hkey = coap_observer_hkey(session, &s->pdu->actual_token);
+  DL_PREPEND(resource->subscribers, s);
+  HASH_ADD(hh, resource->subscriber_hash, hkey, sizeof(s->hkey), s);
+  DL_PREPEND2(session->subscriptions, s, session_prev, session_next);
+  HASH_ADD_KEYPTR(hh_key, session->subscription_keys, s->cache_key,
+                  sizeof(coap_cache_key_t), s);
+
+  notify_key = coap_observer_notify_key(s);
+  if (!notify_key)
+    return;
+  HASH_FIND(hh, resource->notify_groups, notify_key, sizeof(group->key),
+            group);
+  if (!group) {
+    group = coap_malloc_type(COAP_STRING, sizeof(coap_notify_group_t));
+    if (!group)
+      return;
+    memset(group, 0, sizeof(coap_notify_group_t));
+    memcpy(&group->key, notify_key, sizeof(group->key));
+    HASH_ADD(hh, resource->notify_groups, key, sizeof(group->key), group);
+  }
+  DL_PREPEND2(group->subscribers, s, group_prev, group_next);
+  group->count++;
+  s->group = group;
+}
+
+static void
+coap_free_observer(coap_subscription_t *s) {
+  coap_resource_t *resource = s->resource;
+  coap_session_t *session = s->session;
+  coap_notify_group_t *group = s->group;
+
+  if (group) {
+    DL_DELETE2(group->subscribers, s, group_prev, group_next);
+    if (--group->count == 0) {
+      HASH_DELETE(hh, resource->notify_groups, group);
+      coap_free_type(COAP_STRING, group);
+    }
+  }
+  DL_DELETE(resource->subscribers, s);
+  HASH_DELETE(hh, resource->subscriber_hash, s);
+  DL_DELETE2(session->subscriptions, s, session_prev, session_next);
+  HASH_DELETE(hh_key, session->subscription_keys, s);
+  coap_session_release(session);
+  coap_delete_pdu(s->pdu);
+  coap_delete_cache_key(s->cache_key);
+  coap_delete_cache_key(s->notify_key);
+  coap_free_type(COAP_SUBSCRIPTION, s);
+}
+
 coap_subscription_t *
 coap_find_observer(coap_resource_t *resource, coap_session_t *session,
                      const coap_bin_const_t *token) {
@@ -676,8 +1886,20 @@ coap_find_observer(coap_resource_t *resource, coap_session_t *session,
   assert(resource);
   assert(session);
 
-  LL_FOREACH(resource->subscribers, s) {
+  if (token) {
+    uint64_t hkey = coap_observer_hkey(session, token);
+
+    HASH_FIND(hh, resource->subscriber_hash, &hkey, sizeof(hkey), s);
+    if (!s)
+      return NULL;
     if (s->session == session &&
+        coap_binary_equal(token, &s->pdu->actual_token))
+      return s;
+    /* Some other session and token hash to the same key */
+  }
+
+  DL_FOREACH2(session->subscriptions, s, session_next) {
+    if (s->resource == resource &&
         (!token || coap_binary_equal(token, &s->pdu->actual_token)))
       return s;
   }
@@ -693,12 +1915,10 @@ coap_find_observer_cache_key(coap_resource_t *resource, coap_session_t *session,
   assert(resource);
   assert(session);
 
-  LL_FOREACH(resource->subscribers, s) {
-    if (s->session == session
-        && (memcmp(cache_key, s->cache_key, sizeof(coap_cache_key_t)) == 0))
-      return s;
-  }
-
+  HASH_FIND(hh_key, session->subscription_keys, cache_key,
+            sizeof(coap_cache_key_t), s);
+  if (s && s->resource == resource)
+    return s;
   return NULL;
 }
 
@@ -746,9 +1966,7 @@ static const uint16_t cache_ignore_options[] = { COAP_OPTION_ETAG,
 
   /* Check if there is already maximum number of subscribers present */
 #if (COAP_RESOURCE_MAX_SUBSCRIBER > 0)
-  uint32_t subscriber_count = 0;
-  LL_COUNT(resource->subscribers, s, subscriber_count);
-  if (subscriber_count >= COAP_RESOURCE_MAX_SUBSCRIBER) {
+  if (HASH_COUNT(resource->subscriber_hash) >= COAP_RESOURCE_MAX_SUBSCRIBER) {
     return NULL; /* Signal error */
   }
 #endif /* COAP_RESOURCE_MAX_SUBSCRIBER */
@@ -787,10 +2005,9 @@ static const uint16_t cache_ignore_options[] = { COAP_OPTION_ETAG,
     }
   }
   s->cache_key = cache_key;
-  s->session = coap_session_reference(session);
 
   /* add subscriber to resource */
-  LL_PREPEND(resource->subscribers, s);
+  coap_link_observer(resource, session, s);
 
   coap_log_debug("create new subscription %p key 0x%02x%02x%02x%02x\n",
            (void*)s, s->cache_key->key[0], s->cache_key->key[1],
@@ -804,9 +2021,9 @@ coap_touch_observer(coap_context_t *context, coap_session_t *session,
                     const coap_bin_const_t *token) {
   coap_subscription_t *s;
 
-  RESOURCES_ITER(context->resources, r) {
-    s = coap_find_observer(r, session, token);
-    if (s) {
+  (void)context;
+  DL_FOREACH2(session->subscriptions, s, session_next) {
+    if (coap_binary_equal(token, &s->pdu->actual_token)) {
       s->fail_cnt = 0;
     }
   }
@@ -836,11 +2053,7 @@ coap_delete_observer(coap_resource_t *resource, coap_session_t *session,
   }
 
   if (resource->subscribers && s) {
-    LL_DELETE(resource->subscribers, s);
-    coap_session_release( session );
-    coap_delete_pdu(s->pdu);
-    coap_delete_cache_key(s->cache_key);
-    coap_free_type(COAP_SUBSCRIPTION, s);
+    coap_free_observer(s);
   }
 
   return s != NULL;
@@ -848,18 +2061,329 @@ coap_delete_observer(coap_resource_t *resource, coap_session_t *session,
 
 void
 coap_delete_observers(coap_context_t *context, coap_session_t *session) {
-  RESOURCES_ITER(context->resources, resource) {
-    coap_subscription_t *s, *tmp;
-    LL_FOREACH_SAFE(resource->subscribers, s, tmp) {
-      if (s->session == session) {
-        LL_DELETE(resource->subscribers, s);
-        coap_session_release(session);
-        coap_delete_pdu(s->pdu);
-        coap_delete_cache_key(s->cache_key);
-        coap_free_type(COAP_SUBSCRIPTION, s);
-      }
+  (void)context;
+  while (session->subscriptions) {
+    coap_free_observer(session->subscriptions);
+  }
+}
+
+/*
+ * A response built by the handler, kept so that it can be sent again without
+ * calling the handler. For a resource with
+ * COAP_RESOURCE_FLAGS_NOTIFY_ENCODE_ONCE set, a notification is kept for the
+ * duration of a coap_notify_observers() run for all the other observers with
+ * the same notify_key. For a resource with
+ * COAP_RESOURCE_FLAGS_CACHE_REPRESENTATION set, a GET or FETCH response is
+ * kept in the resource's reps until the resource changes.
+ */
+typedef struct coap_rep_body_t {
+  unsigned int ref;           /**< number of users of the body */
+  size_t length;              /**< length of data */
+  uint8_t data[1];            /**< the body */
+} coap_rep_body_t;
+
+struct coap_rep_t {
+  UT_hash_handle hh;
+  coap_cache_key_t key;       /**< key of the requests */
+  coap_pdu_t *pdu;            /**< code and options of the response */
+  coap_string_t *query;       /**< Uri-Query of the requests */
+  coap_rep_body_t *body;      /**< body of the response */
+  int large;                  /**< set if the body needs an lg_xmit */
+  uint16_t media_type;        /**< Content-Format (if large) */
+  int maxage;                 /**< Max-Age or -1 (if large) */
+  uint64_t etag;              /**< ETag (if large) */
+};
+
+static void
+rep_body_release(coap_session_t *session COAP_UNUSED, void *app_ptr) {
+  coap_rep_body_t *body = (coap_rep_body_t *)app_ptr;
+
+  if (--body->ref == 0)
+    coap_free_type(COAP_STRING, body);
+}
+
+coap_cache_key_t *
+coap_observer_notify_key(coap_subscription_t *obs) {
+  static const uint16_t ignore_options[] = { COAP_OPTION_ETAG,
+                                             COAP_OPTION_OSCORE,
+                                             COAP_OPTION_RTAG };
+
+  if (!obs->notify_key)
+    obs->notify_key = coap_cache_derive_key_w_ignore(obs->session, obs->pdu,
+                                                COAP_CACHE_NOT_SESSION_BASED,
+                                                ignore_options,
+                        sizeof(ignore_options)/sizeof(ignore_options[0]));
+  return obs->notify_key;
+}
+
+static coap_rep_t *
+rep_save(coap_rep_t **reps, const coap_cache_key_t *key,
+         coap_session_t *session, const coap_pdu_t *response,
+         const coap_string_t *query) {
+  coap_lg_xmit_t *lg_xmit = response->lg_xmit;
+  coap_rep_t *rep;
+  coap_opt_filter_t drop_options;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *opt;
+  const uint8_t *data = NULL;
+  size_t length = 0;
+
+  rep = coap_malloc_type(COAP_STRING, sizeof(coap_rep_t));
+  if (!rep)
+    return NULL;
+  memset(rep, 0, sizeof(coap_rep_t));
+  memcpy(&rep->key, key, sizeof(rep->key));
+  coap_option_filter_clear(&drop_options);
+  if (lg_xmit) {
+    /* Options that coap_add_data_large_response() adds back in */
+    rep->large = 1;
+    data = lg_xmit->data;
+    length = lg_xmit->length;
+    opt = coap_check_option(response, COAP_OPTION_CONTENT_FORMAT, &opt_iter);
+    rep->media_type = opt ? coap_decode_var_bytes(coap_opt_value(opt),
+                                                  coap_opt_length(opt)) :
+                            COAP_MEDIATYPE_TEXT_PLAIN;
+    opt = coap_check_option(response, COAP_OPTION_MAXAGE, &opt_iter);
+    rep->maxage = opt ? (int)coap_decode_var_bytes(coap_opt_value(opt),
+                                                   coap_opt_length(opt)) : -1;
+    rep->etag = lg_xmit->b.b2.etag;
+    coap_option_filter_set(&drop_options, COAP_OPTION_CONTENT_FORMAT);
+    coap_option_filter_set(&drop_options, COAP_OPTION_MAXAGE);
+    coap_option_filter_set(&drop_options, COAP_OPTION_ETAG);
+    coap_option_filter_set(&drop_options, COAP_OPTION_BLOCK2);
+    coap_option_filter_set(&drop_options, COAP_OPTION_Q_BLOCK2);
+    coap_option_filter_set(&drop_options, COAP_OPTION_SIZE2);
+  } else {
+    coap_get_data(response, &length, &data);
+  }
+  rep->pdu = coap_pdu_duplicate(response, session, 0, NULL, &drop_options);
+  rep->body = coap_malloc_type(COAP_STRING,
+                               sizeof(coap_rep_body_t) + length);
+  if (query)
+    rep->query = coap_new_string(query->length);
+  if (!rep->pdu || !rep->body || (query && !rep->query)) {
+    coap_delete_pdu(rep->pdu);
+    coap_free_type(COAP_STRING, rep->body);
+    coap_delete_string(rep->query);
+    coap_free_type(COAP_STRING, rep);
+    return NULL;
+  }
+  rep->body->ref = 1;
+  rep->body->length = length;
+  if (length)
+    memcpy(rep->body->data, data, length);
+  if (query)
+    memcpy(rep->query->s, query->s, query->length);
+  HASH_ADD(hh, *reps, key, sizeof(rep->key), rep);
+  return rep;
+}
+
+/*
+ * Build the response to request from rep, with token, type and mid. For a
+ * notification, the body starts again at block 0.  Returns the new
+ * response, or NULL if the handler needs to be called instead.
+ */
+static coap_pdu_t *
+rep_apply(coap_resource_t *r, coap_session_t *session,
+          const coap_pdu_t *request, coap_rep_t *rep,
+          const coap_bin_const_t *token, coap_pdu_type_t type,
+          coap_mid_t mid, int notify) {
+  coap_pdu_t *pdu;
+  coap_block_b_t block;
+  uint8_t buf[4];
+
+  pdu = coap_pdu_duplicate(rep->pdu, session, token->length, token->s, NULL);
+  if (!pdu)
+    return NULL;
+  pdu->type = type;
+  pdu->mid = mid;
+  if (!rep->large) {
+    if (rep->body->length &&
+        !coap_add_data(pdu, rep->body->length, rep->body->data)) {
+      /* Does not fit into this session's PDUs */
+      coap_delete_pdu(pdu);
+      return NULL;
+    }
+    return pdu;
+  }
+  if (notify &&
+      coap_get_block_b(session, request, COAP_OPTION_BLOCK2, &block)) {
+    coap_add_option_internal(pdu, COAP_OPTION_BLOCK2,
+                             coap_encode_var_safe(buf, sizeof(buf),
+                                                  block.aszx),
+                             buf);
+  }
+  rep->body->ref++;
+  coap_add_data_large_response(r, session, request, pdu, rep->query,
+                               rep->media_type, rep->maxage, rep->etag,
+                               rep->body->length, rep->body->data,
+                               rep_body_release, rep->body);
+  coap_check_code_lg_xmit(session, request, pdu, r, rep->query);
+  return pdu;
+}
+
+static void
+rep_free(coap_rep_t **reps, coap_rep_t *rep) {
+  HASH_DELETE(hh, *reps, rep);
+  coap_delete_pdu(rep->pdu);
+  coap_delete_string(rep->query);
+  rep_body_release(NULL, rep->body);
+  coap_free_type(COAP_STRING, rep);
+}
+
+static void
+reps_free(coap_rep_t **reps) {
+  coap_rep_t *rep, *rtmp;
+
+  HASH_ITER(hh, *reps, rep, rtmp) {
+    rep_free(reps, rep);
+  }
+}
+
+/* The session independent key of the representation request asks for */
+static coap_cache_key_t *
+rep_key(coap_session_t *session, const coap_pdu_t *request) {
+  /* The whole body is kept, any block of it can be sent */
+  static const uint16_t ignore_options[] = { COAP_OPTION_ETAG,
+                                             COAP_OPTION_BLOCK2,
+                                             COAP_OPTION_Q_BLOCK2,
+                                             COAP_OPTION_OSCORE,
+                                             COAP_OPTION_RTAG };
+
+  return coap_cache_derive_key_w_ignore(session, request,
+                                        COAP_CACHE_NOT_SESSION_BASED,
+                                        ignore_options,
+                        sizeof(ignore_options)/sizeof(ignore_options[0]));
+}
+
+/* Returns the ETag of rep in buf, or NULL if there is none */
+static const uint8_t *
+rep_etag(const coap_rep_t *rep, uint8_t buf[8], size_t *length) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *opt;
+
+  if (rep->large) {
+    *length = coap_encode_var_safe8(buf, 8, rep->etag);
+    return buf;
+  }
+  opt = coap_check_option(rep->pdu, COAP_OPTION_ETAG, &opt_iter);
+  if (!opt)
+    return NULL;
+  *length = coap_opt_length(opt);
+  return coap_opt_value(opt);
+}
+
+coap_pdu_t *
+coap_resource_rep_respond(coap_resource_t *resource, coap_session_t *session,
+                          const coap_pdu_t *request,
+                          const coap_pdu_t *response) {
+  coap_cache_key_t *key = rep_key(session, request);
+  coap_rep_t *rep;
+  coap_opt_filter_t etag_filter;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *opt;
+  const uint8_t *etag;
+  size_t etag_length = 0;
+  uint8_t buf[8];
+  coap_pdu_t *pdu;
+
+  if (!key)
+    return NULL;
+  HASH_FIND(hh, resource->reps, key, sizeof(rep->key), rep);
+  coap_delete_cache_key(key);
+  if (!rep)
+    return NULL;
+
+  /* Validation of an ETag the client already has */
+  etag = rep_etag(rep, buf, &etag_length);
+  coap_option_filter_clear(&etag_filter);
+  coap_option_filter_set(&etag_filter, COAP_OPTION_ETAG);
+  coap_option_iterator_init(request, &opt_iter, &etag_filter);
+  while (etag && (opt = coap_option_next(&opt_iter))) {
+    if (coap_opt_length(opt) != etag_length ||
+        memcmp(coap_opt_value(opt), etag, etag_length) != 0)
+      continue;
+    pdu = coap_pdu_init(response->type, COAP_RESPONSE_CODE(203),
+                        response->mid, coap_session_max_pdu_size(session));
+    if (!pdu || !coap_add_token(pdu, response->actual_token.length,
+                                response->actual_token.s)) {
+      coap_delete_pdu(pdu);
+      return NULL;
+    }
+    coap_add_option_internal(pdu, COAP_OPTION_ETAG, etag_length, etag);
+    if (rep->large) {
+      if (rep->maxage >= 0)
+        coap_add_option_internal(pdu, COAP_OPTION_MAXAGE,
+                                 coap_encode_var_safe(buf, sizeof(buf),
+                                                      rep->maxage),
+                                 buf);
+    } else if ((opt = coap_check_option(rep->pdu, COAP_OPTION_MAXAGE,
+                                        &opt_iter)) != NULL) {
+      coap_add_option_internal(pdu, COAP_OPTION_MAXAGE, coap_opt_length(opt),
+                               coap_opt_value(opt));
     }
+    return pdu;
+  }
+
+  /* A kept single PDU body cannot honour a requested block size */
+  if (!rep->large &&
+      (coap_check_option(request, COAP_OPTION_BLOCK2, &opt_iter) ||
+       coap_check_option(request, COAP_OPTION_Q_BLOCK2, &opt_iter)))
+    return NULL;
+  return rep_apply(resource, session, request, rep, &response->actual_token,
+                   response->type, response->mid, 0);
+}
+
+void
+coap_resource_rep_update(coap_resource_t *resource, coap_session_t *session,
+                         const coap_pdu_t *request,
+                         const coap_string_t *query, coap_pdu_t *response) {
+  coap_cache_key_t *key;
+  coap_rep_t *rep;
+  coap_opt_iterator_t opt_iter;
+
+  if (request->code != COAP_REQUEST_CODE_GET &&
+      request->code != COAP_REQUEST_CODE_FETCH) {
+    /* The resource may have changed */
+    if (COAP_RESPONSE_CLASS(response->code) == 2)
+      coap_resource_rep_invalidate(resource);
+    return;
   }
+  if (response->code != COAP_RESPONSE_CODE(205))
+    return;
+
+  if (!response->lg_xmit &&
+      !coap_check_option(response, COAP_OPTION_ETAG, &opt_iter)) {
+    /* Give the client something to validate with */
+    coap_key_t etag;
+    size_t length;
+    const uint8_t *data;
+
+    if (!coap_get_data(response, &length, &data))
+      length = 0;
+    memset(etag, 0, sizeof(etag));
+    coap_hash(data, length, etag);
+    coap_insert_option(response, COAP_OPTION_ETAG, sizeof(etag), etag);
+  }
+
+  key = rep_key(session, request);
+  if (!key)
+    return;
+  HASH_FIND(hh, resource->reps, key, sizeof(rep->key), rep);
+  if (rep)
+    rep_free(&resource->reps, rep);
+  else if (HASH_COUNT(resource->reps) >= COAP_RESOURCE_MAX_REPRESENTATIONS)
+    /* Make room by dropping the oldest */
+    rep_free(&resource->reps, resource->reps);
+  rep = rep_save(&resource->reps, key, session, response, query);
+  if (rep)
+    coap_remove_option(rep->pdu, COAP_OPTION_OBSERVE);
+  coap_delete_cache_key(key);
+}
+
+void
+coap_resource_rep_invalidate(coap_resource_t *resource) {
+  reps_free(&resource->reps);
 }
 
 static void
@@ -874,6 +2398,8 @@ coap_notify_observers(coap_context_t *context, coap_resource_t *r,
   coap_block_b_t block;
   coap_tick_t now;
   coap_session_t *obs_session;
+  coap_rep_t *reps = NULL;
+  int encode_once = (r->flags & COAP_RESOURCE_FLAGS_NOTIFY_ENCODE_ONCE) != 0;
 
   if (r->observable && (r->dirty || r->partiallydirty)) {
     r->partiallydirty = 0;
@@ -909,43 +2435,71 @@ coap_notify_observers(coap_context_t *context, coap_resource_t *r,
       }
 
       coap_mid_t mid = COAP_INVALID_MID;
-      obs->dirty = 0;
-      /* initialize response */
-      response = coap_pdu_init(COAP_MESSAGE_CON, 0, 0, coap_session_max_pdu_size(obs->session));
-      if (!response) {
-        obs->dirty = 1;
-        r->partiallydirty = 1;
-        context->observe_pending = 1;
-        coap_log_debug(
-                 "coap_check_notify: pdu init failed, resource stays "
-                 "partially dirty\n");
-        continue;
-      }
-
-      if (!coap_add_token(response, obs->pdu->actual_token.length,
-                          obs->pdu->actual_token.s)) {
-        obs->dirty = 1;
-        r->partiallydirty = 1;
-        context->observe_pending = 1;
-        coap_log_debug(
-                 "coap_check_notify: cannot add token, resource stays "
-                 "partially dirty\n");
-        coap_delete_pdu(response);
-        continue;
-      }
+      coap_pdu_type_t type;
+      int cached = 0;
 
-      obs->pdu->mid = response->mid = coap_new_message_id(obs->session);
+      obs->dirty = 0;
+      token = obs->pdu->actual_token;
+      obs->pdu->mid = coap_new_message_id(obs->session);
       /* A lot of the reliable code assumes type is CON */
       if (COAP_PROTO_NOT_RELIABLE(obs->session->proto) &&
           (r->flags & COAP_RESOURCE_FLAGS_NOTIFY_CON) == 0 &&
           ((r->flags & COAP_RESOURCE_FLAGS_NOTIFY_NON_ALWAYS) ||
            obs->non_cnt < COAP_OBS_MAX_NON)) {
-        response->type = COAP_MESSAGE_NON;
+        type = COAP_MESSAGE_NON;
       } else {
-        response->type = COAP_MESSAGE_CON;
+        type = COAP_MESSAGE_CON;
+      }
+      response = NULL;
+      if (deleting == COAP_NOT_DELETING_RESOURCE && encode_once && reps &&
+          coap_observer_notify_key(obs)) {
+        coap_rep_t *rep;
+
+        HASH_FIND(hh, reps, obs->notify_key, sizeof(rep->key), rep);
+        if (rep) {
+          /* Same representation as already built for another observer */
+          response = rep_apply(r, obs->session, obs->pdu, rep, &token, type,
+                               obs->pdu->mid, 1);
+          cached = response != NULL;
+        }
+      }
+      if (!response) {
+        /* initialize response */
+        response = coap_pdu_init(type, 0, obs->pdu->mid,
+                                 coap_session_max_pdu_size(obs->session));
+        if (!response) {
+          obs->dirty = 1;
+          r->partiallydirty = 1;
+          context->observe_pending = 1;
+          coap_log_debug(
+                   "coap_check_notify: pdu init failed, resource stays "
+                   "partially dirty\n");
+          continue;
+        }
+
+        if (!coap_add_token(response, token.length, token.s)) {
+          obs->dirty = 1;
+          r->partiallydirty = 1;
+          context->observe_pending = 1;
+          coap_log_debug(
+                   "coap_check_notify: cannot add token, resource stays "
+                   "partially dirty\n");
+          coap_delete_pdu(response);
+          continue;
+        }
       }
       switch (deleting) {
       case COAP_NOT_DELETING_RESOURCE:
+        if (cached) {
+          if (COAP_RESPONSE_CLASS(response->code) != 2) {
+            coap_remove_option(response, COAP_OPTION_OBSERVE);
+          }
+          if (COAP_RESPONSE_CLASS(response->code) > 2) {
+            coap_delete_observer(r, obs->session, &token);
+            obs = NULL;
+          }
+          break;
+        }
         /* fill with observer-specific data */
         coap_add_option_internal(response, COAP_OPTION_OBSERVE,
                                  coap_encode_var_safe(buf, sizeof (buf),
@@ -974,6 +2528,9 @@ coap_notify_observers(coap_context_t *context, coap_resource_t *r,
         h(r, obs->session, obs->pdu, query, response);
         /* Check if lg_xmit generated and update PDU code if so */
         coap_check_code_lg_xmit(obs->session, obs->pdu, response, r, query);
+        if (encode_once && COAP_RESPONSE_CLASS(response->code) == 2 &&
+            coap_observer_notify_key(obs))
+          rep_save(&reps, obs->notify_key, obs->session, response, query);
         coap_delete_string(query);
         if (COAP_RESPONSE_CLASS(response->code) != 2) {
           coap_remove_option(response, COAP_OPTION_OBSERVE);
@@ -1019,6 +2576,7 @@ coap_notify_observers(coap_context_t *context, coap_resource_t *r,
       }
     }
   }
+  reps_free(&reps);
   r->dirty = 0;
 }
 
@@ -1027,9 +2585,40 @@ coap_resource_set_dirty(coap_resource_t *r, const coap_string_t *query) {
   return coap_resource_notify_observers(r, query);
 }
 
+unsigned int
+coap_resource_observers_by_key(coap_resource_t *r,
+                               const coap_cache_key_t *notify_key,
+                               int notify) {
+  coap_notify_group_t *group;
+  coap_subscription_t *obs;
+
+  HASH_FIND(hh, r->notify_groups, notify_key, sizeof(group->key), group);
+  if (!group)
+    return 0;
+  if (!notify)
+    return group->count;
+  DL_FOREACH2(group->subscribers, obs, group_next) {
+    obs->dirty = 1;
+  }
+  if (!r->observable)
+    return group->count;
+
+  /* Only the flagged observers are sent the notification */
+  coap_resource_rep_invalidate(r);
+  r->partiallydirty = 1;
+  r->observe = (r->observe + 1) & 0xFFFFFF;
+  assert(r->context);
+  r->context->observe_pending = 1;
+#ifdef COAP_EPOLL_SUPPORT
+  coap_update_epoll_timer(r->context, 0);
+#endif /* COAP_EPOLL_SUPPORT */
+  return group->count;
+}
+
 int
 coap_resource_notify_observers(coap_resource_t *r,
                                const coap_string_t *query COAP_UNUSED) {
+  coap_resource_rep_invalidate(r);
   if (!r->observable)
     return 0;
   if ( !r->subscribers )
@@ -1072,6 +2661,8 @@ coap_resource_release_userdata_handler(coap_context_t *context,
 
 void
 coap_resource_set_get_observable(coap_resource_t *resource, int mode) {
+  if (resource->observable != (mode ? 1 : 0) && resource->context)
+    coap_wkc_invalidate(resource->context);
   resource->observable = mode ? 1 : 0;
 }
 
@@ -1090,50 +2681,38 @@ coap_check_notify(coap_context_t *context) {
     RESOURCES_ITER(context->resources, r) {
       coap_notify_observers(context, r, COAP_NOT_DELETING_RESOURCE);
     }
+    /* These can be observed when relaying observations as a proxy */
+    if (context->unknown_resource)
+      coap_notify_observers(context, context->unknown_resource,
+                            COAP_NOT_DELETING_RESOURCE);
+    if (context->proxy_uri_resource)
+      coap_notify_observers(context, context->proxy_uri_resource,
+                            COAP_NOT_DELETING_RESOURCE);
   }
 }
 
-/**
- * Checks the failure counter for (peer, token) and removes peer from
- * the list of observers for the given resource when COAP_OBS_MAX_FAIL
- * is reached.
- *
- * @param context  The CoAP context to use
- * @param resource The resource to check for (peer, token)
- * @param session  The observer's session
- * @param token    The token that has been used for subscription.
+/*
+ * Checks the failure counter for each of the session's subscriptions with
+ * token and removes the observer when COAP_OBS_MAX_FAIL is reached.
  */
-static void
-coap_remove_failed_observers(coap_context_t *context,
-                             coap_resource_t *resource,
-                             coap_session_t *session,
-                             const coap_bin_const_t *token) {
+void
+coap_handle_failed_notify(coap_context_t *context,
+                          coap_session_t *session,
+                          const coap_bin_const_t *token) {
   coap_subscription_t *obs, *otmp;
 
-  LL_FOREACH_SAFE(resource->subscribers, obs, otmp) {
-    if (obs->session == session &&
-        coap_binary_equal(token, &obs->pdu->actual_token)) {
+  DL_FOREACH_SAFE2(session->subscriptions, obs, otmp, session_next) {
+    if (coap_binary_equal(token, &obs->pdu->actual_token)) {
       /* count failed notifies and remove when
        * COAP_OBS_MAX_FAIL is reached */
       obs->fail_cnt++;
       if (obs->fail_cnt >= COAP_OBS_MAX_FAIL) {
         coap_cancel_all_messages(context, obs->session,
                                  &obs->pdu->actual_token);
-        coap_delete_observer(resource, session, token);
+        coap_delete_observer(obs->resource, session, token);
       }
-      break;                        /* break loop if observer was found */
     }
   }
 }
 
-void
-coap_handle_failed_notify(coap_context_t *context,
-                          coap_session_t *session,
-                          const coap_bin_const_t *token) {
-
-  RESOURCES_ITER(context->resources, r) {
-    coap_remove_failed_observers(context, r, session, token);
-  }
-}
-
 #endif /* ! COAP_SERVER_SUPPORT */
@@ -0,0 +1,343 @@
+/* libcoap unit tests
+ *
+ * Copyright (C) 2023 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "test_common.h"
+#include "test_address.h"
+
+#if !defined(WITH_CONTIKI) && !defined(WITH_LWIP)
+#include <stdio.h>
+
+static coap_context_t *ctx; /* Holds the coap context for most tests */
+
+/* The results given to resolved() */
+static struct {
+  int called;
+  uint16_t port;
+  int evict;
+} result[2];
+
+static coap_str_const_t *
+host(const char *name) {
+  static coap_str_const_t str;
+
+  str.s = (const uint8_t *)name;
+  str.length = strlen(name);
+  return &str;
+}
+
+static coap_resolve_entry_t *
+find_entry(const char *name) {
+  coap_resolve_entry_t *entry;
+
+  LL_FOREACH(ctx->resolve_cache, entry) {
+    if (strcmp(entry->host, name) == 0)
+      return entry;
+  }
+  return NULL;
+}
+
+static int
+cache_count(void) {
+  coap_resolve_entry_t *entry;
+  int count = 0;
+
+  LL_FOREACH(ctx->resolve_cache, entry) {
+    count++;
+  }
+  return count;
+}
+
+static void
+resolved(coap_context_t *context, coap_addr_info_t *info_list,
+         void *app_data) {
+  int i = (int)(intptr_t)app_data;
+  coap_addr_info_t *dummy;
+  char name[16];
+  int j;
+
+  result[i].called++;
+  result[i].port = info_list ? coap_address_get_port(&info_list->addr) : 0;
+  coap_free_address_info(info_list);
+  if (result[i].evict) {
+    /* Fill the cache with other hosts, evicting the one just resolved */
+    for (j = 1; j <= COAP_RESOLVE_CACHE_MAX; j++) {
+      snprintf(name, sizeof(name), "127.0.1.%d", j);
+      coap_resolve_address_info_cached(context, host(name), 5683, 5684, 0,
+                                       COAP_URI_SCHEME_COAP_BIT, NULL,
+                                       NULL, &dummy);
+      coap_free_address_info(dummy);
+    }
+  }
+}
+
+/* Runs the I/O loop until the pending lookups are done */
+static int
+wait_resolved(void) {
+  coap_resolve_entry_t *entry;
+  int i;
+
+  for (i = 0; i < 50; i++) {
+    LL_FOREACH(ctx->resolve_cache, entry) {
+      if (entry->resolving)
+        break;
+    }
+    if (!entry)
+      return 1;
+    coap_io_process(ctx, 100);
+  }
+  return 0;
+}
+
+/* IP literals are resolved at once, and held */
+static void
+t_resolve1(void) {
+  coap_addr_info_t *info_list;
+  coap_resolve_entry_t *entry;
+  coap_tick_t now;
+
+  coap_ticks(&now);
+  CU_ASSERT(coap_resolve_address_info_cached(ctx, host("127.0.0.1"), 5683,
+                                             5684, 0,
+                                             COAP_URI_SCHEME_COAP_BIT,
+                                             resolved, NULL,
+                                             &info_list) == 1);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(info_list);
+  CU_ASSERT(coap_address_get_port(&info_list->addr) == 5683);
+  CU_ASSERT_PTR_NULL(info_list->next);
+  coap_free_address_info(info_list);
+  /* Not handed to the worker thread */
+  CU_ASSERT(ctx->resolve_fd[0] == -1);
+  CU_ASSERT(result[0].called == 0);
+
+  entry = find_entry("127.0.0.1");
+  CU_ASSERT_PTR_NOT_NULL_FATAL(entry);
+  CU_ASSERT(entry->resolving == 0);
+  CU_ASSERT(entry->expire >= now + COAP_RESOLVE_CACHE_TTL *
+            COAP_TICKS_PER_SECOND);
+  CU_ASSERT(entry->expire <= now + (COAP_RESOLVE_CACHE_TTL + 1) *
+            COAP_TICKS_PER_SECOND);
+}
+
+/* Held hosts are found in the cache until they expire */
+static void
+t_resolve2(void) {
+  coap_addr_info_t *info_list;
+  coap_resolve_entry_t *entry = find_entry("127.0.0.1");
+  coap_tick_t now;
+
+  CU_ASSERT_PTR_NOT_NULL_FATAL(entry);
+  info_list = coap_context_resolve_address_info(ctx, host("127.0.0.1"),
+                                                5683, 5684, 0,
+                                                COAP_URI_SCHEME_COAP_BIT);
+  CU_ASSERT_PTR_NOT_NULL(info_list);
+  coap_free_address_info(info_list);
+  CU_ASSERT(find_entry("127.0.0.1") == entry);
+  CU_ASSERT(cache_count() == 1);
+
+  coap_ticks(&now);
+  entry->expire = now;
+  info_list = coap_context_resolve_address_info(ctx, host("127.0.0.1"),
+                                                5683, 5684, 0,
+                                                COAP_URI_SCHEME_COAP_BIT);
+  CU_ASSERT_PTR_NOT_NULL(info_list);
+  coap_free_address_info(info_list);
+  entry = find_entry("127.0.0.1");
+  CU_ASSERT_PTR_NOT_NULL_FATAL(entry);
+  CU_ASSERT(entry->expire > now);
+  CU_ASSERT(cache_count() == 1);
+}
+
+/* Names that cannot be resolved are held for a shorter time */
+static void
+t_resolve3(void) {
+  coap_addr_info_t *info_list;
+  coap_resolve_entry_t *entry;
+  coap_tick_t now;
+
+  coap_ticks(&now);
+  info_list = coap_context_resolve_address_info(ctx, host("libcoap.invalid"),
+                                                5683, 5684, 0,
+                                                COAP_URI_SCHEME_COAP_BIT);
+  CU_ASSERT_PTR_NULL(info_list);
+  entry = find_entry("libcoap.invalid");
+  CU_ASSERT_PTR_NOT_NULL_FATAL(entry);
+  CU_ASSERT_PTR_NULL(entry->info_list);
+  CU_ASSERT(entry->expire >= now + COAP_RESOLVE_CACHE_FAIL_TTL *
+            COAP_TICKS_PER_SECOND);
+  CU_ASSERT(entry->expire < now + COAP_RESOLVE_CACHE_TTL *
+            COAP_TICKS_PER_SECOND);
+
+  /* Held, so not looked up again */
+  CU_ASSERT(coap_resolve_address_info_cached(ctx, host("libcoap.invalid"),
+                                             5683, 5684, 0,
+                                             COAP_URI_SCHEME_COAP_BIT,
+                                             resolved, NULL,
+                                             &info_list) == 1);
+  CU_ASSERT_PTR_NULL(info_list);
+  CU_ASSERT(find_entry("libcoap.invalid") == entry);
+}
+
+/* Names are looked up by the worker thread, and each waiter called once */
+static void
+t_resolve4(void) {
+  coap_addr_info_t *info_list;
+
+  memset(result, 0, sizeof(result));
+  CU_ASSERT(coap_resolve_address_info_cached(ctx, host("localhost"), 5683,
+                                             5684, 0,
+                                             COAP_URI_SCHEME_COAP_BIT,
+                                             resolved, (void *)0,
+                                             &info_list) == 0);
+  CU_ASSERT(coap_resolve_address_info_cached(ctx, host("localhost"), 5683,
+                                             5684, 0,
+                                             COAP_URI_SCHEME_COAP_BIT,
+                                             resolved, (void *)0,
+                                             &info_list) == 0);
+  CU_ASSERT(coap_resolve_address_info_async(ctx, host("localhost"), 5683,
+                                            5684, 0, COAP_URI_SCHEME_COAP_BIT,
+                                            resolved, (void *)1) == 1);
+  CU_ASSERT(ctx->resolve_fd[0] != -1);
+  CU_ASSERT(result[0].called == 0);
+
+  CU_ASSERT(wait_resolved());
+  CU_ASSERT(result[0].called == 1);
+  CU_ASSERT(result[0].port == 5683);
+  CU_ASSERT(result[1].called == 1);
+  CU_ASSERT(result[1].port == 5683);
+
+  CU_ASSERT(coap_resolve_address_info_cached(ctx, host("localhost"), 5683,
+                                             5684, 0,
+                                             COAP_URI_SCHEME_COAP_BIT,
+                                             resolved, (void *)0,
+                                             &info_list) == 1);
+  CU_ASSERT_PTR_NOT_NULL(info_list);
+  coap_free_address_info(info_list);
+  CU_ASSERT(result[0].called == 1);
+}
+
+/* A handler evicting the host it was given does not affect other waiters */
+static void
+t_resolve5(void) {
+  coap_resolve_entry_t *entry;
+
+  memset(result, 0, sizeof(result));
+  entry = find_entry("localhost");
+  CU_ASSERT_PTR_NOT_NULL_FATAL(entry);
+  entry->expire = 0;
+  result[0].evict = 1;
+  CU_ASSERT(coap_resolve_address_info_async(ctx, host("localhost"), 5683,
+                                            5684, 0, COAP_URI_SCHEME_COAP_BIT,
+                                            resolved, (void *)0) == 1);
+  CU_ASSERT(coap_resolve_address_info_async(ctx, host("localhost"), 5683,
+                                            5684, 0, COAP_URI_SCHEME_COAP_BIT,
+                                            resolved, (void *)1) == 1);
+  CU_ASSERT(wait_resolved());
+  CU_ASSERT(result[0].called == 1);
+  CU_ASSERT(result[1].called == 1);
+  CU_ASSERT(result[1].port == 5683);
+  CU_ASSERT_PTR_NULL(find_entry("localhost"));
+  CU_ASSERT(cache_count() == COAP_RESOLVE_CACHE_MAX);
+  result[0].evict = 0;
+}
+
+/*
+ * Only so many names are looked up at a time, and those still being looked
+ * up when the cache is freed are abandoned.
+ */
+static void
+t_resolve6(void) {
+  coap_addr_info_t *info_list;
+  char name[32];
+  int i;
+
+  memset(result, 0, sizeof(result));
+  for (i = 0; i < COAP_RESOLVE_MAX_PENDING; i++) {
+    snprintf(name, sizeof(name), "host%d.libcoap.invalid", i);
+    CU_ASSERT(coap_resolve_address_info_cached(ctx, host(name), 5683, 5684,
+                                               0, COAP_URI_SCHEME_COAP_BIT,
+                                               resolved, (void *)0,
+                                               &info_list) == 0);
+  }
+  CU_ASSERT(coap_resolve_address_info_cached(ctx,
+                                             host("other.libcoap.invalid"),
+                                             5683, 5684, 0,
+                                             COAP_URI_SCHEME_COAP_BIT,
+                                             resolved, (void *)0,
+                                             &info_list) == -2);
+  CU_ASSERT(coap_resolve_address_info_async(ctx,
+                                            host("other.libcoap.invalid"),
+                                            5683, 5684, 0,
+                                            COAP_URI_SCHEME_COAP_BIT,
+                                            resolved, (void *)0) == 0);
+  CU_ASSERT_PTR_NULL(find_entry("other.libcoap.invalid"));
+  /* IP literals are not held up */
+  CU_ASSERT(coap_resolve_address_info_cached(ctx, host("::1"), 5683, 5684,
+                                             0, COAP_URI_SCHEME_COAP_BIT,
+                                             resolved, (void *)0,
+                                             &info_list) == 1);
+  coap_free_address_info(info_list);
+
+  coap_resolve_free(ctx);
+  CU_ASSERT_PTR_NULL(ctx->resolve_cache);
+  CU_ASSERT(ctx->resolve_fd[0] == -1);
+  CU_ASSERT(result[0].called == 0);
+
+  /* The worker carries on for the next context */
+  CU_ASSERT(coap_resolve_address_info_async(ctx,
+                                            host("other.libcoap.invalid"),
+                                            5683, 5684, 0,
+                                            COAP_URI_SCHEME_COAP_BIT,
+                                            resolved, (void *)0) == 1);
+  CU_ASSERT(wait_resolved());
+  CU_ASSERT(result[0].called == 1);
+  CU_ASSERT(result[0].port == 0);
+}
+
+static int
+t_address_tests_create(void) {
+  ctx = coap_new_context(NULL);
+  return ctx == NULL;
+}
+
+static int
+t_address_tests_remove(void) {
+  coap_free_context(ctx);
+  return 0;
+}
+
+CU_pSuite
+t_init_address_tests(void) {
+  CU_pSuite suite;
+
+  suite = CU_add_suite("address",
+                       t_address_tests_create, t_address_tests_remove);
+  if (!suite) {                        /* signal error */
+    fprintf(stderr, "W: cannot add address test suite (%s)\n",
+            CU_get_error_msg());
+
+    return NULL;
+  }
+
+#define ADDRESS_TEST(s,t)                                              \
+  if (!CU_ADD_TEST(s,t)) {                                              \
+    fprintf(stderr, "W: cannot add address test (%s)\n",              \
+            CU_get_error_msg());                                      \
+  }
+
+  ADDRESS_TEST(suite, t_resolve1);
+  ADDRESS_TEST(suite, t_resolve2);
+  ADDRESS_TEST(suite, t_resolve3);
+  ADDRESS_TEST(suite, t_resolve4);
+  ADDRESS_TEST(suite, t_resolve5);
+  ADDRESS_TEST(suite, t_resolve6);
+
+  return suite;
+}
+#endif /* ! WITH_CONTIKI && ! WITH_LWIP */
@@ -0,0 +1,938 @@
+/* libcoap unit tests
+ *
+ * Copyright (C) 2023 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "test_common.h"
+#include "test_block.h"
+
+#if COAP_SERVER_SUPPORT && COAP_CLIENT_SUPPORT && \
+    !defined(WITH_CONTIKI) && !defined(WITH_LWIP)
+#include <stdio.h>
+#include <unistd.h>
+
+static coap_context_t *server_ctx; /* Handles Block2 itself */
+static coap_context_t *q_ctx;      /* libcoap blocks, with Q-Block */
+static coap_context_t *plain_ctx;  /* libcoap blocks, without Q-Block */
+static coap_context_t *client_ctx;
+static coap_session_t *client;     /* client_ctx session to a server */
+static coap_address_t server_addr;
+static coap_address_t q_addr;
+static coap_address_t plain_addr;
+
+static uint8_t body[3000];         /* as it is for etag */
+static uint64_t etag;
+static uint32_t change_at;         /* block whose request changes the body */
+static unsigned int hits;          /* requests seen by the server */
+
+/* 25 blocks of 1024, so three payload sets */
+static uint8_t large[25 * 1024];
+static uint8_t put_body[sizeof(large)]; /* as PUT to q_ctx or plain_ctx */
+static size_t put_length;
+
+/* What the block1_sink of the sink resource was given */
+#define SINK_SZX 2                 /* 64 byte blocks */
+#define SINK_CHUNK (1 << (SINK_SZX + 4))
+static struct {
+  int calls;
+  int in_order;                    /* each part followed on from the last */
+  size_t length;                   /* of the body passed on so far */
+  size_t total;
+  int handled;                     /* calls of the PUT handler */
+  int handled_data;                /* of those, with data */
+  int abort_at;                    /* the call to fail, if not 0 */
+  int abort_ret;                   /* what is returned to fail it */
+  uint8_t data[sizeof(large)];
+} sink;
+
+/*
+ * A UDP relay between the client and q_ctx or plain_ctx that logs the
+ * packets going through it, and can drop one of them.
+ */
+#define RELAY_MTU 1500
+static int relay_fd = -1;
+static coap_address_t relay_addr;      /* what the client sends to */
+static coap_address_t peer_addr;       /* the client, as seen by the relay */
+static const coap_address_t *relay_to; /* the server */
+static uint16_t drop_option;           /* drop the first payload in block */
+static uint32_t drop_num;              /* drop_num of drop_option */
+
+typedef struct {
+  int from_server;
+  coap_pdu_type_t type;
+  coap_pdu_code_t code;
+  uint16_t option;                     /* first Block option found */
+  uint32_t count;                      /* number of the option */
+  uint32_t num[COAP_MAX_PAYLOADS];     /* block numbers in the option */
+  int dropped;
+} relayed_t;
+
+static relayed_t relayed[200];
+static size_t relayed_count;
+
+static struct {
+  int called;
+  int partial;                     /* COAP_EVENT_PARTIAL_BLOCK events */
+  coap_pdu_code_t code;
+  size_t offset;                   /* of the last data */
+  size_t length;                   /* of the last data */
+  size_t total;
+  uint8_t data[sizeof(large)];     /* each part at its offset */
+} result;
+
+/* Fills the body for etag */
+static void
+set_body(void) {
+  size_t i;
+
+  for (i = 0; i < sizeof(body); i++)
+    body[i] = (uint8_t)(i + etag);
+}
+
+/* Serves the body a block at a time, changing it when change_at is asked for */
+static void
+hnd_get(coap_resource_t *resource, coap_session_t *session,
+        const coap_pdu_t *request, const coap_string_t *query,
+        coap_pdu_t *response) {
+  coap_block_b_t block;
+  uint8_t buf[8];
+
+  (void)resource;
+  (void)query;
+  hits++;
+  if (change_at && coap_get_block_b(session, request, COAP_OPTION_BLOCK2,
+                                    &block) && block.num == change_at) {
+    change_at = 0;
+    etag++;
+    set_body();
+  }
+  coap_add_option(response, COAP_OPTION_ETAG,
+                  coap_encode_var_safe8(buf, sizeof(buf), etag), buf);
+  coap_add_data_blocked_response(request, response, COAP_MEDIATYPE_TEXT_PLAIN,
+                                 -1, sizeof(body), body);
+}
+
+static coap_response_t
+response_handler(coap_session_t *session, const coap_pdu_t *sent,
+                 const coap_pdu_t *received, const coap_mid_t id) {
+  size_t length;
+  size_t offset;
+  size_t total;
+  const uint8_t *data;
+
+  (void)session;
+  (void)sent;
+  (void)id;
+  result.called++;
+  result.code = coap_pdu_get_code(received);
+  if (coap_get_data_large(received, &length, &data, &offset, &total) &&
+      offset + length <= sizeof(result.data)) {
+    memcpy(&result.data[offset], data, length);
+    result.offset = offset;
+    result.length = length;
+    result.total = total;
+  }
+  return COAP_RESPONSE_OK;
+}
+
+static int
+event_handler(coap_session_t *session, const coap_event_t event) {
+  (void)session;
+  if (event == COAP_EVENT_PARTIAL_BLOCK)
+    result.partial++;
+  return 0;
+}
+
+/* Serves large */
+static void
+hnd_large_get(coap_resource_t *resource, coap_session_t *session,
+              const coap_pdu_t *request, const coap_string_t *query,
+              coap_pdu_t *response) {
+  coap_pdu_set_code(response, COAP_RESPONSE_CODE_CONTENT);
+  coap_add_data_large_response(resource, session, request, response, query,
+                               COAP_MEDIATYPE_TEXT_PLAIN, -1, 0,
+                               sizeof(large), large, NULL, NULL);
+}
+
+/* Keeps the body in put_body */
+static void
+hnd_large_put(coap_resource_t *resource, coap_session_t *session,
+              const coap_pdu_t *request, const coap_string_t *query,
+              coap_pdu_t *response) {
+  size_t length;
+  size_t offset;
+  size_t total;
+  const uint8_t *data;
+
+  (void)resource;
+  (void)session;
+  (void)query;
+  put_length = 0;
+  if (coap_get_data_large(request, &length, &data, &offset, &total) &&
+      offset == 0 && length <= sizeof(put_body)) {
+    memcpy(put_body, data, length);
+    put_length = length;
+  }
+  coap_pdu_set_code(response, COAP_RESPONSE_CODE_CHANGED);
+}
+
+static int
+block1_sink(coap_resource_t *resource, coap_session_t *session,
+            const coap_pdu_t *request, size_t offset, const uint8_t *data,
+            size_t length, size_t total) {
+  (void)resource;
+  (void)session;
+  (void)request;
+  if (++sink.calls == sink.abort_at)
+    return sink.abort_ret;
+  if (offset != sink.length || offset + length > sizeof(sink.data))
+    sink.in_order = 0;
+  else
+    memcpy(&sink.data[offset], data, length);
+  sink.length = offset + length;
+  sink.total = total;
+  return 1;
+}
+
+static void
+hnd_sink_put(coap_resource_t *resource, coap_session_t *session,
+             const coap_pdu_t *request, const coap_string_t *query,
+             coap_pdu_t *response) {
+  size_t length;
+  const uint8_t *data;
+
+  (void)resource;
+  (void)session;
+  (void)query;
+  sink.handled++;
+  if (coap_get_data(request, &length, &data))
+    sink.handled_data++;
+  coap_pdu_set_code(response, COAP_RESPONSE_CODE_CHANGED);
+}
+
+static void
+sink_reset(void) {
+  memset(&sink, 0, sizeof(sink));
+  sink.in_order = 1;
+}
+
+/*
+ * Logs the packet in data going through the relay.
+ * Returns 1 if it is to be dropped.
+ */
+static int
+log_relayed(const uint8_t *data, size_t length, int from_server) {
+  static const uint16_t options[] = {
+    COAP_OPTION_Q_BLOCK1, COAP_OPTION_Q_BLOCK2,
+    COAP_OPTION_BLOCK1, COAP_OPTION_BLOCK2
+  };
+  coap_pdu_t *pdu = coap_pdu_init(0, 0, 0, RELAY_MTU);
+  relayed_t *r;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_filter_t filter;
+  coap_opt_t *option;
+  size_t payload_length;
+  const uint8_t *payload;
+  size_t i;
+
+  if (!pdu)
+    return 0;
+  if (!coap_pdu_parse(COAP_PROTO_UDP, data, length, pdu) ||
+      relayed_count == sizeof(relayed) / sizeof(relayed[0])) {
+    coap_delete_pdu(pdu);
+    return 0;
+  }
+  r = &relayed[relayed_count++];
+  memset(r, 0, sizeof(*r));
+  r->from_server = from_server;
+  r->type = coap_pdu_get_type(pdu);
+  r->code = coap_pdu_get_code(pdu);
+  for (i = 0; i < sizeof(options) / sizeof(options[0]) && !r->count; i++) {
+    coap_option_filter_clear(&filter);
+    coap_option_filter_set(&filter, options[i]);
+    coap_option_iterator_init(pdu, &opt_iter, &filter);
+    while ((option = coap_option_next(&opt_iter)) &&
+           r->count < COAP_MAX_PAYLOADS) {
+      r->num[r->count++] = coap_decode_var_bytes(coap_opt_value(option),
+                                                 coap_opt_length(option)) >> 4;
+      r->option = options[i];
+    }
+  }
+  if (drop_option && r->option == drop_option && r->num[0] == drop_num &&
+      coap_get_data(pdu, &payload_length, &payload)) {
+    drop_option = 0;
+    r->dropped = 1;
+  }
+  coap_delete_pdu(pdu);
+  return r->dropped;
+}
+
+/* Passes on all the packets waiting at the relay */
+static void
+relay(void) {
+  uint8_t buf[RELAY_MTU];
+  coap_address_t from;
+  const coap_address_t *to;
+  ssize_t length;
+  int from_server;
+
+  if (relay_fd == -1)
+    return;
+  for (;;) {
+    coap_address_init(&from);
+    length = recvfrom(relay_fd, buf, sizeof(buf), MSG_DONTWAIT,
+                      &from.addr.sa, &from.size);
+    if (length <= 0)
+      return;
+    from_server = coap_address_equals(&from, relay_to);
+    if (!from_server)
+      coap_address_copy(&peer_addr, &from);
+    if (log_relayed(buf, (size_t)length, from_server))
+      continue;
+    to = from_server ? &peer_addr : relay_to;
+    sendto(relay_fd, buf, (size_t)length, 0, &to->addr.sa, to->size);
+  }
+}
+
+/* Runs the I/O loops until done is set, or for count goes */
+static void
+run_io(const int *done, int count) {
+  while (count-- && (!done || !*done)) {
+    coap_io_process(server_ctx, COAP_IO_NO_WAIT);
+    coap_io_process(q_ctx, COAP_IO_NO_WAIT);
+    coap_io_process(plain_ctx, COAP_IO_NO_WAIT);
+    relay();
+    coap_io_process(client_ctx, 10);
+    relay();
+  }
+}
+
+/* Sets up client to addr with block_mode */
+static void
+new_client(uint8_t block_mode, const coap_address_t *addr) {
+  coap_session_release(client);
+  coap_context_set_block_mode(client_ctx, block_mode);
+  client = coap_new_client_session(client_ctx, NULL, addr, COAP_PROTO_UDP);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(client);
+}
+
+/* Sends a request for path from client, with data if length is not 0 */
+static void
+send_request(coap_pdu_type_t type, coap_pdu_code_t code, const char *path,
+             const uint8_t *data, size_t length) {
+  coap_pdu_t *pdu;
+  uint8_t token[8];
+  size_t token_length;
+
+  memset(&result, 0, sizeof(result));
+  hits = 0;
+  put_length = 0;
+  relayed_count = 0;
+  pdu = coap_pdu_init(type, code, coap_new_message_id(client),
+                      coap_session_max_pdu_size(client));
+  CU_ASSERT_PTR_NOT_NULL_FATAL(pdu);
+  coap_session_new_token(client, &token_length, token);
+  coap_add_token(pdu, token_length, token);
+  coap_add_option(pdu, COAP_OPTION_URI_PATH, strlen(path),
+                  (const uint8_t *)path);
+  if (length)
+    CU_ASSERT_FATAL(coap_add_data_large_request(client, pdu, length, data,
+                                                NULL, NULL));
+  CU_ASSERT_FATAL(coap_send(client, pdu) != COAP_INVALID_MID);
+}
+
+/* Sets up client with block_mode, and sends a GET for path to server_ctx */
+static void
+send_get(uint8_t block_mode, const char *path) {
+  new_client(block_mode, &server_addr);
+  send_request(COAP_MESSAGE_CON, COAP_REQUEST_CODE_GET, path, NULL, 0);
+}
+
+/* Makes NON_TIMEOUT 500 ms for the client and server sessions */
+static void
+set_non_timeout(coap_context_t *server) {
+  coap_fixed_point_t timeout = { 0, 500 };
+  coap_session_t *session;
+  coap_session_t *rtmp;
+
+  coap_session_set_ack_timeout(client, timeout);
+  SESSIONS_ITER(server->endpoint->sessions, session, rtmp) {
+    coap_session_set_ack_timeout(session, timeout);
+  }
+}
+
+/* Returns the number of packets relayed from the client */
+static size_t
+relayed_requests(void) {
+  size_t count = 0;
+  size_t i;
+
+  for (i = 0; i < relayed_count; i++) {
+    if (!relayed[i].from_server)
+      count++;
+  }
+  return count;
+}
+
+/* Returns the index of the first packet relayed at or after i with code */
+static size_t
+find_relayed(size_t i, coap_pdu_code_t code) {
+  for (; i < relayed_count; i++) {
+    if (relayed[i].code == code)
+      return i;
+  }
+  return relayed_count;
+}
+
+/*
+ * Test 1 has the body change part way through a transfer, which is
+ * started again when the body is being re-assembled.
+ */
+static void
+t_block1(void) {
+  etag = 1;
+  set_body();
+  change_at = 1;
+  send_get(COAP_BLOCK_USE_LIBCOAP | COAP_BLOCK_SINGLE_BODY, "test");
+  run_io(&result.called, 200);
+
+  CU_ASSERT(result.called == 1);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CONTENT);
+  CU_ASSERT(result.partial == 0);
+  CU_ASSERT(result.offset == 0);
+  CU_ASSERT(result.length == sizeof(body));
+  CU_ASSERT(etag == 2);
+  CU_ASSERT(memcmp(result.data, body, sizeof(body)) == 0);
+  /* Blocks 0 and 1, then all of them again */
+  CU_ASSERT(hits > 2 + 2);
+}
+
+/*
+ * Test 2 has the body change part way through a transfer that is being
+ * streamed to the response handler, which is abandoned.
+ */
+static void
+t_block2(void) {
+  unsigned int seen;
+
+  etag = 1;
+  set_body();
+  change_at = 1;
+  send_get(COAP_BLOCK_USE_LIBCOAP | COAP_BLOCK_STREAM_BODY, "test");
+  run_io(&result.partial, 200);
+
+  CU_ASSERT(result.partial == 1);
+  /* Only the first block of the old body */
+  CU_ASSERT(result.called == 1);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CONTENT);
+  CU_ASSERT(result.offset == 0);
+  CU_ASSERT(result.length > 0 && result.length < sizeof(body));
+  CU_ASSERT(result.total > result.length);
+  CU_ASSERT(etag == 2);
+  CU_ASSERT_PTR_NULL(client->lg_crcv);
+
+  /* Not started again */
+  seen = hits;
+  run_io(NULL, 20);
+  CU_ASSERT(hits == seen);
+  CU_ASSERT(result.called == 1);
+}
+
+/*
+ * Test 3 has a body that does not change streamed to the response handler
+ * a part at a time.
+ */
+static void
+t_block3(void) {
+  size_t parts = 0;
+  size_t next = 0;
+
+  etag = 1;
+  set_body();
+  change_at = 0;
+  send_get(COAP_BLOCK_USE_LIBCOAP | COAP_BLOCK_STREAM_BODY, "test");
+  while (parts < 100 && next < sizeof(body)) {
+    int called = result.called;
+
+    run_io(NULL, 1);
+    if (result.called != called) {
+      CU_ASSERT(result.offset == next);
+      next = result.offset + result.length;
+    }
+    parts++;
+  }
+  CU_ASSERT(next == sizeof(body));
+  CU_ASSERT(result.total == sizeof(body));
+  CU_ASSERT(result.called > 1);
+  CU_ASSERT(result.partial == 0);
+  CU_ASSERT(memcmp(result.data, body, sizeof(body)) == 0);
+}
+
+/*
+ * Test 4 has a large body sent with Q-Block2 in payload sets of
+ * MAX_PAYLOADS NON responses, with a lost one being asked for again.
+ */
+static void
+t_block4(void) {
+  const uint8_t mode = COAP_BLOCK_USE_LIBCOAP | COAP_BLOCK_SINGLE_BODY |
+                       COAP_BLOCK_TRY_Q_BLOCK;
+  uint32_t i;
+  size_t j;
+
+  relay_to = &q_addr;
+  new_client(mode, &relay_addr);
+
+  /* Q-Block support is checked with a CON */
+  send_request(COAP_MESSAGE_NON, COAP_REQUEST_CODE_GET, "large", NULL, 0);
+  run_io(&result.called, 300);
+  CU_ASSERT_FATAL(result.called == 1);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CONTENT);
+  CU_ASSERT(result.length == sizeof(large));
+  CU_ASSERT(memcmp(result.data, large, sizeof(large)) == 0);
+  CU_ASSERT(relayed[0].type == COAP_MESSAGE_CON);
+  CU_ASSERT(relayed[0].option == COAP_OPTION_Q_BLOCK2);
+  CU_ASSERT(client->block_mode & COAP_BLOCK_HAS_Q_BLOCK);
+  set_non_timeout(q_ctx);
+
+  /* A payload set for each request */
+  send_request(COAP_MESSAGE_NON, COAP_REQUEST_CODE_GET, "large", NULL, 0);
+  run_io(&result.called, 300);
+  CU_ASSERT_FATAL(result.called == 1);
+  CU_ASSERT(result.length == sizeof(large));
+  CU_ASSERT(memcmp(result.data, large, sizeof(large)) == 0);
+  CU_ASSERT(relayed_requests() == 3);
+  CU_ASSERT_FATAL(relayed_count > COAP_MAX_PAYLOADS + 1);
+  CU_ASSERT(!relayed[0].from_server);
+  CU_ASSERT(relayed[0].type == COAP_MESSAGE_NON);
+  for (i = 0; i < COAP_MAX_PAYLOADS; i++) {
+    CU_ASSERT(relayed[i + 1].from_server);
+    CU_ASSERT(relayed[i + 1].type == COAP_MESSAGE_NON);
+    CU_ASSERT(relayed[i + 1].option == COAP_OPTION_Q_BLOCK2);
+    CU_ASSERT(relayed[i + 1].num[0] == i);
+  }
+  CU_ASSERT(!relayed[COAP_MAX_PAYLOADS + 1].from_server);
+  CU_ASSERT(relayed[COAP_MAX_PAYLOADS + 1].option == COAP_OPTION_Q_BLOCK2);
+  CU_ASSERT(relayed[COAP_MAX_PAYLOADS + 1].num[0] == COAP_MAX_PAYLOADS);
+
+  /* Block 3 is lost, and asked for on its own */
+  drop_option = COAP_OPTION_Q_BLOCK2;
+  drop_num = 3;
+  send_request(COAP_MESSAGE_NON, COAP_REQUEST_CODE_GET, "large", NULL, 0);
+  run_io(&result.called, 500);
+  CU_ASSERT_FATAL(result.called == 1);
+  CU_ASSERT(result.length == sizeof(large));
+  CU_ASSERT(memcmp(result.data, large, sizeof(large)) == 0);
+  for (j = 0; j < relayed_count && !relayed[j].dropped; j++)
+    ;
+  CU_ASSERT_FATAL(j < relayed_count);
+  for (j++; j < relayed_count && relayed[j].from_server; j++)
+    ;
+  CU_ASSERT_FATAL(j < relayed_count);
+  CU_ASSERT(relayed[j].option == COAP_OPTION_Q_BLOCK2);
+  CU_ASSERT(relayed[j].count == 1);
+  CU_ASSERT(relayed[j].num[0] == 3);
+}
+
+/*
+ * Test 5 has a large body sent with Q-Block1 in payload sets of
+ * MAX_PAYLOADS NON requests, each set being answered by a 2.31 (Continue),
+ * and a lost one being asked for again by a 4.08.
+ */
+static void
+t_block5(void) {
+  const uint8_t mode = COAP_BLOCK_USE_LIBCOAP | COAP_BLOCK_SINGLE_BODY |
+                       COAP_BLOCK_TRY_Q_BLOCK;
+  uint32_t i;
+  size_t j;
+
+  relay_to = &q_addr;
+  new_client(mode, &relay_addr);
+
+  /* Q-Block support is checked with a CON */
+  send_request(COAP_MESSAGE_NON, COAP_REQUEST_CODE_PUT, "large", large,
+               sizeof(large));
+  run_io(&result.called, 300);
+  CU_ASSERT_FATAL(result.called == 1);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CHANGED);
+  CU_ASSERT(put_length == sizeof(large));
+  CU_ASSERT(memcmp(put_body, large, sizeof(large)) == 0);
+  CU_ASSERT(relayed[0].type == COAP_MESSAGE_CON);
+  CU_ASSERT(relayed[0].option == COAP_OPTION_Q_BLOCK1);
+  CU_ASSERT(client->block_mode & COAP_BLOCK_HAS_Q_BLOCK);
+  set_non_timeout(q_ctx);
+
+  /* Payload sets, each answered by a Continue */
+  send_request(COAP_MESSAGE_NON, COAP_REQUEST_CODE_PUT, "large", large,
+               sizeof(large));
+  run_io(&result.called, 300);
+  CU_ASSERT_FATAL(result.called == 1);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CHANGED);
+  CU_ASSERT(put_length == sizeof(large));
+  CU_ASSERT(memcmp(put_body, large, sizeof(large)) == 0);
+  CU_ASSERT(relayed_requests() == sizeof(large) / 1024);
+  CU_ASSERT_FATAL(relayed_count > COAP_MAX_PAYLOADS);
+  for (i = 0; i < COAP_MAX_PAYLOADS; i++) {
+    CU_ASSERT(!relayed[i].from_server);
+    CU_ASSERT(relayed[i].type == COAP_MESSAGE_NON);
+    CU_ASSERT(relayed[i].option == COAP_OPTION_Q_BLOCK1);
+    CU_ASSERT(relayed[i].num[0] == i);
+  }
+  j = find_relayed(0, COAP_RESPONSE_CODE(231));
+  CU_ASSERT_FATAL(j == COAP_MAX_PAYLOADS);
+  CU_ASSERT(relayed[j].option == COAP_OPTION_Q_BLOCK1);
+  CU_ASSERT(relayed[j].num[0] == COAP_MAX_PAYLOADS - 1);
+  CU_ASSERT(!relayed[j + 1].from_server);
+  CU_ASSERT(relayed[j + 1].num[0] == COAP_MAX_PAYLOADS);
+  j = find_relayed(j + 1, COAP_RESPONSE_CODE(231));
+  CU_ASSERT(j < relayed_count);
+  CU_ASSERT(find_relayed(0, COAP_RESPONSE_CODE(408)) == relayed_count);
+
+  /* Block 4 is lost, and asked for by a 4.08 */
+  drop_option = COAP_OPTION_Q_BLOCK1;
+  drop_num = 4;
+  send_request(COAP_MESSAGE_NON, COAP_REQUEST_CODE_PUT, "large", large,
+               sizeof(large));
+  run_io(&result.called, 800);
+  CU_ASSERT_FATAL(result.called == 1);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CHANGED);
+  CU_ASSERT(put_length == sizeof(large));
+  CU_ASSERT(memcmp(put_body, large, sizeof(large)) == 0);
+  CU_ASSERT(relayed[4].dropped);
+  j = find_relayed(0, COAP_RESPONSE_CODE(408));
+  CU_ASSERT_FATAL(j < relayed_count);
+  CU_ASSERT(relayed[j].from_server);
+  for (j++; j < relayed_count && relayed[j].from_server; j++)
+    ;
+  CU_ASSERT_FATAL(j < relayed_count);
+  CU_ASSERT(relayed[j].option == COAP_OPTION_Q_BLOCK1);
+  CU_ASSERT(relayed[j].num[0] == 4);
+}
+
+/*
+ * Test 6 has a peer that does not know Q-Block answer with 4.02 (Bad
+ * Option), the body being sent with Block1, and later Block2.
+ */
+static void
+t_block6(void) {
+  const uint8_t mode = COAP_BLOCK_USE_LIBCOAP | COAP_BLOCK_SINGLE_BODY |
+                       COAP_BLOCK_TRY_Q_BLOCK;
+  size_t j;
+
+  relay_to = &plain_addr;
+  new_client(mode, &relay_addr);
+
+  send_request(COAP_MESSAGE_CON, COAP_REQUEST_CODE_PUT, "large", large,
+               sizeof(large));
+  run_io(&result.called, 300);
+  CU_ASSERT_FATAL(result.called == 1);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CHANGED);
+  CU_ASSERT(put_length == sizeof(large));
+  CU_ASSERT(memcmp(put_body, large, sizeof(large)) == 0);
+  CU_ASSERT(relayed[0].option == COAP_OPTION_Q_BLOCK1);
+  CU_ASSERT(relayed[1].code == COAP_RESPONSE_CODE_BAD_OPTION);
+  for (j = 2; j < relayed_count; j++) {
+    if (!relayed[j].from_server)
+      CU_ASSERT(relayed[j].option == COAP_OPTION_BLOCK1);
+  }
+  CU_ASSERT(client->block_mode & COAP_BLOCK_NOT_Q_BLOCK);
+
+  /* No longer tried */
+  send_request(COAP_MESSAGE_CON, COAP_REQUEST_CODE_GET, "large", NULL, 0);
+  run_io(&result.called, 300);
+  CU_ASSERT_FATAL(result.called == 1);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CONTENT);
+  CU_ASSERT(result.length == sizeof(large));
+  CU_ASSERT(memcmp(result.data, large, sizeof(large)) == 0);
+  CU_ASSERT(find_relayed(0, COAP_RESPONSE_CODE_BAD_OPTION) == relayed_count);
+  for (j = 0; j < relayed_count; j++) {
+    CU_ASSERT(relayed[j].option != COAP_OPTION_Q_BLOCK1 &&
+              relayed[j].option != COAP_OPTION_Q_BLOCK2);
+  }
+}
+
+/*
+ * Test 7 has a peer that does not know Q-Block answer a GET with 4.02 (Bad
+ * Option), the body being asked for again with Block2.
+ */
+static void
+t_block7(void) {
+  const uint8_t mode = COAP_BLOCK_USE_LIBCOAP | COAP_BLOCK_SINGLE_BODY |
+                       COAP_BLOCK_TRY_Q_BLOCK;
+  size_t j;
+
+  relay_to = &plain_addr;
+  new_client(mode, &relay_addr);
+
+  send_request(COAP_MESSAGE_NON, COAP_REQUEST_CODE_GET, "large", NULL, 0);
+  run_io(&result.called, 300);
+  CU_ASSERT_FATAL(result.called == 1);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CONTENT);
+  CU_ASSERT(result.length == sizeof(large));
+  CU_ASSERT(memcmp(result.data, large, sizeof(large)) == 0);
+  CU_ASSERT(relayed[0].option == COAP_OPTION_Q_BLOCK2);
+  CU_ASSERT(relayed[1].code == COAP_RESPONSE_CODE_BAD_OPTION);
+  CU_ASSERT(client->block_mode & COAP_BLOCK_NOT_Q_BLOCK);
+  for (j = 2; j < relayed_count; j++) {
+    CU_ASSERT(relayed[j].option != COAP_OPTION_Q_BLOCK1 &&
+              relayed[j].option != COAP_OPTION_Q_BLOCK2);
+  }
+}
+
+/*
+ * Test 8 has the body of a Block1 PUT passed to the block1_sink in order,
+ * and the request handler called without it.
+ */
+static void
+t_block8(void) {
+  new_client(COAP_BLOCK_USE_LIBCOAP, &plain_addr);
+  sink_reset();
+  send_request(COAP_MESSAGE_CON, COAP_REQUEST_CODE_PUT, "sink", large,
+               sizeof(large));
+  run_io(&result.called, 300);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CHANGED);
+  CU_ASSERT(sink.in_order);
+  CU_ASSERT(sink.calls == (int)((sizeof(large) + 1023) / 1024));
+  CU_ASSERT(sink.length == sizeof(large));
+  CU_ASSERT(sink.total == sizeof(large));
+  CU_ASSERT(memcmp(sink.data, large, sizeof(large)) == 0);
+  CU_ASSERT(sink.handled == 1);
+  CU_ASSERT(sink.handled_data == 0);
+  CU_ASSERT(put_length == 0);
+}
+
+/*
+ * Sends Q-Block1 block num of large (taken to be of length total) to the
+ * sink resource as it is, running the I/O loops for up to count goes for the
+ * response.
+ */
+static void
+send_sink_block(uint32_t num, size_t total, int count) {
+  coap_pdu_t *pdu;
+  size_t offset = (size_t)num * SINK_CHUNK;
+  size_t length = total - offset < SINK_CHUNK ? total - offset : SINK_CHUNK;
+  uint8_t buf[4];
+  uint8_t token[8];
+  size_t token_length;
+
+  memset(&result, 0, sizeof(result));
+  pdu = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_CODE_PUT,
+                      coap_new_message_id(client),
+                      coap_session_max_pdu_size(client));
+  CU_ASSERT_PTR_NOT_NULL_FATAL(pdu);
+  coap_session_new_token(client, &token_length, token);
+  coap_add_token(pdu, token_length, token);
+  coap_add_option(pdu, COAP_OPTION_URI_PATH, 4, (const uint8_t *)"sink");
+  coap_add_option(pdu, COAP_OPTION_Q_BLOCK1,
+                  coap_encode_var_safe(buf, sizeof(buf),
+                                       (num << 4) |
+                                       ((offset + length < total) << 3) |
+                                       SINK_SZX), buf);
+  coap_add_option(pdu, COAP_OPTION_SIZE1,
+                  coap_encode_var_safe(buf, sizeof(buf), (unsigned int)total),
+                  buf);
+  coap_add_data(pdu, length, &large[offset]);
+  CU_ASSERT_FATAL(coap_send(client, pdu) != COAP_INVALID_MID);
+  run_io(&result.called, count);
+}
+
+/*
+ * Test 9 has Q-Block1 blocks sent out of order held back from the
+ * block1_sink until those before them come in, the last (short) block
+ * included, but not a block too far ahead to be held back.
+ */
+static void
+t_block9(void) {
+  static const uint32_t order[] = { 0, 3, 2, 4 };
+  const size_t total = 5 * SINK_CHUNK + 10;
+  size_t i;
+
+  /* Blocks are sent as they are, all without a Request-Tag */
+  new_client(COAP_BLOCK_USE_LIBCOAP | COAP_BLOCK_TRY_Q_BLOCK |
+             COAP_BLOCK_NO_PREEMPTIVE_RTAG, &q_addr);
+  sink_reset();
+  for (i = 0; i < sizeof(order) / sizeof(order[0]); i++) {
+    send_sink_block(order[i], total, 300);
+    CU_ASSERT(result.code == COAP_RESPONSE_CODE(231));
+  }
+  /* The last block is only acknowledged while the body is not all in */
+  send_sink_block(5, total, 20);
+  CU_ASSERT(result.called == 0);
+  /* Only block 0 can be passed on, the rest waiting for block 1 */
+  CU_ASSERT(sink.calls == 1);
+  CU_ASSERT(sink.length == SINK_CHUNK);
+
+  send_sink_block(1, total, 300);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CHANGED);
+  CU_ASSERT(sink.in_order);
+  CU_ASSERT(sink.calls == 6);
+  CU_ASSERT(sink.length == total);
+  CU_ASSERT(memcmp(sink.data, large, total) == 0);
+  CU_ASSERT(sink.handled == 1);
+  CU_ASSERT(sink.handled_data == 0);
+
+  /* Block 1 is wanted, so COAP_BLOCK1_SINK_WINDOW blocks on is too far */
+  sink_reset();
+  send_sink_block(0, sizeof(large), 300);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE(231));
+  send_sink_block(COAP_BLOCK1_SINK_WINDOW, sizeof(large), 300);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE(231));
+  send_sink_block(COAP_BLOCK1_SINK_WINDOW + 1, sizeof(large), 300);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_INCOMPLETE);
+  CU_ASSERT(sink.calls == 1);
+  CU_ASSERT(sink.handled == 0);
+}
+
+/*
+ * Test 10 has the block1_sink abort the transfer, returning 0 or -1, which
+ * is answered with 5.00 without the request handler being called.
+ */
+static void
+t_block10(void) {
+  static const int aborts[] = { 0, -1 };
+  size_t i;
+
+  for (i = 0; i < sizeof(aborts) / sizeof(aborts[0]); i++) {
+    new_client(COAP_BLOCK_USE_LIBCOAP, &plain_addr);
+    sink_reset();
+    sink.abort_at = 3;
+    sink.abort_ret = aborts[i];
+    send_request(COAP_MESSAGE_CON, COAP_REQUEST_CODE_PUT, "sink", large,
+                 sizeof(large));
+    run_io(&result.called, 300);
+    CU_ASSERT(result.called == 1);
+    CU_ASSERT(result.code == COAP_RESPONSE_CODE_INTERNAL_ERROR);
+    CU_ASSERT(sink.calls == 3);
+    CU_ASSERT(sink.length == 2 * 1024);
+    CU_ASSERT(sink.handled == 0);
+  }
+}
+
+/* Returns a context with a UDP endpoint on the loopback address in addr */
+static coap_context_t *
+new_server(uint8_t block_mode, coap_address_t *addr) {
+  coap_context_t *ctx = coap_new_context(NULL);
+  coap_endpoint_t *ep;
+
+  if (!ctx)
+    return NULL;
+  coap_address_init(addr);
+  addr->size = sizeof(struct sockaddr_in);
+  addr->addr.sin.sin_family = AF_INET;
+  addr->addr.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  ep = coap_new_endpoint(ctx, addr, COAP_PROTO_UDP);
+  if (!ep) {
+    coap_free_context(ctx);
+    return NULL;
+  }
+  coap_address_copy(addr, &ep->bind_addr);
+  coap_context_set_block_mode(ctx, block_mode);
+  return ctx;
+}
+
+/* Adds the large resource to ctx */
+static void
+add_large(coap_context_t *ctx) {
+  coap_resource_t *r;
+
+  r = coap_resource_init(coap_make_str_const("large"), 0);
+  coap_register_handler(r, COAP_REQUEST_GET, hnd_large_get);
+  coap_register_handler(r, COAP_REQUEST_PUT, hnd_large_put);
+  coap_add_resource(ctx, r);
+}
+
+static int
+t_block_tests_create(void) {
+  coap_resource_t *r;
+  socklen_t size;
+  size_t i;
+
+  server_ctx = new_server(0, &server_addr);
+  q_ctx = new_server(COAP_BLOCK_USE_LIBCOAP | COAP_BLOCK_SINGLE_BODY |
+                     COAP_BLOCK_TRY_Q_BLOCK, &q_addr);
+  plain_ctx = new_server(COAP_BLOCK_USE_LIBCOAP | COAP_BLOCK_SINGLE_BODY,
+                         &plain_addr);
+  client_ctx = coap_new_context(NULL);
+  if (!server_ctx || !q_ctx || !plain_ctx || !client_ctx)
+    return 1;
+
+  r = coap_resource_init(coap_make_str_const("test"), 0);
+  coap_register_handler(r, COAP_REQUEST_GET, hnd_get);
+  coap_add_resource(server_ctx, r);
+  for (i = 0; i < sizeof(large); i++)
+    large[i] = (uint8_t)(i / 1024 + i);
+  add_large(q_ctx);
+  add_large(plain_ctx);
+  r = coap_resource_init(coap_make_str_const("sink"), 0);
+  coap_register_handler(r, COAP_REQUEST_PUT, hnd_sink_put);
+  coap_resource_set_block1_sink(r, block1_sink);
+  coap_add_resource(plain_ctx, r);
+  r = coap_resource_init(coap_make_str_const("sink"), 0);
+  coap_register_handler(r, COAP_REQUEST_PUT, hnd_sink_put);
+  coap_resource_set_block1_sink(r, block1_sink);
+  coap_add_resource(q_ctx, r);
+
+  relay_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (relay_fd == -1)
+    return 1;
+  coap_address_copy(&relay_addr, &server_addr);
+  coap_address_set_port(&relay_addr, 0);
+  size = relay_addr.size;
+  if (bind(relay_fd, &relay_addr.addr.sa, relay_addr.size) == -1 ||
+      getsockname(relay_fd, &relay_addr.addr.sa, &size) == -1)
+    return 1;
+
+  coap_register_response_handler(client_ctx, response_handler);
+  coap_register_event_handler(client_ctx, event_handler);
+  return 0;
+}
+
+static int
+t_block_tests_remove(void) {
+  coap_session_release(client);
+  coap_free_context(client_ctx);
+  coap_free_context(plain_ctx);
+  coap_free_context(q_ctx);
+  coap_free_context(server_ctx);
+  if (relay_fd != -1)
+    close(relay_fd);
+  return 0;
+}
+
+CU_pSuite
+t_init_block_tests(void) {
+  CU_pSuite suite;
+
+  suite = CU_add_suite("block", t_block_tests_create, t_block_tests_remove);
+  if (!suite) {                        /* signal error */
+    fprintf(stderr, "W: cannot add block test suite (%s)\n",
+            CU_get_error_msg());
+
+    return NULL;
+  }
+
+#define BLOCK_TEST(s,t)                                                 \
+  if (!CU_ADD_TEST(s,t)) {                                              \
+    fprintf(stderr, "W: cannot add block test (%s)\n",                  \
+            CU_get_error_msg());                                        \
+  }
+
+  BLOCK_TEST(suite, t_block1);
+  BLOCK_TEST(suite, t_block2);
+  BLOCK_TEST(suite, t_block3);
+  BLOCK_TEST(suite, t_block4);
+  BLOCK_TEST(suite, t_block5);
+  BLOCK_TEST(suite, t_block6);
+  BLOCK_TEST(suite, t_block7);
+  BLOCK_TEST(suite, t_block8);
+  BLOCK_TEST(suite, t_block9);
+  BLOCK_TEST(suite, t_block10);
+
+  return suite;
+}
+#endif /* COAP_SERVER_SUPPORT && COAP_CLIENT_SUPPORT &&
+          ! WITH_CONTIKI && ! WITH_LWIP */
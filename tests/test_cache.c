@@ -0,0 +1,479 @@
+/* libcoap unit tests
+ *
+ * Copyright (C) 2023 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "test_common.h"
+#include "test_cache.h"
+
+#if COAP_SERVER_SUPPORT && COAP_CLIENT_SUPPORT
+#include <assert.h>
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Can be raised to use the suite as a benchmark */
+#ifndef TEST_CACHE_KEY_ROUNDS
+#define TEST_CACHE_KEY_ROUNDS 10000
+#endif /* TEST_CACHE_KEY_ROUNDS */
+
+static coap_context_t *ctx;       /* Holds the coap context for all tests */
+static coap_session_t *session;
+
+static coap_pdu_t *
+request(const char *path, const char *query) {
+  coap_pdu_t *pdu;
+
+  pdu = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_CODE_GET, 0, 128);
+  if (!pdu)
+    return NULL;
+  coap_add_option(pdu, COAP_OPTION_URI_PATH, strlen(path),
+                  (const uint8_t *)path);
+  if (query)
+    coap_add_option(pdu, COAP_OPTION_URI_QUERY, strlen(query),
+                    (const uint8_t *)query);
+  return pdu;
+}
+
+static void
+t_cache_siphash(void) {
+  /* Test vectors of the SipHash reference implementation, with the key
+   * 00 01 .. 0f and the message 00 01 .. */
+  static const uint8_t expect64_15[8] = {
+    0xe5, 0x45, 0xbe, 0x49, 0x61, 0xca, 0x29, 0xa1
+  };
+  static const uint8_t expect64_0[8] = {
+    0x31, 0x0e, 0x0e, 0xdd, 0x47, 0xdb, 0x6f, 0x72
+  };
+  static const uint8_t expect128_0[16] = {
+    0xa3, 0x81, 0x7f, 0x04, 0xba, 0x25, 0xa8, 0xe6,
+    0x6d, 0xf6, 0x72, 0x14, 0xc7, 0x55, 0x02, 0x93
+  };
+  coap_siphash_t state;
+  uint8_t key[16];
+  uint8_t data[15];
+  uint8_t out[16];
+  size_t i;
+
+  for (i = 0; i < sizeof(key); i++)
+    key[i] = (uint8_t)i;
+  for (i = 0; i < sizeof(data); i++)
+    data[i] = (uint8_t)i;
+
+  coap_siphash_init(&state, key, 8);
+  coap_siphash_update(&state, data, sizeof(data));
+  coap_siphash_final(&state, out);
+  CU_ASSERT(memcmp(out, expect64_15, sizeof(expect64_15)) == 0);
+
+  /* The result does not depend on how the data is split up */
+  coap_siphash_init(&state, key, 8);
+  coap_siphash_update(&state, data, 3);
+  coap_siphash_update(&state, data + 3, 0);
+  coap_siphash_update(&state, data + 3, 1);
+  coap_siphash_update(&state, data + 4, 11);
+  coap_siphash_final(&state, out);
+  CU_ASSERT(memcmp(out, expect64_15, sizeof(expect64_15)) == 0);
+
+  coap_siphash_init(&state, key, 8);
+  coap_siphash_final(&state, out);
+  CU_ASSERT(memcmp(out, expect64_0, sizeof(expect64_0)) == 0);
+
+  coap_siphash_init(&state, key, 16);
+  coap_siphash_final(&state, out);
+  CU_ASSERT(memcmp(out, expect128_0, sizeof(expect128_0)) == 0);
+}
+
+static void
+check_keys(void) {
+  coap_pdu_t *a = request("sensors", "id=1");
+  coap_pdu_t *b = request("sensors", "id=1");
+  coap_pdu_t *c = request("sensors", "id=2");
+  coap_cache_key_t *ka, *kb, *kc, *ks;
+
+  CU_ASSERT_PTR_NOT_NULL_FATAL(a);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(b);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(c);
+  ka = coap_cache_derive_key(session, a, COAP_CACHE_NOT_SESSION_BASED);
+  kb = coap_cache_derive_key(session, b, COAP_CACHE_NOT_SESSION_BASED);
+  kc = coap_cache_derive_key(session, c, COAP_CACHE_NOT_SESSION_BASED);
+  ks = coap_cache_derive_key(session, a, COAP_CACHE_IS_SESSION_BASED);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(ka);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(kb);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(kc);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(ks);
+  CU_ASSERT(memcmp(ka, kb, sizeof(*ka)) == 0);
+  CU_ASSERT(memcmp(ka, kc, sizeof(*ka)) != 0);
+  CU_ASSERT(memcmp(ka, ks, sizeof(*ka)) != 0);
+
+  /* An entry is found again from an equal request */
+  CU_ASSERT_PTR_NOT_NULL(coap_new_cache_entry(session, a,
+                                              COAP_CACHE_NOT_RECORD_PDU,
+                                              COAP_CACHE_NOT_SESSION_BASED,
+                                              0));
+  CU_ASSERT(coap_cache_get_by_pdu(session, b,
+                                  COAP_CACHE_NOT_SESSION_BASED) ==
+            coap_cache_get_by_key(ctx, ka));
+  CU_ASSERT_PTR_NOT_NULL(coap_cache_get_by_key(ctx, ka));
+  CU_ASSERT_PTR_NULL(coap_cache_get_by_pdu(session, c,
+                                           COAP_CACHE_NOT_SESSION_BASED));
+  coap_delete_cache_entry(ctx, coap_cache_get_by_key(ctx, ka));
+
+  coap_delete_cache_key(ka);
+  coap_delete_cache_key(kb);
+  coap_delete_cache_key(kc);
+  coap_delete_cache_key(ks);
+  coap_delete_pdu(a);
+  coap_delete_pdu(b);
+  coap_delete_pdu(c);
+}
+
+static void
+t_cache_key_digest(void) {
+  CU_ASSERT(coap_cache_set_key_hash(ctx, COAP_CACHE_KEY_HASH_DIGEST) == 1);
+  check_keys();
+}
+
+static void
+t_cache_key_siphash(void) {
+  CU_ASSERT(coap_cache_set_key_hash(ctx, COAP_CACHE_KEY_HASH_SIPHASH) == 1);
+  check_keys();
+  CU_ASSERT(coap_cache_set_key_hash(ctx, COAP_CACHE_KEY_HASH_DIGEST) == 1);
+}
+
+static coap_pdu_t *
+response(unsigned int max_age, size_t length) {
+  coap_pdu_t *pdu;
+  uint8_t buf[4];
+  uint8_t data[256];
+
+  pdu = coap_pdu_init(COAP_MESSAGE_ACK, COAP_RESPONSE_CODE(205), 0,
+                      length + 16);
+  if (!pdu)
+    return NULL;
+  coap_add_option(pdu, COAP_OPTION_MAXAGE,
+                  coap_encode_var_safe(buf, sizeof(buf), max_age), buf);
+  memset(data, 'x', sizeof(data));
+  coap_add_data(pdu, length, data);
+  return pdu;
+}
+
+static coap_cache_entry_t *
+add_entry(const char *query, unsigned int max_age) {
+  coap_pdu_t *req = request("r", query);
+  coap_pdu_t *rsp = response(max_age, 200);
+  coap_cache_entry_t *entry;
+
+  entry = coap_cache_add_response(session, req, rsp,
+                                  COAP_CACHE_NOT_SESSION_BASED);
+  coap_delete_pdu(req);
+  coap_delete_pdu(rsp);
+  return entry;
+}
+
+static coap_cache_entry_t *
+get_entry(const char *query) {
+  coap_pdu_t *req = request("r", query);
+  coap_cache_entry_t *entry;
+
+  entry = coap_cache_get_by_pdu(session, req, COAP_CACHE_NOT_SESSION_BASED);
+  coap_delete_pdu(req);
+  return entry;
+}
+
+static void
+t_cache_response(void) {
+  coap_cache_stats_t before, after;
+  coap_cache_entry_t *entry;
+
+  coap_cache_get_stats(ctx, &before);
+  CU_ASSERT_PTR_NULL(add_entry("a", 0));
+  entry = add_entry("a", 30);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(entry);
+  CU_ASSERT(coap_cache_get_max_age(entry) == 29 ||
+            coap_cache_get_max_age(entry) == 30);
+  CU_ASSERT(get_entry("a") == entry);
+  CU_ASSERT(coap_pdu_get_code(coap_cache_get_pdu(entry)) ==
+            COAP_RESPONSE_CODE(205));
+
+  /* A newer response replaces it */
+  entry = add_entry("a", 10);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(entry);
+  CU_ASSERT(get_entry("a") == entry);
+  CU_ASSERT(coap_cache_get_max_age(entry) <= 10);
+
+  /* No longer fresh */
+  entry->expire_ticks = 1;
+  CU_ASSERT_PTR_NULL(get_entry("a"));
+  CU_ASSERT_PTR_NULL(get_entry("b"));
+
+  coap_cache_get_stats(ctx, &after);
+  CU_ASSERT(after.hits - before.hits == 2);
+  CU_ASSERT(after.misses - before.misses == 2);
+  CU_ASSERT(after.expirations - before.expirations == 1);
+  CU_ASSERT(after.entries == before.entries);
+  CU_ASSERT(after.size == before.size);
+}
+
+static void
+t_cache_lru(void) {
+  coap_cache_stats_t before, after;
+  coap_cache_entry_t *a, *b, *c;
+
+  a = add_entry("a", 60);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(a);
+  coap_cache_get_stats(ctx, &before);
+  /* Room for two such entries */
+  coap_cache_set_max_size(ctx, before.size * 2 + before.size / 2);
+  b = add_entry("b", 60);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(b);
+  /* Using a makes b the least recently used */
+  CU_ASSERT(get_entry("a") == a);
+  c = add_entry("c", 60);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(c);
+  CU_ASSERT(get_entry("a") == a);
+  CU_ASSERT_PTR_NULL(get_entry("b"));
+  CU_ASSERT(get_entry("c") == c);
+
+  coap_cache_get_stats(ctx, &after);
+  CU_ASSERT(after.evictions - before.evictions == 1);
+  CU_ASSERT(after.entries == 2);
+  CU_ASSERT(after.size == before.size * 2);
+
+  /* An entry that can never fit is refused */
+  coap_cache_set_max_size(ctx, before.size / 2);
+  coap_cache_get_stats(ctx, &after);
+  CU_ASSERT(after.entries == 0);
+  CU_ASSERT(after.size == 0);
+  CU_ASSERT_PTR_NULL(add_entry("a", 60));
+  coap_cache_set_max_size(ctx, 0);
+}
+
+static void
+check_expiry_heap(void) {
+  size_t i;
+
+  for (i = 0; i < ctx->cache_expiry_count; i++) {
+    CU_ASSERT(ctx->cache_expiry[i]->heap_index == i + 1);
+    if (i > 0)
+      CU_ASSERT(ctx->cache_expiry[(i - 1) / 2]->expire_ticks <=
+                ctx->cache_expiry[i]->expire_ticks);
+  }
+}
+
+static void
+t_cache_expiry(void) {
+  coap_cache_entry_t *entry[20];
+  coap_cache_stats_t stats;
+  char query[8];
+  unsigned int i;
+
+  for (i = 0; i < 20; i++) {
+    snprintf(query, sizeof(query), "e%u", i);
+    entry[i] = add_entry(query, (i * 7) % 20 + 100);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(entry[i]);
+  }
+  CU_ASSERT(ctx->cache_expiry_count == 20);
+  check_expiry_heap();
+  CU_ASSERT(ctx->cache_expiry[0] == entry[0]);
+  for (i = 0; i < 20; i += 3)
+    coap_delete_cache_entry(ctx, entry[i]);
+  check_expiry_heap();
+  coap_expire_cache_entries(ctx);
+  coap_cache_get_stats(ctx, &stats);
+  CU_ASSERT(stats.entries == 13);
+  for (i = 0; i < 20; i++) {
+    if (i % 3)
+      coap_delete_cache_entry(ctx, entry[i]);
+  }
+  CU_ASSERT(ctx->cache_expiry_count == 0);
+}
+
+static coap_pdu_t *
+flight_request(coap_pdu_code_t code, uint8_t token) {
+  coap_pdu_t *pdu;
+
+  pdu = coap_pdu_init(COAP_MESSAGE_CON, code, token, 128);
+  if (!pdu)
+    return NULL;
+  coap_add_token(pdu, 1, &token);
+  coap_add_option(pdu, COAP_OPTION_URI_PATH, 6, (const uint8_t *)"flight");
+  return pdu;
+}
+
+static void
+t_cache_flight(void) {
+  coap_resource_t *r;
+  coap_pdu_t *req[5];
+  coap_pdu_t *post;
+  coap_pdu_t *rsp;
+  coap_cache_key_t *key;
+  coap_cache_stats_t before, after;
+  coap_bin_const_t token;
+  uint8_t t;
+  size_t i;
+
+  if (!coap_async_is_supported()) {
+    CU_PASS("async not supported");
+    return;
+  }
+  r = coap_resource_init(coap_make_str_const("flight"), 0);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+  coap_add_resource(ctx, r);
+  for (i = 0; i < 5; i++) {
+    req[i] = flight_request(COAP_REQUEST_CODE_GET, (uint8_t)(i + 1));
+    CU_ASSERT_PTR_NOT_NULL_FATAL(req[i]);
+  }
+  key = coap_cache_derive_key(session, req[0], COAP_CACHE_NOT_SESSION_BASED);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(key);
+  coap_cache_get_stats(ctx, &before);
+
+  /* The first request leads, identical ones are parked */
+  CU_ASSERT(coap_cache_flight_join(session, req[0], key) ==
+            COAP_CACHE_FLIGHT_LEADER);
+  CU_ASSERT(coap_cache_flight_join(session, req[1], key) ==
+            COAP_CACHE_FLIGHT_PARKED);
+  CU_ASSERT(coap_cache_flight_join(session, req[2], key) ==
+            COAP_CACHE_FLIGHT_PARKED);
+  /* Already parked, or not safe to coalesce */
+  CU_ASSERT(coap_cache_flight_join(session, req[1], key) ==
+            COAP_CACHE_FLIGHT_NONE);
+  post = flight_request(COAP_REQUEST_CODE_POST, 9);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(post);
+  CU_ASSERT(coap_cache_flight_join(session, post, key) ==
+            COAP_CACHE_FLIGHT_NONE);
+  coap_delete_pdu(post);
+
+  /* The fetched response answers the parked requests */
+  rsp = response(30, 100);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(rsp);
+  CU_ASSERT(coap_cache_flight_complete(r, key, rsp) == 2);
+  CU_ASSERT(coap_cache_flight_complete(r, key, rsp) == 0);
+  for (t = 2; t <= 3; t++) {
+    token.length = 1;
+    token.s = &t;
+    CU_ASSERT_PTR_NULL(coap_find_async(session, token));
+  }
+  coap_cache_get_stats(ctx, &after);
+  CU_ASSERT(after.coalesced == before.coalesced + 2);
+
+  /* A failed fetch passes the parked requests back to the handler */
+  CU_ASSERT(coap_cache_flight_join(session, req[3], key) ==
+            COAP_CACHE_FLIGHT_LEADER);
+  CU_ASSERT(coap_cache_flight_join(session, req[4], key) ==
+            COAP_CACHE_FLIGHT_PARKED);
+  CU_ASSERT(coap_cache_flight_complete(r, key, NULL) == 1);
+  t = 5;
+  token.length = 1;
+  token.s = &t;
+  CU_ASSERT_PTR_NOT_NULL(coap_find_async(session, token));
+  coap_free_async(session, coap_find_async(session, token));
+  coap_cache_get_stats(ctx, &after);
+  CU_ASSERT(after.coalesced == before.coalesced + 2);
+
+  /* Flights still open are freed with the context */
+  CU_ASSERT(coap_cache_flight_join(session, req[0], key) ==
+            COAP_CACHE_FLIGHT_LEADER);
+  CU_ASSERT(coap_cache_flight_join(session, req[1], key) ==
+            COAP_CACHE_FLIGHT_PARKED);
+
+  coap_delete_pdu(rsp);
+  coap_delete_cache_key(key);
+  for (i = 0; i < 5; i++)
+    coap_delete_pdu(req[i]);
+}
+
+/* Returns the seconds taken to derive TEST_CACHE_KEY_ROUNDS keys */
+static double
+time_keys(coap_cache_key_hash_t hash, coap_pdu_t *pdu) {
+  coap_cache_key_t *key;
+  clock_t start;
+  unsigned int i;
+
+  CU_ASSERT(coap_cache_set_key_hash(ctx, hash) == 1);
+  start = clock();
+  for (i = 0; i < TEST_CACHE_KEY_ROUNDS; i++) {
+    key = coap_cache_derive_key(session, pdu, COAP_CACHE_IS_SESSION_BASED);
+    CU_ASSERT_PTR_NOT_NULL(key);
+    coap_delete_cache_key(key);
+  }
+  return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void
+t_cache_key_speed(void) {
+  coap_pdu_t *pdu = request("sensors/temperature", "unit=celsius");
+  double digest, siphash;
+
+  CU_ASSERT_PTR_NOT_NULL_FATAL(pdu);
+  digest = time_keys(COAP_CACHE_KEY_HASH_DIGEST, pdu);
+  siphash = time_keys(COAP_CACHE_KEY_HASH_SIPHASH, pdu);
+  coap_log_info("%u cache-keys: digest %.3fs, siphash %.3fs\n",
+                TEST_CACHE_KEY_ROUNDS, digest, siphash);
+  CU_ASSERT(coap_cache_set_key_hash(ctx, COAP_CACHE_KEY_HASH_DIGEST) == 1);
+  coap_delete_pdu(pdu);
+}
+
+static int
+t_cache_tests_create(void) {
+  coap_address_t addr;
+
+  coap_address_init(&addr);
+
+  addr.size = sizeof(struct sockaddr_in6);
+  addr.addr.sin6.sin6_family = AF_INET6;
+  addr.addr.sin6.sin6_addr = in6addr_loopback;
+  addr.addr.sin6.sin6_port = htons(COAP_DEFAULT_PORT);
+
+  ctx = coap_new_context(NULL);
+  if (!ctx)
+    return 1;
+  session = coap_new_client_session(ctx, NULL, &addr, COAP_PROTO_UDP);
+  return session == NULL;
+}
+
+static int
+t_cache_tests_remove(void) {
+  coap_session_release(session);
+  coap_free_context(ctx);
+  return 0;
+}
+
+CU_pSuite
+t_init_cache_tests(void) {
+  CU_pSuite suite;
+
+  suite = CU_add_suite("cache", t_cache_tests_create, t_cache_tests_remove);
+  if (!suite) {                        /* signal error */
+    fprintf(stderr, "W: cannot add cache test suite (%s)\n",
+            CU_get_error_msg());
+
+    return NULL;
+  }
+
+#define CACHE_TEST(s,t)                                        \
+  if (!CU_ADD_TEST(s,t)) {                                     \
+    fprintf(stderr, "W: cannot add cache test (%s)\n",         \
+            CU_get_error_msg());                               \
+  }
+
+  CACHE_TEST(suite, t_cache_siphash);
+  CACHE_TEST(suite, t_cache_key_digest);
+  CACHE_TEST(suite, t_cache_key_siphash);
+  CACHE_TEST(suite, t_cache_response);
+  CACHE_TEST(suite, t_cache_lru);
+  CACHE_TEST(suite, t_cache_expiry);
+  CACHE_TEST(suite, t_cache_flight);
+  CACHE_TEST(suite, t_cache_key_speed);
+
+  return suite;
+}
+#endif /* COAP_SERVER_SUPPORT && COAP_CLIENT_SUPPORT */
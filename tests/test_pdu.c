@@ -1249,6 +1249,50 @@ t_encode_pdu22(void) {
 }
 
 
+static void
+t_encode_pdu23(void) {
+  uint8_t token[] = { 't' };
+  uint8_t token2[] = { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+                       0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10 };
+  coap_bin_const_t tok2 = { sizeof(token2), token2 };
+  uint8_t data[] = { 0xc0, 0x21, 0x3c, 0xff, 'h', 'e', 'l', 'l', 'o' };
+  uint8_t buf[4];
+  coap_pdu_template_t *tmpl;
+  coap_pdu_t *copy;
+
+  coap_pdu_clear(pdu, pdu->max_size);
+  pdu->code = COAP_RESPONSE_CODE(205);
+  coap_add_token(pdu, sizeof(token), token);
+  coap_add_option(pdu, COAP_OPTION_CONTENT_FORMAT,
+                  coap_encode_var_safe(buf, sizeof(buf), 0), buf);
+  coap_add_option(pdu, COAP_OPTION_MAXAGE,
+                  coap_encode_var_safe(buf, sizeof(buf), 60), buf);
+  coap_add_data(pdu, 5, (const uint8_t *)"hello");
+
+  tmpl = coap_pdu_template_new(pdu);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(tmpl);
+  CU_ASSERT(tmpl->length == sizeof(data));
+
+  copy = coap_pdu_from_template(tmpl, COAP_MESSAGE_ACK, 0x1234, &tok2,
+                                COAP_DEFAULT_MTU);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(copy);
+  CU_ASSERT(copy->type == COAP_MESSAGE_ACK);
+  CU_ASSERT(copy->code == COAP_RESPONSE_CODE(205));
+  CU_ASSERT(copy->mid == 0x1234);
+  CU_ASSERT(copy->max_opt == COAP_OPTION_MAXAGE);
+  CU_ASSERT(coap_binary_equal(&copy->actual_token, &tok2));
+  CU_ASSERT(copy->used_size == copy->e_token_length + sizeof(data));
+  CU_ASSERT(memcmp(copy->token + copy->e_token_length, data,
+                   sizeof(data)) == 0);
+  CU_ASSERT(copy->data == copy->token + copy->used_size - 5);
+  coap_delete_pdu(copy);
+
+  /* Does not fit */
+  copy = coap_pdu_from_template(tmpl, COAP_MESSAGE_ACK, 0x1234, &tok2, 20);
+  CU_ASSERT_PTR_NULL(copy);
+  coap_pdu_template_free(tmpl);
+}
+
 static int
 t_pdu_tests_create(void) {
   pdu = coap_pdu_init(0, 0, 0, COAP_DEFAULT_MTU);
@@ -1327,6 +1371,7 @@ t_init_pdu_tests(void) {
     PDU_ENCODER_TEST(suite[1], t_encode_pdu20);
     PDU_ENCODER_TEST(suite[1], t_encode_pdu21);
     PDU_ENCODER_TEST(suite[1], t_encode_pdu22);
+    PDU_ENCODER_TEST(suite[1], t_encode_pdu23);
 
   } else                         /* signal error */
     fprintf(stderr, "W: cannot add pdu parser test suite (%s)\n",
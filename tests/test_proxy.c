@@ -0,0 +1,815 @@
+/* libcoap unit tests
+ *
+ * Copyright (C) 2023 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "test_common.h"
+#include "test_proxy.h"
+
+#if COAP_SERVER_SUPPORT && COAP_CLIENT_SUPPORT && \
+    !defined(WITH_CONTIKI) && !defined(WITH_LWIP)
+#include <stdio.h>
+#include <unistd.h>
+
+static coap_context_t *server_ctx; /* The upstream server */
+static coap_context_t *proxy_ctx;  /* The reverse proxy */
+static coap_context_t *client_ctx; /* The downstream client */
+static coap_session_t *client;     /* client_ctx session to the proxy */
+static coap_context_t *stateless_ctx; /* The stateless reverse proxy */
+static coap_session_t *stateless_client; /* client_ctx session to it */
+static coap_context_t *observer_ctx; /* The downstream observers */
+static coap_session_t *observer[2];  /* observer_ctx sessions to the proxy */
+static coap_resource_t *observed;    /* The observable server resource */
+static uint8_t observe_token[2][8];  /* of the observers' registrations */
+
+static coap_address_t server_addr[2]; /* upstream server endpoints */
+static coap_address_t proxy_addr;
+static coap_address_t stateless_addr;
+static int silent_fd[2] = { -1, -1 }; /* UDP sockets not read by coap */
+static uint16_t silent_port[2];
+static unsigned int hits[2];       /* requests on each server endpoint */
+static size_t server_token_length; /* of the last request answered */
+static coap_binary_t *held_token;  /* of the last request not answered */
+static uint8_t sent_token[8];      /* of the last request the client sent */
+static size_t sent_token_length;
+
+/*
+ * The server list entries, each list having its own:
+ * [0] server endpoint 0, for server_list
+ * [1] silent socket 0, for silent_list
+ * [2] and [3] server endpoints 0 and 1, for rr_list and hash_list
+ * [4] silent socket 1 and [5] server endpoint 1, for check_list
+ */
+static char server_uri[6][32];
+static coap_proxy_server_t servers[6];
+static coap_proxy_server_list_t server_list;
+static coap_proxy_server_list_t silent_list;
+static coap_proxy_server_list_t rr_list;
+static coap_proxy_server_list_t hash_list;
+static coap_proxy_server_list_t check_list;
+static coap_proxy_server_list_t stateless_list;
+static coap_proxy_server_list_t observe_list;
+
+/* Larger than a block, so that it is relayed with Block2 */
+static uint8_t body[3000];
+
+/* The last response the client was given */
+static struct {
+  int called;
+  coap_pdu_code_t code;
+  size_t length;
+  int same;
+} result;
+
+/* The notifications each observer was given */
+static struct {
+  int called[2];
+  char value[2][8];
+} observe_result;
+static unsigned int observe_hits;  /* requests on the observed resource */
+static int observe_value;
+
+static void
+hnd_get(coap_resource_t *resource, coap_session_t *session,
+        const coap_pdu_t *request, const coap_string_t *query,
+        coap_pdu_t *response) {
+  uint16_t port = coap_address_get_port(coap_session_get_addr_local(session));
+  size_t i;
+
+  for (i = 0; i < 2; i++) {
+    if (port == coap_address_get_port(&server_addr[i]))
+      hits[i]++;
+  }
+  server_token_length = coap_pdu_get_token(request).length;
+  coap_pdu_set_code(response, COAP_RESPONSE_CODE_CONTENT);
+  coap_add_data_large_response(resource, session, request, response, query,
+                               COAP_MEDIATYPE_TEXT_PLAIN, -1, 0,
+                               sizeof(body), body, NULL, NULL);
+}
+
+static void
+hnd_observed(coap_resource_t *resource, coap_session_t *session,
+             const coap_pdu_t *request, const coap_string_t *query,
+             coap_pdu_t *response) {
+  char value[8];
+
+  (void)resource;
+  (void)session;
+  (void)request;
+  (void)query;
+  observe_hits++;
+  snprintf(value, sizeof(value), "v%d", observe_value);
+  coap_pdu_set_code(response, COAP_RESPONSE_CODE_CONTENT);
+  coap_add_data(response, strlen(value), (const uint8_t *)value);
+}
+
+/* Answers with an empty ACK, and no response */
+static void
+hnd_hold(coap_resource_t *resource, coap_session_t *session,
+         const coap_pdu_t *request, const coap_string_t *query,
+         coap_pdu_t *response) {
+  coap_bin_const_t token = coap_pdu_get_token(request);
+
+  (void)resource;
+  (void)session;
+  (void)query;
+  (void)response;
+  coap_delete_binary(held_token);
+  held_token = coap_new_binary(token.length);
+  if (held_token)
+    memcpy(held_token->s, token.s, token.length);
+}
+
+/* Forwards to the server list that is the user data of resource */
+static void
+hnd_proxy(coap_resource_t *resource, coap_session_t *session,
+          const coap_pdu_t *request, const coap_string_t *query,
+          coap_pdu_t *response) {
+  (void)query;
+  coap_proxy_forward_request(session, request, response, resource,
+                             coap_resource_get_userdata(resource));
+}
+
+static coap_response_t
+response_handler(coap_session_t *session, const coap_pdu_t *sent,
+                 const coap_pdu_t *received, const coap_mid_t id) {
+  size_t length;
+  size_t offset;
+  size_t total;
+  const uint8_t *data;
+
+  (void)session;
+  (void)sent;
+  (void)id;
+  result.called++;
+  result.code = coap_pdu_get_code(received);
+  result.length = 0;
+  result.same = 0;
+  if (coap_get_data_large(received, &length, &data, &offset, &total)) {
+    result.length = total;
+    result.same = offset == 0 && length == sizeof(body) &&
+                  memcmp(data, body, length) == 0;
+  }
+  return COAP_RESPONSE_OK;
+}
+
+static coap_response_t
+observe_response_handler(coap_session_t *session, const coap_pdu_t *sent,
+                         const coap_pdu_t *received, const coap_mid_t id) {
+  size_t length;
+  const uint8_t *data;
+  int i = session == observer[0] ? 0 : 1;
+
+  (void)sent;
+  (void)id;
+  if (coap_pdu_get_code(received) != COAP_RESPONSE_CODE_CONTENT)
+    return COAP_RESPONSE_OK;
+  observe_result.called[i]++;
+  memset(observe_result.value[i], 0, sizeof(observe_result.value[i]));
+  if (coap_get_data(received, &length, &data) &&
+      length < sizeof(observe_result.value[i]))
+    memcpy(observe_result.value[i], data, length);
+  return COAP_RESPONSE_OK;
+}
+
+/* Runs the I/O loops of all the contexts until a response, or 3 seconds */
+static void
+wait_response(void) {
+  int i;
+
+  for (i = 0; i < 100 && !result.called; i++) {
+    coap_io_process(server_ctx, 10);
+    coap_io_process(proxy_ctx, 10);
+    coap_io_process(stateless_ctx, 10);
+    coap_io_process(client_ctx, 10);
+  }
+}
+
+/* Runs the I/O loops of the proxy and client until a request is forwarded */
+static void
+wait_forwarded(void) {
+  int i;
+
+  for (i = 0; i < 20 && HASH_COUNT(proxy_ctx->proxy_reqs) == 0; i++) {
+    coap_io_process(proxy_ctx, 10);
+    coap_io_process(client_ctx, 10);
+  }
+}
+
+/* Sends a CON GET for path over s */
+static int
+send_get(coap_session_t *s, const char *path) {
+  coap_pdu_t *pdu;
+
+  memset(&result, 0, sizeof(result));
+  pdu = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_CODE_GET,
+                      coap_new_message_id(s), coap_session_max_pdu_size(s));
+  if (!pdu)
+    return 0;
+  /* Long enough not to be found in an encrypted token by chance */
+  sent_token_length = sizeof(sent_token);
+  coap_prng(sent_token, sent_token_length);
+  if (!coap_add_token(pdu, sent_token_length, sent_token) ||
+      !coap_add_option(pdu, COAP_OPTION_URI_PATH, strlen(path),
+                       (const uint8_t *)path)) {
+    coap_delete_pdu(pdu);
+    return 0;
+  }
+  return coap_send(s, pdu) != COAP_INVALID_MID;
+}
+
+/*
+ * Test 1 has a body larger than a block relayed to a client using CON over
+ * UDP, the proxy sending it as a separate Block2 response.
+ */
+static void
+t_proxy1(void) {
+  CU_ASSERT_FATAL(send_get(client, "test"));
+  wait_response();
+  CU_ASSERT(result.called == 1);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CONTENT);
+  CU_ASSERT(result.length == sizeof(body));
+  CU_ASSERT(result.same);
+  CU_ASSERT(HASH_COUNT(proxy_ctx->proxy_reqs) == 0);
+  CU_ASSERT(HASH_COUNT(proxy_ctx->proxy_upstreams) == 1);
+}
+
+/*
+ * Test 2 has a forwarded request time out, which the proxy notices from its
+ * I/O loop with no other requests being forwarded.
+ */
+static void
+t_proxy2(void) {
+  coap_proxy_req_t *req;
+  coap_tick_t now;
+
+  CU_ASSERT_FATAL(send_get(client, "silent"));
+  wait_forwarded();
+  CU_ASSERT_FATAL(HASH_COUNT(proxy_ctx->proxy_reqs) == 1);
+  CU_ASSERT(result.called == 0);
+
+  /* Its time is up */
+  coap_ticks(&now);
+  req = proxy_ctx->proxy_reqs;
+  req->expire = now;
+  wait_response();
+  CU_ASSERT(result.called == 1);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_GATEWAY_TIMEOUT);
+  CU_ASSERT(HASH_COUNT(proxy_ctx->proxy_reqs) == 0);
+}
+
+/*
+ * Test 3 has the idle upstream session closed from the I/O loop once it has
+ * had no requests for idle_timeout_secs, the other one being kept.
+ */
+static void
+t_proxy3(void) {
+  coap_proxy_upstream_t *upstream;
+  int i;
+
+  for (i = 0; i < 30 && HASH_COUNT(proxy_ctx->proxy_upstreams) > 1; i++)
+    coap_io_process(proxy_ctx, 100);
+  CU_ASSERT(HASH_COUNT(proxy_ctx->proxy_upstreams) == 1);
+  upstream = proxy_ctx->proxy_upstreams;
+  if (upstream)
+    CU_ASSERT(coap_address_get_port(
+                  coap_session_get_addr_remote(upstream->session)) ==
+              silent_port[0]);
+}
+
+/*
+ * Test 4 has requests shared between two servers in turn, and then by the
+ * hash of their path, the same path always going to the same server.
+ */
+static void
+t_proxy4(void) {
+  int i;
+
+  memset(hits, 0, sizeof(hits));
+  for (i = 0; i < 4; i++) {
+    CU_ASSERT_FATAL(send_get(client, "rr"));
+    wait_response();
+    CU_ASSERT(result.code == COAP_RESPONSE_CODE_CONTENT);
+  }
+  CU_ASSERT(hits[0] == 2);
+  CU_ASSERT(hits[1] == 2);
+
+  memset(hits, 0, sizeof(hits));
+  for (i = 0; i < 4; i++) {
+    CU_ASSERT_FATAL(send_get(client, "hash"));
+    wait_response();
+    CU_ASSERT(result.code == COAP_RESPONSE_CODE_CONTENT);
+  }
+  CU_ASSERT((hits[0] == 4 && hits[1] == 0) || (hits[0] == 0 && hits[1] == 4));
+}
+
+static coap_proxy_backend_t *
+find_backend(const coap_proxy_server_t *server) {
+  coap_proxy_backend_t *backend, *btmp;
+
+  HASH_ITER(hh, proxy_ctx->proxy_backends, backend, btmp) {
+    if (backend->server == server)
+      return backend;
+  }
+  return NULL;
+}
+
+/* Answers the pings (empty CONs) received on fd with a RST */
+static void
+answer_pings(int fd) {
+  uint8_t buf[64];
+  coap_address_t from;
+  socklen_t size;
+  ssize_t len;
+
+  for (;;) {
+    coap_address_init(&from);
+    size = sizeof(from.addr);
+    len = recvfrom(fd, buf, sizeof(buf), MSG_DONTWAIT, &from.addr.sa, &size);
+    if (len < 0)
+      break;
+    /* Version 1, CON, no token, Empty code */
+    if (len == 4 && buf[0] == 0x40 && buf[1] == 0) {
+      buf[0] = 0x70;
+      sendto(fd, buf, 4, 0, &from.addr.sa, size);
+    }
+  }
+}
+
+/*
+ * Test 5 has a server that does not answer marked as down, the request
+ * being sent to the other server, and kept down by the health checks until
+ * it answers their pings.
+ */
+static void
+t_proxy5(void) {
+  coap_proxy_backend_t *backend;
+  coap_proxy_req_t *req;
+  coap_tick_t now;
+  int i;
+
+  memset(hits, 0, sizeof(hits));
+  CU_ASSERT_FATAL(send_get(client, "check"));
+  wait_forwarded();
+  CU_ASSERT_FATAL(HASH_COUNT(proxy_ctx->proxy_reqs) == 1);
+  req = proxy_ctx->proxy_reqs;
+  CU_ASSERT(req->server == &servers[4]);
+  backend = find_backend(&servers[4]);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(backend);
+  CU_ASSERT(backend->down == 0);
+
+  /* Its time is up, so is sent to the other server instead */
+  coap_ticks(&now);
+  req->expire = now;
+  wait_response();
+  CU_ASSERT(result.called == 1);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CONTENT);
+  CU_ASSERT(hits[1] == 1);
+  CU_ASSERT(backend->down == 1);
+
+  /* Not up while its health check pings are not answered */
+  for (i = 0; i < 15; i++)
+    coap_io_process(proxy_ctx, 100);
+  CU_ASSERT(backend->down == 1);
+  CU_ASSERT(backend->check_sent != 0 || backend->fails > 1);
+
+  /* Requests are not sent to it while it is down */
+  memset(hits, 0, sizeof(hits));
+  CU_ASSERT_FATAL(send_get(client, "check"));
+  wait_response();
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CONTENT);
+  CU_ASSERT(hits[1] == 1);
+
+  for (i = 0; i < 40 && backend->down; i++) {
+    coap_io_process(proxy_ctx, 50);
+    answer_pings(silent_fd[1]);
+  }
+  CU_ASSERT(backend->down == 0);
+  CU_ASSERT(backend->fails == 0);
+}
+
+/*
+ * Test 6 has requests forwarded statelessly once the server has been found
+ * to take long tokens, the response being relayed from the token alone.
+ */
+static void
+t_proxy6(void) {
+  coap_proxy_upstream_t *upstream;
+  int i;
+
+  /* Forwarded with state while the server is being checked */
+  CU_ASSERT_FATAL(send_get(stateless_client, "test"));
+  wait_response();
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CONTENT);
+  CU_ASSERT(result.same);
+  CU_ASSERT(server_token_length <= 8);
+
+  upstream = stateless_ctx->proxy_upstreams;
+  CU_ASSERT_PTR_NOT_NULL_FATAL(upstream);
+  for (i = 0; i < 100 &&
+       upstream->session->max_token_checked != COAP_EXT_T_CHECKED; i++) {
+    coap_io_process(server_ctx, 10);
+    coap_io_process(stateless_ctx, 10);
+  }
+  CU_ASSERT(upstream->session->max_token_checked == COAP_EXT_T_CHECKED);
+  CU_ASSERT(upstream->session->max_token_size == 100);
+
+  CU_ASSERT_FATAL(send_get(stateless_client, "test"));
+  for (i = 0; i < 100 && !result.called; i++) {
+    coap_io_process(server_ctx, 10);
+    coap_io_process(stateless_ctx, 10);
+    coap_io_process(client_ctx, 10);
+    CU_ASSERT(HASH_COUNT(stateless_ctx->proxy_reqs) == 0);
+  }
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CONTENT);
+  CU_ASSERT(result.same);
+  CU_ASSERT(server_token_length > 8);
+  CU_ASSERT(server_token_length <= COAP_PROXY_STATELESS_TOKEN_SIZE);
+}
+
+/*
+ * Test 7 has the token of a request forwarded statelessly recover the
+ * downstream request, but not once it has expired or been tampered with.
+ */
+static void
+t_proxy7(void) {
+  coap_pdu_t *pdu;
+  coap_pdu_t *request = NULL;
+  coap_resource_t *resource = NULL;
+  coap_session_t *session;
+  coap_bin_const_t token;
+  coap_tick_t now;
+  int i;
+
+  coap_delete_binary(held_token);
+  held_token = NULL;
+  CU_ASSERT_FATAL(send_get(stateless_client, "hold"));
+  for (i = 0; i < 100 && !held_token; i++) {
+    coap_io_process(server_ctx, 10);
+    coap_io_process(stateless_ctx, 10);
+    coap_io_process(client_ctx, 10);
+  }
+  CU_ASSERT_PTR_NOT_NULL_FATAL(held_token);
+  CU_ASSERT(HASH_COUNT(stateless_ctx->proxy_reqs) == 0);
+
+  pdu = coap_pdu_init(COAP_MESSAGE_ACK, COAP_RESPONSE_CODE_CONTENT, 0, 256);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(pdu);
+  CU_ASSERT_FATAL(coap_add_token(pdu, held_token->length, held_token->s));
+  coap_ticks(&now);
+  session = coap_proxy_stateless_decode(stateless_ctx, pdu, now, &request,
+                                        &resource);
+  CU_ASSERT_PTR_NOT_NULL(session);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(request);
+  token = coap_pdu_get_token(request);
+  CU_ASSERT(token.length == sent_token_length);
+  CU_ASSERT(memcmp(token.s, sent_token, sent_token_length) == 0);
+  CU_ASSERT(coap_pdu_get_code(request) == COAP_REQUEST_CODE_GET);
+  CU_ASSERT(coap_pdu_get_type(request) == COAP_MESSAGE_CON);
+  CU_ASSERT(resource == stateless_ctx->unknown_resource);
+  coap_delete_pdu(request);
+
+  /* The downstream token and address are not in the clear */
+  CU_ASSERT(held_token->length > sent_token_length);
+  for (i = 0; i + sent_token_length <= held_token->length; i++) {
+    if (memcmp(&held_token->s[i], sent_token, sent_token_length) == 0)
+      break;
+  }
+  CU_ASSERT(i + sent_token_length > held_token->length);
+
+  /* Too late */
+  request = NULL;
+  session = coap_proxy_stateless_decode(stateless_ctx, pdu,
+                                        now + (COAP_PROXY_REQ_LIFETIME + 2) *
+                                        COAP_TICKS_PER_SECOND,
+                                        &request, &resource);
+  CU_ASSERT_PTR_NULL(session);
+
+  /* Changed in the encrypted state, and in the MAC */
+  held_token->s[held_token->length / 2] ^= 0x01;
+  CU_ASSERT_FATAL(coap_update_token(pdu, held_token->length, held_token->s));
+  session = coap_proxy_stateless_decode(stateless_ctx, pdu, now, &request,
+                                        &resource);
+  CU_ASSERT_PTR_NULL(session);
+  held_token->s[held_token->length / 2] ^= 0x01;
+  held_token->s[held_token->length - 1] ^= 0x80;
+  CU_ASSERT_FATAL(coap_update_token(pdu, held_token->length, held_token->s));
+  session = coap_proxy_stateless_decode(stateless_ctx, pdu, now, &request,
+                                        &resource);
+  CU_ASSERT_PTR_NULL(session);
+  coap_delete_pdu(pdu);
+}
+
+/* Has observer n send a CON GET registering an observation of path */
+static int
+send_observe(int n, const char *path) {
+  coap_session_t *s = observer[n];
+  uint8_t *token = observe_token[n];
+  coap_pdu_t *pdu;
+  uint8_t buf[4];
+
+  pdu = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_CODE_GET,
+                      coap_new_message_id(s), coap_session_max_pdu_size(s));
+  if (!pdu)
+    return 0;
+  coap_prng(token, sizeof(observe_token[n]));
+  if (!coap_add_token(pdu, sizeof(observe_token[n]), token) ||
+      !coap_add_option(pdu, COAP_OPTION_OBSERVE,
+                       coap_encode_var_safe(buf, sizeof(buf),
+                                            COAP_OBSERVE_ESTABLISH), buf) ||
+      !coap_add_option(pdu, COAP_OPTION_URI_PATH, strlen(path),
+                       (const uint8_t *)path)) {
+    coap_delete_pdu(pdu);
+    return 0;
+  }
+  return coap_send(s, pdu) != COAP_INVALID_MID;
+}
+
+/* Runs the I/O loops until observer n has had count responses */
+static void
+wait_observed(int n, int count) {
+  int i;
+
+  for (i = 0; i < 100 && observe_result.called[n] < count; i++) {
+    coap_io_process(server_ctx, 10);
+    coap_io_process(proxy_ctx, 10);
+    coap_io_process(observer_ctx, 10);
+  }
+}
+
+/*
+ * Test 8 has two downstream observers of the same representation share one
+ * upstream observation, each being sent the notifications relayed from it,
+ * and the upstream observation cancelled once neither is left.
+ */
+static void
+t_proxy8(void) {
+  coap_proxy_req_t *req;
+  coap_binary_t token;
+  int i;
+  int n;
+
+  memset(&observe_result, 0, sizeof(observe_result));
+  observe_hits = 0;
+
+  CU_ASSERT_FATAL(send_observe(0, "observed"));
+  wait_observed(0, 1);
+  CU_ASSERT(observe_result.called[0] == 1);
+  CU_ASSERT(strcmp(observe_result.value[0], "v0") == 0);
+  CU_ASSERT(observe_hits == 1);
+  CU_ASSERT(HASH_COUNT(proxy_ctx->proxy_observes) == 1);
+
+  /* Answered from the upstream observation already relayed */
+  CU_ASSERT_FATAL(send_observe(1, "observed"));
+  wait_observed(1, 1);
+  CU_ASSERT(observe_result.called[1] == 1);
+  CU_ASSERT(strcmp(observe_result.value[1], "v0") == 0);
+  CU_ASSERT(observe_hits == 1);
+  CU_ASSERT(HASH_COUNT(proxy_ctx->proxy_observes) == 1);
+  req = proxy_ctx->proxy_observes;
+  CU_ASSERT_PTR_NOT_NULL_FATAL(req);
+  CU_ASSERT(coap_resource_observers_by_key(req->resource, &req->observe_key,
+                                           0) == 2);
+
+  /* One upstream notification goes to both */
+  observe_value = 1;
+  coap_resource_notify_observers(observed, NULL);
+  wait_observed(0, 2);
+  wait_observed(1, 2);
+  CU_ASSERT(observe_result.called[0] == 2);
+  CU_ASSERT(observe_result.called[1] == 2);
+  CU_ASSERT(strcmp(observe_result.value[0], "v1") == 0);
+  CU_ASSERT(strcmp(observe_result.value[1], "v1") == 0);
+  CU_ASSERT(observe_hits == 2);
+  CU_ASSERT(HASH_COUNT(proxy_ctx->proxy_observes) == 1);
+
+  for (n = 0; n < 2; n++) {
+    token.length = sizeof(observe_token[n]);
+    token.s = observe_token[n];
+    CU_ASSERT(coap_cancel_observe(observer[n], &token, COAP_MESSAGE_CON));
+  }
+  for (i = 0; i < 300 && (proxy_ctx->proxy_observes ||
+                          observed->subscribers); i++) {
+    coap_io_process(server_ctx, 10);
+    coap_io_process(proxy_ctx, 10);
+    coap_io_process(observer_ctx, 10);
+  }
+  CU_ASSERT(HASH_COUNT(proxy_ctx->proxy_observes) == 0);
+  CU_ASSERT_PTR_NULL(observed->subscribers);
+}
+
+/* Returns the bound address of a UDP endpoint on 127.0.0.1 in c */
+static int
+add_endpoint(coap_context_t *c, coap_address_t *addr) {
+  coap_endpoint_t *ep;
+
+  coap_address_init(addr);
+  addr->size = sizeof(struct sockaddr_in);
+  addr->addr.sin.sin_family = AF_INET;
+  addr->addr.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  ep = coap_new_endpoint(c, addr, COAP_PROTO_UDP);
+  if (!ep)
+    return 0;
+  coap_address_copy(addr, &ep->bind_addr);
+  return 1;
+}
+
+static int
+set_server(size_t i, uint16_t port) {
+  snprintf(server_uri[i], sizeof(server_uri[i]), "coap://127.0.0.1:%u", port);
+  return coap_split_uri((const uint8_t *)server_uri[i], strlen(server_uri[i]),
+                        &servers[i].uri) == 0;
+}
+
+/* Returns a UDP socket bound to the address of addr, with its port in *port */
+static int
+add_silent(const coap_address_t *addr, uint16_t *port) {
+  coap_address_t bound;
+  socklen_t size;
+  int fd;
+
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd == -1)
+    return -1;
+  coap_address_copy(&bound, addr);
+  coap_address_set_port(&bound, 0);
+  size = bound.size;
+  if (bind(fd, &bound.addr.sa, bound.size) == -1 ||
+      getsockname(fd, &bound.addr.sa, &size) == -1) {
+    close(fd);
+    return -1;
+  }
+  *port = coap_address_get_port(&bound);
+  return fd;
+}
+
+static coap_resource_t *
+add_proxy(const char *path, coap_proxy_server_list_t *list,
+          size_t first, size_t count) {
+  coap_resource_t *r;
+
+  list->entry = &servers[first];
+  list->entry_count = count;
+  list->type = COAP_PROXY_REVERSE;
+  list->idle_timeout_secs = 30;
+  if (path)
+    r = coap_resource_init(coap_make_str_const(path), 0);
+  else
+    r = coap_resource_unknown_init2(hnd_proxy, 0);
+  coap_register_handler(r, COAP_REQUEST_GET, hnd_proxy);
+  coap_resource_set_userdata(r, list);
+  coap_add_resource(proxy_ctx, r);
+  return r;
+}
+
+static int
+t_proxy_tests_create(void) {
+  static const int uses[6] = { 0, 2, 0, 1, 3, 1 };
+  coap_resource_t *r;
+  uint16_t port;
+  size_t i;
+
+  for (i = 0; i < sizeof(body); i++)
+    body[i] = (uint8_t)('a' + i % 26);
+
+  server_ctx = coap_new_context(NULL);
+  proxy_ctx = coap_new_context(NULL);
+  client_ctx = coap_new_context(NULL);
+  if (!server_ctx || !proxy_ctx || !client_ctx ||
+      !add_endpoint(server_ctx, &server_addr[0]) ||
+      !add_endpoint(server_ctx, &server_addr[1]) ||
+      !add_endpoint(proxy_ctx, &proxy_addr))
+    return 1;
+  coap_context_set_block_mode(server_ctx, COAP_BLOCK_USE_LIBCOAP);
+  /* Takes the long tokens of stateless requests */
+  coap_context_set_max_token_size(server_ctx, 100);
+  r = coap_resource_unknown_init2(hnd_get, 0);
+  coap_register_handler(r, COAP_REQUEST_GET, hnd_get);
+  coap_add_resource(server_ctx, r);
+  r = coap_resource_init(coap_make_str_const("hold"), 0);
+  coap_register_handler(r, COAP_REQUEST_GET, hnd_hold);
+  coap_add_resource(server_ctx, r);
+  observed = coap_resource_init(coap_make_str_const("observed"), 0);
+  coap_register_handler(observed, COAP_REQUEST_GET, hnd_observed);
+  coap_resource_set_get_observable(observed, 1);
+  coap_add_resource(server_ctx, observed);
+
+  for (i = 0; i < 2; i++) {
+    silent_fd[i] = add_silent(&server_addr[0], &silent_port[i]);
+    if (silent_fd[i] == -1)
+      return 1;
+  }
+  /* uses[] 0 and 1 are the server endpoints, 2 and 3 the silent sockets */
+  for (i = 0; i < 6; i++) {
+    port = uses[i] < 2 ? coap_address_get_port(&server_addr[uses[i]]) :
+                         silent_port[uses[i] - 2];
+    if (!set_server(i, port))
+      return 1;
+  }
+
+  coap_context_set_block_mode(proxy_ctx,
+                              COAP_BLOCK_USE_LIBCOAP | COAP_BLOCK_SINGLE_BODY);
+  add_proxy(NULL, &server_list, 0, 1);
+  server_list.idle_timeout_secs = 1;
+  add_proxy("silent", &silent_list, 1, 1);
+  add_proxy("rr", &rr_list, 2, 2);
+  add_proxy("hash", &hash_list, 2, 2);
+  hash_list.lb = COAP_PROXY_LB_HASH_PATH;
+  add_proxy("check", &check_list, 4, 2);
+  check_list.health_check_secs = 1;
+  r = add_proxy("observed", &observe_list, 0, 1);
+  coap_resource_set_get_observable(r, 1);
+
+  stateless_ctx = coap_new_context(NULL);
+  if (!stateless_ctx || !add_endpoint(stateless_ctx, &stateless_addr))
+    return 1;
+  coap_context_set_block_mode(stateless_ctx,
+                              COAP_BLOCK_USE_LIBCOAP | COAP_BLOCK_SINGLE_BODY);
+  coap_context_set_max_token_size(stateless_ctx, 100);
+  stateless_list.entry = &servers[0];
+  stateless_list.entry_count = 1;
+  stateless_list.type = COAP_PROXY_REVERSE;
+  stateless_list.idle_timeout_secs = 30;
+  stateless_list.stateless = 1;
+  r = coap_resource_unknown_init2(hnd_proxy, 0);
+  coap_register_handler(r, COAP_REQUEST_GET, hnd_proxy);
+  coap_resource_set_userdata(r, &stateless_list);
+  coap_add_resource(stateless_ctx, r);
+
+  coap_context_set_block_mode(client_ctx,
+                              COAP_BLOCK_USE_LIBCOAP | COAP_BLOCK_SINGLE_BODY);
+  coap_register_response_handler(client_ctx, response_handler);
+  client = coap_new_client_session(client_ctx, NULL, &proxy_addr,
+                                   COAP_PROTO_UDP);
+  stateless_client = coap_new_client_session(client_ctx, NULL,
+                                             &stateless_addr, COAP_PROTO_UDP);
+  if (client == NULL || stateless_client == NULL)
+    return 1;
+
+  observer_ctx = coap_new_context(NULL);
+  if (!observer_ctx)
+    return 1;
+  /* For the observations to be cancelled */
+  coap_context_set_block_mode(observer_ctx, COAP_BLOCK_USE_LIBCOAP);
+  coap_register_response_handler(observer_ctx, observe_response_handler);
+  for (i = 0; i < 2; i++) {
+    observer[i] = coap_new_client_session(observer_ctx, NULL, &proxy_addr,
+                                          COAP_PROTO_UDP);
+    if (!observer[i])
+      return 1;
+  }
+  return 0;
+}
+
+static int
+t_proxy_tests_remove(void) {
+  size_t i;
+
+  coap_free_context(observer_ctx);
+  coap_free_context(client_ctx);
+  coap_free_context(stateless_ctx);
+  coap_free_context(proxy_ctx);
+  coap_free_context(server_ctx);
+  for (i = 0; i < 2; i++) {
+    if (silent_fd[i] != -1)
+      close(silent_fd[i]);
+  }
+  coap_delete_binary(held_token);
+  return 0;
+}
+
+CU_pSuite
+t_init_proxy_tests(void) {
+  CU_pSuite suite;
+
+  suite = CU_add_suite("proxy", t_proxy_tests_create, t_proxy_tests_remove);
+  if (!suite) {                        /* signal error */
+    fprintf(stderr, "W: cannot add proxy test suite (%s)\n",
+            CU_get_error_msg());
+
+    return NULL;
+  }
+
+#define PROXY_TEST(s,t)                                                \
+  if (!CU_ADD_TEST(s,t)) {                                              \
+    fprintf(stderr, "W: cannot add proxy test (%s)\n",                \
+            CU_get_error_msg());                                      \
+  }
+
+  PROXY_TEST(suite, t_proxy1);
+  PROXY_TEST(suite, t_proxy2);
+  PROXY_TEST(suite, t_proxy3);
+  PROXY_TEST(suite, t_proxy4);
+  PROXY_TEST(suite, t_proxy5);
+  PROXY_TEST(suite, t_proxy6);
+  PROXY_TEST(suite, t_proxy7);
+  PROXY_TEST(suite, t_proxy8);
+
+  return suite;
+}
+#endif /* COAP_SERVER_SUPPORT && COAP_CLIENT_SUPPORT &&
+          ! WITH_CONTIKI && ! WITH_LWIP */
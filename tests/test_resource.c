@@ -0,0 +1,833 @@
+/* libcoap unit tests
+ *
+ * Copyright (C) 2023 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "test_common.h"
+#include "test_resource.h"
+
+#if COAP_SERVER_SUPPORT
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if COAP_CLIENT_SUPPORT && !defined(WITH_CONTIKI) && !defined(WITH_LWIP)
+#include <unistd.h>
+#define FILE_TESTS 1
+#endif /* COAP_CLIENT_SUPPORT && ! WITH_CONTIKI && ! WITH_LWIP */
+
+static coap_context_t *ctx;       /* Holds the coap context for all tests */
+
+static coap_resource_t *
+add_resource(const char *path, int flags) {
+  coap_resource_t *r;
+
+  r = coap_resource_init(coap_make_str_const(path), flags);
+  if (r)
+    coap_add_resource(ctx, r);
+  return r;
+}
+
+/* Routes a request for the '/' separated segments in path */
+static coap_resource_t *
+route(const char *path, coap_pdu_t **request) {
+  coap_pdu_t *pdu;
+  coap_resource_t *r;
+  const char *seg = path;
+  const char *end;
+
+  pdu = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_CODE_GET, 0, 256);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(pdu);
+  while (*path) {
+    end = strchr(seg, '/');
+    if (!end)
+      end = seg + strlen(seg);
+    coap_add_option(pdu, COAP_OPTION_URI_PATH, end - seg,
+                    (const uint8_t *)seg);
+    if (!*end)
+      break;
+    seg = end + 1;
+  }
+  r = coap_resource_match(ctx, pdu);
+  if (request)
+    *request = pdu;
+  else
+    coap_delete_pdu(pdu);
+  return r;
+}
+
+static void
+t_resource_exact(void) {
+  coap_resource_t *root = add_resource("", 0);
+  coap_resource_t *a = add_resource("exact/a", 0);
+  coap_resource_t *b = add_resource("exact/b%20c", 0);
+
+  CU_ASSERT(route("", NULL) == root);
+  CU_ASSERT(route("exact/a", NULL) == a);
+  CU_ASSERT(route("exact/b c", NULL) == b);
+  CU_ASSERT_PTR_NULL(route("exact", NULL));
+  CU_ASSERT_PTR_NULL(route("exact/a/x", NULL));
+  CU_ASSERT_PTR_NULL(route("exact/b%20c", NULL));
+
+  /* Deleting a resource takes it out of the trie */
+  coap_delete_resource(ctx, a);
+  CU_ASSERT_PTR_NULL(route("exact/a", NULL));
+  CU_ASSERT(route("exact/b c", NULL) == b);
+}
+
+static void
+t_resource_template(void) {
+  coap_resource_t *temp = add_resource("dev/{id}/temp",
+                                       COAP_RESOURCE_FLAGS_URI_TEMPLATE);
+  coap_resource_t *hum = add_resource("dev/{id}/hum",
+                                      COAP_RESOURCE_FLAGS_URI_TEMPLATE);
+  coap_resource_t *fixed = add_resource("dev/42/temp", 0);
+  coap_resource_t *r;
+  coap_pdu_t *request;
+  coap_str_const_t value;
+
+  r = route("dev/7/temp", &request);
+  CU_ASSERT(r == temp);
+  CU_ASSERT(coap_resource_get_uri_param(r, request, "id", &value) == 1);
+  CU_ASSERT(value.length == 1 && value.s[0] == '7');
+  CU_ASSERT(coap_resource_get_uri_param(r, request, "ident", &value) == 0);
+  coap_delete_pdu(request);
+
+  CU_ASSERT(route("dev/7/hum", NULL) == hum);
+  CU_ASSERT(route("dev/42/temp", NULL) == fixed);
+  /* Falls back from the exact segment to the template */
+  CU_ASSERT(route("dev/42/hum", NULL) == hum);
+  CU_ASSERT_PTR_NULL(route("dev/7", NULL));
+  CU_ASSERT_PTR_NULL(route("dev/7/temp/x", NULL));
+
+  /* Without the flag, the braces are just part of the path */
+  r = add_resource("lit/{id}", 0);
+  CU_ASSERT(route("lit/{id}", NULL) == r);
+  CU_ASSERT_PTR_NULL(route("lit/1", NULL));
+}
+
+static void
+t_resource_prefix(void) {
+  coap_resource_t *all = add_resource("files/*",
+                                      COAP_RESOURCE_FLAGS_URI_TEMPLATE);
+  coap_resource_t *fw = add_resource("files/fw/*",
+                                     COAP_RESOURCE_FLAGS_URI_TEMPLATE);
+  coap_resource_t *readme = add_resource("files/readme", 0);
+
+  CU_ASSERT(route("files", NULL) == all);
+  CU_ASSERT(route("files/a/b/c", NULL) == all);
+  CU_ASSERT(route("files/readme", NULL) == readme);
+  CU_ASSERT(route("files/readme/x", NULL) == all);
+  CU_ASSERT(route("files/fw", NULL) == fw);
+  CU_ASSERT(route("files/fw/1/2", NULL) == fw);
+
+  coap_delete_resource(ctx, fw);
+  CU_ASSERT(route("files/fw/1/2", NULL) == all);
+  coap_delete_resource(ctx, all);
+  CU_ASSERT_PTR_NULL(route("files/a", NULL));
+  CU_ASSERT(route("files/readme", NULL) == readme);
+}
+
+#ifdef FILE_TESTS
+static coap_context_t *client_ctx; /* Sends requests to the resources */
+static coap_session_t *client;     /* client_ctx session to ctx */
+static char file_path[] = "/tmp/coap_file_XXXXXX";
+
+static struct {
+  int called;
+  coap_pdu_code_t code;
+  uint64_t etag;
+  int etag_changed;    /* a later block had a different ETag */
+  size_t length;       /* up to the end of the last block */
+  size_t total;
+  uint8_t data[4096];  /* each block at its offset */
+} result;
+
+static coap_response_t
+response_handler(coap_session_t *session, const coap_pdu_t *sent,
+                 const coap_pdu_t *received, const coap_mid_t id) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  size_t length;
+  size_t offset;
+  size_t total;
+  const uint8_t *data;
+  uint64_t etag;
+
+  (void)session;
+  (void)sent;
+  (void)id;
+  option = coap_check_option(received, COAP_OPTION_ETAG, &opt_iter);
+  etag = option ? coap_decode_var_bytes8(coap_opt_value(option),
+                                         coap_opt_length(option)) : 0;
+  if (result.called && etag != result.etag)
+    result.etag_changed = 1;
+  result.called++;
+  result.code = coap_pdu_get_code(received);
+  result.etag = etag;
+  result.length = 0;
+  if (coap_get_data_large(received, &length, &data, &offset, &total) &&
+      offset + length <= sizeof(result.data)) {
+    result.length = offset + length;
+    result.total = total;
+    memcpy(&result.data[offset], data, length);
+  }
+  return COAP_RESPONSE_OK;
+}
+
+/*
+ * Sends a code request for path over session, with query and etag if not
+ * NULL or 0
+ */
+static void
+send_request(coap_session_t *session, coap_pdu_code_t code, const char *path,
+             const char *query, uint64_t etag) {
+  coap_pdu_t *pdu;
+  uint8_t buf[8];
+
+  memset(&result, 0, sizeof(result));
+  pdu = coap_pdu_init(COAP_MESSAGE_CON, code, coap_new_message_id(session),
+                      coap_session_max_pdu_size(session));
+  CU_ASSERT_PTR_NOT_NULL_FATAL(pdu);
+  coap_add_option(pdu, COAP_OPTION_URI_PATH, strlen(path),
+                  (const uint8_t *)path);
+  if (query)
+    coap_add_option(pdu, COAP_OPTION_URI_QUERY, strlen(query),
+                    (const uint8_t *)query);
+  if (etag)
+    coap_add_option(pdu, COAP_OPTION_ETAG,
+                    coap_encode_var_safe8(buf, sizeof(buf), etag), buf);
+  CU_ASSERT_FATAL(coap_send(session, pdu) != COAP_INVALID_MID);
+}
+
+static void
+send_get(coap_session_t *session, const char *path, uint64_t etag) {
+  send_request(session, COAP_REQUEST_CODE_GET, path, NULL, etag);
+}
+
+/* Sends a code request from client, as send_request(), and waits */
+static void
+request(coap_pdu_code_t code, const char *path, const char *query,
+        uint64_t etag) {
+  int i;
+
+  send_request(client, code, path, query, etag);
+  for (i = 0; i < 100 && !result.called; i++) {
+    coap_io_process(ctx, 10);
+    coap_io_process(client_ctx, 10);
+  }
+  CU_ASSERT_FATAL(result.called);
+}
+
+/* Sends a GET for path, with etag if not 0, and waits for the response */
+static void
+get_file(const char *path, uint64_t etag) {
+  request(COAP_REQUEST_CODE_GET, path, NULL, etag);
+}
+
+/* Writes the file in place, keeping its inode */
+static void
+write_file_data(const uint8_t *data, size_t length) {
+  FILE *fp = fopen(file_path, "wb");
+
+  CU_ASSERT_PTR_NOT_NULL_FATAL(fp);
+  CU_ASSERT(fwrite(data, 1, length, fp) == length);
+  fclose(fp);
+}
+
+static void
+write_file(const char *data) {
+  write_file_data((const uint8_t *)data, strlen(data));
+}
+
+#define CHECK_BODY(s) \
+  CU_ASSERT(result.length == strlen(s) && \
+            memcmp(result.data, s, strlen(s)) == 0)
+
+static void
+t_resource_file_get(void) {
+  coap_resource_t *r;
+  uint64_t etag;
+
+  write_file("first");
+  r = coap_resource_file_init(coap_make_str_const("file1"), file_path,
+                              COAP_MEDIATYPE_TEXT_PLAIN, 60, 0);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+  coap_add_resource(ctx, r);
+
+  get_file("file1", 0);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CONTENT);
+  CHECK_BODY("first");
+  CU_ASSERT(result.etag != 0);
+  etag = result.etag;
+
+  get_file("file1", etag);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_VALID);
+  CU_ASSERT(result.length == 0);
+  CU_ASSERT(result.etag == etag);
+
+  /* Reloaded when changed */
+  write_file("second");
+  get_file("file1", etag);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CONTENT);
+  CHECK_BODY("second");
+  CU_ASSERT(result.etag != etag);
+
+  /* Gone */
+  CU_ASSERT(unlink(file_path) == 0);
+  get_file("file1", 0);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_NOT_FOUND);
+
+  /* Not loaded */
+  CU_ASSERT_PTR_NULL(coap_resource_file_init(coap_make_str_const("file2"),
+                                             file_path,
+                                             COAP_MEDIATYPE_TEXT_PLAIN, 60,
+                                             0));
+  coap_delete_resource(ctx, r);
+}
+
+/*
+ * Without an inotify watch, changes are found from the size and
+ * modification time of the file.
+ */
+static void
+t_resource_file_stat(void) {
+  coap_resource_t *r;
+
+  write_file("first");
+  r = coap_resource_file_init(coap_make_str_const("file3"), file_path,
+                              COAP_MEDIATYPE_TEXT_PLAIN, 60, 0);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+  coap_resource_file_unwatch(r);
+  coap_add_resource(ctx, r);
+
+  get_file("file3", 0);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CONTENT);
+  CHECK_BODY("first");
+
+  /* Written in place, keeping the inode */
+  write_file("second");
+  get_file("file3", 0);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CONTENT);
+  CHECK_BODY("second");
+
+  CU_ASSERT(unlink(file_path) == 0);
+  get_file("file3", 0);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_NOT_FOUND);
+  coap_delete_resource(ctx, r);
+}
+
+/*
+ * A download in progress carries on with the contents the file had when it
+ * started, even if the file is re-written in place (and shrinks) between
+ * two of its blocks.
+ */
+static void
+t_resource_file_rewrite(void) {
+  coap_resource_t *r;
+  coap_session_t *session;
+  uint8_t data[3000];
+  size_t i;
+
+  for (i = 0; i < sizeof(data); i++)
+    data[i] = (uint8_t)(i / 7);
+  write_file_data(data, sizeof(data));
+  r = coap_resource_file_init(coap_make_str_const("file4"), file_path,
+                              COAP_MEDIATYPE_TEXT_PLAIN, 60, 0);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+  coap_add_resource(ctx, r);
+
+  /* Each block is passed to the response handler as it arrives */
+  coap_context_set_block_mode(client_ctx, COAP_BLOCK_USE_LIBCOAP);
+  session = coap_new_client_session(client_ctx, NULL,
+                                    coap_session_get_addr_remote(client),
+                                    COAP_PROTO_UDP);
+  coap_context_set_block_mode(client_ctx,
+                              COAP_BLOCK_USE_LIBCOAP | COAP_BLOCK_SINGLE_BODY);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(session);
+
+  send_get(session, "file4", 0);
+  for (i = 0; i < 100 && !result.called; i++) {
+    coap_io_process(ctx, 10);
+    coap_io_process(client_ctx, 10);
+  }
+  CU_ASSERT_FATAL(result.called == 1);
+  CU_ASSERT_FATAL(result.length < sizeof(data));
+
+  write_file("shorter");
+  for (i = 0; i < 200 && result.length < sizeof(data); i++) {
+    coap_io_process(ctx, 10);
+    coap_io_process(client_ctx, 10);
+  }
+  CU_ASSERT(result.called > 1);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CONTENT);
+  CU_ASSERT(!result.etag_changed);
+  CU_ASSERT(result.length == sizeof(data));
+  CU_ASSERT(result.total == sizeof(data));
+  CU_ASSERT(memcmp(result.data, data, sizeof(data)) == 0);
+
+  /* The next download has the new contents */
+  get_file("file4", 0);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CONTENT);
+  CHECK_BODY("shorter");
+
+  coap_session_release(session);
+  coap_delete_resource(ctx, r);
+}
+
+static int rep_value;            /* changed by PUT and POST */
+static int rep_hits;             /* calls of the GET handler */
+static coap_pdu_code_t rep_code; /* what PUT and POST answer with */
+
+/* Returns the value, and the query, as text */
+static void
+hnd_rep_get(coap_resource_t *resource, coap_session_t *session,
+            const coap_pdu_t *request, const coap_string_t *query,
+            coap_pdu_t *response) {
+  char buf[32];
+
+  (void)resource;
+  (void)session;
+  (void)request;
+  rep_hits++;
+  snprintf(buf, sizeof(buf), "v%d%s%.*s", rep_value, query ? "?" : "",
+           query ? (int)query->length : 0, query ? (const char *)query->s : "");
+  coap_pdu_set_code(response, COAP_RESPONSE_CODE_CONTENT);
+  coap_add_data(response, strlen(buf), (const uint8_t *)buf);
+}
+
+static void
+hnd_rep_put(coap_resource_t *resource, coap_session_t *session,
+            const coap_pdu_t *request, const coap_string_t *query,
+            coap_pdu_t *response) {
+  (void)resource;
+  (void)session;
+  (void)request;
+  (void)query;
+  if (COAP_RESPONSE_CLASS(rep_code) == 2)
+    rep_value++;
+  coap_pdu_set_code(response, rep_code);
+}
+
+static coap_resource_t *
+add_rep_resource(const char *path) {
+  coap_resource_t *r;
+
+  r = add_resource(path, COAP_RESOURCE_FLAGS_CACHE_REPRESENTATION);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+  coap_register_handler(r, COAP_REQUEST_GET, hnd_rep_get);
+  coap_register_handler(r, COAP_REQUEST_PUT, hnd_rep_put);
+  coap_register_handler(r, COAP_REQUEST_POST, hnd_rep_put);
+  rep_value = 0;
+  rep_hits = 0;
+  rep_code = COAP_RESPONSE_CODE_CHANGED;
+  return r;
+}
+
+/*
+ * A repeated GET is answered from the kept representation without calling
+ * the handler, with 2.03 if it has the ETag, until the resource is notified
+ * of a change or changed by a successful PUT or POST.
+ */
+static void
+t_resource_rep_kept(void) {
+  coap_resource_t *r = add_rep_resource("rep1");
+  uint64_t etag;
+
+  request(COAP_REQUEST_CODE_GET, "rep1", NULL, 0);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CONTENT);
+  CHECK_BODY("v0");
+  CU_ASSERT(result.etag != 0);
+  CU_ASSERT(rep_hits == 1);
+  etag = result.etag;
+
+  request(COAP_REQUEST_CODE_GET, "rep1", NULL, 0);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CONTENT);
+  CHECK_BODY("v0");
+  CU_ASSERT(result.etag == etag);
+  CU_ASSERT(rep_hits == 1);
+
+  request(COAP_REQUEST_CODE_GET, "rep1", NULL, etag);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_VALID);
+  CU_ASSERT(result.length == 0);
+  CU_ASSERT(result.etag == etag);
+  CU_ASSERT(rep_hits == 1);
+
+  /* Another ETag gets the representation */
+  request(COAP_REQUEST_CODE_GET, "rep1", NULL, etag + 1);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CONTENT);
+  CHECK_BODY("v0");
+  CU_ASSERT(rep_hits == 1);
+
+  /* Notified of a change */
+  rep_value = 1;
+  coap_resource_notify_observers(r, NULL);
+  request(COAP_REQUEST_CODE_GET, "rep1", NULL, etag);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CONTENT);
+  CHECK_BODY("v1");
+  CU_ASSERT(result.etag != etag);
+  CU_ASSERT(rep_hits == 2);
+
+  /* A PUT that fails changes nothing */
+  rep_code = COAP_RESPONSE_CODE_BAD_REQUEST;
+  request(COAP_REQUEST_CODE_PUT, "rep1", NULL, 0);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_BAD_REQUEST);
+  request(COAP_REQUEST_CODE_GET, "rep1", NULL, 0);
+  CHECK_BODY("v1");
+  CU_ASSERT(rep_hits == 2);
+
+  rep_code = COAP_RESPONSE_CODE_CHANGED;
+  request(COAP_REQUEST_CODE_PUT, "rep1", NULL, 0);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CHANGED);
+  request(COAP_REQUEST_CODE_GET, "rep1", NULL, 0);
+  CHECK_BODY("v2");
+  CU_ASSERT(rep_hits == 3);
+
+  request(COAP_REQUEST_CODE_POST, "rep1", NULL, 0);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CHANGED);
+  request(COAP_REQUEST_CODE_GET, "rep1", NULL, 0);
+  CHECK_BODY("v3");
+  CU_ASSERT(rep_hits == 4);
+  coap_delete_resource(ctx, r);
+}
+
+/*
+ * Each Uri-Query has its own representation, the oldest being dropped to
+ * make room for a new one once COAP_RESOURCE_MAX_REPRESENTATIONS are kept.
+ */
+static void
+t_resource_rep_evict(void) {
+  coap_resource_t *r = add_rep_resource("rep2");
+  char query[8];
+  int i;
+
+  for (i = 0; i < COAP_RESOURCE_MAX_REPRESENTATIONS; i++) {
+    snprintf(query, sizeof(query), "q=%d", i);
+    request(COAP_REQUEST_CODE_GET, "rep2", query, 0);
+    CU_ASSERT(result.code == COAP_RESPONSE_CODE_CONTENT);
+  }
+  CU_ASSERT(rep_hits == COAP_RESOURCE_MAX_REPRESENTATIONS);
+
+  /* All kept */
+  request(COAP_REQUEST_CODE_GET, "rep2", "q=0", 0);
+  CHECK_BODY("v0?q=0");
+  CU_ASSERT(rep_hits == COAP_RESOURCE_MAX_REPRESENTATIONS);
+
+  /* Drops q=0, the oldest */
+  request(COAP_REQUEST_CODE_GET, "rep2", "q=new", 0);
+  CHECK_BODY("v0?q=new");
+  CU_ASSERT(rep_hits == COAP_RESOURCE_MAX_REPRESENTATIONS + 1);
+  request(COAP_REQUEST_CODE_GET, "rep2", "q=1", 0);
+  CU_ASSERT(rep_hits == COAP_RESOURCE_MAX_REPRESENTATIONS + 1);
+  request(COAP_REQUEST_CODE_GET, "rep2", "q=0", 0);
+  CHECK_BODY("v0?q=0");
+  CU_ASSERT(rep_hits == COAP_RESOURCE_MAX_REPRESENTATIONS + 2);
+  coap_delete_resource(ctx, r);
+}
+
+#define OBSERVERS 4
+
+static struct {
+  int called;
+  int observe[OBSERVERS];  /* last Observe value seen for each token */
+  int body[OBSERVERS];     /* last value seen for each token */
+} notified;
+
+/* Tokens are 'a' + the observer index */
+static coap_response_t
+notify_handler(coap_session_t *session, const coap_pdu_t *sent,
+               const coap_pdu_t *received, const coap_mid_t id) {
+  coap_bin_const_t token = coap_pdu_get_token(received);
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  const uint8_t *data;
+  size_t length;
+  int i;
+
+  (void)session;
+  (void)sent;
+  (void)id;
+  if (token.length != 1 || token.s[0] < 'a' || token.s[0] >= 'a' + OBSERVERS)
+    return COAP_RESPONSE_FAIL;
+  i = token.s[0] - 'a';
+  notified.called++;
+  option = coap_check_option(received, COAP_OPTION_OBSERVE, &opt_iter);
+  notified.observe[i] = option ?
+                        (int)coap_decode_var_bytes(coap_opt_value(option),
+                                                   coap_opt_length(option)) :
+                        -1;
+  notified.body[i] = -1;
+  if (coap_get_data(received, &length, &data) && length == 2 &&
+      data[0] == 'v')
+    notified.body[i] = data[1] - '0';
+  return COAP_RESPONSE_OK;
+}
+
+static void
+wait_notified(int count) {
+  int i;
+
+  for (i = 0; i < 100 && notified.called < count; i++) {
+    coap_io_process(ctx, 10);
+    coap_io_process(client_ctx, 10);
+  }
+  CU_ASSERT_FATAL(notified.called == count);
+}
+
+/*
+ * With COAP_RESOURCE_FLAGS_NOTIFY_ENCODE_ONCE, observers of the same
+ * representation share one call of the handler, but each is sent its own
+ * token and the new Observe value.
+ */
+static void
+t_resource_notify_once(void) {
+  coap_resource_t *r;
+  coap_pdu_t *pdu;
+  uint8_t token;
+  int observe;
+  int i;
+
+  r = add_resource("once", COAP_RESOURCE_FLAGS_NOTIFY_ENCODE_ONCE |
+                           COAP_RESOURCE_FLAGS_NOTIFY_NON);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+  coap_register_handler(r, COAP_REQUEST_GET, hnd_rep_get);
+  coap_resource_set_get_observable(r, 1);
+  rep_value = 0;
+  rep_hits = 0;
+  memset(&notified, 0, sizeof(notified));
+  coap_register_response_handler(client_ctx, notify_handler);
+
+  for (i = 0; i < OBSERVERS; i++) {
+    token = (uint8_t)('a' + i);
+    pdu = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_CODE_GET,
+                        coap_new_message_id(client),
+                        coap_session_max_pdu_size(client));
+    CU_ASSERT_PTR_NOT_NULL_FATAL(pdu);
+    coap_add_token(pdu, 1, &token);
+    coap_add_option(pdu, COAP_OPTION_OBSERVE, 0, NULL);
+    coap_add_option(pdu, COAP_OPTION_URI_PATH, 4, (const uint8_t *)"once");
+    CU_ASSERT_FATAL(coap_send(client, pdu) != COAP_INVALID_MID);
+  }
+  wait_notified(OBSERVERS);
+  CU_ASSERT(rep_hits == OBSERVERS);
+  observe = notified.observe[0];
+  CU_ASSERT(observe >= 0);
+
+  rep_value = 1;
+  coap_resource_notify_observers(r, NULL);
+  wait_notified(2 * OBSERVERS);
+  CU_ASSERT(rep_hits == OBSERVERS + 1);
+  for (i = 0; i < OBSERVERS; i++) {
+    CU_ASSERT(notified.observe[i] > observe);
+    CU_ASSERT(notified.observe[i] == notified.observe[0]);
+    CU_ASSERT(notified.body[i] == 1);
+  }
+
+  for (i = 0; i < OBSERVERS; i++) {
+    coap_binary_t binary = { 1, &token };
+
+    token = (uint8_t)('a' + i);
+    CU_ASSERT(coap_cancel_observe(client, &binary, COAP_MESSAGE_CON));
+  }
+  wait_notified(3 * OBSERVERS);
+  CU_ASSERT_PTR_NULL(r->subscribers);
+  coap_register_response_handler(client_ctx, response_handler);
+  coap_delete_resource(ctx, r);
+}
+
+/*
+ * A request matching a response template is answered from it without
+ * calling the handler, unless it asks for a block.
+ */
+static void
+t_resource_response_template(void) {
+  coap_resource_t *r;
+  coap_pdu_t *response;
+  coap_pdu_t *pdu;
+  uint8_t buf[4];
+  int i;
+
+  r = add_resource("tmpl", 0);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+  coap_register_handler(r, COAP_REQUEST_GET, hnd_rep_get);
+  rep_value = 0;
+  rep_hits = 0;
+  response = coap_pdu_init(COAP_MESSAGE_ACK, COAP_RESPONSE_CODE_CONTENT, 0,
+                           COAP_DEFAULT_MTU);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(response);
+  coap_add_option(response, COAP_OPTION_CONTENT_FORMAT,
+                  coap_encode_var_safe(buf, sizeof(buf),
+                                       COAP_MEDIATYPE_TEXT_PLAIN), buf);
+  coap_add_data(response, 5, (const uint8_t *)"fixed");
+  CU_ASSERT(coap_resource_set_response_template(r, COAP_REQUEST_GET,
+                                                response));
+  CU_ASSERT(coap_resource_set_response_template(r, COAP_REQUEST_PUT,
+                                                response));
+  coap_delete_pdu(response);
+
+  for (i = 0; i < 2; i++) {
+    request(COAP_REQUEST_CODE_GET, "tmpl", NULL, 0);
+    CU_ASSERT(result.code == COAP_RESPONSE_CODE_CONTENT);
+    CHECK_BODY("fixed");
+  }
+  CU_ASSERT(rep_hits == 0);
+
+  /* Only the handler can send a block */
+  memset(&result, 0, sizeof(result));
+  pdu = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_CODE_GET,
+                      coap_new_message_id(client),
+                      coap_session_max_pdu_size(client));
+  CU_ASSERT_PTR_NOT_NULL_FATAL(pdu);
+  coap_add_option(pdu, COAP_OPTION_URI_PATH, 4, (const uint8_t *)"tmpl");
+  coap_add_option(pdu, COAP_OPTION_BLOCK2,
+                  coap_encode_var_safe(buf, sizeof(buf), 6), buf);
+  CU_ASSERT_FATAL(coap_send(client, pdu) != COAP_INVALID_MID);
+  for (i = 0; i < 100 && !result.called; i++) {
+    coap_io_process(ctx, 10);
+    coap_io_process(client_ctx, 10);
+  }
+  CU_ASSERT_FATAL(result.called);
+  CHECK_BODY("v0");
+  CU_ASSERT(rep_hits == 1);
+
+  /* No handler is needed */
+  request(COAP_REQUEST_CODE_PUT, "tmpl", NULL, 0);
+  CU_ASSERT(result.code == COAP_RESPONSE_CODE_CONTENT);
+  CHECK_BODY("fixed");
+
+  /* Removed */
+  CU_ASSERT(coap_resource_set_response_template(r, COAP_REQUEST_GET, NULL));
+  request(COAP_REQUEST_CODE_GET, "tmpl", NULL, 0);
+  CHECK_BODY("v0");
+  CU_ASSERT(rep_hits == 2);
+  coap_delete_resource(ctx, r);
+}
+
+/*
+ * The error responses of handle_request() are copied from templates kept
+ * by the context, one for each code.
+ */
+static void
+t_resource_error_template(void) {
+  coap_pdu_template_t *tmpl;
+  coap_resource_t *r;
+  int count;
+  int i;
+
+  r = add_resource("noput", 0);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+  coap_register_handler(r, COAP_REQUEST_GET, hnd_rep_get);
+
+  for (i = 0; i < 2; i++) {
+    request(COAP_REQUEST_CODE_GET, "missing", NULL, 0);
+    CU_ASSERT(result.code == COAP_RESPONSE_CODE_NOT_FOUND);
+#if COAP_ERROR_PHRASE_LENGTH > 0
+    CHECK_BODY("Not Found");
+#endif /* COAP_ERROR_PHRASE_LENGTH > 0 */
+    LL_COUNT(ctx->error_templates, tmpl, count);
+    CU_ASSERT(count == 1);
+  }
+  LL_SEARCH_SCALAR(ctx->error_templates, tmpl, code,
+                   COAP_RESPONSE_CODE_NOT_FOUND);
+  CU_ASSERT_PTR_NOT_NULL(tmpl);
+
+  for (i = 0; i < 2; i++) {
+    request(COAP_REQUEST_CODE_PUT, "noput", NULL, 0);
+    CU_ASSERT(result.code == COAP_RESPONSE_CODE_NOT_ALLOWED);
+#if COAP_ERROR_PHRASE_LENGTH > 0
+    CHECK_BODY("Method Not Allowed");
+#endif /* COAP_ERROR_PHRASE_LENGTH > 0 */
+    LL_COUNT(ctx->error_templates, tmpl, count);
+    CU_ASSERT(count == 2);
+  }
+  coap_delete_resource(ctx, r);
+}
+#endif /* FILE_TESTS */
+
+static int
+t_resource_tests_create(void) {
+  ctx = coap_new_context(NULL);
+  if (!ctx)
+    return 1;
+#ifdef FILE_TESTS
+  {
+    coap_address_t addr;
+    coap_endpoint_t *ep;
+    int fd;
+
+    fd = mkstemp(file_path);
+    if (fd == -1)
+      return 1;
+    close(fd);
+    coap_address_init(&addr);
+    addr.size = sizeof(struct sockaddr_in);
+    addr.addr.sin.sin_family = AF_INET;
+    addr.addr.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ep = coap_new_endpoint(ctx, &addr, COAP_PROTO_UDP);
+    client_ctx = coap_new_context(NULL);
+    if (!ep || !client_ctx)
+      return 1;
+    coap_context_set_block_mode(ctx, COAP_BLOCK_USE_LIBCOAP);
+    coap_context_set_block_mode(client_ctx,
+                                COAP_BLOCK_USE_LIBCOAP | COAP_BLOCK_SINGLE_BODY);
+    coap_register_response_handler(client_ctx, response_handler);
+    client = coap_new_client_session(client_ctx, NULL, &ep->bind_addr,
+                                     COAP_PROTO_UDP);
+    if (!client)
+      return 1;
+  }
+#endif /* FILE_TESTS */
+  return 0;
+}
+
+static int
+t_resource_tests_remove(void) {
+#ifdef FILE_TESTS
+  coap_free_context(client_ctx);
+  unlink(file_path);
+#endif /* FILE_TESTS */
+  coap_free_context(ctx);
+  return 0;
+}
+
+CU_pSuite
+t_init_resource_tests(void) {
+  CU_pSuite suite;
+
+  suite = CU_add_suite("resource routing", t_resource_tests_create,
+                       t_resource_tests_remove);
+  if (!suite) {                        /* signal error */
+    fprintf(stderr, "W: cannot add resource routing test suite (%s)\n",
+            CU_get_error_msg());
+
+    return NULL;
+  }
+
+#define RESOURCE_TEST(s,t)                                        \
+  if (!CU_ADD_TEST(s,t)) {                                        \
+    fprintf(stderr, "W: cannot add resource routing test (%s)\n", \
+            CU_get_error_msg());                                  \
+  }
+
+  RESOURCE_TEST(suite, t_resource_exact);
+  RESOURCE_TEST(suite, t_resource_template);
+  RESOURCE_TEST(suite, t_resource_prefix);
+#ifdef FILE_TESTS
+  RESOURCE_TEST(suite, t_resource_file_get);
+  RESOURCE_TEST(suite, t_resource_file_stat);
+  RESOURCE_TEST(suite, t_resource_file_rewrite);
+  RESOURCE_TEST(suite, t_resource_rep_kept);
+  RESOURCE_TEST(suite, t_resource_rep_evict);
+  RESOURCE_TEST(suite, t_resource_notify_once);
+  RESOURCE_TEST(suite, t_resource_response_template);
+  RESOURCE_TEST(suite, t_resource_error_template);
+#endif /* FILE_TESTS */
+
+  return suite;
+}
+#endif /* COAP_SERVER_SUPPORT */
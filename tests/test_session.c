@@ -165,6 +165,427 @@ t_session6(void) {
   coap_session_release(session);
 }
 
+/* Test 7 checks that the session and context traffic counters are
+ * maintained */
+static void
+t_session7(void) {
+  coap_address_t saddr;
+  coap_stats_t ctx_before, stats;
+  coap_pdu_t *pdu;
+  uint8_t runt[] = { 0x50, 0x01 };
+
+  coap_address_init(&saddr);
+  saddr.size = sizeof(struct sockaddr_in6);
+  saddr.addr.sin6.sin6_family = AF_INET6;
+  saddr.addr.sin6.sin6_addr = in6addr_loopback;
+  saddr.addr.sin6.sin6_port = htons(20000);
+
+  coap_context_get_stats(ctx, &ctx_before);
+  session = coap_new_client_session(ctx, NULL, &saddr, COAP_PROTO_UDP);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(session);
+
+  coap_session_get_stats(session, &stats);
+  CU_ASSERT(stats.pdus_sent == 0);
+  CU_ASSERT(stats.bytes_sent == 0);
+
+  pdu = coap_pdu_init(COAP_MESSAGE_NON, COAP_REQUEST_CODE_GET,
+                      coap_new_message_id(session),
+                      coap_session_max_pdu_size(session));
+  CU_ASSERT_PTR_NOT_NULL_FATAL(pdu);
+  CU_ASSERT(coap_send(session, pdu) != COAP_INVALID_MID);
+
+  coap_session_get_stats(session, &stats);
+  CU_ASSERT(stats.pdus_sent == 1);
+  CU_ASSERT(stats.bytes_sent == 4);
+
+  CU_ASSERT(coap_handle_dgram(ctx, session, runt, sizeof(runt)) == -1);
+  coap_session_get_stats(session, &stats);
+  CU_ASSERT(stats.bad_pdus == 1);
+
+  coap_context_get_stats(ctx, &stats);
+  CU_ASSERT(stats.pdus_sent == ctx_before.pdus_sent + 1);
+  CU_ASSERT(stats.bytes_sent == ctx_before.bytes_sent + 4);
+  CU_ASSERT(stats.bad_pdus == ctx_before.bad_pdus + 1);
+
+  coap_session_release(session);
+  session = NULL;
+}
+
+/* Test 8 checks the shared RTT estimator and the resulting RTO */
+static void
+t_session8(void) {
+  coap_address_t saddr;
+  coap_session_t *session2;
+  coap_rtt_info_t info;
+  coap_queue_t node;
+  coap_tick_t now, rto, expect;
+
+  coap_address_init(&saddr);
+  saddr.size = sizeof(struct sockaddr_in6);
+  saddr.addr.sin6.sin6_family = AF_INET6;
+  saddr.addr.sin6.sin6_addr = in6addr_loopback;
+  saddr.addr.sin6.sin6_port = htons(20000);
+
+  coap_context_set_rtt_estimation(ctx, COAP_RTT_ESTIMATION_SHARED);
+  session = coap_new_client_session(ctx, NULL, &saddr, COAP_PROTO_UDP);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(session);
+  saddr.addr.sin6.sin6_port = htons(20001);
+  session2 = coap_new_client_session(ctx, NULL, &saddr, COAP_PROTO_UDP);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(session2);
+
+  /* Estimators are attached when the first timeout is calculated */
+  CU_ASSERT(coap_session_get_rtt_info(session, &info) == 0);
+  CU_ASSERT(coap_calc_timeout(session, 0) == 2 * COAP_TICKS_PER_SECOND);
+  CU_ASSERT(coap_calc_timeout(session2, 0) == 2 * COAP_TICKS_PER_SECOND);
+  CU_ASSERT(coap_session_get_rtt_info(session2, &info) == 1);
+  CU_ASSERT(info.shared == 2);
+  CU_ASSERT(info.rto == 2 * COAP_TICKS_PER_SECOND);
+
+  /* A strong sample of 100ms (ticks may start at 0, so measure forwards) */
+  coap_ticks(&now);
+  memset(&node, 0, sizeof(node));
+  node.tx_time = now;
+  now += COAP_TICKS_PER_SECOND / 10;
+  coap_session_rtt_update(session, &node, now);
+
+  rto = COAP_TICKS_PER_SECOND / 10 + 4 * (COAP_TICKS_PER_SECOND / 20);
+  expect = (2 * COAP_TICKS_PER_SECOND + rto) / 2;
+  CU_ASSERT(coap_session_get_rtt_info(session2, &info) == 1);
+  CU_ASSERT(info.strong_samples == 1);
+  CU_ASSERT(info.srtt_strong == COAP_TICKS_PER_SECOND / 10);
+  CU_ASSERT(info.rto == expect);
+  CU_ASSERT(coap_calc_timeout(session2, 0) == expect);
+
+  /* Samples after more than 2 retransmissions are ignored */
+  node.retransmit_cnt = 3;
+  coap_session_rtt_update(session, &node, now);
+  CU_ASSERT(coap_session_get_rtt_info(session, &info) == 1);
+  CU_ASSERT(info.weak_samples == 0);
+  CU_ASSERT(info.rto == expect);
+
+  coap_session_release(session2);
+  CU_ASSERT(coap_session_get_rtt_info(session, &info) == 1);
+  CU_ASSERT(info.shared == 1);
+  coap_session_release(session);
+  session = NULL;
+  CU_ASSERT_PTR_NULL(ctx->rtt_estimators);
+  coap_context_set_rtt_estimation(ctx, COAP_RTT_ESTIMATION_NONE);
+}
+
+#if COAP_CONNECT_RACE
+#include <arpa/inet.h>
+#include <unistd.h>
+
+/* Listens on a TCP socket, returning the fd, with *port set if it was 0 */
+static int
+listen_tcp(const coap_address_t *addr, uint16_t *port, int backlog) {
+  coap_address_t bound;
+  socklen_t size;
+  int on = 1;
+  int fd;
+
+  coap_address_copy(&bound, addr);
+  coap_address_set_port(&bound, *port);
+  fd = socket(bound.addr.sa.sa_family, SOCK_STREAM, 0);
+  if (fd == -1)
+    return -1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (bind(fd, &bound.addr.sa, bound.size) == -1 || listen(fd, backlog) == -1) {
+    close(fd);
+    return -1;
+  }
+  size = bound.size;
+  getsockname(fd, &bound.addr.sa, &size);
+  *port = coap_address_get_port(&bound);
+  return fd;
+}
+
+/* Holds addr[] in the resolver cache of c as the addresses of name */
+static coap_resolve_entry_t *
+add_host(coap_context_t *c, const char *name, const coap_address_t *addr,
+         size_t count, uint16_t port) {
+  coap_resolve_entry_t *entry;
+  coap_addr_info_t **last;
+  coap_tick_t now;
+  size_t i;
+
+  entry = coap_malloc_type(COAP_STRING,
+                           sizeof(coap_resolve_entry_t) + strlen(name));
+  if (!entry)
+    return NULL;
+  memset(entry, 0, sizeof(coap_resolve_entry_t));
+  strcpy(entry->host, name);
+  entry->host_length = strlen(name);
+  entry->port = entry->secure_port = port;
+  entry->scheme_hint_bits = COAP_URI_SCHEME_COAP_TCP_BIT;
+  coap_ticks(&now);
+  entry->expire = now + 60 * COAP_TICKS_PER_SECOND;
+  last = &entry->info_list;
+  for (i = 0; i < count; i++) {
+    *last = coap_malloc_type(COAP_STRING, sizeof(coap_addr_info_t));
+    if (!*last)
+      break;
+    memset(*last, 0, sizeof(coap_addr_info_t));
+    (*last)->scheme = COAP_URI_SCHEME_COAP_TCP;
+    coap_address_copy(&(*last)->addr, &addr[i]);
+    coap_address_set_port(&(*last)->addr, port);
+    last = &(*last)->next;
+  }
+  LL_PREPEND(c->resolve_cache, entry);
+  return entry;
+}
+
+/* Runs the I/O loop of c until s has connected, or for 2 seconds */
+static void
+wait_connected(coap_context_t *c, coap_session_t *s) {
+  int i;
+
+  for (i = 0; i < 40 && s->state == COAP_SESSION_STATE_CONNECTING; i++)
+    coap_io_process(c, 50);
+  /* So that the race is ended */
+  coap_io_process(c, COAP_IO_NO_WAIT);
+}
+
+static void
+loopback(coap_address_t *addr, int family, const char *ip) {
+  coap_address_init(addr);
+  if (family == AF_INET6) {
+    addr->size = sizeof(struct sockaddr_in6);
+    addr->addr.sin6.sin6_family = AF_INET6;
+    inet_pton(AF_INET6, ip, &addr->addr.sin6.sin6_addr);
+  } else {
+    addr->size = sizeof(struct sockaddr_in);
+    addr->addr.sin.sin_family = AF_INET;
+    inet_pton(AF_INET, ip, &addr->addr.sin.sin_addr);
+  }
+}
+
+/*
+ * Test 9 connects to a host with a listener on only its IPv4 address, after
+ * the attempt to its IPv6 address fails, and so has IPv4 listed first.
+ */
+static void
+t_session9(void) {
+  coap_context_t *c = coap_new_context(NULL);
+  coap_address_t addr[2];
+  coap_resolve_entry_t *entry;
+  coap_addr_info_t *info_list;
+  coap_str_const_t name = { 9, (const uint8_t *)"race.test" };
+  uint16_t port = 0;
+  int fd;
+
+  CU_ASSERT_PTR_NOT_NULL_FATAL(c);
+  loopback(&addr[0], AF_INET6, "::1");
+  loopback(&addr[1], AF_INET, "127.0.0.1");
+  fd = listen_tcp(&addr[1], &port, 5);
+  CU_ASSERT_FATAL(fd != -1);
+  entry = add_host(c, "race.test", addr, 2, port);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(entry);
+
+  coap_address_set_port(&addr[0], port);
+  session = coap_new_client_session(c, NULL, &addr[0], COAP_PROTO_TCP);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(session);
+  wait_connected(c, session);
+  CU_ASSERT(session->state != COAP_SESSION_STATE_CONNECTING &&
+            session->state != COAP_SESSION_STATE_NONE);
+  CU_ASSERT(session->addr_info.remote.addr.sa.sa_family == AF_INET);
+  CU_ASSERT(coap_address_get_port(&session->addr_info.remote) == port);
+  CU_ASSERT_PTR_NULL(session->connect_race);
+  CU_ASSERT(entry->prefer_family == AF_INET);
+
+  info_list = coap_context_resolve_address_info(c, &name, port, port, 0,
+                                                COAP_URI_SCHEME_COAP_TCP_BIT);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(info_list);
+  CU_ASSERT(info_list->addr.addr.sa.sa_family == AF_INET);
+  CU_ASSERT_PTR_NOT_NULL(info_list->next);
+  if (info_list->next)
+    CU_ASSERT(info_list->next->addr.addr.sa.sa_family == AF_INET6);
+  coap_free_address_info(info_list);
+
+  coap_session_release(session);
+  session = NULL;
+  close(fd);
+  coap_free_context(c);
+}
+
+/*
+ * Test 10 has the first address not answer, so that the next is tried
+ * after COAP_CONNECT_ATTEMPT_DELAY and wins the race.
+ */
+static void
+t_session10(void) {
+  coap_context_t *c = coap_new_context(NULL);
+  coap_address_t addr[2];
+  coap_resolve_entry_t *entry;
+  coap_tick_t start, now;
+  uint16_t port = 0;
+  int slow_fd, fill_fd, fd;
+
+  CU_ASSERT_PTR_NOT_NULL_FATAL(c);
+  loopback(&addr[0], AF_INET, "127.0.0.1");
+  loopback(&addr[1], AF_INET, "127.0.0.2");
+  /* A full accept queue drops the SYNs of the first address */
+  slow_fd = listen_tcp(&addr[0], &port, 0);
+  CU_ASSERT_FATAL(slow_fd != -1);
+  fd = listen_tcp(&addr[1], &port, 5);
+  CU_ASSERT_FATAL(fd != -1);
+  coap_address_set_port(&addr[0], port);
+  coap_address_set_port(&addr[1], port);
+  fill_fd = socket(AF_INET, SOCK_STREAM, 0);
+  CU_ASSERT_FATAL(fill_fd != -1);
+  CU_ASSERT(connect(fill_fd, &addr[0].addr.sa, addr[0].size) == 0);
+  entry = add_host(c, "race.test", addr, 2, port);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(entry);
+
+  coap_ticks(&start);
+  session = coap_new_client_session(c, NULL, &addr[0], COAP_PROTO_TCP);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(session);
+  CU_ASSERT_PTR_NOT_NULL(session->connect_race);
+  wait_connected(c, session);
+  coap_ticks(&now);
+  CU_ASSERT(session->state != COAP_SESSION_STATE_CONNECTING &&
+            session->state != COAP_SESSION_STATE_NONE);
+  CU_ASSERT(coap_address_equals(&session->addr_info.remote, &addr[1]));
+  CU_ASSERT(now - start >= COAP_CONNECT_ATTEMPT_DELAY *
+            COAP_TICKS_PER_SECOND / 1000);
+  CU_ASSERT_PTR_NULL(session->connect_race);
+  CU_ASSERT(entry->prefer_family == AF_INET);
+
+  coap_session_release(session);
+  session = NULL;
+  close(fill_fd);
+  close(slow_fd);
+  close(fd);
+  coap_free_context(c);
+}
+#endif /* COAP_CONNECT_RACE */
+
+#if COAP_SERVER_SUPPORT && !COAP_DISABLE_TCP
+#define COALESCE_PDUS 5
+
+static struct {
+  int received;               /* requests seen by the server */
+  uint8_t seq[COALESCE_PDUS + 1]; /* their payloads, in order */
+  int responses;              /* responses seen by the client */
+} coalesce;
+
+static void
+hnd_coalesce_put(coap_resource_t *resource, coap_session_t *s,
+                 const coap_pdu_t *request, const coap_string_t *query,
+                 coap_pdu_t *response) {
+  const uint8_t *data;
+  size_t length;
+
+  (void)resource;
+  (void)s;
+  (void)query;
+  if (coap_get_data(request, &length, &data) && length == 1 &&
+      coalesce.received < (int)sizeof(coalesce.seq))
+    coalesce.seq[coalesce.received] = data[0];
+  coalesce.received++;
+  coap_pdu_set_code(response, COAP_RESPONSE_CODE_CHANGED);
+}
+
+static coap_response_t
+coalesce_response_handler(coap_session_t *s, const coap_pdu_t *sent,
+                          const coap_pdu_t *received, const coap_mid_t id) {
+  (void)s;
+  (void)sent;
+  (void)id;
+  if (coap_pdu_get_code(received) == COAP_RESPONSE_CODE_CHANGED)
+    coalesce.responses++;
+  return COAP_RESPONSE_OK;
+}
+
+/* Sends a PUT with the one byte payload value, returning its size */
+static size_t
+coalesce_put(coap_session_t *s, uint8_t value) {
+  coap_pdu_t *pdu;
+  size_t size;
+
+  pdu = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_CODE_PUT,
+                      coap_new_message_id(s), coap_session_max_pdu_size(s));
+  CU_ASSERT_PTR_NOT_NULL_FATAL(pdu);
+  coap_add_option(pdu, COAP_OPTION_URI_PATH, 3, (const uint8_t *)"seq");
+  coap_add_data(pdu, 1, &value);
+  CU_ASSERT_FATAL(coap_pdu_encode_header(pdu, s->proto) != 0);
+  size = pdu->hdr_size + pdu->used_size;
+  CU_ASSERT_FATAL(coap_send(s, pdu) != COAP_INVALID_MID);
+  return size;
+}
+
+static void
+coalesce_wait(coap_context_t *server, coap_context_t *client, int responses) {
+  int i;
+
+  for (i = 0; i < 100 && coalesce.responses < responses; i++) {
+    coap_io_process(server, 10);
+    coap_io_process(client, 10);
+  }
+  CU_ASSERT_FATAL(coalesce.responses == responses);
+}
+
+/*
+ * Test 11 has PDUs sent on a TCP session before the next I/O pass held in
+ * the session's output buffer, and written out together in order.
+ */
+static void
+t_session11(void) {
+  coap_context_t *server = coap_new_context(NULL);
+  coap_context_t *client = coap_new_context(NULL);
+  coap_endpoint_t *ep;
+  coap_resource_t *r;
+  coap_address_t addr;
+  size_t total = 0;
+  int i;
+
+  CU_ASSERT_PTR_NOT_NULL_FATAL(server);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(client);
+  memset(&coalesce, 0, sizeof(coalesce));
+  coap_address_init(&addr);
+  addr.size = sizeof(struct sockaddr_in);
+  addr.addr.sin.sin_family = AF_INET;
+  addr.addr.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  ep = coap_new_endpoint(server, &addr, COAP_PROTO_TCP);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(ep);
+  r = coap_resource_init(coap_make_str_const("seq"), 0);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+  coap_register_handler(r, COAP_REQUEST_PUT, hnd_coalesce_put);
+  coap_add_resource(server, r);
+
+  coap_context_set_write_coalesce_size(client, 1024);
+  coap_register_response_handler(client, coalesce_response_handler);
+  session = coap_new_client_session(client, NULL, &ep->bind_addr,
+                                    COAP_PROTO_TCP);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(session);
+
+  /* Get the session established */
+  coalesce_put(session, 'x');
+  coalesce_wait(server, client, 1);
+  CU_ASSERT(session->state == COAP_SESSION_STATE_ESTABLISHED);
+  CU_ASSERT(session->write_buf_used == 0);
+
+  for (i = 0; i < COALESCE_PDUS; i++) {
+    total += coalesce_put(session, (uint8_t)('0' + i));
+    /* Held back, not written */
+    CU_ASSERT(session->write_buf_used == total);
+  }
+  CU_ASSERT(coalesce.received == 1);
+  /* All go out with one write */
+  CU_ASSERT(coap_session_flush_write_buf(session) == 1);
+  CU_ASSERT(session->write_buf_used == 0);
+
+  coalesce_wait(server, client, 1 + COALESCE_PDUS);
+  CU_ASSERT(coalesce.received == 1 + COALESCE_PDUS);
+  CU_ASSERT(memcmp(coalesce.seq, "x01234", 1 + COALESCE_PDUS) == 0);
+
+  coap_session_release(session);
+  session = NULL;
+  coap_free_context(client);
+  coap_free_context(server);
+}
+#endif /* COAP_SERVER_SUPPORT && !COAP_DISABLE_TCP */
+
 /* This function creates a set of nodes for testing. These nodes
  * will exist for all tests and are modified by coap_insert_node()
  * and coap_remove_from_queue().
@@ -220,6 +641,15 @@ t_init_session_tests(void) {
   SESSION_TEST(suite, t_session4);
   SESSION_TEST(suite, t_session5);
   SESSION_TEST(suite, t_session6);
+  SESSION_TEST(suite, t_session7);
+  SESSION_TEST(suite, t_session8);
+#if COAP_CONNECT_RACE
+  SESSION_TEST(suite, t_session9);
+  SESSION_TEST(suite, t_session10);
+#endif /* COAP_CONNECT_RACE */
+#if COAP_SERVER_SUPPORT && !COAP_DISABLE_TCP
+  SESSION_TEST(suite, t_session11);
+#endif /* COAP_SERVER_SUPPORT && !COAP_DISABLE_TCP */
 
   return suite;
 }
@@ -0,0 +1,368 @@
+/* libcoap unit tests
+ *
+ * Copyright (C) 2023 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "test_common.h"
+#include "test_subscribe.h"
+
+#if COAP_SERVER_SUPPORT
+#if COAP_CLIENT_SUPPORT
+#include <assert.h>
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Can be raised to use the suite as a benchmark */
+#ifndef TEST_SUBSCRIBE_RESOURCES
+#define TEST_SUBSCRIBE_RESOURCES 1000
+#endif /* TEST_SUBSCRIBE_RESOURCES */
+#ifndef TEST_SUBSCRIBE_SESSIONS
+#define TEST_SUBSCRIBE_SESSIONS 4
+#endif /* TEST_SUBSCRIBE_SESSIONS */
+#ifndef TEST_SUBSCRIBE_LOOKUPS
+#define TEST_SUBSCRIBE_LOOKUPS 100000
+#endif /* TEST_SUBSCRIBE_LOOKUPS */
+
+static coap_context_t *ctx;       /* Holds the coap context for all tests */
+static coap_session_t *session[TEST_SUBSCRIBE_SESSIONS];
+static coap_resource_t *resource[TEST_SUBSCRIBE_RESOURCES];
+
+static coap_pdu_t *
+subscribe_request(coap_resource_t *r, coap_bin_const_t *token) {
+  coap_pdu_t *request;
+  uint8_t buf[4];
+
+  request = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_CODE_GET, 0, 128);
+  if (!request)
+    return NULL;
+  coap_add_token(request, token->length, token->s);
+  coap_add_option(request, COAP_OPTION_OBSERVE,
+                  coap_encode_var_safe(buf, sizeof(buf),
+                                       COAP_OBSERVE_ESTABLISH), buf);
+  coap_add_option(request, COAP_OPTION_URI_PATH, r->uri_path->length,
+                  r->uri_path->s);
+  return request;
+}
+
+static coap_subscription_t *
+subscribe(coap_resource_t *r, coap_session_t *s, uint32_t token_value) {
+  coap_subscription_t *subscription;
+  coap_pdu_t *request;
+  uint8_t buf[4];
+  coap_bin_const_t token;
+
+  token.length = coap_encode_var_safe(buf, sizeof(buf), token_value);
+  token.s = buf;
+  request = subscribe_request(r, &token);
+  if (!request)
+    return NULL;
+  subscription = coap_add_observer(r, s, &token, request);
+  coap_delete_pdu(request);
+  return subscription;
+}
+
+static coap_subscription_t *
+find(coap_resource_t *r, coap_session_t *s, uint32_t token_value) {
+  uint8_t buf[4];
+  coap_bin_const_t token;
+
+  token.length = coap_encode_var_safe(buf, sizeof(buf), token_value);
+  token.s = buf;
+  return coap_find_observer(r, s, &token);
+}
+
+static unsigned int
+session_count(coap_session_t *s) {
+  coap_subscription_t *obs;
+  unsigned int count = 0;
+
+  DL_FOREACH2(s->subscriptions, obs, session_next) {
+    count++;
+  }
+  return count;
+}
+
+static unsigned int
+resource_count(coap_resource_t *r) {
+  coap_subscription_t *obs;
+  unsigned int count = 0;
+
+  LL_COUNT(r->subscribers, obs, count);
+  CU_ASSERT(count == HASH_COUNT(r->subscriber_hash));
+  return count;
+}
+
+/* Add, find and replace a single subscription */
+static void
+t_subscribe1(void) {
+  coap_subscription_t *s1, *s2;
+
+  s1 = subscribe(resource[0], session[0], 1);
+  CU_ASSERT_PTR_NOT_NULL(s1);
+  CU_ASSERT(find(resource[0], session[0], 1) == s1);
+  CU_ASSERT(coap_find_observer(resource[0], session[0], NULL) == s1);
+  CU_ASSERT_PTR_NULL(find(resource[0], session[0], 2));
+  CU_ASSERT_PTR_NULL(find(resource[0], session[1], 1));
+  CU_ASSERT_PTR_NULL(find(resource[1], session[0], 1));
+
+  /* Same token is the same subscription */
+  CU_ASSERT(subscribe(resource[0], session[0], 1) == s1);
+  CU_ASSERT(resource_count(resource[0]) == 1);
+
+  /* Same request with a new token replaces the subscription */
+  s2 = subscribe(resource[0], session[0], 2);
+  CU_ASSERT_PTR_NOT_NULL(s2);
+  CU_ASSERT_PTR_NULL(find(resource[0], session[0], 1));
+  CU_ASSERT(find(resource[0], session[0], 2) == s2);
+  CU_ASSERT(resource_count(resource[0]) == 1);
+  CU_ASSERT(session_count(session[0]) == 1);
+
+  CU_ASSERT(coap_delete_observer(resource[0], session[0],
+                                 &s2->pdu->actual_token) == 1);
+  CU_ASSERT(resource_count(resource[0]) == 0);
+  CU_ASSERT(session_count(session[0]) == 0);
+}
+
+/* Every session observes every resource */
+static void
+t_subscribe2(void) {
+  unsigned int i, j;
+  int ok = 1;
+
+  for (i = 0; i < TEST_SUBSCRIBE_RESOURCES; i++) {
+    for (j = 0; j < TEST_SUBSCRIBE_SESSIONS; j++) {
+      if (!subscribe(resource[i], session[j], i * TEST_SUBSCRIBE_SESSIONS + j))
+        ok = 0;
+    }
+  }
+  CU_ASSERT(ok);
+
+  for (i = 0; i < TEST_SUBSCRIBE_RESOURCES; i++) {
+    for (j = 0; j < TEST_SUBSCRIBE_SESSIONS; j++) {
+      coap_subscription_t *s;
+
+      s = find(resource[i], session[j], i * TEST_SUBSCRIBE_SESSIONS + j);
+      if (!s || s->session != session[j] || s->resource != resource[i])
+        ok = 0;
+      /* Token of another session */
+      if (find(resource[i], session[j],
+               i * TEST_SUBSCRIBE_SESSIONS + (j + 1) % TEST_SUBSCRIBE_SESSIONS))
+        ok = 0;
+    }
+    if (resource_count(resource[i]) != TEST_SUBSCRIBE_SESSIONS)
+      ok = 0;
+  }
+  CU_ASSERT(ok);
+  for (j = 0; j < TEST_SUBSCRIBE_SESSIONS; j++) {
+    CU_ASSERT(session_count(session[j]) == TEST_SUBSCRIBE_RESOURCES);
+  }
+}
+
+/* Session teardown only removes that session's subscriptions */
+static void
+t_subscribe3(void) {
+  unsigned int i, j;
+  int ok = 1;
+
+  coap_delete_observers(ctx, session[0]);
+  CU_ASSERT_PTR_NULL(session[0]->subscriptions);
+
+  for (i = 0; i < TEST_SUBSCRIBE_RESOURCES; i++) {
+    if (find(resource[i], session[0], i * TEST_SUBSCRIBE_SESSIONS))
+      ok = 0;
+    for (j = 1; j < TEST_SUBSCRIBE_SESSIONS; j++) {
+      if (!find(resource[i], session[j], i * TEST_SUBSCRIBE_SESSIONS + j))
+        ok = 0;
+    }
+    if (resource_count(resource[i]) != TEST_SUBSCRIBE_SESSIONS - 1)
+      ok = 0;
+  }
+  CU_ASSERT(ok);
+  for (j = 1; j < TEST_SUBSCRIBE_SESSIONS; j++) {
+    CU_ASSERT(session_count(session[j]) == TEST_SUBSCRIBE_RESOURCES);
+  }
+}
+
+/* Deleting a resource removes its subscriptions from the sessions */
+static void
+t_subscribe4(void) {
+  unsigned int j;
+  coap_log_t level = coap_get_log_level();
+
+  /* The 4.04 notifications have nowhere to go */
+  coap_set_log_level(COAP_LOG_EMERG);
+  coap_delete_resource(ctx, resource[0]);
+  coap_set_log_level(level);
+  resource[0] = NULL;
+  for (j = 1; j < TEST_SUBSCRIBE_SESSIONS; j++) {
+    CU_ASSERT(session_count(session[j]) == TEST_SUBSCRIBE_RESOURCES - 1);
+    CU_ASSERT_PTR_NULL(find(resource[1], session[j], j));
+  }
+}
+
+/* Observers of the same representation share a notify key */
+static void
+t_subscribe5(void) {
+  coap_subscription_t *obs;
+  coap_cache_key_t *key, *other;
+  unsigned int j;
+  uint32_t observe = resource[1]->observe;
+
+  key = coap_observer_notify_key(find(resource[1], session[1],
+                                      TEST_SUBSCRIBE_SESSIONS + 1));
+  other = coap_observer_notify_key(find(resource[2], session[1],
+                                        2 * TEST_SUBSCRIBE_SESSIONS + 1));
+  CU_ASSERT_PTR_NOT_NULL_FATAL(key);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(other);
+  CU_ASSERT(memcmp(key, other, sizeof(*key)) != 0);
+
+  CU_ASSERT(coap_resource_observers_by_key(resource[1], key, 0) ==
+            TEST_SUBSCRIBE_SESSIONS - 1);
+  CU_ASSERT(coap_resource_observers_by_key(resource[1], other, 0) == 0);
+  CU_ASSERT(coap_resource_observers_by_key(resource[1], other, 1) == 0);
+  CU_ASSERT(resource[1]->partiallydirty == 0);
+  CU_ASSERT(resource[1]->observe == observe);
+
+  CU_ASSERT(coap_resource_observers_by_key(resource[1], key, 1) ==
+            TEST_SUBSCRIBE_SESSIONS - 1);
+  CU_ASSERT(resource[1]->partiallydirty == 1);
+  CU_ASSERT(resource[1]->dirty == 0);
+  CU_ASSERT(resource[1]->observe == observe + 1);
+  for (j = 1; j < TEST_SUBSCRIBE_SESSIONS; j++) {
+    obs = find(resource[1], session[j], TEST_SUBSCRIBE_SESSIONS + j);
+    CU_ASSERT(obs && obs->dirty);
+    /* Nothing is to be sent */
+    if (obs)
+      obs->dirty = 0;
+  }
+  resource[1]->partiallydirty = 0;
+  ctx->observe_pending = 0;
+}
+
+/*
+ * Times adding session[0] as an observer of every resource, looking the
+ * observers up and tearing the session down again
+ */
+static void
+t_subscribe_speed(void) {
+  unsigned int i;
+  int ok = 1;
+  clock_t start;
+  double add, lookup, teardown;
+
+  start = clock();
+  for (i = 1; i < TEST_SUBSCRIBE_RESOURCES; i++) {
+    if (!subscribe(resource[i], session[0], i * TEST_SUBSCRIBE_SESSIONS))
+      ok = 0;
+  }
+  add = (double)(clock() - start) / CLOCKS_PER_SEC;
+  CU_ASSERT(ok);
+
+  start = clock();
+  for (i = 0; i < TEST_SUBSCRIBE_LOOKUPS; i++) {
+    unsigned int r = 1 + i % (TEST_SUBSCRIBE_RESOURCES - 1);
+
+    if (!find(resource[r], session[0], r * TEST_SUBSCRIBE_SESSIONS))
+      ok = 0;
+  }
+  lookup = (double)(clock() - start) / CLOCKS_PER_SEC;
+  CU_ASSERT(ok);
+
+  start = clock();
+  coap_delete_observers(ctx, session[0]);
+  teardown = (double)(clock() - start) / CLOCKS_PER_SEC;
+  CU_ASSERT_PTR_NULL(session[0]->subscriptions);
+
+  coap_log_info("%u resources, %u sessions: add %.3fs, %u lookups %.3fs, "
+                "teardown %.3fs\n", TEST_SUBSCRIBE_RESOURCES,
+                TEST_SUBSCRIBE_SESSIONS, add, TEST_SUBSCRIBE_LOOKUPS, lookup,
+                teardown);
+}
+
+static int
+t_subscribe_tests_create(void) {
+  coap_address_t addr;
+  unsigned int i;
+  char path[16];
+
+  coap_address_init(&addr);
+
+  addr.size = sizeof(struct sockaddr_in6);
+  addr.addr.sin6.sin6_family = AF_INET6;
+  addr.addr.sin6.sin6_addr = in6addr_loopback;
+
+  ctx = coap_new_context(NULL);
+  if (!ctx)
+    return 1;
+
+  for (i = 0; i < TEST_SUBSCRIBE_SESSIONS; i++) {
+    addr.addr.sin6.sin6_port = htons(COAP_DEFAULT_PORT + i);
+    session[i] = coap_new_client_session(ctx, NULL, &addr, COAP_PROTO_UDP);
+    if (!session[i])
+      return 1;
+  }
+  for (i = 0; i < TEST_SUBSCRIBE_RESOURCES; i++) {
+    snprintf(path, sizeof(path), "r%u", i);
+    resource[i] = coap_resource_init(coap_new_str_const((const uint8_t *)path,
+                                                        strlen(path)),
+                                     COAP_RESOURCE_FLAGS_RELEASE_URI);
+    if (!resource[i])
+      return 1;
+    coap_resource_set_get_observable(resource[i], 1);
+    coap_add_resource(ctx, resource[i]);
+  }
+  return 0;
+}
+
+static int
+t_subscribe_tests_remove(void) {
+  unsigned int j;
+
+  /* Do not send 4.04 notifications as the resources get deleted */
+  for (j = 0; j < TEST_SUBSCRIBE_SESSIONS; j++) {
+    coap_delete_observers(ctx, session[j]);
+  }
+  coap_free_context(ctx);
+  return 0;
+}
+
+CU_pSuite
+t_init_subscribe_tests(void) {
+  CU_pSuite suite;
+
+  suite = CU_add_suite("subscribe", t_subscribe_tests_create,
+                       t_subscribe_tests_remove);
+  if (!suite) {                        /* signal error */
+    fprintf(stderr, "W: cannot add subscribe test suite (%s)\n",
+            CU_get_error_msg());
+
+    return NULL;
+  }
+
+#define SUBSCRIBE_TEST(s,t)                                       \
+  if (!CU_ADD_TEST(s,t)) {                                        \
+    fprintf(stderr, "W: cannot add subscribe test (%s)\n",        \
+            CU_get_error_msg());                                  \
+  }
+
+  SUBSCRIBE_TEST(suite, t_subscribe1);
+  SUBSCRIBE_TEST(suite, t_subscribe2);
+  SUBSCRIBE_TEST(suite, t_subscribe3);
+  SUBSCRIBE_TEST(suite, t_subscribe4);
+  SUBSCRIBE_TEST(suite, t_subscribe5);
+  SUBSCRIBE_TEST(suite, t_subscribe_speed);
+
+  return suite;
+}
+#endif /* COAP_CLIENT_SUPPORT */
+#endif /* COAP_SERVER_SUPPORT */
@@ -188,6 +188,242 @@ t_wellknown4(void) {
 }
 
 
+static coap_print_status_t
+print_filtered(const char *filter, unsigned char *buf, size_t *buflen) {
+  coap_print_status_t result;
+  coap_string_t *query;
+
+  query = coap_new_string(strlen(filter));
+  CU_ASSERT_PTR_NOT_NULL_FATAL(query);
+  memcpy(query->s, filter, strlen(filter));
+  result = coap_print_wellknown(ctx, buf, buflen, 0, query);
+  coap_delete_string(query);
+  return result;
+}
+
+static void
+t_wellknown5(void) {
+  coap_print_status_t result;
+  coap_resource_t *r;
+  unsigned char buf[200];
+  unsigned char expect[200];
+  size_t buflen, expect_len;
+  coap_wkc_cache_t *cache1, *cache2;
+
+  r = coap_resource_init(coap_make_str_const("sensors/temp"), 0);
+  coap_add_attr(r, coap_make_str_const("rt"),
+                coap_make_str_const("\"temperature-c sensor\""), 0);
+  coap_add_resource(ctx, r);
+  r = coap_resource_init(coap_make_str_const("sensors/light"), 0);
+  coap_add_attr(r, coap_make_str_const("rt"),
+                coap_make_str_const("\"light-lux sensor\""), 0);
+  coap_add_resource(ctx, r);
+
+  /* Exact (indexed) and prefix (scanned) filters agree */
+  expect_len = sizeof(expect);
+  result = print_filtered("rt=sensor*", expect, &expect_len);
+  CU_ASSERT((result & COAP_PRINT_STATUS_ERROR) == 0);
+  buflen = sizeof(buf);
+  result = print_filtered("rt=sensor", buf, &buflen);
+  CU_ASSERT((result & COAP_PRINT_STATUS_ERROR) == 0);
+  CU_ASSERT(buflen == expect_len);
+  CU_ASSERT(memcmp(buf, expect, buflen) == 0);
+
+  buflen = sizeof(buf);
+  result = print_filtered("rt=light-lux", buf, &buflen);
+  CU_ASSERT(buflen == sizeof("</sensors/light>;rt=\"light-lux sensor\"") - 1);
+  buflen = sizeof(buf);
+  result = print_filtered("rt=light", buf, &buflen);
+  CU_ASSERT(buflen == 0);
+  buflen = sizeof(buf);
+  result = print_filtered("href=/sensors/temp", buf, &buflen);
+  CU_ASSERT(buflen == sizeof("</sensors/temp>;rt=\"temperature-c sensor\"") - 1);
+
+  /* Adding an attribute is seen by the next query */
+  coap_add_attr(r, coap_make_str_const("if"), coap_make_str_const("sensor"),
+                0);
+  buflen = sizeof(buf);
+  result = print_filtered("if=sensor", buf, &buflen);
+  CU_ASSERT(buflen == sizeof("</sensors/light>;if=sensor;rt=\"light-lux sensor\"") - 1);
+
+  /* The unfiltered document is kept until something changes */
+  cache1 = coap_wkc_cache_get(ctx,
+                              COAP_MEDIATYPE_APPLICATION_LINK_FORMAT);
+  cache2 = coap_wkc_cache_get(ctx,
+                              COAP_MEDIATYPE_APPLICATION_LINK_FORMAT);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(cache1);
+  CU_ASSERT(cache1 == cache2);
+  coap_wkc_cache_release(NULL, cache2);
+  coap_delete_resource(ctx, r);
+  cache2 = coap_wkc_cache_get(ctx,
+                              COAP_MEDIATYPE_APPLICATION_LINK_FORMAT);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(cache2);
+  CU_ASSERT(cache1 != cache2);
+  CU_ASSERT(cache2->length + sizeof(",</sensors/light>;if=sensor;rt=\"light-lux sensor\"") - 1 ==
+            cache1->length);
+  coap_wkc_cache_release(NULL, cache1);
+  coap_wkc_cache_release(NULL, cache2);
+}
+
+static void
+t_wellknown6(void) {
+  coap_resource_t *r;
+  coap_string_t *query;
+  uint8_t buf[64];
+  size_t buflen;
+  static const uint8_t expect[] = {
+    0x81,                                   /* array(1) */
+    0xa4,                                   /* map(4) */
+    0x01, 0x65, '/', 'c', 'b', 'o', 'r',    /* href: "/cbor" */
+    0x09, 0x82, 0x61, 'a', 0x61, 'b',       /* rt: ["a", "b"] */
+    0x63, 'f', 'o', 'o', 0xf5,              /* "foo": true */
+    0x0d, 0xf5                              /* obs: true */
+  };
+
+  r = coap_resource_init(coap_make_str_const("cbor"), 0);
+  coap_add_attr(r, coap_make_str_const("foo"), NULL, 0);
+  coap_add_attr(r, coap_make_str_const("rt"), coap_make_str_const("b"), 0);
+  coap_add_attr(r, coap_make_str_const("rt"), coap_make_str_const("\"a\""), 0);
+  coap_resource_set_get_observable(r, 1);
+  coap_add_resource(ctx, r);
+
+  query = coap_new_string(10);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(query);
+  memcpy(query->s, "href=/cbor", 10);
+
+  CU_ASSERT(coap_print_wellknown_cbor(ctx, NULL, &buflen, query) == 1);
+  CU_ASSERT(buflen == sizeof(expect));
+  /* Too small for the link, so an empty array rather than a cut map */
+  buflen = sizeof(expect) - 1;
+  CU_ASSERT(coap_print_wellknown_cbor(ctx, buf, &buflen, query) == 1);
+  CU_ASSERT(buflen == 1);
+  CU_ASSERT(buf[0] == 0x80);
+  buflen = 0;
+  CU_ASSERT(coap_print_wellknown_cbor(ctx, buf, &buflen, query) == 0);
+  buflen = sizeof(buf);
+  CU_ASSERT(coap_print_wellknown_cbor(ctx, buf, &buflen, query) == 1);
+  CU_ASSERT(buflen == sizeof(expect));
+  CU_ASSERT(memcmp(buf, expect, sizeof(expect)) == 0);
+
+  /* No match is an empty array */
+  memcpy(query->s, "href=/none", 10);
+  buflen = sizeof(buf);
+  CU_ASSERT(coap_print_wellknown_cbor(ctx, buf, &buflen, query) == 1);
+  CU_ASSERT(buflen == 1);
+  CU_ASSERT(buf[0] == 0x80);
+
+  coap_delete_string(query);
+  coap_delete_resource(ctx, r);
+}
+
+#define WKC_LINKS 200   /* too many links for one PDU */
+#define WKC_LINK_CBOR 11 /* {1: "/link000"} */
+
+static struct {
+  int called;
+  coap_pdu_code_t code;
+  size_t length;
+  uint8_t data[1500];
+} wkc_result;
+
+static coap_response_t
+wkc_response_handler(coap_session_t *sess, const coap_pdu_t *sent,
+                     const coap_pdu_t *received, const coap_mid_t id) {
+  size_t length;
+  const uint8_t *data;
+
+  (void)sess;
+  (void)sent;
+  (void)id;
+  wkc_result.called++;
+  wkc_result.code = coap_pdu_get_code(received);
+  if (coap_get_data(received, &length, &data) &&
+      length <= sizeof(wkc_result.data)) {
+    wkc_result.length = length;
+    memcpy(wkc_result.data, data, length);
+  }
+  return COAP_RESPONSE_OK;
+}
+
+static void
+wkc_get(coap_context_t *server_ctx, coap_session_t *client,
+        unsigned int accept) {
+  coap_pdu_t *request;
+  uint8_t buf[4];
+  int i;
+
+  memset(&wkc_result, 0, sizeof(wkc_result));
+  request = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_CODE_GET,
+                          coap_new_message_id(client),
+                          coap_session_max_pdu_size(client));
+  CU_ASSERT_PTR_NOT_NULL_FATAL(request);
+  coap_add_option(request, COAP_OPTION_URI_PATH, 11,
+                  (const uint8_t *)".well-known");
+  coap_add_option(request, COAP_OPTION_URI_PATH, 4, (const uint8_t *)"core");
+  coap_add_option(request, COAP_OPTION_ACCEPT,
+                  coap_encode_var_safe(buf, sizeof(buf), accept), buf);
+  CU_ASSERT_FATAL(coap_send(client, request) != COAP_INVALID_MID);
+  for (i = 0; i < 100 && !wkc_result.called; i++) {
+    coap_io_process(server_ctx, 10);
+    coap_io_process(client->context, 10);
+  }
+  CU_ASSERT_FATAL(wkc_result.called);
+}
+
+/*
+ * Without libcoap block support, a CBOR document too big for the PDU is
+ * sent as the leading links that fit, never as a cut array.
+ */
+static void
+t_wellknown7(void) {
+  coap_context_t *server_ctx;
+  coap_context_t *client_ctx;
+  coap_session_t *client;
+  coap_endpoint_t *ep;
+  coap_address_t addr;
+  char path[8];
+  size_t count;
+  int i;
+
+  server_ctx = coap_new_context(NULL);
+  client_ctx = coap_new_context(NULL);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(server_ctx);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(client_ctx);
+  coap_address_init(&addr);
+  addr.size = sizeof(struct sockaddr_in);
+  addr.addr.sin.sin_family = AF_INET;
+  addr.addr.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  ep = coap_new_endpoint(server_ctx, &addr, COAP_PROTO_UDP);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(ep);
+  for (i = 0; i < WKC_LINKS; i++) {
+    snprintf(path, sizeof(path), "link%03d", i);
+    coap_add_resource(server_ctx,
+                      coap_resource_init(coap_make_str_const(path), 0));
+  }
+  coap_register_response_handler(client_ctx, wkc_response_handler);
+  client = coap_new_client_session(client_ctx, NULL, &ep->bind_addr,
+                                   COAP_PROTO_UDP);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(client);
+
+  wkc_get(server_ctx, client, COAP_MEDIATYPE_APPLICATION_LINK_FORMAT_CBOR);
+  CU_ASSERT(wkc_result.code == COAP_RESPONSE_CODE(205));
+  CU_ASSERT_FATAL(wkc_result.length > 3);
+  /* array(count) with a 2 byte head, then count whole links */
+  CU_ASSERT(wkc_result.data[0] == 0x98);
+  count = wkc_result.data[1];
+  CU_ASSERT(count > 0);
+  CU_ASSERT(count < WKC_LINKS);
+  CU_ASSERT(wkc_result.length == 2 + count * WKC_LINK_CBOR);
+  CU_ASSERT(memcmp(&wkc_result.data[2], "\xa1\x01\x68/link000",
+                   WKC_LINK_CBOR) == 0);
+
+  wkc_get(server_ctx, client, COAP_MEDIATYPE_TEXT_PLAIN);
+  CU_ASSERT(wkc_result.code == COAP_RESPONSE_CODE(406));
+
+  coap_free_context(client_ctx);
+  coap_free_context(server_ctx);
+}
+
 static int
 t_wkc_tests_create(void) {
   coap_address_t addr;
@@ -270,6 +506,9 @@ t_init_wellknown_tests(void) {
   WKC_TEST(suite, t_wellknown2);
   WKC_TEST(suite, t_wellknown3);
   WKC_TEST(suite, t_wellknown4);
+  WKC_TEST(suite, t_wellknown5);
+  WKC_TEST(suite, t_wellknown6);
+  WKC_TEST(suite, t_wellknown7);
 
   return suite;
 }
@@ -14,13 +14,19 @@
 #include <CUnit/Basic.h>
 
 #include "test_common.h"
+#include "test_address.h"
+#include "test_block.h"
+#include "test_cache.h"
 #include "test_uri.h"
 #include "test_encode.h"
 #include "test_options.h"
 #include "test_pdu.h"
+#include "test_proxy.h"
 #include "test_error_response.h"
+#include "test_resource.h"
 #include "test_session.h"
 #include "test_sendqueue.h"
+#include "test_subscribe.h"
 #include "test_wellknown.h"
 #include "test_tls.h"
 #if HAVE_OSCORE && COAP_SERVER_SUPPORT
@@ -43,12 +49,24 @@ main(int argc COAP_UNUSED, char **argv COAP_UNUSED) {
   t_init_option_tests();
   t_init_pdu_tests();
   t_init_error_response_tests();
+#if !defined(WITH_CONTIKI) && !defined(WITH_LWIP)
+  t_init_address_tests();
+#endif /* ! WITH_CONTIKI && ! WITH_LWIP */
+#if COAP_SERVER_SUPPORT
+  t_init_resource_tests();
+#endif /* COAP_SERVER_SUPPORT */
 #if COAP_CLIENT_SUPPORT
   t_init_session_tests();
   t_init_sendqueue_tests();
 #endif /* COAP_CLIENT_SUPPORT */
 #if COAP_SERVER_SUPPORT && COAP_CLIENT_SUPPORT
   t_init_wellknown_tests();
+  t_init_subscribe_tests();
+  t_init_cache_tests();
+#if !defined(WITH_CONTIKI) && !defined(WITH_LWIP)
+  t_init_block_tests();
+  t_init_proxy_tests();
+#endif /* ! WITH_CONTIKI && ! WITH_LWIP */
 #endif /* COAP_SERVER_SUPPORT && COAP_CLIENT_SUPPORT */
   t_init_tls_tests();
 #if HAVE_OSCORE && COAP_SERVER_SUPPORT